@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sikv.h"
+#include "log.h"
+
+/*
+ * Loading a dump file into a table with KV_load. The file is mapped rather than read, so records are
+ * passed to KV_load pointing straight into it and each key and value is copied once, into the table.
+ * A first pass counts the records so the table is sized for all of them before any is stored.
+ *
+ * Two formats are taken. A file starting with LOAD_MAGIC is binary: the magic, then for every record
+ * its key length and value length as native 32 bit integers followed by the key and value bytes.
+ * Anything else is TSV: a record per line, the key up to the first tab and the value after it, with
+ * a '\r' before the newline dropped and empty lines skipped.
+ */
+
+struct load_file
+{
+    const char *data;
+    size_t len;
+    bool binary;
+};
+
+// Parse the record at *pos and move past it. Returns 0 at the end, -1 for a malformed record
+static int next_record(struct load_file *file, size_t *pos, struct KV_record *rec)
+{
+    const char *data = file->data;
+    size_t len = file->len;
+
+    if (file->binary)
+    {
+        uint32_t lens[2];
+        if (*pos == len)
+        {
+            return 0;
+        }
+        if (len - *pos < sizeof(lens))
+        {
+            return -1;
+        }
+        memcpy(lens, &data[*pos], sizeof(lens));
+        *pos += sizeof(lens);
+        if (lens[0] == 0 || lens[0] > INT32_MAX || lens[1] >= INT32_MAX - lens[0] || len - *pos < (size_t)lens[0] + lens[1])
+        {
+            return -1;
+        }
+        rec->key = &data[*pos];
+        rec->key_len = lens[0];
+        rec->val = &data[*pos + lens[0]];
+        rec->val_len = lens[1];
+        *pos += (size_t)lens[0] + lens[1];
+        return 1;
+    }
+
+    while (*pos < len && (data[*pos] == '\n' || data[*pos] == '\r'))
+    {
+        (*pos)++;
+    }
+    if (*pos == len)
+    {
+        return 0;
+    }
+
+    const char *line = &data[*pos];
+    const char *end = memchr(line, '\n', len - *pos);
+    size_t line_len = end ? (size_t)(end - line) : len - *pos;
+    *pos += line_len + (end != NULL);
+    if (line_len && line[line_len - 1] == '\r')
+    {
+        line_len--;
+    }
+
+    const char *tab = memchr(line, '\t', line_len);
+    if (tab == NULL || tab == line || line_len >= INT32_MAX)
+    {
+        return -1;
+    }
+    rec->key = line;
+    rec->key_len = tab - line;
+    rec->val = tab + 1;
+    rec->val_len = line_len - rec->key_len - 1;
+    return 1;
+}
+
+/*
+ * Load every record of the file at path into hmap, with up to nr_threads threads. Later records for a
+ * key replace earlier ones. Returns how many were stored, or -1 with errno set when the file cannot
+ * be read or holds a malformed record, in which case the records before it may have been stored
+ */
+int64_t KV_load_file(struct hash_map *hmap, const char *path, int nr_threads)
+{
+    struct load_file file = {0};
+    struct KV_record *recs = NULL;
+    struct stat st;
+    int64_t stored = 0;
+    size_t pos = 0;
+    int ret;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        int err = errno;
+        KV_log(LL_WARNING, "KV_load_file: Unable to open %s: %s", path, strerror(err));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        errno = err;
+        return -1;
+    }
+    file.len = st.st_size;
+    if (file.len)
+    {
+        void *data = mmap(NULL, file.len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            int err = errno;
+            KV_log(LL_WARNING, "KV_load_file: Unable to map %s: %s", path, strerror(err));
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        madvise(data, file.len, MADV_SEQUENTIAL);
+        file.data = (const char *)data;
+    }
+    close(fd);
+
+    file.binary = file.len >= strlen(LOAD_MAGIC) && memcmp(file.data, LOAD_MAGIC, strlen(LOAD_MAGIC)) == 0;
+    size_t start = file.binary ? strlen(LOAD_MAGIC) : 0;
+
+    // Count first, so the table is resized once
+    uint64_t nr_records = 0;
+    struct KV_record rec;
+    for (pos = start; (ret = next_record(&file, &pos, &rec)) > 0;)
+    {
+        nr_records++;
+    }
+    if (ret < 0)
+    {
+        KV_log(LL_WARNING, "KV_load_file: Malformed record %lu of %s", nr_records + 1, path);
+        errno = EINVAL;
+        stored = -1;
+        goto done;
+    }
+
+    recs = (struct KV_record *)malloc((nr_records < LOAD_BATCH ? nr_records + 1 : LOAD_BATCH) * sizeof(struct KV_record));
+    if (recs == NULL || KV_reserve(hmap, nr_records) < 0)
+    {
+        KV_log(LL_WARNING, "KV_load_file: Unable to make room for %lu records", nr_records);
+        errno = ENOMEM;
+        stored = -1;
+        goto done;
+    }
+
+    pos = start;
+    while (stored >= 0)
+    {
+        uint64_t n = 0;
+        while (n < LOAD_BATCH && next_record(&file, &pos, &recs[n]) > 0)
+        {
+            n++;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        uint64_t batch_stored = KV_load(hmap, recs, n, nr_threads);
+        stored += batch_stored;
+        if (batch_stored < n)
+        {
+            int err = errno;
+            KV_log(LL_WARNING, "KV_load_file: Unable to store %lu records of %s: %s", n - batch_stored, path, strerror(err));
+            errno = err;
+            stored = -1;
+        }
+    }
+
+done:
+    free(recs);
+    if (file.len)
+    {
+        munmap((void *)file.data, file.len);
+    }
+    return stored;
+}
@@ -1,16 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <errno.h>
 
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <netinet/in.h>
-
-#include "sikv.h"
+#include "sikv_client.h"
 
+// Usage: client.out host port | client.out --unixsocket path [--shm]
 int main(int argc, char *argv[])
 {
     if (argc < 3)
@@ -19,51 +14,23 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    char buf[BUFFSZ];
-    int client_fd;
-    char *server_hostname = argv[1];
-    ssize_t nr_read;
+    struct sikv_client_options options = {.connections = 1};
     size_t input_read;
     char *input_ptr = NULL;
-    struct protoent *proto = {NULL};
-    in_addr_t in_addr;
-    unsigned short server_port = strtol(argv[2], NULL, 10);
-    struct sockaddr_in addr_in;
-    struct hostent *hostent = {NULL};
-
-    proto = getprotobyname("tcp");
-    if (proto == NULL)
-    {
-        perror("getprotobyname");
-        exit(EXIT_FAILURE);
-    }
-
-    client_fd = socket(AF_INET, SOCK_STREAM, proto->p_proto);
-    if (client_fd == -1)
-    {
-        perror("socket");
-        exit(EXIT_FAILURE);
-    }
 
-    hostent = gethostbyname(server_hostname);
-    if (hostent == NULL)
+    if (strcmp(argv[1], "--unixsocket") == 0)
     {
-        fprintf(stderr, "gethostbyname: %s: %s\n", server_hostname, strerror(errno));
-        exit(EXIT_FAILURE);
+        options.unix_path = argv[2];
+        options.shm = argc > 3 && strcmp(argv[3], "--shm") == 0;
     }
-
-    in_addr = inet_addr(inet_ntoa(*(struct in_addr *)*(hostent->h_addr_list)));
-    if (in_addr == (in_addr_t)-1)
+    else
     {
-        fprintf(stderr, "inet_addr: %s: %s\n", *(hostent->h_addr_list), strerror(errno));
-        exit(EXIT_FAILURE);
+        options.host = argv[1];
+        options.port = strtol(argv[2], NULL, 10);
     }
 
-    addr_in.sin_addr.s_addr = in_addr;
-    addr_in.sin_family = AF_INET;
-    addr_in.sin_port = htons(server_port);
-
-    if (connect(client_fd, (struct sockaddr *)&addr_in, sizeof(addr_in)) == -1)
+    sikv_pool_t *pool = sikv_pool_open(&options);
+    if (pool == NULL)
     {
         perror("connect");
         exit(EXIT_FAILURE);
@@ -100,24 +67,25 @@ int main(int argc, char *argv[])
             break;
         }
 
-        if (write(client_fd, input_ptr, input_read) == -1)
+        const char *reply;
+        sikv_future_t *future = sikv_pool_submit_line(pool, input_ptr, input_read - (input_ptr[input_read - 1] == '\n'));
+        if (future == NULL)
         {
-            fprintf(stderr, "write error\n");
-            break;
+            perror("send");
+            continue;
         }
-
-        while ((nr_read = read(client_fd, buf, BUFFSZ)) > 0)
+        if (sikv_future_wait(future, &reply, NULL) == 0)
+        {
+            printf("%s\n", reply);
+        }
+        else
         {
-            if (buf[nr_read - 1] == '\n')
-            {
-                buf[nr_read - 1] = '\0';
-                printf("%s\n", buf);
-                break;
-            }
+            perror("reply");
         }
+        sikv_future_free(future);
     }
-    close(client_fd);
+    sikv_pool_close(pool);
     free(input_ptr);
 
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <unistd.h>
+
+#include "sikv.h"
+#include "server.h"
+#include "log.h"
+
+/*
+ * Server settings. Each one can be given in a config file named with `--config <path>`, as a
+ * `--<name> <value>` flag, which wins over the file, and, for those marked live, changed while
+ * serving with `CONFIG SET <name> <value>`. `CONFIG GET [pattern]` shows the settings whose name
+ * matches the glob pattern as name=value pairs.
+ *
+ * The file has a setting per line, its name then its value, with blank lines and lines starting
+ * with '#' skipped. Booleans take yes or no; on the command line a bare flag means yes. Engine wide
+ * settings go straight to the engine, the rest are kept in server_config for serve to apply.
+ */
+
+#define CONFIG_VALUE_MAX 1024
+
+typedef enum
+{
+    CONFIG_INT,    // int within [min, max]
+    CONFIG_BYTES,  // uint64_t within [min, max], with an optional k, m, g or t suffix
+    CONFIG_BOOL,   // yes or no
+    CONFIG_STRING, // a path; empty for none
+    CONFIG_CUSTOM  // parsed and shown by set and get
+} config_type;
+
+struct config_param
+{
+    const char *name;
+    config_type type;
+    void *value; // in server_config, for all but CONFIG_CUSTOM
+    int64_t min;
+    int64_t max;
+    bool live;           // may be changed with CONFIG SET
+    void (*apply)(void); // puts a live change into effect once the keyspaces exist
+    int words;           // the flag's values when more than one
+    const char *(*set)(const char *val);
+    int (*get)(char *buf, size_t len);
+};
+
+struct server_config server_config = {
+    .databases = DEFAULT_DATABASES,
+    .io_buffer_size = BUFFSZ,
+};
+
+static char config_err[128];
+
+// Sizes like 512m or 64g; the suffixes are powers of 1024
+static int parse_bytes(const char *str, uint64_t *bytes)
+{
+    char *end;
+    int shift;
+
+    // strtoull would take a negative number and wrap it
+    if (str[strspn(str, " \t")] == '-')
+    {
+        return -1;
+    }
+    errno = 0;
+    uint64_t n = strtoull(str, &end, 10);
+    if (end == str || errno)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
+    case 't':
+    case 'T':
+        shift = 40;
+        break;
+    case '\0':
+        shift = 0;
+        break;
+    default:
+        return -1;
+    }
+    if ((shift && end[1] != '\0') || n > UINT64_MAX >> shift)
+    {
+        return -1;
+    }
+    *bytes = n << shift;
+    return 0;
+}
+
+static int parse_uint64(const char *str, uint64_t *n)
+{
+    char *end;
+    errno = 0;
+    *n = strtoull(str, &end, 10);
+    return end == str || *end != '\0' || errno || str[strspn(str, " \t")] == '-' ? -1 : 0;
+}
+
+static const char *set_hugepages(const char *val)
+{
+    KV_HUGEPAGE_MODE mode;
+    if (KV_parse_hugepage_mode(val, &mode) < 0)
+    {
+        return "must be one of off, madvise or on";
+    }
+    KV_set_hugepage_mode(mode);
+    return NULL;
+}
+
+static int get_hugepages(char *buf, size_t len)
+{
+    return snprintf(buf, len, "%s", KV_hugepage_mode_name(KV_hugepage_mode()));
+}
+
+static const char *set_slowlog_threshold(const char *val)
+{
+    uint64_t us;
+    if (parse_uint64(val, &us) < 0)
+    {
+        return "takes a number of microseconds";
+    }
+    KV_slowlog_set_threshold(us);
+    return NULL;
+}
+
+static int get_slowlog_threshold(char *buf, size_t len)
+{
+    return snprintf(buf, len, "%lu", KV_slowlog_threshold());
+}
+
+static const char *set_loglevel(const char *val)
+{
+    KV_LOG_LEVEL level;
+    if (KV_parse_log_level(val, &level) < 0)
+    {
+        return "must be one of debug, verbose, notice, warning or none";
+    }
+    KV_log_set_level(level);
+    return NULL;
+}
+
+static int get_loglevel(char *buf, size_t len)
+{
+    return snprintf(buf, len, "%s", KV_log_level_name(kv_log_level));
+}
+
+static const char *set_replicaof(const char *val)
+{
+    const char *sep = strpbrk(val, " \t");
+    uint64_t port;
+    if (sep == NULL || sep == val || parse_uint64(sep + strspn(sep, " \t"), &port) < 0 || port == 0 || port > 65535)
+    {
+        return "requires the primary host and port";
+    }
+    char *host = strndup(val, sep - val);
+    if (host == NULL)
+    {
+        return "out of memory";
+    }
+    free(server_config.replicaof_host);
+    server_config.replicaof_host = host;
+    server_config.replicaof_port = port;
+    return NULL;
+}
+
+static int get_replicaof(char *buf, size_t len)
+{
+    if (server_config.replicaof_host == NULL)
+    {
+        buf[0] = '\0';
+        return 0;
+    }
+    return snprintf(buf, len, "%s:%u", server_config.replicaof_host, server_config.replicaof_port);
+}
+
+static const char *set_initial_capacity(const char *val)
+{
+    uint64_t capacity;
+    if (parse_uint64(val, &capacity) < 0 || KV_set_initial_capacity(capacity) < 0)
+    {
+        snprintf(config_err, sizeof(config_err), "must be a power of two of at least %lu", MIN_ENTRY_NUM);
+        return config_err;
+    }
+    return NULL;
+}
+
+static int get_initial_capacity(char *buf, size_t len)
+{
+    return snprintf(buf, len, "%lu", KV_initial_capacity());
+}
+
+static const char *set_load_factor(const char *val)
+{
+    char *end;
+    float lf = strtof(val, &end);
+    if (end == val || *end != '\0' || KV_set_load_factor(lf) < 0)
+    {
+        snprintf(config_err, sizeof(config_err), "must be between %g and %g", LOAD_FACTOR_MIN, LOAD_FACTOR_MAX);
+        return config_err;
+    }
+    return NULL;
+}
+
+static int get_load_factor(char *buf, size_t len)
+{
+    return snprintf(buf, len, "%g", KV_load_factor());
+}
+
+static const char *set_growth_factor(const char *val)
+{
+    uint64_t factor;
+    if (parse_uint64(val, &factor) < 0 || factor > GROWTH_FACTOR_MAX || KV_set_growth_factor(factor) < 0)
+    {
+        snprintf(config_err, sizeof(config_err), "must be a power of two from 2 to %d", GROWTH_FACTOR_MAX);
+        return config_err;
+    }
+    return NULL;
+}
+
+static int get_growth_factor(char *buf, size_t len)
+{
+    return snprintf(buf, len, "%d", KV_growth_factor());
+}
+
+// The limit applies to each keyspace, replacing any MEMORY LIMIT
+static void apply_maxmemory(void)
+{
+    for (int i = 0; i < server_nr_dbs(); i++)
+    {
+        KV_set_max_memory(server_db(i), server_config.maxmemory);
+    }
+}
+
+static void apply_active_defrag(void)
+{
+    for (int i = 0; i < server_nr_dbs(); i++)
+    {
+        KV_set_active_defrag(server_db(i), server_config.active_defrag);
+    }
+}
+
+static const struct config_param params[] = {
+    {.name = "databases", .type = CONFIG_INT, .value = &server_config.databases, .min = 1, .max = INT32_MAX},
+    {.name = "initial-capacity", .type = CONFIG_CUSTOM, .live = true, .set = set_initial_capacity, .get = get_initial_capacity},
+    {.name = "load-factor", .type = CONFIG_CUSTOM, .live = true, .set = set_load_factor, .get = get_load_factor},
+    {.name = "growth-factor", .type = CONFIG_CUSTOM, .live = true, .set = set_growth_factor, .get = get_growth_factor},
+    {.name = "maxmemory", .type = CONFIG_BYTES, .value = &server_config.maxmemory, .max = INT64_MAX, .live = true, .apply = apply_maxmemory},
+    {.name = "hugepages", .type = CONFIG_CUSTOM, .live = true, .set = set_hugepages, .get = get_hugepages},
+    {.name = "active-defrag", .type = CONFIG_BOOL, .value = &server_config.active_defrag, .live = true, .apply = apply_active_defrag},
+    {.name = "ordered-index", .type = CONFIG_BOOL, .value = &server_config.ordered_index},
+    {.name = "io-buffer-size", .type = CONFIG_BYTES, .value = &server_config.io_buffer_size, .min = IO_BUFFER_MIN, .max = IO_BUFFER_MAX, .live = true},
+    {.name = "io-uring", .type = CONFIG_BOOL, .value = &server_config.io_uring},
+    {.name = "unixsocket", .type = CONFIG_STRING, .value = &server_config.unixsocket},
+    {.name = "load", .type = CONFIG_STRING, .value = &server_config.load},
+    {.name = "load-threads", .type = CONFIG_INT, .value = &server_config.load_threads, .min = 1, .max = INT32_MAX},
+    {.name = "replicaof", .type = CONFIG_CUSTOM, .words = 2, .set = set_replicaof, .get = get_replicaof},
+    {.name = "slowlog-threshold", .type = CONFIG_CUSTOM, .live = true, .set = set_slowlog_threshold, .get = get_slowlog_threshold},
+    {.name = "loglevel", .type = CONFIG_CUSTOM, .live = true, .set = set_loglevel, .get = get_loglevel},
+    {.name = "logfile", .type = CONFIG_STRING, .value = &server_config.logfile},
+};
+
+static const struct config_param *config_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++)
+    {
+        if (strcasecmp(params[i].name, name) == 0)
+        {
+            return &params[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns NULL once the value is stored, otherwise why it was refused
+static const char *config_set(const struct config_param *param, const char *val)
+{
+    uint64_t n;
+
+    switch (param->type)
+    {
+    case CONFIG_INT:
+        if (parse_uint64(val, &n) < 0 || (int64_t)n < param->min || (int64_t)n > param->max)
+        {
+            snprintf(config_err, sizeof(config_err), "must be a number of at least %ld", param->min);
+            return config_err;
+        }
+        *(int *)param->value = n;
+        return NULL;
+    case CONFIG_BYTES:
+        if (parse_bytes(val, &n) < 0 || (int64_t)n < param->min || n > (uint64_t)param->max)
+        {
+            if (param->max == INT64_MAX)
+            {
+                return "takes a size in bytes, optionally with a k, m, g or t suffix";
+            }
+            snprintf(config_err, sizeof(config_err), "takes a size from %ld to %ld bytes, optionally with a k, m, g or t suffix", param->min, param->max);
+            return config_err;
+        }
+        *(uint64_t *)param->value = n;
+        return NULL;
+    case CONFIG_BOOL:
+        if (*val != '\0' && strcasecmp(val, "yes") != 0 && strcasecmp(val, "no") != 0)
+        {
+            return "must be yes or no";
+        }
+        *(bool *)param->value = strcasecmp(val, "no") != 0;
+        return NULL;
+    case CONFIG_STRING:
+    {
+        char *str = *val ? strdup(val) : NULL;
+        if (*val && str == NULL)
+        {
+            return "out of memory";
+        }
+        free(*(char **)param->value);
+        *(char **)param->value = str;
+        return NULL;
+    }
+    case CONFIG_CUSTOM:
+        return param->set(val);
+    }
+    return NULL;
+}
+
+static int config_get(const struct config_param *param, char *buf, size_t len)
+{
+    switch (param->type)
+    {
+    case CONFIG_INT:
+        return snprintf(buf, len, "%d", *(int *)param->value);
+    case CONFIG_BYTES:
+        return snprintf(buf, len, "%lu", *(uint64_t *)param->value);
+    case CONFIG_BOOL:
+        return snprintf(buf, len, "%s", *(bool *)param->value ? "yes" : "no");
+    case CONFIG_STRING:
+        return snprintf(buf, len, "%s", *(char **)param->value ? *(char **)param->value : "");
+    case CONFIG_CUSTOM:
+        return param->get(buf, len);
+    }
+    return 0;
+}
+
+static void config_load_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Unable to read config file %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    for (int lineno = 1; (len = getline(&line, &cap, file)) != -1; lineno++)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+        {
+            line[--len] = '\0';
+        }
+        char *name = line + strspn(line, " \t");
+        if (*name == '\0' || *name == '#')
+        {
+            continue;
+        }
+        char *val = name + strcspn(name, " \t");
+        if (*val)
+        {
+            *val++ = '\0';
+            val += strspn(val, " \t");
+        }
+
+        const struct config_param *param = config_find(name);
+        const char *err = param ? config_set(param, val) : "is not a setting";
+        if (err)
+        {
+            fprintf(stderr, "%s:%d: %s %s\n", path, lineno, name, err);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(line);
+    fclose(file);
+}
+
+// Read the settings from the config file and the flags after the host and port. Exits when one is bad
+void config_init(int argc, char *argv[])
+{
+    char val[CONFIG_VALUE_MAX];
+
+    server_config.load_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // The file first, so flags override it
+    for (int i = 3; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--config") == 0)
+        {
+            config_load_file(argv[++i]);
+        }
+    }
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--config") == 0)
+        {
+            i++;
+            continue;
+        }
+        const struct config_param *param = strncmp(argv[i], "--", 2) == 0 ? config_find(argv[i] + 2) : NULL;
+        if (param == NULL)
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        int words = param->words ? param->words : 1;
+        if (param->type == CONFIG_BOOL)
+        {
+            words = i + 1 < argc && (strcasecmp(argv[i + 1], "yes") == 0 || strcasecmp(argv[i + 1], "no") == 0);
+        }
+        val[0] = '\0';
+        for (int j = 1; j <= words && i + j < argc; j++)
+        {
+            size_t len = strlen(val);
+            snprintf(&val[len], sizeof(val) - len, "%s%s", j > 1 ? " " : "", argv[i + j]);
+        }
+
+        const char *err = i + words < argc ? config_set(param, val) : "requires a value";
+        if (err)
+        {
+            fprintf(stderr, "%s %s\n", argv[i], err);
+            exit(EXIT_FAILURE);
+        }
+        i += words;
+    }
+}
+
+// CONFIG GET [pattern] | CONFIG SET <name> <value>
+void config_cmd(struct connection *conn, int argc, char *argv[])
+{
+    char buf[CONFIG_VALUE_MAX];
+    const char *err;
+
+    if (argc >= 2 && strcasecmp(argv[1], "GET") == 0)
+    {
+        const char *pattern = argc > 2 ? argv[2] : "*";
+        bool first = true;
+        for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++)
+        {
+            if (fnmatch(pattern, params[i].name, 0) != 0)
+            {
+                continue;
+            }
+            int len = snprintf(buf, sizeof(buf), "%s%s=", first ? "" : " ", params[i].name);
+            conn_write(conn, buf, len);
+            len = config_get(&params[i], buf, sizeof(buf));
+            conn_write(conn, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+            first = false;
+        }
+        conn_write(conn, "\n", 1);
+        return;
+    }
+
+    const struct config_param *param = argc > 2 ? config_find(argv[2]) : NULL;
+    if (argc < 4 || strcasecmp(argv[1], "SET") != 0)
+    {
+        err = "ERR CONFIG takes GET [pattern] or SET name value\n";
+    }
+    else if (param == NULL)
+    {
+        snprintf(buf, sizeof(buf), "ERR %s is not a setting\n", argv[2]);
+        err = buf;
+    }
+    else if (!param->live)
+    {
+        snprintf(buf, sizeof(buf), "ERR %s can only be set at startup\n", param->name);
+        err = buf;
+    }
+    else if ((err = config_set(param, argv[3])) != NULL)
+    {
+        snprintf(buf, sizeof(buf), "ERR %s %s\n", param->name, err);
+        err = buf;
+    }
+    if (err)
+    {
+        conn_write(conn, err, strlen(err));
+        return;
+    }
+
+    if (param->apply)
+    {
+        param->apply();
+    }
+    KV_log(LL_NOTICE, "CONFIG SET %s %s", argv[2], argv[3]);
+    conn_write(conn, "Ok\n", 3);
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "sikv.h"
+
+static KV_HUGEPAGE_MODE hugepage_mode = HUGEPAGE_OFF;
+
+static const char *mode_names[] = {"off", "madvise", "on"};
+
+void KV_set_hugepage_mode(KV_HUGEPAGE_MODE mode)
+{
+    hugepage_mode = mode;
+}
+
+KV_HUGEPAGE_MODE KV_hugepage_mode(void)
+{
+    return hugepage_mode;
+}
+
+const char *KV_hugepage_mode_name(KV_HUGEPAGE_MODE mode)
+{
+    return mode_names[mode];
+}
+
+int KV_parse_hugepage_mode(const char *name, KV_HUGEPAGE_MODE *mode)
+{
+    for (int i = HUGEPAGE_OFF; i <= HUGEPAGE_ON; i++)
+    {
+        if (strcmp(name, mode_names[i]) == 0)
+        {
+            *mode = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Ask for transparent huge pages on the 2MB aligned part of [addr, addr + len)
+void KV_page_advise(void *addr, size_t len)
+{
+    if (hugepage_mode == HUGEPAGE_OFF)
+    {
+        return;
+    }
+
+    uintptr_t start = ((uintptr_t)addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)addr + len) & ~(HUGE_PAGE_SIZE - 1);
+    if (end > start)
+    {
+        madvise((void *)start, end - start, MADV_HUGEPAGE);
+    }
+}
+
+/*
+ * Map size bytes for a large allocation. In HUGEPAGE_ON mode explicit huge pages (MAP_HUGETLB) are
+ * tried first; they need pages reserved in /proc/sys/vm/nr_hugepages. Otherwise, or when none are
+ * free, the mapping is 2MB aligned and advised for transparent huge pages. Returns NULL when huge
+ * pages are off or the allocation is too small to benefit so callers use their usual allocator.
+ */
+void *KV_page_alloc(size_t size, size_t *map_len)
+{
+    *map_len = 0;
+    if (hugepage_mode == HUGEPAGE_OFF || size < HUGE_PAGE_SIZE)
+    {
+        return NULL;
+    }
+
+    size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    if (hugepage_mode == HUGEPAGE_ON)
+    {
+        void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED)
+        {
+            *map_len = len;
+            return addr;
+        }
+    }
+
+    // Over map so the region can be trimmed to a 2MB boundary
+    char *addr = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    char *aligned = (char *)(((uintptr_t)addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > addr)
+    {
+        munmap(addr, aligned - addr);
+    }
+    if (aligned + len < addr + len + HUGE_PAGE_SIZE)
+    {
+        munmap(aligned + len, (addr + len + HUGE_PAGE_SIZE) - (aligned + len));
+    }
+
+    madvise(aligned, len, MADV_HUGEPAGE);
+    *map_len = len;
+    return aligned;
+}
+
+void KV_page_free(void *addr, size_t map_len)
+{
+    if (addr && map_len)
+    {
+        munmap(addr, map_len);
+    }
+}
+
+// Bytes of the mappings overlapping [addr, addr + len) backed by huge pages, from /proc/self/smaps
+uint64_t KV_huge_backed(void *addr, size_t len)
+{
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL)
+    {
+        return 0;
+    }
+
+    char line[256];
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + len;
+    bool in_range = false;
+    uint64_t total = 0;
+
+    while (fgets(line, sizeof(line), smaps))
+    {
+        unsigned long lo, hi, kb;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+        {
+            in_range = lo < end && hi > start;
+        }
+        else if (in_range && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+                              sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1 ||
+                              sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1))
+        {
+            total += kb * 1024;
+        }
+    }
+    fclose(smaps);
+    return total;
+}
+
+// Resident set size of the process in bytes, from /proc/self/statm
+uint64_t KV_rss(void)
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+    {
+        return 0;
+    }
+
+    unsigned long size, resident = 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(statm);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
@@ -23,4 +23,9 @@ fi
 if [ -z "$(command -v valgrind)" ]; then
   echo "Attempting to install valgrind..."
   sudo $PKG_MGR install -y valgrind > /dev/null
-fi
\ No newline at end of file
+fi
+
+if [ ! -f /usr/include/sys/sdt.h ]; then
+  echo "Attempting to install systemtap-sdt-dev for USDT probes..."
+  sudo $PKG_MGR install -y systemtap-sdt-dev > /dev/null
+fi
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sikv.h"
+
+/*
+ * Per command latency histograms and the slow command log.
+ *
+ * Every thread records into its own histogram (power of two nanosecond buckets) without taking
+ * locks. The histograms are linked into a global list when a thread records its first command and
+ * summed when the stats are requested. Counters are written with relaxed atomics so a concurrent
+ * reader sees whole values, at the cost of a possibly slightly stale total.
+ */
+
+struct latency_hist
+{
+    uint64_t buckets[CMD_NOOP + 1][LATENCY_BUCKETS];
+    uint64_t count[CMD_NOOP + 1];
+    uint64_t total_ns[CMD_NOOP + 1];
+    uint64_t max_ns[CMD_NOOP + 1];
+    struct latency_hist *next;
+};
+
+struct slowlog_entry
+{
+    uint64_t id;
+    time_t time;
+    uint64_t duration_us;
+    char cmd[SLOWLOG_CMD_LEN];
+    char key[SLOWLOG_KEY_LEN];
+    size_t key_len;
+    size_t val_len;
+    uint32_t probes;
+};
+
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct latency_hist *hists = NULL;
+static __thread struct latency_hist *local_hist = NULL;
+
+static pthread_mutex_t slowlog_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slowlog_entry slowlog[SLOWLOG_LEN];
+static uint64_t slowlog_next_id = 0;
+static uint64_t slowlog_threshold_us = SLOWLOG_DEFAULT_THRESHOLD_US;
+
+uint64_t KV_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct latency_hist *hist_get(void)
+{
+    if (local_hist == NULL)
+    {
+        struct latency_hist *hist = (struct latency_hist *)calloc(1, sizeof(struct latency_hist));
+        if (hist == NULL)
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&hist_lock);
+        hist->next = hists;
+        hists = hist;
+        pthread_mutex_unlock(&hist_lock);
+        local_hist = hist;
+    }
+    return local_hist;
+}
+
+// Only the owning thread writes, so a relaxed load and store is enough
+static inline void counter_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline int bucket_of(uint64_t ns)
+{
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+void KV_latency_record(KV_CMD cmd, uint64_t ns)
+{
+    struct latency_hist *hist = hist_get();
+    if (hist == NULL)
+    {
+        return;
+    }
+
+    counter_add(&hist->buckets[cmd][bucket_of(ns)], 1);
+    counter_add(&hist->count[cmd], 1);
+    counter_add(&hist->total_ns[cmd], ns);
+    if (ns > hist->max_ns[cmd])
+    {
+        __atomic_store_n(&hist->max_ns[cmd], ns, __ATOMIC_RELAXED);
+    }
+}
+
+void KV_latency_reset(void)
+{
+    pthread_mutex_lock(&hist_lock);
+    for (struct latency_hist *hist = hists; hist; hist = hist->next)
+    {
+        // Racing writers may keep a sample or two; good enough for a reset
+        memset(hist->buckets, 0, sizeof(hist->buckets));
+        memset(hist->count, 0, sizeof(hist->count));
+        memset(hist->total_ns, 0, sizeof(hist->total_ns));
+        memset(hist->max_ns, 0, sizeof(hist->max_ns));
+    }
+    pthread_mutex_unlock(&hist_lock);
+}
+
+// Upper bound of the bucket holding the given percentile, capped at the maximum seen, in microseconds
+static double percentile_us(uint64_t *buckets, uint64_t count, uint64_t max, double pct)
+{
+    uint64_t rank = (uint64_t)(count * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+        {
+            return (double)((1ULL << i) < max ? (1ULL << i) : max) / 1000.0;
+        }
+    }
+    return (double)max / 1000.0;
+}
+
+// One `CMD:count=..,avg_us=..,p50_us=..,p99_us=..,p999_us=..,max_us=..` group per command seen
+int KV_latency_report(char *buf, size_t len)
+{
+    uint64_t buckets[LATENCY_BUCKETS];
+    size_t off = 0;
+
+    buf[0] = '\0';
+    pthread_mutex_lock(&hist_lock);
+    for (int cmd = 0; cmd <= CMD_NOOP; cmd++)
+    {
+        uint64_t count = 0, total = 0, max = 0;
+        memset(buckets, 0, sizeof(buckets));
+
+        for (struct latency_hist *hist = hists; hist; hist = hist->next)
+        {
+            for (int i = 0; i < LATENCY_BUCKETS; i++)
+            {
+                buckets[i] += __atomic_load_n(&hist->buckets[cmd][i], __ATOMIC_RELAXED);
+            }
+            count += __atomic_load_n(&hist->count[cmd], __ATOMIC_RELAXED);
+            total += __atomic_load_n(&hist->total_ns[cmd], __ATOMIC_RELAXED);
+            uint64_t hist_max = __atomic_load_n(&hist->max_ns[cmd], __ATOMIC_RELAXED);
+            max = hist_max > max ? hist_max : max;
+        }
+
+        if (count == 0 || off >= len)
+        {
+            continue;
+        }
+
+        off += snprintf(&buf[off], len - off, "%s%s:count=%lu,avg_us=%.3f,p50_us=%.3f,p99_us=%.3f,p999_us=%.3f,max_us=%.3f",
+                        off ? " " : "", KV_cmd_name(cmd), count, (double)total / count / 1000.0,
+                        percentile_us(buckets, count, max, 50), percentile_us(buckets, count, max, 99),
+                        percentile_us(buckets, count, max, 99.9),
+                        (double)max / 1000.0);
+    }
+    pthread_mutex_unlock(&hist_lock);
+    return off < len ? off : len - 1;
+}
+
+void KV_slowlog_set_threshold(uint64_t us)
+{
+    __atomic_store_n(&slowlog_threshold_us, us, __ATOMIC_RELAXED);
+}
+
+uint64_t KV_slowlog_threshold(void)
+{
+    return __atomic_load_n(&slowlog_threshold_us, __ATOMIC_RELAXED);
+}
+
+void KV_slowlog_record(const char *cmd, const char *key, size_t key_len, size_t val_len, uint32_t probes, uint64_t ns)
+{
+    if (ns / 1000 < KV_slowlog_threshold())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&slowlog_lock);
+    struct slowlog_entry *entry = &slowlog[slowlog_next_id % SLOWLOG_LEN];
+    entry->id = slowlog_next_id++;
+    entry->time = time(NULL);
+    entry->duration_us = ns / 1000;
+    snprintf(entry->cmd, SLOWLOG_CMD_LEN, "%s", cmd);
+    entry->key_len = key_len;
+    if (key_len >= SLOWLOG_KEY_LEN)
+    {
+        key_len = SLOWLOG_KEY_LEN - 1;
+    }
+    memcpy(entry->key, key ? key : "", key ? key_len : 0);
+    entry->key[key ? key_len : 0] = '\0';
+    entry->val_len = val_len;
+    entry->probes = probes;
+    pthread_mutex_unlock(&slowlog_lock);
+}
+
+void KV_slowlog_reset(void)
+{
+    pthread_mutex_lock(&slowlog_lock);
+    slowlog_next_id = 0;
+    pthread_mutex_unlock(&slowlog_lock);
+}
+
+uint64_t KV_slowlog_len(void)
+{
+    pthread_mutex_lock(&slowlog_lock);
+    uint64_t len = slowlog_next_id < SLOWLOG_LEN ? slowlog_next_id : SLOWLOG_LEN;
+    pthread_mutex_unlock(&slowlog_lock);
+    return len;
+}
+
+// Newest first, entries separated by ';'. Keys are truncated to SLOWLOG_KEY_LEN - 1 bytes
+int KV_slowlog_report(char *buf, size_t len, int count)
+{
+    size_t off = 0;
+
+    buf[0] = '\0';
+    pthread_mutex_lock(&slowlog_lock);
+    uint64_t stored = slowlog_next_id < SLOWLOG_LEN ? slowlog_next_id : SLOWLOG_LEN;
+    for (uint64_t i = 0; i < stored && i < count && off < len; i++)
+    {
+        struct slowlog_entry *entry = &slowlog[(slowlog_next_id - 1 - i) % SLOWLOG_LEN];
+        off += snprintf(&buf[off], len - off, "%sid=%lu time=%ld duration_us=%lu cmd=%s key=%s key_len=%zu val_len=%zu probes=%u",
+                        off ? ";" : "", entry->id, (long)entry->time, entry->duration_us, entry->cmd, entry->key,
+                        entry->key_len, entry->val_len, entry->probes);
+    }
+    pthread_mutex_unlock(&slowlog_lock);
+    return off < len ? off : len - 1;
+}
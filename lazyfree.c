@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sikv.h"
+#include "log.h"
+
+/*
+ * Lazy freeing.
+ *
+ * Freeing a large value or a whole table touches every page it spans, so doing it on the request
+ * path stalls every client for as long as that takes. Callers detach what is to be freed and hand
+ * it here instead; a background thread, started on first use, runs the free jobs in order. If the
+ * thread or a job cannot be allocated the job runs inline so memory is never leaked.
+ */
+
+struct lazyfree_job
+{
+    KV_free_fn fn;
+    void *arg;
+    struct lazyfree_job *next;
+};
+
+static pthread_mutex_t lazyfree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazyfree_cond = PTHREAD_COND_INITIALIZER;
+static struct lazyfree_job *head = NULL;
+static struct lazyfree_job *tail = NULL;
+static uint64_t pending = 0;
+static bool started = false;
+static bool stopping = false;
+static pthread_t lazyfree_thread;
+
+static void *lazyfree_main(void *arg)
+{
+    pthread_mutex_lock(&lazyfree_lock);
+    while (1)
+    {
+        while (head == NULL && !stopping)
+        {
+            pthread_cond_wait(&lazyfree_cond, &lazyfree_lock);
+        }
+        if (head == NULL)
+        {
+            break;
+        }
+
+        struct lazyfree_job *job = head;
+        head = job->next;
+        if (head == NULL)
+        {
+            tail = NULL;
+        }
+        pthread_mutex_unlock(&lazyfree_lock);
+
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&lazyfree_lock);
+        pending--;
+    }
+    pthread_mutex_unlock(&lazyfree_lock);
+    return NULL;
+}
+
+// Called with lazyfree_lock held
+static bool lazyfree_start(void)
+{
+    if (started)
+    {
+        return true;
+    }
+    if (pthread_create(&lazyfree_thread, NULL, lazyfree_main, NULL) != 0)
+    {
+        KV_log(LL_WARNING, "KV_lazyfree: Unable to start lazy free thread, freeing inline");
+        return false;
+    }
+    started = true;
+    atexit(KV_lazyfree_shutdown);
+    return true;
+}
+
+// Run fn(arg) on the lazy free thread
+void KV_lazyfree(KV_free_fn fn, void *arg)
+{
+    struct lazyfree_job *job = (struct lazyfree_job *)malloc(sizeof(struct lazyfree_job));
+    if (job == NULL)
+    {
+        fn(arg);
+        return;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&lazyfree_lock);
+    if (stopping || !lazyfree_start())
+    {
+        pthread_mutex_unlock(&lazyfree_lock);
+        free(job);
+        fn(arg);
+        return;
+    }
+    if (tail)
+    {
+        tail->next = job;
+    }
+    else
+    {
+        head = job;
+    }
+    tail = job;
+    pending++;
+    pthread_cond_signal(&lazyfree_cond);
+    pthread_mutex_unlock(&lazyfree_lock);
+}
+
+// Jobs queued or running
+uint64_t KV_lazyfree_pending(void)
+{
+    pthread_mutex_lock(&lazyfree_lock);
+    uint64_t n = pending;
+    pthread_mutex_unlock(&lazyfree_lock);
+    return n;
+}
+
+// Stop the thread once every queued job has run
+void KV_lazyfree_shutdown(void)
+{
+    pthread_mutex_lock(&lazyfree_lock);
+    if (!started || stopping)
+    {
+        pthread_mutex_unlock(&lazyfree_lock);
+        return;
+    }
+    stopping = true;
+    pthread_cond_signal(&lazyfree_cond);
+    pthread_mutex_unlock(&lazyfree_lock);
+    pthread_join(lazyfree_thread, NULL);
+}
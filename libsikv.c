@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "sikv.h"
+#include "libsikv.h"
+#include "log.h"
+
+/*
+ * Handle based API over the engine in main.c, see libsikv.h.
+ *
+ * The engine itself is single threaded, so every handle pairs a table with a reader/writer lock:
+ * lookups, scans and views take it shared, anything that can touch the slot arrays or move a value
+ * (writes, the incremental rebuild, defrag) takes it exclusive. No call returns holding it. A view of
+ * a large value takes a reference on its block instead, which keeps the block alive and makes writes
+ * to the key copy it rather than change it in place; smaller values are copied for the view.
+ */
+
+struct sikv
+{
+    pthread_rwlock_t lock;
+    struct hash_map *hmap;
+};
+
+struct scan_ctx
+{
+    struct hash_map *hmap;
+    sikv_scan_fn fn;
+    void *arg;
+};
+
+// The engine takes int lengths and stores the value with a '\0' after it
+static int check_len(size_t key_len, size_t val_len)
+{
+    if (key_len > INT32_MAX || val_len >= INT32_MAX || key_len + val_len + 1 > INT32_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+sikv_t *sikv_open(const struct sikv_options *options)
+{
+    struct sikv_options defaults = {0};
+    if (options == NULL)
+    {
+        options = &defaults;
+    }
+
+    sikv_t *db = (sikv_t *)malloc(sizeof(sikv_t));
+    if (db == NULL)
+    {
+        return NULL;
+    }
+    if (pthread_rwlock_init(&db->lock, NULL) != 0)
+    {
+        free(db);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Writes are serialized by the handle lock, so the table's allocator pool needs no locking of its own
+    db->hmap = KV_init(options->capacity ? options->capacity : KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    if (db->hmap == NULL)
+    {
+        pthread_rwlock_destroy(&db->lock);
+        free(db);
+        return NULL;
+    }
+    KV_set_max_memory(db->hmap, options->max_memory);
+    if (options->ordered_index && KV_index_enable(db->hmap) < 0)
+    {
+        KV_drop(db->hmap);
+        pthread_rwlock_destroy(&db->lock);
+        free(db);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return db;
+}
+
+void sikv_close(sikv_t *db)
+{
+    if (db == NULL)
+    {
+        return;
+    }
+    KV_drop(db->hmap);
+    pthread_rwlock_destroy(&db->lock);
+    free(db);
+}
+
+// Called with the lock held exclusive
+static int set_locked(sikv_t *db, const char *key, size_t key_len, const char *val, size_t val_len)
+{
+    if (check_len(key_len, val_len) < 0)
+    {
+        return -1;
+    }
+    // KV_set reads val_len bytes of val and writes the '\0' itself
+    errno = 0;
+    if (KV_set(db->hmap, (char *)key, key_len, (char *)val, val_len + 1) < 0)
+    {
+        if (errno == 0)
+        {
+            errno = ENOMEM;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int sikv_set(sikv_t *db, const char *key, size_t key_len, const char *val, size_t val_len)
+{
+    pthread_rwlock_wrlock(&db->lock);
+    int ret = set_locked(db, key, key_len, val, val_len);
+    pthread_rwlock_unlock(&db->lock);
+    return ret;
+}
+
+uint64_t sikv_version(sikv_t *db, const char *key, size_t key_len)
+{
+    if (key_len > INT32_MAX)
+    {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&db->lock);
+    uint64_t version = KV_version(db->hmap, (char *)key, key_len);
+    pthread_rwlock_unlock(&db->lock);
+    return version;
+}
+
+int sikv_cas(sikv_t *db, const char *key, size_t key_len, const char *val, size_t val_len, uint64_t version)
+{
+    if (check_len(key_len, val_len) < 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&db->lock);
+    errno = 0;
+    int ret = KV_set_if(db->hmap, (char *)key, key_len, (char *)val, val_len + 1, KV_SET_VERSION, version);
+    if (ret > 0)
+    {
+        errno = KV_version(db->hmap, (char *)key, key_len) ? EAGAIN : ENOENT;
+    }
+    pthread_rwlock_unlock(&db->lock);
+    if (ret < 0 && errno == 0)
+    {
+        errno = ENOMEM;
+    }
+    return ret ? -1 : 0;
+}
+
+// Returns the new length of the value, or -1 with errno set
+int64_t sikv_append(sikv_t *db, const char *key, size_t key_len, const char *val, size_t val_len)
+{
+    if (check_len(key_len, val_len) < 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&db->lock);
+    errno = 0;
+    int64_t ret = KV_append(db->hmap, (char *)key, key_len, val, val_len);
+    pthread_rwlock_unlock(&db->lock);
+    if (ret < 0 && errno == 0)
+    {
+        errno = ENOMEM;
+    }
+    return ret;
+}
+
+int64_t sikv_setrange(sikv_t *db, const char *key, size_t key_len, uint64_t offset, const char *val, size_t val_len)
+{
+    if (check_len(key_len, val_len) < 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&db->lock);
+    errno = 0;
+    int64_t ret = KV_setrange(db->hmap, (char *)key, key_len, offset, val, val_len);
+    pthread_rwlock_unlock(&db->lock);
+    if (ret < 0 && errno == 0)
+    {
+        errno = ENOMEM;
+    }
+    return ret;
+}
+
+// Called with the lock held shared
+static const char *get_locked(sikv_t *db, const char *key, size_t key_len, size_t *val_len)
+{
+    int len;
+
+    if (key_len > INT32_MAX)
+    {
+        return NULL;
+    }
+    const char *val = (const char *)KV_get_value(db->hmap, (char *)key, key_len, &len);
+    if (val)
+    {
+        *val_len = len - 1;
+    }
+    return val;
+}
+
+int sikv_get(sikv_t *db, const char *key, size_t key_len, char *buf, size_t buf_len, size_t *val_len)
+{
+    size_t len;
+
+    pthread_rwlock_rdlock(&db->lock);
+    const char *val = get_locked(db, key, key_len, &len);
+    if (val)
+    {
+        memcpy(buf, val, len < buf_len ? len : buf_len);
+    }
+    pthread_rwlock_unlock(&db->lock);
+
+    if (val == NULL)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (val_len)
+    {
+        *val_len = len;
+    }
+    return 0;
+}
+
+// Called with the lock held shared
+static int view_locked(sikv_t *db, const char *key, size_t key_len, sikv_view_t *view)
+{
+    char *block;
+    int len;
+
+    view->data = NULL;
+    view->len = 0;
+    view->block = NULL;
+    const char *val = key_len > INT32_MAX ? NULL : (const char *)KV_get_ref(db->hmap, (char *)key, key_len, &len, &block);
+    if (val == NULL)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (block == NULL)
+    {
+        // Small values can move with the next write, so the view gets its own copy, '\0' included
+        char *copy = (char *)malloc(len);
+        if (copy == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(copy, val, len);
+        val = copy;
+    }
+    view->data = val;
+    view->len = len - 1;
+    view->block = block;
+    return 0;
+}
+
+int sikv_get_view(sikv_t *db, const char *key, size_t key_len, sikv_view_t *view)
+{
+    pthread_rwlock_rdlock(&db->lock);
+    int ret = view_locked(db, key, key_len, view);
+    pthread_rwlock_unlock(&db->lock);
+    return ret;
+}
+
+void sikv_view_release(sikv_view_t *view)
+{
+    if (view->block)
+    {
+        KV_large_release(view->block);
+    }
+    else
+    {
+        free((char *)view->data);
+    }
+    view->data = NULL;
+    view->len = 0;
+    view->block = NULL;
+}
+
+int sikv_del(sikv_t *db, const char *key, size_t key_len)
+{
+    if (key_len > INT32_MAX)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Large values are freed by the lazy free thread rather than under the lock
+    pthread_rwlock_wrlock(&db->lock);
+    int ret = KV_unlink(db->hmap, (char *)key, key_len);
+    pthread_rwlock_unlock(&db->lock);
+    if (ret < 0)
+    {
+        errno = ENOENT;
+    }
+    return ret;
+}
+
+size_t sikv_mset(sikv_t *db, size_t n, const char *const keys[], const size_t key_lens[], const char *const vals[], const size_t val_lens[])
+{
+    size_t i;
+
+    pthread_rwlock_wrlock(&db->lock);
+    for (i = 0; i < n; i++)
+    {
+        if (set_locked(db, keys[i], key_lens[i], vals[i], val_lens[i]) < 0)
+        {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&db->lock);
+    return i;
+}
+
+/*
+ * Records go to KV_load a batch at a time, after the table has been sized for all of them. The write
+ * lock is held throughout, and KV_load's threads are the only ones touching the table
+ */
+size_t sikv_load(sikv_t *db, size_t n, const char *const keys[], const size_t key_lens[], const char *const vals[], const size_t val_lens[], int nr_threads)
+{
+    size_t stored = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (check_len(key_lens[i], val_lens[i]) < 0)
+        {
+            return 0;
+        }
+    }
+    struct KV_record *recs = (struct KV_record *)malloc((n < LOAD_BATCH ? n + 1 : LOAD_BATCH) * sizeof(struct KV_record));
+    if (recs == NULL)
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&db->lock);
+    int ret = KV_reserve(db->hmap, n);
+    for (size_t i = 0; ret == 0 && i < n; i += LOAD_BATCH)
+    {
+        size_t batch = n - i < LOAD_BATCH ? n - i : LOAD_BATCH;
+        for (size_t j = 0; j < batch; j++)
+        {
+            recs[j] = (struct KV_record){.key = keys[i + j], .key_len = key_lens[i + j], .val = vals[i + j], .val_len = val_lens[i + j]};
+        }
+        uint64_t batch_stored = KV_load(db->hmap, recs, batch, nr_threads);
+        stored += batch_stored;
+        ret = batch_stored < batch ? -1 : 0;
+    }
+    pthread_rwlock_unlock(&db->lock);
+
+    free(recs);
+    return stored;
+}
+
+int64_t sikv_load_file(sikv_t *db, const char *path, int nr_threads)
+{
+    pthread_rwlock_wrlock(&db->lock);
+    int64_t ret = KV_load_file(db->hmap, path, nr_threads);
+    pthread_rwlock_unlock(&db->lock);
+    return ret;
+}
+
+size_t sikv_mget(sikv_t *db, size_t n, const char *const keys[], const size_t key_lens[], sikv_view_t views[])
+{
+    size_t nr_found = 0;
+
+    pthread_rwlock_rdlock(&db->lock);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (view_locked(db, keys[i], key_lens[i], &views[i]) == 0)
+        {
+            nr_found++;
+        }
+    }
+    pthread_rwlock_unlock(&db->lock);
+    return nr_found;
+}
+
+static void scan_key(void *arg, const char *key, int key_len, const char *val, int val_len)
+{
+    struct scan_ctx *ctx = (struct scan_ctx *)arg;
+    ctx->fn(ctx->arg, key, key_len, val, val_len - 1);
+}
+
+uint64_t sikv_scan(sikv_t *db, uint64_t cursor, int count, sikv_scan_fn fn, void *arg)
+{
+    struct scan_ctx ctx = {.hmap = db->hmap, .fn = fn, .arg = arg};
+
+    pthread_rwlock_rdlock(&db->lock);
+    cursor = KV_scan(db->hmap, cursor, NULL, 0, count, scan_key, &ctx);
+    pthread_rwlock_unlock(&db->lock);
+    return cursor;
+}
+
+// The index only holds keys, so the value is looked up in the table
+static void range_key(void *arg, const char *key, int key_len, const char *val, int val_len)
+{
+    struct scan_ctx *ctx = (struct scan_ctx *)arg;
+    val = (const char *)KV_get_value(ctx->hmap, (char *)key, key_len, &val_len);
+    ctx->fn(ctx->arg, key, key_len, val, val ? val_len - 1 : 0);
+}
+
+int sikv_range(sikv_t *db, const char *start, size_t start_len, const char *end, size_t end_len, int limit, sikv_scan_fn fn, void *arg)
+{
+    struct scan_ctx ctx = {.hmap = db->hmap, .fn = fn, .arg = arg};
+
+    pthread_rwlock_rdlock(&db->lock);
+    int ret = KV_range(db->hmap, start, start_len, false, end, end_len, false, limit > 0 ? limit : INT32_MAX, range_key, &ctx);
+    pthread_rwlock_unlock(&db->lock);
+    if (ret < 0)
+    {
+        errno = EINVAL;
+    }
+    return ret;
+}
+
+uint64_t sikv_used_memory(sikv_t *db)
+{
+    pthread_rwlock_rdlock(&db->lock);
+    uint64_t size = db->hmap->size;
+    pthread_rwlock_unlock(&db->lock);
+    return size;
+}
+
+int sikv_flush(sikv_t *db)
+{
+    pthread_rwlock_wrlock(&db->lock);
+    int ret = KV_flush(db->hmap, true);
+    pthread_rwlock_unlock(&db->lock);
+    if (ret < 0)
+    {
+        errno = ENOMEM;
+    }
+    return ret;
+}
+
+void sikv_cron(sikv_t *db)
+{
+    pthread_rwlock_wrlock(&db->lock);
+    KV_cron(db->hmap);
+    pthread_rwlock_unlock(&db->lock);
+}
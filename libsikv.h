@@ -0,0 +1,105 @@
+#ifndef _LIBSIKV_
+#define _LIBSIKV_
+
+/*
+ * Embeddable SiKV.
+ *
+ * Link with libsikv.a or libsikv.so (and -lpthread) to use the store in-process. Each sikv_t is an
+ * independent table behind its own reader/writer lock: any number of threads may read a handle at
+ * once while writes to it are serialized, and separate handles never contend. Keys and values are
+ * arbitrary bytes, e.g.
+ *
+ *     sikv_t *db = sikv_open(NULL);
+ *     sikv_set(db, "user:1", 6, "alice", 5);
+ *
+ *     sikv_view_t view;
+ *     if (sikv_get_view(db, "user:1", 6, &view) == 0)
+ *     {
+ *         fwrite(view.data, 1, view.len, stdout);
+ *         sikv_view_release(&view);
+ *     }
+ *     sikv_close(db);
+ *
+ * Functions returning int give 0 on success and -1 with errno set on failure: ENOENT for a missing
+ * key, ENOMEM at the memory limit, EINVAL for a key or value too large for the table (2GB).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIKV_API_VERSION 1
+
+typedef struct sikv sikv_t;
+
+struct sikv_options
+{
+    uint64_t capacity;   // initial slots, a power of two; 0 for the default
+    uint64_t max_memory; // bytes; 0 is no limit
+    bool ordered_index;  // keep keys sorted for sikv_range
+};
+
+/*
+ * A value that stays readable whatever is done to its key, without holding up writers. A large value
+ * is borrowed straight out of the table with a reference on it; a write to the key then copies it. A
+ * small one is copied. data is valid until sikv_view_release, even after sikv_close, and is followed
+ * by a '\0' that len does not count.
+ */
+typedef struct sikv_view
+{
+    const char *data;
+    size_t len;
+    char *block; // the large value referenced, NULL when data is a copy or the view holds nothing
+} sikv_view_t;
+
+typedef void (*sikv_scan_fn)(void *arg, const char *key, size_t key_len, const char *val, size_t val_len);
+
+// NULL options for the defaults. Returns NULL with errno set on failure
+sikv_t *sikv_open(const struct sikv_options *options);
+// Views still held stay valid until released. The memory is freed in the background
+void sikv_close(sikv_t *db);
+
+int sikv_set(sikv_t *db, const char *key, size_t key_len, const char *val, size_t val_len);
+// Version of the value, which changes on every write to the key; 0 when it is missing
+uint64_t sikv_version(sikv_t *db, const char *key, size_t key_len);
+// sikv_set only if the key is still at version. Fails with EAGAIN when it has been written since
+int sikv_cas(sikv_t *db, const char *key, size_t key_len, const char *val, size_t val_len, uint64_t version);
+// Add val to the end of the value, creating the key if missing. Return the new length of the value, or -1
+int64_t sikv_append(sikv_t *db, const char *key, size_t key_len, const char *val, size_t val_len);
+// Overwrite the value from offset, growing it as needed; a gap past its end is filled with '\0' bytes
+int64_t sikv_setrange(sikv_t *db, const char *key, size_t key_len, uint64_t offset, const char *val, size_t val_len);
+// Copies up to buf_len bytes of the value into buf; *val_len is set to the full length
+int sikv_get(sikv_t *db, const char *key, size_t key_len, char *buf, size_t buf_len, size_t *val_len);
+int sikv_get_view(sikv_t *db, const char *key, size_t key_len, sikv_view_t *view);
+void sikv_view_release(sikv_view_t *view);
+int sikv_del(sikv_t *db, const char *key, size_t key_len);
+
+// Stores the pairs in order under one lock. Returns how many were stored; fewer than n means the next one failed, with errno set
+size_t sikv_mset(sikv_t *db, size_t n, const char *const keys[], const size_t key_lens[], const char *const vals[], const size_t val_lens[]);
+/*
+ * For filling a handle fast: sizes the table for all n pairs up front and stores them with up to
+ * nr_threads threads, each working on its own part of the table. A later pair for a key replaces an
+ * earlier one. Returns how many were stored; fewer than n means some failed, with errno set
+ */
+size_t sikv_load(sikv_t *db, size_t n, const char *const keys[], const size_t key_lens[], const char *const vals[], const size_t val_lens[], int nr_threads);
+/*
+ * sikv_load from a dump file: either tab separated key and value lines, or "SiKVLOAD" followed by
+ * records of a 32 bit key length, a 32 bit value length (both native byte order), the key and the
+ * value. Returns how many were stored, or -1 with errno set
+ */
+int64_t sikv_load_file(sikv_t *db, const char *path, int nr_threads);
+// Looks the keys up under one lock. Returns how many were found; each found view must be released, views of missing keys hold nothing
+size_t sikv_mget(sikv_t *db, size_t n, const char *const keys[], const size_t key_lens[], sikv_view_t views[]);
+
+// Calls fn for up to about count keys from cursor and returns the next cursor, 0 when done. fn must not write to db
+uint64_t sikv_scan(sikv_t *db, uint64_t cursor, int count, sikv_scan_fn fn, void *arg);
+// Calls fn for up to limit keys in [start, end] in sorted order, NULL for unbounded, and returns how
+// many. Fails with EINVAL without ordered_index. fn must not write to db
+int sikv_range(sikv_t *db, const char *start, size_t start_len, const char *end, size_t end_len, int limit, sikv_scan_fn fn, void *arg);
+
+uint64_t sikv_used_memory(sikv_t *db);
+int sikv_flush(sikv_t *db);
+// Shrinks and compacts the table a little at a time; call it every 100ms or so from any thread
+void sikv_cron(sikv_t *db);
+
+#endif // _LIBSIKV_
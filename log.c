@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sikv.h"
+#include "log.h"
+
+/*
+ * Asynchronous logger.
+ *
+ * Each thread formats its messages into its own single producer, single consumer ring, so logging
+ * takes no locks and does no I/O. A background thread drains every ring every LOG_FLUSH_INTERVAL_MS
+ * and writes the lines out in one batch. A full ring or a thread over LOG_RATE_LIMIT drops the
+ * message and counts it; the logger thread reports the count so drops are never silent. A thread
+ * that exits marks its ring orphaned, and the logger thread frees it once it has drained it.
+ */
+
+struct log_msg
+{
+    uint64_t time_ns; // wall clock
+    KV_LOG_LEVEL level;
+    char text[LOG_MSG_LEN];
+};
+
+struct log_ring
+{
+    struct log_msg slots[LOG_RING_SLOTS];
+    uint64_t head; // written by the owning thread
+    uint64_t tail; // written by the logger thread
+    uint64_t dropped;
+    uint64_t reported; // drops already reported, logger thread only
+    uint64_t window_start_ns;
+    uint32_t window_count;
+    bool orphaned; // set once the owning thread has exited, after its last message
+    struct log_ring *next;
+};
+
+int kv_log_level = LL_NOTICE;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = NULL;
+static __thread struct log_ring *local_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t logger_thread;
+static int running = 0;
+static int log_fd = STDOUT_FILENO;
+static uint64_t total_dropped = 0;
+
+static const char *level_names[] = {"debug", "verbose", "notice", "warning", "none"};
+static const char level_marks[] = ".-*#";
+
+void KV_log_set_level(KV_LOG_LEVEL level)
+{
+    __atomic_store_n(&kv_log_level, level, __ATOMIC_RELAXED);
+}
+
+int KV_parse_log_level(const char *name, KV_LOG_LEVEL *level)
+{
+    for (int i = LL_DEBUG; i <= LL_NONE; i++)
+    {
+        if (strcmp(name, level_names[i]) == 0)
+        {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *KV_log_level_name(KV_LOG_LEVEL level)
+{
+    return level_names[level];
+}
+
+uint64_t KV_log_dropped(void)
+{
+    return __atomic_load_n(&total_dropped, __ATOMIC_RELAXED);
+}
+
+// Runs as the owning thread exits; the ring is left for the logger thread to drain and free
+static void ring_orphan(void *arg)
+{
+    struct log_ring *ring = (struct log_ring *)arg;
+    __atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+    pthread_key_create(&ring_key, ring_orphan);
+}
+
+static struct log_ring *ring_get(void)
+{
+    if (local_ring == NULL)
+    {
+        struct log_ring *ring = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+        if (ring == NULL)
+        {
+            return NULL;
+        }
+        pthread_once(&ring_key_once, ring_key_create);
+        pthread_setspecific(ring_key, ring);
+        pthread_mutex_lock(&rings_lock);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&rings_lock);
+        local_ring = ring;
+    }
+    return local_ring;
+}
+
+static void ring_drop(struct log_ring *ring)
+{
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total_dropped, 1, __ATOMIC_RELAXED);
+}
+
+void KV_log_write(KV_LOG_LEVEL level, const char *fmt, ...)
+{
+    struct timespec ts;
+    va_list ap;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+        return;
+    }
+
+    struct log_ring *ring = ring_get();
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (now - ring->window_start_ns >= 1000000000ULL)
+    {
+        ring->window_start_ns = now;
+        ring->window_count = 0;
+    }
+
+    uint64_t head = ring->head;
+    if (ring->window_count >= LOG_RATE_LIMIT || head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
+    {
+        ring_drop(ring);
+        return;
+    }
+
+    struct log_msg *msg = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    msg->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    msg->level = level;
+    va_start(ap, fmt);
+    vsnprintf(msg->text, LOG_MSG_LEN, fmt, ap);
+    va_end(ap);
+
+    ring->window_count++;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_all(const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(log_fd, buf, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static size_t format_line(char *buf, size_t len, uint64_t time_ns, KV_LOG_LEVEL level, const char *text)
+{
+    struct tm tm;
+    time_t secs = time_ns / 1000000000ULL;
+    char date[32];
+
+    localtime_r(&secs, &tm);
+    strftime(date, sizeof(date), "%d %b %Y %H:%M:%S", &tm);
+    int n = snprintf(buf, len, "%d %s.%03lu %c %s\n", getpid(), date, (time_ns / 1000000) % 1000, level_marks[level], text);
+    return n < len ? n : len;
+}
+
+static void drain(void)
+{
+    static char out[LOG_MSG_LEN * 64];
+    size_t off = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    for (struct log_ring **link = &rings, *ring; (ring = *link) != NULL;)
+    {
+        // Read before head, so an orphaned ring is seen with every message its thread wrote
+        bool orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t tail = ring->tail; tail != head; tail++)
+        {
+            struct log_msg *msg = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+            if (sizeof(out) - off < LOG_MSG_LEN + 64)
+            {
+                write_all(out, off);
+                off = 0;
+            }
+            off += format_line(&out[off], sizeof(out) - off, msg->time_ns, msg->level, msg->text);
+            // Hand the slot back only once its text has been copied out
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported)
+        {
+            char text[64];
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            snprintf(text, sizeof(text), "%lu log messages dropped", dropped - ring->reported);
+            if (sizeof(out) - off < LOG_MSG_LEN + 64)
+            {
+                write_all(out, off);
+                off = 0;
+            }
+            off += format_line(&out[off], sizeof(out) - off, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec, LL_WARNING, text);
+            ring->reported = dropped;
+        }
+
+        if (orphaned)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+        {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    write_all(out, off);
+}
+
+static void *logger_main(void *arg)
+{
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000L};
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        drain();
+        nanosleep(&interval, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+// Start the logger thread writing to path, or to stdout when path is NULL
+int KV_log_init(const char *path)
+{
+    if (running)
+    {
+        return 0;
+    }
+
+    if (path)
+    {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd == -1)
+        {
+            perror("KV_log_init: Unable to open log file");
+            log_fd = STDOUT_FILENO;
+            return -1;
+        }
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&logger_thread, NULL, logger_main, NULL) != 0)
+    {
+        perror("KV_log_init: Unable to start logger thread");
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    atexit(KV_log_shutdown);
+    return 0;
+}
+
+// Stop the logger thread after writing out everything already logged
+void KV_log_shutdown(void)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(logger_thread, NULL);
+    if (log_fd != STDOUT_FILENO)
+    {
+        close(log_fd);
+        log_fd = STDOUT_FILENO;
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef _SIKV_LOG_
+#define _SIKV_LOG_
+
+#include <stdint.h>
+
+#include "sikv.h"
+
+#define LOG_MSG_LEN 256          // longer messages are truncated
+#define LOG_RING_SLOTS 1024      // per thread, power of two
+#define LOG_FLUSH_INTERVAL_MS 10 // how often the logger thread drains the rings
+#define LOG_RATE_LIMIT 1000      // messages per second per thread; the rest are dropped and counted
+
+typedef enum
+{
+    LL_DEBUG,
+    LL_VERBOSE,
+    LL_NOTICE,
+    LL_WARNING,
+    LL_NONE
+} KV_LOG_LEVEL;
+
+// Calls below this level are compiled out. SIKV_VERBOSE keeps the per operation debug messages
+#ifndef LOG_COMPILED_LEVEL
+#if SIKV_VERBOSE
+#define LOG_COMPILED_LEVEL LL_DEBUG
+#else
+#define LOG_COMPILED_LEVEL LL_VERBOSE
+#endif
+#endif
+
+extern int kv_log_level;
+
+/*
+ * Format the message into the calling thread's ring buffer; the logger thread writes it out. Never
+ * blocks: when the ring is full or the thread is over its rate limit the message is dropped. Before
+ * KV_log_init the message goes straight to stderr.
+ */
+#define KV_log(level, ...)                                                  \
+    do                                                                      \
+    {                                                                       \
+        if ((level) >= LOG_COMPILED_LEVEL && (level) >= kv_log_level)       \
+        {                                                                   \
+            KV_log_write(level, __VA_ARGS__);                               \
+        }                                                                   \
+    } while (0)
+
+void KV_log_write(KV_LOG_LEVEL level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int KV_log_init(const char *path);
+void KV_log_shutdown(void);
+void KV_log_set_level(KV_LOG_LEVEL level);
+int KV_parse_log_level(const char *name, KV_LOG_LEVEL *level);
+const char *KV_log_level_name(KV_LOG_LEVEL level);
+uint64_t KV_log_dropped(void);
+
+#endif // _SIKV_LOG_
@@ -1,18 +1,34 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "MurmurHash3.h"
 #include "sikv.h"
+#include "skiplist.h"
+#include "log.h"
+#include "trace.h"
 
 #if USE_CUSTOM_ALLOC
 // to be enabled once windows setup is complete
 #if defined(__linux__)
 #include <alloc.h>
 #endif
+#else
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 #endif
 
 static struct hash_map *HMAP = NULL;
+// Every live table, for the totals that are process wide (e.g the fragmentation defrag looks at)
+static struct hash_map *hmaps = NULL;
+static pthread_mutex_t hmaps_lock = PTHREAD_MUTEX_INITIALIZER;
+// Table sizing, see KV_set_initial_capacity and friends. The macros in sikv.h are the defaults
+static uint64_t initial_capacity = MIN_ENTRY_NUM;
+static float load_factor = LOAD_FACTOR;
+static int growth_factor = RESIZE_POLICY;
 
 void set_hmap(struct hash_map *hmap)
 {
@@ -22,24 +38,58 @@ void set_hmap(struct hash_map *hmap)
     }
 }
 
-struct hash_map *KV_init(unsigned long capacity, hash_function hash_fn, KV_TYPE val_type, bool allow_concurrent_access)
+// Large slot arrays come from huge page backed mappings when enabled, everything else from the usual allocator
+static char *slots_alloc(struct hash_map *hmap, size_t size, size_t *map_len)
+{
+    char *arr = (char *)KV_page_alloc(size, map_len);
+    if (arr)
+    {
+        return arr;
+    }
+
+#if !USE_CUSTOM_ALLOC
+    return (char *)malloc(size);
+#else
+    return (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, size);
+#endif
+}
+
+static void slots_free(struct hash_map *hmap, char *arr, size_t map_len)
+{
+    if (map_len)
+    {
+        KV_page_free(arr, map_len);
+        return;
+    }
+
+#if !USE_CUSTOM_ALLOC
+    free(arr);
+#else
+    KV_free((struct KV_alloc_pool *)hmap->pool, arr);
+#endif
+}
+
+// Returns NULL with errno set on failure; embedders decide whether that is fatal
+struct hash_map *KV_init(uint64_t capacity, hash_function hash_fn, KV_TYPE val_type, bool allow_concurrent_access)
 {
     if (capacity && CHECK_POWER_OF_2(capacity) != 0)
     {
-        fprintf(stderr, "ERROR: Hmap size must be a power of two\n");
-        exit(EXIT_FAILURE);
+        KV_log(LL_WARNING, "KV_init: Hmap size must be a power of two");
+        errno = EINVAL;
+        return NULL;
     }
 
     struct hash_map *hmap = (struct hash_map *)malloc(sizeof(struct hash_map));
     if (hmap == NULL)
     {
         perror("KV_hash_map_init: Unable to initialize hash table");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
     memset(hmap, 0, sizeof(struct hash_map));
 
     hmap->hash_fn = hash_fn;
+    hmap->alloc_concurrent_access = allow_concurrent_access;
 
 #if USE_CUSTOM_ALLOC
     struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, allow_concurrent_access);
@@ -47,42 +97,45 @@ struct hash_map *KV_init(unsigned long capacity, hash_function hash_fn, KV_TYPE
     {
         perror("KV_hash_map_init: Unable to initialize pool");
         free(hmap);
-        exit(EXIT_FAILURE);
+        return NULL;
     }
+    KV_page_advise(pool->data, MIN_ALLOCATION_POOL_SIZE);
     memset(pool->data, EMPTY, MIN_ALLOCATION_POOL_SIZE);
     hmap->pool = (char *)pool;
-    hmap->arr = (char *)KV_malloc(pool, capacity * sizeof(struct KV));
-#else
-    hmap->arr = (char *)malloc(capacity * sizeof(struct KV));
 #endif
+    hmap->arr = slots_alloc(hmap, capacity * sizeof(struct KV), &hmap->arr_map_len);
 
     if (hmap->arr == NULL)
     {
         perror("KV_hash_map_init: Unable to initialize array");
+#if USE_CUSTOM_ALLOC
+        KV_alloc_pool_free(pool);
+#endif
         free(hmap);
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
-#if !USE_CUSTOM_ALLOC
     memset(hmap->arr, EMPTY, capacity * sizeof(struct KV));
-#endif
     hmap->len = 0;
     hmap->size = capacity * sizeof(struct KV);
-#if SIKV_VERBOSE
-    printf("Initializing array of size=%i\n", hmap->size);
-#endif
+    KV_log(LL_DEBUG, "Initializing array of size=%lu", hmap->size);
     hmap->seed = 1;
     hmap->capacity = capacity;
     hmap->val_type = val_type;
-    HMAP = hmap;
+    pthread_mutex_lock(&hmaps_lock);
+    hmap->next = hmaps;
+    hmaps = hmap;
+    // The first table is the default one KV_hmap returns; more can be created for separate keyspaces
+    set_hmap(hmap);
+    pthread_mutex_unlock(&hmaps_lock);
     return hmap;
 }
 
 struct hash_map *KV_hmap(bool alloc_concurrent_access)
 {
-    if (!HMAP)
+    if (!HMAP && KV_init(initial_capacity, KV_hash_function, KV_STRING, alloc_concurrent_access) == NULL)
     {
-        KV_init(MIN_ENTRY_NUM, KV_hash_function, KV_STRING, alloc_concurrent_access);
+        exit(EXIT_FAILURE);
     }
     return HMAP;
 }
@@ -109,427 +162,2909 @@ size_t get_type_size(KV_TYPE val_type, char *val)
     return -1;
 }
 
+static const struct
+{
+    const char *name;
+    KV_CMD cmd;
+} commands[] = {
+    {"SET", CMD_SET},
+    {"GET", CMD_GET},
+    {"PUT", CMD_PUT},
+    {"DEL", CMD_DEL},
+    {"SCAN", CMD_SCAN},
+    {"RANGE", CMD_RANGE},
+    {"PREFIX", CMD_PREFIX},
+    {"PSYNC", CMD_PSYNC},
+    {"ROLE", CMD_ROLE},
+    {"MEMORY", CMD_MEMORY},
+    {"LATENCY", CMD_LATENCY},
+    {"SLOWLOG", CMD_SLOWLOG},
+    {"DEBUG", CMD_DEBUG},
+    {"LOGLEVEL", CMD_LOGLEVEL},
+    {"COMPACT", CMD_COMPACT},
+    {"UNLINK", CMD_UNLINK},
+    {"FLUSH", CMD_FLUSH},
+    {"SELECT", CMD_SELECT},
+    {"SHM", CMD_SHM},
+    {"TRACKING", CMD_TRACKING},
+    {"SETBULK", CMD_SETBULK},
+    {"APPEND", CMD_APPEND},
+    {"GETRANGE", CMD_GETRANGE},
+    {"SETRANGE", CMD_SETRANGE},
+    {"GETS", CMD_GETS},
+    {"CAS", CMD_CAS},
+    {"SETNX", CMD_SETNX},
+    {"SETXX", CMD_SETXX},
+    {"CONFIG", CMD_CONFIG},
+};
+
 KV_CMD parse_cmd(char *cmd, int len)
 {
-    if (memcmp("SET", cmd, len) == 0)
-    {
-        return CMD_SET;
-    }
-    else if (memcmp("GET", cmd, len) == 0)
-    {
-        return CMD_GET;
-    }
-    else if (memcmp("PUT", cmd, len) == 0)
-    {
-        return CMD_PUT;
-    }
-    else if (memcmp("DEL", cmd, len) == 0)
-    {
-        return CMD_DEL;
-    }
-    else
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
     {
-        return CMD_NOOP;
+        if (strlen(commands[i].name) == len && memcmp(commands[i].name, cmd, len) == 0)
+        {
+            return commands[i].cmd;
+        }
     }
+    return CMD_NOOP;
 }
 
-void *process_cmd(struct hash_map *hmap, int argc, char *argv[])
+const char *KV_cmd_name(KV_CMD cmd)
 {
-    if (argc < 1)
-    {
-        fprintf(stderr, "process_cmd: Command is required\n");
-        exit(EXIT_FAILURE);
-    }
-
-    char *cmd = argv[0];
-    int len = strlen(argv[0]);
-    int ret;
-
-    switch (parse_cmd(cmd, len))
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
     {
-    case CMD_SET:
-    case CMD_PUT:
-        if (argc < 3)
-        {
-            fprintf(stderr, "SET Error: Value was not provided\n");
-            return NULL;
-        }
-
-        ret = KV_set(hmap, argv[1], strlen(argv[1]), argv[2], get_type_size(hmap->val_type, argv[2]) + 1);
-        if (ret == 0)
-        {
-            return SUCCESS;
-        }
-        break;
-    case CMD_GET:
-        if (argc < 2)
-        {
-            fprintf(stderr, "GET Error: Key was not provided\n");
-            break;
-        }
-        return KV_get(hmap, argv[1], strlen(argv[1]));
-    case CMD_DEL:
-        if (argc < 2)
-        {
-            fprintf(stderr, "DELETE Error: Key was not provided\n");
-            break;
-        }
-        ret = KV_delete(hmap, argv[1], strlen(argv[1]));
-        if (ret == 0)
+        if (commands[i].cmd == cmd)
         {
-            return SUCCESS;
+            return commands[i].name;
         }
-        break;
-    default:
-        fprintf(stderr, "Invalid command\n");
-        break;
     }
-    return NULL;
+    return "UNKNOWN";
 }
 
-static uint32_t first_slot(uint32_t hash, int capacity)
+/*
+ * Replies generated by a command (e.g SCAN) are built here, in a buffer of the calling thread's own so
+ * threads can run commands on separate tables at once. The returned pointer is only valid until the
+ * thread's next command. The key frees the buffer when its thread exits
+ */
+static __thread char *reply_buf = NULL;
+static __thread size_t reply_len = 0;
+static __thread size_t reply_cap = 0;
+static pthread_key_t reply_key;
+static pthread_once_t reply_key_once = PTHREAD_ONCE_INIT;
+
+static void reply_key_create(void)
 {
-    return hash & (capacity - 1);
+    pthread_key_create(&reply_key, free);
 }
 
-static uint32_t next_slot(uint32_t hash, int capacity)
-{
-    return (hash + 1) & (capacity - 1);
-}
+// Slots probed by the current thread since its last command started
+static __thread uint32_t probes = 0;
 
-static int resize_find_empty_slot(struct hash_map *hmap, char *buf, int buf_len, char *key, int key_len)
+static int reply_reserve(size_t len)
 {
-    uint32_t hash = hmap->hash_fn(key, key_len, hmap->seed);
-    hash = first_slot(hash, hmap->capacity);
-    uint32_t start = hash;
-    void *entry = &buf[hash * sizeof(struct KV)];
-
-    if (*(int8_t *)entry == EMPTY)
+    if (reply_len + len + 1 > reply_cap)
     {
-        return hash;
-    }
-
-    size_t i = 0;
-    while (*(int8_t *)entry != EMPTY && i < hmap->capacity)
-    {
-        hash = next_slot(hash, hmap->capacity);
-        if (hash == start)
+        size_t cap = reply_cap ? reply_cap : BUFFSZ;
+        while (reply_len + len + 1 > cap)
         {
-            break;
+            cap *= 2;
         }
-        entry = &buf[hash * sizeof(struct KV)];
-        if (*(int8_t *)entry == EMPTY)
+        char *buf = realloc(reply_buf, cap);
+        if (buf == NULL)
         {
-            return hash;
+            perror("reply_reserve: Unable to grow reply buffer");
+            return -1;
         }
-        i = hash;
+        reply_buf = buf;
+        reply_cap = cap;
+        pthread_once(&reply_key_once, reply_key_create);
+        pthread_setspecific(reply_key, buf);
     }
-
-    return -1;
+    return 0;
 }
 
-static __attribute__((unused)) void rehash_buf(struct hash_map *hmap, char *buf, int buf_len)
+static int reply_append(const char *str, size_t len)
 {
-    for (size_t i = 0; i < buf_len / RESIZE_POLICY; i += sizeof(struct KV))
+    if (reply_reserve(len) < 0)
     {
-        struct KV *entry = (struct KV *)&hmap->arr[i];
-        if (*(int8_t *)entry == EMPTY || entry->data == TOMBSTONE)
-        {
-            continue;
-        }
-        int slot = resize_find_empty_slot(hmap, buf, buf_len, entry->data, entry->key_len);
-
-        memcpy(&buf[slot * sizeof(struct KV)], entry, sizeof(struct KV));
+        return -1;
     }
+    memcpy(&reply_buf[reply_len], str, len);
+    reply_len += len;
+    reply_buf[reply_len] = '\0';
+    return 0;
 }
 
-static void hash_map_resize(struct hash_map *hmap, int policy)
+static void scan_reply_key(void *arg, const char *key, int key_len, const char *val, int val_len)
 {
-    size_t cap = hmap->capacity * policy * sizeof(struct KV);
-    if (cap > MAXIMUM_SIZE)
-    {
-        perror("hash_map_resize: Maximum memory exceeded");
-        exit(EXIT_FAILURE);
-    }
-
-#if !USE_CUSTOM_ALLOC
-    char *buf = (char *)malloc(cap);
-#else
-    char *buf = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, cap);
-#endif
+    reply_append(" ", 1);
+    reply_append(key, key_len);
+}
 
-    if (buf == NULL)
+static void index_reply_key(void *arg, const char *key, int key_len, const char *val, int val_len)
+{
+    if (reply_len > 0)
     {
-        perror("hash_map_resize: Unable to resize hash table");
-        exit(EXIT_FAILURE);
+        reply_append(" ", 1);
     }
-    memset(buf, EMPTY, cap);
-
-    hmap->size = hmap->size - (hmap->capacity * sizeof(struct KV));
-    memcpy(buf, hmap->arr, hmap->capacity * sizeof(struct KV));
-    hmap->capacity = hmap->capacity * policy;
-    hmap->size += cap;
-    // rehash_buf(hmap, buf, cap);
-#if !USE_CUSTOM_ALLOC
-    free(hmap->arr);
-#else
-    KV_free((struct KV_alloc_pool *)hmap->pool, hmap->arr);
-#endif
-    hmap->arr = buf;
+    reply_append(key, key_len);
 }
 
-bool max_size_reached(int sz, int max_sz)
+// Range bounds: '-' and '+' are unbounded, '(' prefix is exclusive, '[' prefix or bare key is inclusive
+static void parse_range_bound(char *arg, const char *unbounded, char **key, int *key_len, bool *exclusive)
 {
-    return sz >= max_sz;
+    *exclusive = false;
+    if (strcmp(arg, unbounded) == 0)
+    {
+        *key = NULL;
+        *key_len = 0;
+        return;
+    }
+    if (*arg == '(' || *arg == '[')
+    {
+        *exclusive = *arg == '(';
+        arg++;
+    }
+    *key = arg;
+    *key_len = strlen(arg);
 }
 
-uint32_t KV_hash_function(const void *key, int len, int seed)
+// RANGE start end [LIMIT count]
+static void *range_cmd(struct hash_map *hmap, int argc, char *argv[])
 {
-    uint32_t hash = 0;
-    MurmurHash3_x86_32(key, len, seed, &hash);
-    return hash;
-}
+    char *start, *end;
+    int start_len, end_len;
+    bool start_exclusive, end_exclusive;
+    int limit = INDEX_DEFAULT_LIMIT;
 
-static int find_empty_slot(struct hash_map *hmap, char *key, int key_len)
-{
-    uint32_t hash = hmap->hash_fn(key, key_len, hmap->seed);
-    hash = first_slot(hash, hmap->capacity);
-    uint32_t start = hash;
-    struct KV *entry = (struct KV *)&hmap->arr[hash * sizeof(struct KV)];
+    if (argc > 4 && strcmp(argv[3], "LIMIT") == 0)
+    {
+        limit = strtol(argv[4], NULL, 10);
+    }
+    parse_range_bound(argv[1], "-", &start, &start_len, &start_exclusive);
+    parse_range_bound(argv[2], "+", &end, &end_len, &end_exclusive);
 
-    if (*(int8_t *)entry == EMPTY || entry->data == TOMBSTONE || (entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0))
+    reply_len = 0;
+    reply_append("", 0);
+    if (KV_range(hmap, start, start_len, start_exclusive, end, end_len, end_exclusive, limit, index_reply_key, NULL) < 0)
     {
-        return hash;
+        KV_log(LL_VERBOSE, "RANGE Error: Ordered index is not enabled");
+        return NULL;
     }
+    return reply_buf;
+}
 
-    size_t i = 0;
-    while (*(int8_t *)entry != EMPTY && i < hmap->capacity)
+// PREFIX prefix [AFTER key] [LIMIT count]
+static void *prefix_cmd(struct hash_map *hmap, int argc, char *argv[])
+{
+    char *after = NULL;
+    int limit = INDEX_DEFAULT_LIMIT;
+
+    for (int i = 2; i + 1 < argc; i += 2)
     {
-        hash = next_slot(hash, hmap->capacity);
-        if (hash == start)
+        if (strcmp(argv[i], "AFTER") == 0)
         {
-            break;
+            after = argv[i + 1];
         }
-        entry = (struct KV *)&hmap->arr[hash * sizeof(struct KV)];
-        if (*(int8_t *)entry == EMPTY || entry->data == TOMBSTONE)
+        else if (strcmp(argv[i], "LIMIT") == 0)
         {
-            return hash;
+            limit = strtol(argv[i + 1], NULL, 10);
         }
-        i = hash;
     }
 
-    return -1;
+    reply_len = 0;
+    reply_append("", 0);
+    if (KV_prefix(hmap, argv[1], strlen(argv[1]), after, after ? strlen(after) : 0, limit, index_reply_key, NULL) < 0)
+    {
+        KV_log(LL_VERBOSE, "PREFIX Error: Ordered index is not enabled");
+        return NULL;
+    }
+    return reply_buf;
 }
 
-static int entry_init(struct hash_map *hmap, struct KV *entry)
+// SCAN cursor [MATCH pattern] [COUNT count]
+static void *scan_cmd(struct hash_map *hmap, int argc, char *argv[])
 {
-    size_t size = entry->key_len + entry->val_len;
-    char *data = NULL;
+    char *pattern = NULL;
+    int count = SCAN_DEFAULT_COUNT;
+    char cursor_str[24];
 
-#if !USE_CUSTOM_ALLOC
-    // entry->key = (char *)malloc(entry->key_len);
-    data = (char *)malloc(size);
-#else
-    // entry->key = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, entry->key_len);
-    data = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, size);
-#endif
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "MATCH") == 0)
+        {
+            pattern = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "COUNT") == 0)
+        {
+            count = strtol(argv[i + 1], NULL, 10);
+        }
+    }
 
-    if (data == NULL)
+    reply_len = 0;
+    uint64_t cursor = KV_scan(hmap, strtoull(argv[1], NULL, 10), pattern, pattern ? strlen(pattern) : 0, count, scan_reply_key, NULL);
+    size_t keys_len = reply_len;
+    int n = snprintf(cursor_str, sizeof(cursor_str), "%lu", cursor);
+
+    // Cursor goes in front of the keys
+    if (reply_append(cursor_str, n) < 0)
     {
-        fprintf(stderr, "entry_init: Unable to intialize data");
-        return -1;
+        return NULL;
     }
+    memmove(&reply_buf[n], reply_buf, keys_len);
+    memcpy(reply_buf, cursor_str, n);
+    return reply_buf;
+}
 
-    entry->data = data;
+// LATENCY [RESET]
+static void *latency_cmd(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "RESET") == 0)
+    {
+        KV_latency_reset();
+        return SUCCESS;
+    }
 
-    return 0;
+    reply_len = 0;
+    if (reply_reserve(LATENCY_REPORT_SIZE) < 0)
+    {
+        return NULL;
+    }
+    reply_len = KV_latency_report(reply_buf, LATENCY_REPORT_SIZE);
+    return reply_buf;
+}
 
-    //     if (entry->key == NULL)
-    //     {
-    //         fprintf(stderr, "entry_init: Unable to intialize entry key");
-    //         return -1;
-    //     }
+// SLOWLOG GET [count] | LEN | RESET
+static void *slowlog_cmd(int argc, char *argv[])
+{
+    char buf[24];
 
-    // #if !USE_CUSTOM_ALLOC
-    //     entry->val = (char *)malloc(entry->val_len);
-    // #else
-    //     entry->val = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, entry->val_len);
-    // #endif
+    if (argc > 1 && strcmp(argv[1], "RESET") == 0)
+    {
+        KV_slowlog_reset();
+        return SUCCESS;
+    }
 
-    //     if (entry->val == NULL)
-    //     {
-    //         fprintf(stderr, "entry_init: Unable to intialize entry value");
-    // #if !USE_CUSTOM_ALLOC
-    //         // free(entry->key);
-    // #else
-    //         KV_free((struct KV_alloc_pool *)hmap->pool, entry->key);
-    // #endif
-    //         return -1;
-    //     }
-    //     return 0;
+    reply_len = 0;
+    if (argc > 1 && strcmp(argv[1], "LEN") == 0)
+    {
+        int n = snprintf(buf, sizeof(buf), "%lu", KV_slowlog_len());
+        reply_append(buf, n);
+        return reply_buf;
+    }
 
-    // char *chunk = (char *)malloc(e->key_len + e->val_len);
+    int count = argc > 2 ? strtol(argv[2], NULL, 10) : 10;
+    size_t size = (count > 0 && count < SLOWLOG_LEN ? count : SLOWLOG_LEN) * (SLOWLOG_KEY_LEN + 160);
+    if (reply_reserve(size) < 0)
+    {
+        return NULL;
+    }
+    reply_len = KV_slowlog_report(reply_buf, size, count);
+    return reply_buf;
 }
 
-int KV_set(struct hash_map *hmap, char *key, int key_len, char *val, int val_len)
+// DEBUG HTSTATS [samples]; 0 samples walks the whole table
+static void *debug_cmd(struct hash_map *hmap, int argc, char *argv[])
 {
-    size_t size;
-    int ret;
-    int temp;
+    struct KV_table_stats stats;
+    char buf[BUFFSZ];
 
-    int slot = find_empty_slot(hmap, key, key_len);
+    if (argc < 2 || strcmp(argv[1], "HTSTATS") != 0)
+    {
+        return NULL;
+    }
 
-    // KV already allocated during initialization. We just need to get our KV chunk
-    struct KV *entry = (struct KV *)&hmap->arr[slot * sizeof(struct KV)];
-    size = key_len + val_len;
+    uint64_t samples = argc > 2 ? strtoull(argv[2], NULL, 10) : HTSTATS_DEFAULT_SAMPLES;
+    if (KV_table_stats(hmap, samples, &stats) < 0)
+    {
+        return NULL;
+    }
 
-    if (*(int8_t *)entry == EMPTY)
+    int n = snprintf(buf, sizeof(buf), "capacity=%lu scanned=%lu live=%lu tombstones=%lu empty=%lu load_factor=%.3f used_factor=%.3f "
+                                       "longest_cluster=%lu avg_probe=%.2f max_probe=%lu probe_hist=",
+                     stats.capacity, stats.scanned, stats.live, stats.tombstones, stats.empty,
+                     (double)stats.live / stats.scanned, (double)(stats.live + stats.tombstones) / stats.scanned,
+                     stats.longest_cluster, stats.live ? (double)stats.total_probe / stats.live : 0.0, stats.max_probe);
+    for (int i = 0, first = 1; i < HTSTATS_BUCKETS && n < sizeof(buf); i++)
     {
-#if SIKV_VERBOSE
-        printf("Writing object of size=%zu\n", size);
-#endif
-        entry->key_len = key_len;
-        entry->val_len = val_len;
-        ret = entry_init(hmap, entry);
-        if (ret < 0)
+        if (stats.probe_hist[i] == 0)
         {
-            return ret;
+            continue;
         }
-        memcpy(entry->data, key, key_len);
-        memcpy((char *)&entry->data[key_len], val, val_len);
-        entry->data[size - 1] = '\0';
-        hmap->size += size;
-        hmap->len += 1;
-
-        // TODO: We can replace division later
-        float lf = (float)hmap->len / hmap->capacity;
-        if (lf >= LOAD_FACTOR)
+        uint64_t lo = i ? 1UL << (i - 1) : 0;
+        uint64_t hi = i ? (1UL << i) - 1 : 0;
+        if (i == HTSTATS_BUCKETS - 1)
         {
-            temp = hmap->capacity;
-            hash_map_resize(hmap, RESIZE_POLICY);
-#if SIKV_VERBOSE
-            printf("Resizing HashMap from array size=%zu to array size=%zu; current memory usage for data=%i bytes\n", temp * sizeof(struct KV), hmap->capacity * sizeof(struct KV), hmap->size);
-#endif
+            n += snprintf(&buf[n], sizeof(buf) - n, "%s%lu+:%lu", first ? "" : ",", lo, stats.probe_hist[i]);
         }
-    }
-    else
-    {
-#if !USE_CUSTOM_ALLOC
-        entry->data = (char *)malloc(size);
-#else
-        entry->data = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, size);
-#endif
-        if (entry->data == NULL)
+        else if (lo == hi)
         {
-            fprintf(stderr, "KV_set: Unable to intialize entry value");
-            return -1;
+            n += snprintf(&buf[n], sizeof(buf) - n, "%s%lu:%lu", first ? "" : ",", lo, stats.probe_hist[i]);
         }
+        else
+        {
+            n += snprintf(&buf[n], sizeof(buf) - n, "%s%lu-%lu:%lu", first ? "" : ",", lo, hi, stats.probe_hist[i]);
+        }
+        first = 0;
+    }
+    if (stats.rebuild_capacity && n < sizeof(buf))
+    {
+        n += snprintf(&buf[n], sizeof(buf) - n, " rebuild_capacity=%lu rebuild_len=%lu rebuild_progress=%.3f",
+                      stats.rebuild_capacity, stats.rebuild_len, (double)stats.rebuild_pos / stats.capacity);
+    }
 
-        memcpy(entry->data, key, key_len);
-        memcpy((char *)&entry->data[key_len], val, val_len);
-        // hmap->size -= entry->val_len;
-        entry->val_len = val_len;
-        hmap->size += size;
+    reply_len = 0;
+    if (reply_append(buf, n < sizeof(buf) ? n : sizeof(buf) - 1) < 0)
+    {
+        return NULL;
     }
-    return 0;
+    return reply_buf;
 }
 
-static int find(struct hash_map *hmap, char *key, int key_len)
+// LOGLEVEL [debug|verbose|notice|warning|none]
+static void *loglevel_cmd(int argc, char *argv[])
 {
-    uint32_t hash = hmap->hash_fn(key, key_len, hmap->seed);
-    hash = first_slot(hash, hmap->capacity);
-    uint32_t start = hash;
-    struct KV *entry = (struct KV *)&hmap->arr[hash * sizeof(struct KV)];
-    // char key[key_len];
-    // memcpy(key, entry->data, key_len);
+    KV_LOG_LEVEL level;
 
-    if (entry->data != TOMBSTONE && (key_len == entry->key_len && memcmp(entry->data, key, entry->key_len) == 0))
+    if (argc < 2)
     {
-        return hash;
+        const char *name = KV_log_level_name(kv_log_level);
+        reply_len = 0;
+        reply_append(name, strlen(name));
+        return reply_buf;
     }
 
-    size_t i = 0;
-    while ((*(int8_t *)entry != EMPTY || entry->data != TOMBSTONE) && i < hmap->capacity)
+    if (KV_parse_log_level(argv[1], &level) < 0)
     {
-        hash = next_slot(hash, hmap->capacity);
+        KV_log(LL_VERBOSE, "LOGLEVEL Error: Unknown level %s", argv[1]);
+        return NULL;
+    }
+    KV_log_set_level(level);
+    return SUCCESS;
+}
 
-        // We need to stop the search where we started. If we get to the start point; the key does not exist
-        if (hash == start)
-        {
-            break;
-        }
+static size_t large_value_len(char *block);
 
-        entry = (struct KV *)&hmap->arr[hash * sizeof(struct KV)];
-        if (entry->data != TOMBSTONE && key_len == entry->key_len && memcmp(entry->data, key, entry->key_len) == 0)
-        {
-            return hash;
-        }
-        i = hash;
-    }
+// A fixed reply line, e.g an error
+static void *text_reply(const char *text)
+{
+    reply_len = 0;
+    reply_append(text, strlen(text));
+    return reply_buf;
+}
 
-    return -1;
+static bool parse_int64(const char *str, int64_t *val)
+{
+    char *end = NULL;
+    errno = 0;
+    *val = strtoll(str, &end, 10);
+    return end != str && *end == '\0' && errno == 0;
 }
 
-void *KV_get(struct hash_map *hmap, char *key, int key_len)
+// APPEND and SETRANGE reply with the new length of the value
+static void *length_reply(int64_t len)
 {
-    int64_t slot = find(hmap, key, key_len);
-    struct KV *entry = NULL;
-    if (slot == -1)
+    char len_str[24];
+
+    if (len < 0)
     {
-        return NULL;
+        return text_reply(errno == ENOMEM ? "ERR OOM command not allowed when used memory > max memory" : "ERR value is too large");
     }
-    entry = (struct KV *)&hmap->arr[slot * sizeof(struct KV)];
-    return (void *)&entry->data[key_len];
+    int n = snprintf(len_str, sizeof(len_str), "%ld", len);
+    reply_len = 0;
+    reply_append(len_str, n);
+    return reply_buf;
 }
 
-int KV_delete(struct hash_map *hmap, char *key, int key_len)
+/*
+ * SETNX, SETXX and CAS. A write whose condition does not hold replies GET Not found when the key is
+ * missing and Exists when it is there, or has moved past the version asked for
+ */
+static void *set_if_cmd(struct hash_map *hmap, char *key, char *val, KV_SET_COND cond, uint64_t version)
 {
-    struct KV *entry = NULL;
-    int64_t slot = find(hmap, key, key_len);
-    if (slot <= -1)
+    errno = 0;
+    int ret = KV_set_if(hmap, key, strlen(key), val, get_type_size(hmap->val_type, val) + 1, cond, version);
+    if (ret == 0)
     {
-        return -1;
+        return SUCCESS;
     }
-
-    entry = (struct KV *)&hmap->arr[slot * sizeof(struct KV)];
-#if !USE_CUSTOM_ALLOC
-    free(entry->data);
+    if (ret > 0)
+    {
+        return cond == KV_SET_XX || KV_version(hmap, key, strlen(key)) == 0 ? NULL : text_reply("Exists");
+    }
+    if (errno == ENOMEM)
+    {
+        return text_reply("ERR OOM command not allowed when used memory > max memory");
+    }
+    return NULL;
+}
+
+/*
+ * GETRANGE key start end. Offsets are inclusive and count back from the end when negative; a range
+ * past either end is clamped to the value. With block given (process_cmd_large), a range of at least
+ * LARGE_VALUE_SIZE keeps the reference KV_get_ref took so the server can send it straight from the
+ * value, and *val_len is the range length plus one. Otherwise the range is copied into the reply
+ */
+static void *getrange_cmd(struct hash_map *hmap, char *argv[], char **block, int *val_len)
+{
+    int64_t start, end;
+    int len;
+
+    if (!parse_int64(argv[2], &start) || !parse_int64(argv[3], &end))
+    {
+        text_reply("ERR GETRANGE offsets must be integers");
+        if (val_len)
+        {
+            *val_len = reply_len + 1;
+        }
+        return reply_buf;
+    }
+
+    char *local_block = NULL;
+    char *val = block ? KV_get_ref(hmap, argv[1], strlen(argv[1]), &len, &local_block)
+                      : KV_get_value(hmap, argv[1], strlen(argv[1]), &len);
+    if (val == NULL)
+    {
+        return NULL;
+    }
+
+    len -= 1;
+    start = start < 0 ? (start + len < 0 ? 0 : start + len) : start;
+    end = end < 0 ? end + len : (end >= len ? len - 1 : end);
+    int64_t range_len = start <= end && start < len ? end - start + 1 : 0;
+
+    if (block == NULL)
+    {
+        reply_len = 0;
+        reply_append(&val[range_len ? start : 0], range_len);
+        return reply_buf;
+    }
+    if (local_block && range_len < (int64_t)LARGE_VALUE_SIZE)
+    {
+        // The table still holds the value, so it stays readable until the next write
+        KV_large_release(local_block);
+        local_block = NULL;
+    }
+    *block = local_block;
+    *val_len = range_len + 1;
+    return &val[range_len ? start : 0];
+}
+
+// block and val_len are only given by process_cmd_large
+static void *execute_cmd(struct hash_map *hmap, KV_CMD kv_cmd, int argc, char *argv[], char **block, int *val_len)
+{
+    int ret;
+
+    switch (kv_cmd)
+    {
+    case CMD_SET:
+    case CMD_PUT:
+        if (argc < 3)
+        {
+            KV_log(LL_VERBOSE, "SET Error: Value was not provided");
+            return NULL;
+        }
+
+        errno = 0;
+        if (block && *block)
+        {
+            ret = KV_set_large(hmap, *block);
+            *block = NULL;
+        }
+        else
+        {
+            ret = KV_set(hmap, argv[1], strlen(argv[1]), argv[2], get_type_size(hmap->val_type, argv[2]) + 1);
+        }
+        if (ret == 0)
+        {
+            return SUCCESS;
+        }
+        if (errno == ENOMEM)
+        {
+            return text_reply("ERR OOM command not allowed when used memory > max memory");
+        }
+        break;
+    case CMD_GET:
+        if (argc < 2)
+        {
+            KV_log(LL_VERBOSE, "GET Error: Key was not provided");
+            break;
+        }
+        if (block)
+        {
+            return KV_get_ref(hmap, argv[1], strlen(argv[1]), val_len, block);
+        }
+        return KV_get(hmap, argv[1], strlen(argv[1]));
+    case CMD_GETS:
+        if (argc < 2)
+        {
+            KV_log(LL_VERBOSE, "GETS Error: Key was not provided");
+            break;
+        }
+        // The server sends the version ahead of the value itself, so the value can be streamed
+        if (block)
+        {
+            return KV_get_ref(hmap, argv[1], strlen(argv[1]), val_len, block);
+        }
+        else
+        {
+            int len;
+            char *val = KV_get_value(hmap, argv[1], strlen(argv[1]), &len);
+            char version_str[24];
+            if (val == NULL)
+            {
+                break;
+            }
+            int n = snprintf(version_str, sizeof(version_str), "%lu ", KV_version(hmap, argv[1], strlen(argv[1])));
+            reply_len = 0;
+            reply_append(version_str, n);
+            reply_append(val, len - 1);
+            return reply_buf;
+        }
+    case CMD_SETNX:
+    case CMD_SETXX:
+        if (argc < 3)
+        {
+            KV_log(LL_VERBOSE, "%s Error: Value was not provided", KV_cmd_name(kv_cmd));
+            break;
+        }
+        return set_if_cmd(hmap, argv[1], argv[2], kv_cmd == CMD_SETNX ? KV_SET_NX : KV_SET_XX, 0);
+    case CMD_CAS:
+    {
+        int64_t version;
+        if (argc < 4)
+        {
+            KV_log(LL_VERBOSE, "CAS Error: Version and value were not provided");
+            break;
+        }
+        if (!parse_int64(argv[2], &version) || version <= 0)
+        {
+            return text_reply("ERR CAS version must be a positive integer");
+        }
+        return set_if_cmd(hmap, argv[1], argv[3], KV_SET_VERSION, version);
+    }
+    case CMD_APPEND:
+        if (argc < 3)
+        {
+            KV_log(LL_VERBOSE, "APPEND Error: Value was not provided");
+            break;
+        }
+        return length_reply(KV_append(hmap, argv[1], strlen(argv[1]), argv[2], strlen(argv[2])));
+    case CMD_GETRANGE:
+        if (argc < 4)
+        {
+            KV_log(LL_VERBOSE, "GETRANGE Error: Start and end were not provided");
+            break;
+        }
+        return getrange_cmd(hmap, argv, block, val_len);
+    case CMD_SETRANGE:
+    {
+        int64_t offset;
+        int len;
+        if (argc < 4)
+        {
+            KV_log(LL_VERBOSE, "SETRANGE Error: Offset and value were not provided");
+            break;
+        }
+        if (!parse_int64(argv[2], &offset) || offset < 0)
+        {
+            return text_reply("ERR SETRANGE offset must be a positive integer");
+        }
+        // A gap would be filled with '\0', which a value on the command line cannot hold
+        if (offset > (KV_get_value(hmap, argv[1], strlen(argv[1]), &len) ? len - 1 : 0))
+        {
+            return text_reply("ERR SETRANGE offset is past the end of the value");
+        }
+        return length_reply(KV_setrange(hmap, argv[1], strlen(argv[1]), offset, argv[3], strlen(argv[3])));
+    }
+    case CMD_DEL:
+        if (argc < 2)
+        {
+            KV_log(LL_VERBOSE, "DELETE Error: Key was not provided");
+            break;
+        }
+        ret = KV_delete(hmap, argv[1], strlen(argv[1]));
+        if (ret == 0)
+        {
+            return SUCCESS;
+        }
+        break;
+    case CMD_UNLINK:
+        if (argc < 2)
+        {
+            KV_log(LL_VERBOSE, "UNLINK Error: Key was not provided");
+            break;
+        }
+        if (KV_unlink(hmap, argv[1], strlen(argv[1])) == 0)
+        {
+            return SUCCESS;
+        }
+        break;
+    case CMD_FLUSH:
+        // FLUSH [ASYNC|SYNC]; async unless told otherwise
+        if (KV_flush(hmap, argc < 2 || strcmp(argv[1], "SYNC") != 0) == 0)
+        {
+            return SUCCESS;
+        }
+        break;
+    case CMD_SCAN:
+        if (argc < 2)
+        {
+            KV_log(LL_VERBOSE, "SCAN Error: Cursor was not provided");
+            break;
+        }
+        return scan_cmd(hmap, argc, argv);
+    case CMD_RANGE:
+        if (argc < 3)
+        {
+            KV_log(LL_VERBOSE, "RANGE Error: Start and end were not provided");
+            break;
+        }
+        return range_cmd(hmap, argc, argv);
+    case CMD_PREFIX:
+        if (argc < 2)
+        {
+            KV_log(LL_VERBOSE, "PREFIX Error: Prefix was not provided");
+            break;
+        }
+        return prefix_cmd(hmap, argc, argv);
+    case CMD_MEMORY:
+        if (argc > 1 && strcmp(argv[1], "DEFRAG") == 0)
+        {
+            return KV_defrag(hmap) == 0 ? SUCCESS : NULL;
+        }
+        if (argc > 2 && strcmp(argv[1], "LIMIT") == 0)
+        {
+            KV_set_max_memory(hmap, strtoull(argv[2], NULL, 10));
+            return SUCCESS;
+        }
+        return KV_memory_stats(hmap);
+    case CMD_LATENCY:
+        return latency_cmd(argc, argv);
+    case CMD_SLOWLOG:
+        return slowlog_cmd(argc, argv);
+    case CMD_DEBUG:
+        return debug_cmd(hmap, argc, argv);
+    case CMD_LOGLEVEL:
+        return loglevel_cmd(argc, argv);
+    case CMD_COMPACT:
+        if (KV_compact(hmap) == 0)
+        {
+            return SUCCESS;
+        }
+        break;
+    default:
+        KV_log(LL_VERBOSE, "Invalid command");
+        break;
+    }
+    return NULL;
+}
+
+uint32_t KV_probes(void)
+{
+    return probes;
+}
+
+static void *run_cmd(struct hash_map *hmap, int argc, char *argv[], char **block, int *val_len)
+{
+    if (argc < 1)
+    {
+        fprintf(stderr, "process_cmd: Command is required\n");
+        exit(EXIT_FAILURE);
+    }
+
+    KV_CMD cmd = parse_cmd(argv[0], strlen(argv[0]));
+    // Taken now, the table may have released a SET's block by the time the slow log looks
+    size_t large_len = block && *block ? large_value_len(*block) : 0;
+    probes = 0;
+    uint64_t start = KV_now_ns();
+    KV_TRACE2(cmd__start, cmd, argc > 1 ? argv[1] : NULL);
+
+    void *ret = execute_cmd(hmap, cmd, argc, argv, block, val_len);
+
+    uint64_t ns = KV_now_ns() - start;
+    KV_TRACE3(cmd__done, cmd, ns, probes);
+    KV_latency_record(cmd, ns);
+    if (ns / 1000 >= KV_slowlog_threshold())
+    {
+        size_t len = large_len;
+        if (large_len == 0 && (cmd == CMD_SET || cmd == CMD_PUT || cmd == CMD_APPEND || cmd == CMD_SETNX || cmd == CMD_SETXX) && argc > 2)
+        {
+            len = strlen(argv[2]);
+        }
+        else if ((cmd == CMD_SETRANGE || cmd == CMD_CAS) && argc > 3)
+        {
+            len = strlen(argv[3]);
+        }
+        else if (large_len == 0 && ret != NULL && ret != SUCCESS)
+        {
+            len = val_len && (cmd == CMD_GET || cmd == CMD_GETRANGE || cmd == CMD_GETS) ? *val_len - 1 : strlen(ret);
+        }
+        KV_slowlog_record(argv[0], argc > 1 ? argv[1] : NULL, argc > 1 ? strlen(argv[1]) : 0, len, probes, ns);
+    }
+    return ret;
+}
+
+void *process_cmd(struct hash_map *hmap, int argc, char *argv[])
+{
+    return run_cmd(hmap, argc, argv, NULL, NULL);
+}
+
+/*
+ * process_cmd for the server's large values. A SET whose value was read into *block (see
+ * KV_large_alloc) hands it to the table. A GET also gives the value's length and, when it is large,
+ * sets *block to a reference the reply can be sent from (see KV_get_ref)
+ */
+void *process_cmd_large(struct hash_map *hmap, int argc, char *argv[], char **block, int *val_len)
+{
+    return run_cmd(hmap, argc, argv, block, val_len);
+}
+
+// The server always runs with the default string hash; hashing inline rather than through
+// hash_fn lets the compiler drop the calls at every probe site.
+static inline uint64_t kv_hash(struct hash_map *hmap, const void *key, int key_len)
+{
+    if (hmap->hash_fn == KV_hash_function)
+    {
+        uint64_t hash[2];
+        MurmurHash3_x64_128_inline(key, key_len, hmap->seed, hash);
+        return hash[0];
+    }
+    return hmap->hash_fn(key, key_len, hmap->seed);
+}
+
+// Unused slots are filled with EMPTY bytes, so key_len reads -1; live keys and tombstones never do
+static inline bool slot_empty(const void *entry)
+{
+    return ((const struct KV *)entry)->key_len == -1;
+}
+
+static uint64_t first_slot(uint64_t hash, uint64_t capacity)
+{
+    return hash & (capacity - 1);
+}
+
+static uint64_t next_slot(uint64_t hash, uint64_t capacity)
+{
+    return (hash + 1) & (capacity - 1);
+}
+
+// Probe arr from the key's home slot until the key is found or an empty slot ends the cluster
+static struct KV *slot_find(struct hash_map *hmap, char *arr, uint64_t capacity, const char *key, int key_len)
+{
+    uint64_t slot = first_slot(kv_hash(hmap, key, key_len), capacity);
+
+    for (uint64_t i = 0; i < capacity; i++, slot = next_slot(slot, capacity))
+    {
+        struct KV *entry = (struct KV *)&arr[slot * sizeof(struct KV)];
+        probes++;
+        KV_TRACE1(find__probe, slot);
+        if (slot_empty(entry))
+        {
+            break;
+        }
+        if (entry->data != TOMBSTONE && key_len == entry->key_len && memcmp(entry->data, key, key_len) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// First empty or tombstone slot from the key's home slot. The caller must know the key is absent
+static struct KV *slot_find_free(struct hash_map *hmap, char *arr, uint64_t capacity, const char *key, int key_len)
+{
+    uint64_t slot = first_slot(kv_hash(hmap, key, key_len), capacity);
+
+    for (uint64_t i = 0; i < capacity; i++, slot = next_slot(slot, capacity))
+    {
+        struct KV *entry = (struct KV *)&arr[slot * sizeof(struct KV)];
+        probes++;
+        KV_TRACE1(find__probe, slot);
+        if (slot_empty(entry) || entry->data == TOMBSTONE)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static bool in_rebuild_arr(struct hash_map *hmap, struct KV *entry)
+{
+    return hmap->rebuild_arr && (char *)entry >= hmap->rebuild_arr &&
+           (char *)entry < hmap->rebuild_arr + hmap->rebuild_capacity * sizeof(struct KV);
+}
+
+/*
+ * Rebuilding moves every live entry into a fresh slot array of a new capacity, dropping tombstones.
+ * Growing, shrinking and compaction (KV_compact) all do it incrementally: while a rebuild is in
+ * progress new keys go to rebuild_arr, lookups check both arrays, and every write plus each KV_cron
+ * call moves a batch of slots across. Moved slots are left as tombstones so clusters in the old array
+ * stay intact for the keys not moved yet.
+ */
+static int rebuild_start(struct hash_map *hmap, uint64_t capacity)
+{
+    uint64_t len = capacity * sizeof(struct KV);
+
+    // Shrinking or compacting frees memory in the end, so only growth is held to the limit
+    if (hmap->max_memory && capacity > hmap->capacity && hmap->size + len - hmap->capacity * sizeof(struct KV) > hmap->max_memory)
+    {
+        KV_log(LL_WARNING, "rebuild_start: Growing to %lu slots would exceed max memory of %lu bytes", capacity, hmap->max_memory);
+        return -1;
+    }
+
+    size_t map_len;
+    char *arr = slots_alloc(hmap, len, &map_len);
+    if (arr == NULL)
+    {
+        KV_log(LL_WARNING, "rebuild_start: Unable to allocate %lu bytes of slots", len);
+        return -1;
+    }
+    memset(arr, EMPTY, len);
+
+    KV_TRACE2(resize__start, hmap->capacity, capacity);
+    hmap->rebuild_arr = arr;
+    hmap->rebuild_map_len = map_len;
+    hmap->rebuild_capacity = capacity;
+    hmap->rebuild_len = 0;
+    hmap->rebuild_tombstones = 0;
+    hmap->rebuild_pos = 0;
+    hmap->rebuild_start_ns = KV_now_ns();
+    hmap->size += len;
+    return 0;
+}
+
+static void rebuild_finish(struct hash_map *hmap)
+{
+    hmap->size -= hmap->capacity * sizeof(struct KV);
+    slots_free(hmap, hmap->arr, hmap->arr_map_len);
+    hmap->arr = hmap->rebuild_arr;
+    hmap->arr_map_len = hmap->rebuild_map_len;
+    hmap->capacity = hmap->rebuild_capacity;
+    hmap->len = hmap->rebuild_len;
+    hmap->tombstones = hmap->rebuild_tombstones;
+    hmap->rebuild_arr = NULL;
+    hmap->rebuild_map_len = 0;
+    hmap->rebuild_capacity = 0;
+    KV_TRACE2(resize__done, hmap->capacity, KV_now_ns() - hmap->rebuild_start_ns);
+}
+
+/*
+ * Slots a write moves. REBUILD_OP_STEP normally, more as rebuild_arr runs short of room for the keys
+ * still in arr: moving left / room + 1 slots per new key keeps that ratio from rising, so the move
+ * ends before rebuild_arr passes the load factor and no write has to finish the rebuild by itself
+ */
+static uint64_t rebuild_op_step(struct hash_map *hmap)
+{
+    uint64_t left = hmap->capacity - hmap->rebuild_pos;
+    uint64_t used = hmap->rebuild_len + hmap->len - hmap->tombstones;
+    uint64_t limit = hmap->rebuild_capacity * load_factor;
+
+    if (used >= limit)
+    {
+        // Only reachable after load_factor was lowered mid rebuild; fall back to the hard limit
+        limit = hmap->rebuild_capacity * LOAD_FACTOR_MAX;
+        if (used >= limit)
+        {
+            return left;
+        }
+    }
+    uint64_t step = left / (limit - used) + 1;
+    return step > REBUILD_OP_STEP ? step : REBUILD_OP_STEP;
+}
+
+/*
+ * Point a rebuild in progress at a new capacity. Only the keys already in rebuild_arr are moved
+ * again; the ones still in arr go straight to the new array as the rebuild goes on
+ */
+static int rebuild_retarget(struct hash_map *hmap, uint64_t capacity)
+{
+    uint64_t len = capacity * sizeof(struct KV);
+
+    if (hmap->max_memory && capacity > hmap->rebuild_capacity && hmap->size + len - hmap->rebuild_capacity * sizeof(struct KV) > hmap->max_memory)
+    {
+        KV_log(LL_WARNING, "rebuild_retarget: Growing to %lu slots would exceed max memory of %lu bytes", capacity, hmap->max_memory);
+        return -1;
+    }
+
+    size_t map_len;
+    char *arr = slots_alloc(hmap, len, &map_len);
+    if (arr == NULL)
+    {
+        KV_log(LL_WARNING, "rebuild_retarget: Unable to allocate %lu bytes of slots", len);
+        return -1;
+    }
+    memset(arr, EMPTY, len);
+
+    uint64_t moved = 0;
+    for (uint64_t i = 0; i < hmap->rebuild_capacity; i++)
+    {
+        struct KV *entry = (struct KV *)&hmap->rebuild_arr[i * sizeof(struct KV)];
+        if (slot_empty(entry) || entry->data == TOMBSTONE)
+        {
+            continue;
+        }
+        memcpy(slot_find_free(hmap, arr, capacity, entry->data, entry->key_len), entry, sizeof(struct KV));
+        moved++;
+    }
+
+    KV_TRACE2(resize__start, hmap->rebuild_capacity, capacity);
+    hmap->size += len;
+    hmap->size -= hmap->rebuild_capacity * sizeof(struct KV);
+    slots_free(hmap, hmap->rebuild_arr, hmap->rebuild_map_len);
+    hmap->rebuild_arr = arr;
+    hmap->rebuild_map_len = map_len;
+    hmap->rebuild_capacity = capacity;
+    hmap->rebuild_len = moved;
+    hmap->rebuild_tombstones = 0;
+    return 0;
+}
+
+// Move up to nr_slots slots of the old array into the new one
+static void rebuild_step(struct hash_map *hmap, uint64_t nr_slots)
+{
+    for (; nr_slots && hmap->rebuild_pos < hmap->capacity; nr_slots--, hmap->rebuild_pos++)
+    {
+        struct KV *entry = (struct KV *)&hmap->arr[hmap->rebuild_pos * sizeof(struct KV)];
+        if (slot_empty(entry) || entry->data == TOMBSTONE)
+        {
+            continue;
+        }
+
+        struct KV *dst = slot_find_free(hmap, hmap->rebuild_arr, hmap->rebuild_capacity, entry->data, entry->key_len);
+        if (slot_empty(dst))
+        {
+            hmap->rebuild_len++;
+        }
+        else
+        {
+            hmap->rebuild_tombstones--;
+        }
+        memcpy(dst, entry, sizeof(struct KV));
+        entry->data = TOMBSTONE;
+        hmap->tombstones++;
+    }
+
+    if (hmap->rebuild_pos == hmap->capacity)
+    {
+        rebuild_finish(hmap);
+    }
+}
+
+// Smallest capacity, down to the initial one, holding live keys with room for one growth step
+static uint64_t rebuild_target(uint64_t live)
+{
+    uint64_t capacity = initial_capacity;
+    while ((float)live / capacity >= load_factor / growth_factor)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+static int hash_map_resize(struct hash_map *hmap, int policy)
+{
+    return rebuild_start(hmap, hmap->capacity * policy);
+}
+
+// Start an incremental rebuild at the size the live keys need, dropping every tombstone
+int KV_compact(struct hash_map *hmap)
+{
+    if (hmap->rebuild_arr)
+    {
+        return 0;
+    }
+    return rebuild_start(hmap, rebuild_target(hmap->len - hmap->tombstones));
+}
+
+/*
+ * Grow the slot array so nr_keys more keys fit without a resize, e.g before a bulk load. The keys
+ * move across incrementally like any other rebuild; one already in progress is retargeted rather
+ * than finished first
+ */
+int KV_reserve(struct hash_map *hmap, uint64_t nr_keys)
+{
+    if (hmap->rebuild_arr)
+    {
+        uint64_t live = hmap->rebuild_len - hmap->rebuild_tombstones + hmap->len - hmap->tombstones;
+        uint64_t capacity = hmap->rebuild_capacity;
+        while ((float)(live + nr_keys) / capacity >= load_factor)
+        {
+            capacity <<= 1;
+        }
+        if (capacity == hmap->rebuild_capacity && (float)(hmap->rebuild_len + hmap->len - hmap->tombstones + nr_keys) / capacity < load_factor)
+        {
+            return 0;
+        }
+        if (rebuild_retarget(hmap, capacity) < 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        return 0;
+    }
+
+    uint64_t capacity = hmap->capacity;
+    while ((float)(hmap->len - hmap->tombstones + nr_keys) / capacity >= load_factor)
+    {
+        capacity <<= 1;
+    }
+    // Tombstones count against the load factor too, and a rebuild drops them
+    if (capacity == hmap->capacity && (float)(hmap->len + nr_keys) / capacity < load_factor)
+    {
+        return 0;
+    }
+    if (rebuild_start(hmap, capacity) < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+void KV_set_max_memory(struct hash_map *hmap, uint64_t bytes)
+{
+    hmap->max_memory = bytes;
+}
+
+/*
+ * Slots of the tables made by KV_hmap and the server, and of a table after a flush. The cron does not
+ * shrink a table below it, so a table sized for its workload up front stays that size. A power of two
+ * of at least MIN_ENTRY_NUM. Returns -1 with errno set to EINVAL otherwise
+ */
+int KV_set_initial_capacity(uint64_t capacity)
+{
+    if (capacity < MIN_ENTRY_NUM || CHECK_POWER_OF_2(capacity) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    initial_capacity = capacity;
+    return 0;
+}
+
+uint64_t KV_initial_capacity(void)
+{
+    return initial_capacity;
+}
+
+// Used slots per slot, tombstones included, at which a table grows. Takes effect on the next write
+int KV_set_load_factor(float lf)
+{
+    if (!(lf >= LOAD_FACTOR_MIN && lf <= LOAD_FACTOR_MAX))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    load_factor = lf;
+    return 0;
+}
+
+float KV_load_factor(void)
+{
+    return load_factor;
+}
+
+// How many times larger a table gets when it grows; a power of two up to GROWTH_FACTOR_MAX
+int KV_set_growth_factor(int factor)
+{
+    if (factor < 2 || factor > GROWTH_FACTOR_MAX || CHECK_POWER_OF_2(factor) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    growth_factor = factor;
+    return 0;
+}
+
+int KV_growth_factor(void)
+{
+    return growth_factor;
+}
+
+bool max_size_reached(uint64_t sz, uint64_t max_sz)
+{
+    return sz >= max_sz;
+}
+
+uint64_t KV_hash_function(const void *key, int len, int seed)
+{
+    uint64_t hash[2];
+    MurmurHash3_x64_128_inline(key, len, seed, hash);
+    return hash[0];
+}
+
+/*
+ * Bytes allocated for a key and value of size bytes: a multiple of 16 up to 64, then one of four
+ * classes per power of two, so at most a quarter is headroom. An overwrite whose new size falls in
+ * the same class reuses the buffer, and since the class follows from the stored lengths nothing
+ * extra has to be kept per entry.
+ */
+static size_t entry_alloc_size(size_t size)
+{
+    if (size <= 64)
+    {
+        return (size + 15) & ~15UL;
+    }
+    size_t step = (1UL << (63 - __builtin_clzll(size - 1))) / 4;
+    return (size + step - 1) & ~(step - 1);
+}
+
+/*
+ * Large values. An entry whose class is LARGE_VALUE_SIZE or more gets a block of its own from
+ * malloc, even with USE_CUSTOM_ALLOC, behind a header counting the references to it. The table holds
+ * one. KV_get_ref hands out more so the server can send a reply straight from the value while later
+ * commands overwrite or delete it, and KV_large_alloc gives a block a value can be read into before
+ * KV_set_large hands it to the table. Like the class, whether an entry is large follows from its
+ * lengths.
+ */
+struct large_block
+{
+    uint32_t refs;
+    int32_t key_len; // what KV_large_alloc was asked for
+    int32_t val_len;
+    uint32_t pad;    // keeps the data 16 byte aligned
+};
+
+static bool is_large(size_t size)
+{
+    return entry_alloc_size(size) >= LARGE_VALUE_SIZE;
+}
+
+static struct large_block *large_header(char *data)
+{
+    return (struct large_block *)(data - sizeof(struct large_block));
+}
+
+static char *large_alloc(size_t size)
+{
+    struct large_block *block = (struct large_block *)malloc(sizeof(struct large_block) + entry_alloc_size(size));
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    block->refs = 1;
+    return (char *)(block + 1);
+}
+
+// Drop a reference; the last one frees the block, on the lazy free thread when lazy
+static void large_release(char *data, bool lazy)
+{
+    struct large_block *block = large_header(data);
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        if (lazy)
+        {
+            KV_lazyfree(free, block);
+        }
+        else
+        {
+            free(block);
+        }
+    }
+}
+
+static bool large_shared(char *data)
+{
+    return __atomic_load_n(&large_header(data)->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+// Of a block from KV_large_alloc, without the '\0'
+static size_t large_value_len(char *block)
+{
+    return large_header(block)->val_len - 1;
+}
+
+static int entry_init(struct hash_map *hmap, struct KV *entry)
+{
+    size_t size = entry_alloc_size(entry->key_len + entry->val_len);
+    char *data = NULL;
+
+    if (is_large(entry->key_len + entry->val_len))
+    {
+        data = large_alloc(entry->key_len + entry->val_len);
+    }
+    else
+    {
+#if !USE_CUSTOM_ALLOC
+    // entry->key = (char *)malloc(entry->key_len);
+        data = (char *)malloc(size);
+#else
+        // entry->key = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, entry->key_len);
+        data = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, size);
+#endif
+    }
+
+    KV_TRACE2(entry__alloc, size, data);
+    if (data == NULL)
+    {
+        KV_log(LL_WARNING, "entry_init: Unable to intialize data");
+        return -1;
+    }
+
+    entry->data = data;
+
+    return 0;
+
+    //     if (entry->key == NULL)
+    //     {
+    //         fprintf(stderr, "entry_init: Unable to intialize entry key");
+    //         return -1;
+    //     }
+
+    // #if !USE_CUSTOM_ALLOC
+    //     entry->val = (char *)malloc(entry->val_len);
+    // #else
+    //     entry->val = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, entry->val_len);
+    // #endif
+
+    //     if (entry->val == NULL)
+    //     {
+    //         fprintf(stderr, "entry_init: Unable to intialize entry value");
+    // #if !USE_CUSTOM_ALLOC
+    //         // free(entry->key);
+    // #else
+    //         KV_free((struct KV_alloc_pool *)hmap->pool, entry->key);
+    // #endif
+    //         return -1;
+    //     }
+    //     return 0;
+
+    // char *chunk = (char *)malloc(e->key_len + e->val_len);
+}
+
+static void entry_free(struct hash_map *hmap, struct KV *entry, bool lazy)
+{
+    if (is_large(entry->key_len + entry->val_len))
+    {
+        large_release(entry->data, lazy);
+        return;
+    }
+#if !USE_CUSTOM_ALLOC
+    free(entry->data);
 #else
+    // The pool is owned by this thread, and returning a block to it does not touch its pages
     KV_free((struct KV_alloc_pool *)hmap->pool, entry->data);
 #endif
-    hmap->size -= (entry->key_len + entry->val_len);
-    entry->data = TOMBSTONE;
+}
+
+/*
+ * Move an entry to a buffer sized for size bytes, keeping the first keep bytes of its data (at least
+ * the key). The old buffer is released
+ */
+static int entry_resize(struct hash_map *hmap, struct KV *entry, size_t size, size_t keep)
+{
+    size_t alloc_size = entry_alloc_size(size);
+    size_t old_size = entry->key_len + entry->val_len;
+    char *data = NULL;
+
+    // A large block nobody else holds is grown in place where malloc can, without copying the value
+    if (is_large(size) && is_large(old_size) && !large_shared(entry->data))
+    {
+        struct large_block *block = (struct large_block *)realloc(large_header(entry->data), sizeof(struct large_block) + alloc_size);
+        KV_TRACE2(entry__alloc, alloc_size, block);
+        if (block == NULL)
+        {
+            KV_log(LL_WARNING, "entry_resize: Unable to resize data");
+            return -1;
+        }
+        entry->data = (char *)(block + 1);
+        return 0;
+    }
+
+    if (is_large(size) || is_large(old_size))
+    {
+        struct KV resized = {.key_len = entry->key_len, .val_len = size - entry->key_len};
+        if (entry_init(hmap, &resized) < 0)
+        {
+            return -1;
+        }
+        memcpy(resized.data, entry->data, keep);
+        entry_free(hmap, entry, false);
+        entry->data = resized.data;
+        return 0;
+    }
+
+#if !USE_CUSTOM_ALLOC
+    data = (char *)realloc(entry->data, alloc_size);
+#else
+    data = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, alloc_size);
+    if (data)
+    {
+        memcpy(data, entry->data, keep);
+        KV_free((struct KV_alloc_pool *)hmap->pool, entry->data);
+    }
+#endif
+
+    KV_TRACE2(entry__alloc, alloc_size, data);
+    if (data == NULL)
+    {
+        KV_log(LL_WARNING, "entry_resize: Unable to resize data");
+        return -1;
+    }
+
+    entry->data = data;
+    return 0;
+}
+
+/*
+ * Active defragmentation. Values freed by deletes and resizes leave holes in the allocator's pages,
+ * so the process keeps far more memory than it stores. When the resident set outgrows used memory
+ * by DEFRAG_THRESHOLD (and by at least DEFRAG_MIN_BYTES) a pass runs in two sweeps of the slot
+ * array. The first adds up the live bytes on every page holding values; the allocator gives no
+ * hint of page usage, so the survey is the engine's own. The second moves each value sitting on a
+ * page emptier than average into the lowest of DEFRAG_CANDIDATES free blocks, if that is below it.
+ * Values only ever move down, so the sparse pages higher up drain and can be handed back to the OS.
+ */
+struct defrag_page
+{
+    uint64_t page; // address / DEFRAG_PAGE_SIZE; 0 marks an unused slot
+    uint64_t bytes;
+};
+
+static struct defrag_page *defrag_page_get(struct hash_map *hmap, uint64_t page, bool insert)
+{
+    uint64_t mask = hmap->defrag_pages_cap - 1;
+    uint64_t slot = (page * 0x9E3779B97F4A7C15ULL) & mask;
+
+    for (uint64_t i = 0; i < hmap->defrag_pages_cap; i++, slot = (slot + 1) & mask)
+    {
+        struct defrag_page *dp = &hmap->defrag_pages[slot];
+        if (dp->page == page)
+        {
+            return dp;
+        }
+        if (dp->page == 0)
+        {
+            // Keep a quarter free so probes stay short; pages left out simply count as empty
+            if (!insert || hmap->defrag_pages_len >= hmap->defrag_pages_cap / 4 * 3)
+            {
+                return NULL;
+            }
+            dp->page = page;
+            hmap->defrag_pages_len++;
+            return dp;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t defrag_page_bytes(struct hash_map *hmap, const void *addr)
+{
+    struct defrag_page *dp = defrag_page_get(hmap, (uintptr_t)addr / DEFRAG_PAGE_SIZE, false);
+    return dp ? dp->bytes : 0;
+}
+
+static void defrag_page_add(struct hash_map *hmap, const void *addr, int64_t bytes)
+{
+    struct defrag_page *dp = defrag_page_get(hmap, (uintptr_t)addr / DEFRAG_PAGE_SIZE, bytes > 0);
+    if (dp)
+    {
+        dp->bytes += bytes;
+    }
+}
+
+static void defrag_free(struct hash_map *hmap, void *data)
+{
+#if !USE_CUSTOM_ALLOC
+    free(data);
+#else
+    KV_free((struct KV_alloc_pool *)hmap->pool, data);
+#endif
+}
+
+static void defrag_entry(struct hash_map *hmap, struct KV *entry)
+{
+    size_t size = entry->key_len + entry->val_len;
+    size_t alloc_size = entry_alloc_size(size);
+    char *candidates[DEFRAG_CANDIDATES];
+    int best = -1;
+
+    // Values on pages fuller than average stay where they are
+    if (defrag_page_bytes(hmap, entry->data) * hmap->defrag_pages_len >= hmap->defrag_bytes)
+    {
+        return;
+    }
+
+    // All candidates are held at once, otherwise the allocator hands the same block back every time
+    for (int i = 0; i < DEFRAG_CANDIDATES; i++)
+    {
+#if !USE_CUSTOM_ALLOC
+        candidates[i] = (char *)malloc(alloc_size);
+#else
+        candidates[i] = (char *)KV_malloc((struct KV_alloc_pool *)hmap->pool, alloc_size);
+#endif
+        if (candidates[i] && candidates[i] < entry->data && (best < 0 || candidates[i] < candidates[best]))
+        {
+            best = i;
+        }
+    }
+
+    if (best >= 0)
+    {
+        char *data = candidates[best];
+        memcpy(data, entry->data, size);
+        defrag_page_add(hmap, entry->data, -(int64_t)alloc_size);
+        defrag_page_add(hmap, data, alloc_size);
+        candidates[best] = entry->data;
+        entry->data = data;
+        hmap->defrag_moved++;
+    }
+
+    for (int i = 0; i < DEFRAG_CANDIDATES; i++)
+    {
+        if (candidates[i])
+        {
+            defrag_free(hmap, candidates[i]);
+        }
+    }
+}
+
+static void defrag_done(struct hash_map *hmap)
+{
+    free(hmap->defrag_pages);
+    hmap->defrag_pages = NULL;
+    hmap->defrag_pages_cap = 0;
+    hmap->defrag_pages_len = 0;
+    hmap->defrag_phase = DEFRAG_IDLE;
+}
+
+static void defrag_step(struct hash_map *hmap, uint64_t nr_slots)
+{
+    for (; nr_slots && hmap->defrag_pos < hmap->capacity; nr_slots--, hmap->defrag_pos++)
+    {
+        struct KV *entry = (struct KV *)&hmap->arr[hmap->defrag_pos * sizeof(struct KV)];
+        // Large values have blocks of their own
+        if (slot_empty(entry) || entry->data == TOMBSTONE || is_large(entry->key_len + entry->val_len))
+        {
+            continue;
+        }
+        if (hmap->defrag_phase == DEFRAG_SURVEY)
+        {
+            defrag_page_add(hmap, entry->data, entry_alloc_size(entry->key_len + entry->val_len));
+            hmap->defrag_bytes += entry_alloc_size(entry->key_len + entry->val_len);
+        }
+        else
+        {
+            defrag_entry(hmap, entry);
+        }
+    }
+
+    if (hmap->defrag_pos < hmap->capacity)
+    {
+        return;
+    }
+
+    hmap->defrag_pos = 0;
+    if (hmap->defrag_phase == DEFRAG_SURVEY)
+    {
+        hmap->defrag_phase = DEFRAG_MOVE;
+        return;
+    }
+
+    defrag_done(hmap);
+#if !USE_CUSTOM_ALLOC && defined(__GLIBC__)
+    // Hand the pages emptied by the pass back to the OS
+    malloc_trim(0);
+#endif
+    KV_log(LL_VERBOSE, "Defrag pass done, %lu values moved so far; rss=%lu used_memory=%lu", hmap->defrag_moved, KV_rss(), KV_used_memory());
+}
+
+// Start a defrag pass now, whatever the fragmentation
+int KV_defrag(struct hash_map *hmap)
+{
+    if (hmap->defrag_phase != DEFRAG_IDLE)
+    {
+        return 0;
+    }
+
+    // Room for a page per live value, and for the fresh pages values move to
+    uint64_t cap = MIN_ENTRY_NUM;
+    while (cap < (hmap->len - hmap->tombstones) * 2)
+    {
+        cap <<= 1;
+    }
+    hmap->defrag_pages = (struct defrag_page *)calloc(cap, sizeof(struct defrag_page));
+    if (hmap->defrag_pages == NULL)
+    {
+        KV_log(LL_WARNING, "KV_defrag: Unable to allocate page table");
+        return -1;
+    }
+    hmap->defrag_pages_cap = cap;
+    hmap->defrag_pages_len = 0;
+    hmap->defrag_bytes = 0;
+    hmap->defrag_phase = DEFRAG_SURVEY;
+    hmap->defrag_pos = 0;
+    return 0;
+}
+
+void KV_set_active_defrag(struct hash_map *hmap, bool enable)
+{
+    hmap->active_defrag = enable;
+}
+
+static void defrag_cron(struct hash_map *hmap)
+{
+    uint64_t now = KV_now_ns();
+
+    if (hmap->defrag_phase == DEFRAG_IDLE)
+    {
+        // Reading the resident set size costs a few syscalls, so it is only checked every second
+        if (!hmap->active_defrag || now - hmap->defrag_checked_ns < DEFRAG_CHECK_MS * 1000000UL)
+        {
+            return;
+        }
+        hmap->defrag_checked_ns = now;
+
+        // The resident set is shared by every table, so it is weighed against all of them
+        uint64_t rss = KV_rss();
+        uint64_t used = KV_used_memory();
+        if (rss < used * DEFRAG_THRESHOLD || rss - used < DEFRAG_MIN_BYTES)
+        {
+            return;
+        }
+        KV_log(LL_VERBOSE, "Starting defrag pass; rss=%lu used_memory=%lu", rss, used);
+        if (KV_defrag(hmap) < 0)
+        {
+            return;
+        }
+    }
+
+    uint64_t deadline = now + DEFRAG_CRON_US * 1000;
+    while (hmap->defrag_phase != DEFRAG_IDLE && KV_now_ns() < deadline)
+    {
+        defrag_step(hmap, DEFRAG_CRON_STEP);
+    }
+}
+
+/*
+ * Periodic maintenance, for the server's cron. Advances a rebuild in progress for up to
+ * REBUILD_CRON_US, otherwise starts one when the live keys fill less than SHRINK_LOAD_FACTOR of
+ * the table or tombstones take more than TOMBSTONE_LOAD_FACTOR of it. With no rebuild to do, runs
+ * active defragmentation for up to DEFRAG_CRON_US.
+ */
+void KV_cron(struct hash_map *hmap)
+{
+    if (hmap->rebuild_arr == NULL)
+    {
+        uint64_t live = hmap->len - hmap->tombstones;
+        // A low load factor with a large growth factor can put the target above the capacity
+        if ((hmap->capacity > initial_capacity && live < hmap->capacity * SHRINK_LOAD_FACTOR && rebuild_target(live) < hmap->capacity) ||
+            hmap->tombstones > hmap->capacity * TOMBSTONE_LOAD_FACTOR)
+        {
+            KV_log(LL_VERBOSE, "Rebuilding table of %lu slots with %lu keys and %lu tombstones", hmap->capacity, live, hmap->tombstones);
+            KV_compact(hmap);
+        }
+        if (hmap->rebuild_arr == NULL)
+        {
+            defrag_cron(hmap);
+        }
+        return;
+    }
+
+    uint64_t deadline = KV_now_ns() + REBUILD_CRON_US * 1000;
+    while (hmap->rebuild_arr && KV_now_ns() < deadline)
+    {
+        rebuild_step(hmap, REBUILD_CRON_STEP);
+    }
+}
+
+// A key lives in exactly one of the arrays while a rebuild is in progress
+static struct KV *find(struct hash_map *hmap, char *key, int key_len)
+{
+    if (hmap->rebuild_arr)
+    {
+        struct KV *entry = slot_find(hmap, hmap->rebuild_arr, hmap->rebuild_capacity, key, key_len);
+        if (entry)
+        {
+            return entry;
+        }
+    }
+    return slot_find(hmap, hmap->arr, hmap->capacity, key, key_len);
+}
+
+/*
+ * val_len counts the terminating '\0', which is written here rather than read from val. With block
+ * set, the entry takes over a buffer from KV_large_alloc that already holds key and value
+ */
+/*
+ * Fill an empty slot or a tombstone with a new key, from block if given. The slot is only written
+ * once the data is allocated, so a failed allocation leaves it empty or a tombstone as it was
+ * rather than holding lengths with no data behind them.
+ */
+static int entry_create(struct hash_map *hmap, struct KV *entry, char *key, int key_len, char *val, int val_len, char *block)
+{
+    struct KV created = {.key_len = key_len, .val_len = val_len, .data = block};
+    if (block == NULL)
+    {
+        if (entry_init(hmap, &created) < 0)
+        {
+            return -1;
+        }
+        memcpy(created.data, key, key_len);
+        memcpy(&created.data[key_len], val, val_len - 1);
+        created.data[key_len + val_len - 1] = '\0';
+    }
+    entry->key_len = created.key_len;
+    entry->val_len = created.val_len;
+    entry->data = created.data;
+    return 0;
+}
+
+// The index's nodes count towards the table's memory like the keys and values they point at
+static int index_insert(struct hash_map *hmap, const char *key, int key_len)
+{
+    uint64_t index_size = hmap->index->size;
+    int ret = skiplist_insert(hmap->index, key, key_len);
+    hmap->size = hmap->size + hmap->index->size - index_size;
+    return ret;
+}
+
+static void index_delete(struct hash_map *hmap, const char *key, int key_len)
+{
+    uint64_t index_size = hmap->index->size;
+    skiplist_delete(hmap->index, key, key_len);
+    hmap->size = hmap->size + hmap->index->size - index_size;
+}
+
+static int set_key(struct hash_map *hmap, char *key, int key_len, char *val, int val_len, char *block)
+{
+    size_t size;
+    int ret;
+    uint64_t temp;
+
+    if (hmap->rebuild_arr)
+    {
+        rebuild_step(hmap, rebuild_op_step(hmap));
+    }
+
+    // An existing key may sit further along the probe chain than a reusable tombstone
+    struct KV *entry = find(hmap, key, key_len);
+    bool rebuilding = hmap->rebuild_arr != NULL;
+    if (entry == NULL)
+    {
+        // New keys go straight to the array being rebuilt into
+        entry = rebuilding ? slot_find_free(hmap, hmap->rebuild_arr, hmap->rebuild_capacity, key, key_len)
+                           : slot_find_free(hmap, hmap->arr, hmap->capacity, key, key_len);
+        if (entry == NULL)
+        {
+            KV_log(LL_WARNING, "KV_set: Hash table is full");
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    rebuilding = in_rebuild_arr(hmap, entry);
+
+    size = key_len + val_len;
+
+    // Only growth is refused at the limit; overwrites that shrink and deletes always go through
+    uint64_t old_size = slot_empty(entry) || entry->data == TOMBSTONE ? 0 : entry->key_len + entry->val_len;
+    // A new key also takes an index node, of at least one level
+    uint64_t index_size = hmap->index && old_size == 0 ? skiplist_node_size(1, key_len) : 0;
+    if (hmap->max_memory && size > old_size && hmap->size + size + index_size - old_size > hmap->max_memory)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (slot_empty(entry))
+    {
+        KV_log(LL_DEBUG, "Writing object of size=%zu", size);
+        ret = entry_create(hmap, entry, key, key_len, val, val_len, block);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        hmap->size += size;
+        entry->version = ++hmap->version;
+        if (rebuilding)
+        {
+            hmap->rebuild_len += 1;
+        }
+        else
+        {
+            hmap->len += 1;
+        }
+
+        if (hmap->index && index_insert(hmap, key, key_len) < 0)
+        {
+            return -1;
+        }
+
+        // TODO: We can replace division later
+        float lf = (float)hmap->len / hmap->capacity;
+        if (hmap->rebuild_arr == NULL && lf >= load_factor)
+        {
+            // Past the limit the table keeps filling up at its current size until no slot is left
+            temp = hmap->capacity;
+            if (hash_map_resize(hmap, growth_factor) == 0)
+            {
+                KV_log(LL_VERBOSE, "Resizing HashMap from array size=%lu to array size=%lu; current memory usage for data=%lu bytes", temp * sizeof(struct KV), hmap->rebuild_capacity * sizeof(struct KV), hmap->size);
+            }
+        }
+    }
+    else if (entry->data == TOMBSTONE)
+    {
+        if (entry_create(hmap, entry, key, key_len, val, val_len, block) < 0)
+        {
+            return -1;
+        }
+        hmap->size += size;
+        entry->version = ++hmap->version;
+        if (rebuilding)
+        {
+            hmap->rebuild_tombstones -= 1;
+        }
+        else
+        {
+            hmap->tombstones -= 1;
+        }
+
+        if (hmap->index && index_insert(hmap, key, key_len) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        // Overwrite: the key stays in place and the buffer is reused unless the size class changes,
+        // or it holds a large value a reply is still being sent from. On failure the old value is
+        // left intact
+        if (block)
+        {
+            entry_free(hmap, entry, false);
+            entry->data = block;
+        }
+        else
+        {
+            if ((entry_alloc_size(old_size) != entry_alloc_size(size) || (is_large(old_size) && large_shared(entry->data))) &&
+                entry_resize(hmap, entry, size, key_len) < 0)
+            {
+                return -1;
+            }
+            memcpy((char *)&entry->data[key_len], val, val_len - 1);
+            entry->data[size - 1] = '\0';
+        }
+        entry->val_len = val_len;
+        hmap->size = hmap->size + size - old_size;
+        entry->version = ++hmap->version;
+    }
+    return 0;
+}
+
+// A failed write may still have touched the entry, so watchers hear about it either way
+int KV_set(struct hash_map *hmap, char *key, int key_len, char *val, int val_len)
+{
+    int ret = set_key(hmap, key, key_len, val, val_len, NULL);
+    if (hmap->notify)
+    {
+        hmap->notify(hmap->notify_arg, hmap, key, key_len);
+    }
+    return ret;
+}
+
+/*
+ * A block for a large value to be read into before KV_set_large stores it, so it is never copied.
+ * Holds the key, room for val_len - 1 bytes of value at block + key_len, and the closing '\0'.
+ * Returns NULL with errno set to EINVAL when the entry would not be large
+ */
+char *KV_large_alloc(char *key, int key_len, int val_len)
+{
+    size_t size = (size_t)key_len + val_len;
+    if (key_len <= 0 || val_len <= 0 || !is_large(size))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    char *data = large_alloc(size);
+    if (data == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    large_header(data)->key_len = key_len;
+    large_header(data)->val_len = val_len;
+    memcpy(data, key, key_len);
+    data[size - 1] = '\0';
+    return data;
+}
+
+// Store the value read into a block from KV_large_alloc. The table takes the block over, or it is released on failure
+int KV_set_large(struct hash_map *hmap, char *block)
+{
+    int key_len = large_header(block)->key_len;
+    int val_len = large_header(block)->val_len;
+
+    int ret = set_key(hmap, block, key_len, NULL, val_len, block);
+    if (hmap->notify)
+    {
+        hmap->notify(hmap->notify_arg, hmap, block, key_len);
+    }
+    // The entry may hold the block even if indexing it failed
+    struct KV *entry = ret < 0 ? find(hmap, block, key_len) : NULL;
+    if (ret < 0 && (entry == NULL || entry->data != block))
+    {
+        large_release(block, true);
+    }
+    return ret;
+}
+
+// Drop a reference from KV_get_ref, or a block from KV_large_alloc that was never stored
+void KV_large_release(char *block)
+{
+    large_release(block, true);
+}
+
+/*
+ * Write len bytes of val at offset, or at the end when append is set, into the value of key, growing
+ * it as needed, with '\0' bytes filling any gap past its end. A missing key is taken as an empty
+ * value. The buffer is only moved when the value outgrows its size class, and as classes grow
+ * geometrically a run of appends copies each byte a bounded number of times. Returns the new value
+ * length
+ */
+static int64_t write_range(struct hash_map *hmap, char *key, int key_len, uint64_t offset, bool append, const char *val, size_t len)
+{
+    struct KV *entry = find(hmap, key, key_len);
+    size_t old_len = entry ? entry->val_len - 1 : 0;
+    if (append)
+    {
+        offset = old_len;
+    }
+    uint64_t new_len = offset + len > old_len ? offset + len : old_len;
+
+    if (offset > INT32_MAX || new_len >= (uint64_t)INT32_MAX - key_len)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (entry == NULL)
+    {
+        char *buf = (char *)val;
+        if (offset)
+        {
+            buf = (char *)calloc(1, new_len);
+            if (buf == NULL)
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+            memcpy(&buf[offset], val, len);
+        }
+        int ret = set_key(hmap, key, key_len, buf, new_len + 1, NULL);
+        if (buf != val)
+        {
+            free(buf);
+        }
+        return ret < 0 ? -1 : (int64_t)new_len;
+    }
+
+    size_t old_size = entry->key_len + entry->val_len;
+    size_t size = key_len + new_len + 1;
+    if (hmap->max_memory && size > old_size && hmap->size + size - old_size > hmap->max_memory)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    // A large value a reply is still being sent from is copied rather than changed under it
+    if ((entry_alloc_size(old_size) != entry_alloc_size(size) || (is_large(old_size) && large_shared(entry->data))) &&
+        entry_resize(hmap, entry, size, old_size - 1) < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (offset > old_len)
+    {
+        memset(&entry->data[key_len + old_len], 0, offset - old_len);
+    }
+    memcpy(&entry->data[key_len + offset], val, len);
+    entry->data[size - 1] = '\0';
+    entry->val_len = new_len + 1;
+    hmap->size = hmap->size + size - old_size;
+    entry->version = ++hmap->version;
+    return new_len;
+}
+
+// Add len bytes of val to the end of key's value, creating it if missing. Returns the new length, or -1 with errno set
+int64_t KV_append(struct hash_map *hmap, char *key, int key_len, const char *val, size_t len)
+{
+    int64_t ret = write_range(hmap, key, key_len, 0, true, val, len);
+    if (hmap->notify)
+    {
+        hmap->notify(hmap->notify_arg, hmap, key, key_len);
+    }
+    return ret;
+}
+
+// Overwrite key's value from offset with len bytes of val; see write_range
+int64_t KV_setrange(struct hash_map *hmap, char *key, int key_len, uint64_t offset, const char *val, size_t len)
+{
+    int64_t ret = write_range(hmap, key, key_len, offset, false, val, len);
+    if (hmap->notify)
+    {
+        hmap->notify(hmap->notify_arg, hmap, key, key_len);
+    }
+    return ret;
+}
+
+/*
+ * Every write stamps its entry with the next of a per table counter, so a version is never reused
+ * for a key, even once the key has been deleted and set again. Returns 0 for a missing key
+ */
+uint64_t KV_version(struct hash_map *hmap, char *key, int key_len)
+{
+    struct KV *entry = find(hmap, key, key_len);
+    return entry ? entry->version : 0;
+}
+
+// KV_set when cond holds. Returns 1, writing nothing, when it does not
+int KV_set_if(struct hash_map *hmap, char *key, int key_len, char *val, int val_len, KV_SET_COND cond, uint64_t version)
+{
+    struct KV *entry = find(hmap, key, key_len);
+    if (cond == KV_SET_NX ? entry != NULL : entry == NULL || (cond == KV_SET_VERSION && entry->version != version))
+    {
+        return 1;
+    }
+    return KV_set(hmap, key, key_len, val, val_len);
+}
+
+/*
+ * Bulk loading. KV_load presizes the table for the records, then splits the slot array into one
+ * region per thread and has each thread insert the records whose home slot lies in its region, so
+ * threads never touch the same slots and need no locks. A record whose probe would run out of its
+ * region, or that finds its key already there, is left for a serial pass once the threads are done,
+ * which also keeps the last of several records for a key. Values come from each thread's own malloc
+ * arena rather than one shared chunk, since every value stays a buffer of its own the table can free
+ * or resize later.
+ */
+struct load_worker
+{
+    pthread_t thread;
+    struct hash_map *hmap;
+    const struct KV_record *recs;
+    uint64_t *hashes;
+    uint64_t n;
+    uint64_t lo; // records to hash, then home slots to fill, from lo up to hi
+    uint64_t hi;
+    uint64_t version; // of the record before the first
+    bool *deferred;   // records left for the serial pass, shared by all workers
+    uint64_t len;
+    uint64_t size;
+};
+
+#if USE_CUSTOM_ALLOC
+static pthread_mutex_t load_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void *load_hash(void *arg)
+{
+    struct load_worker *w = (struct load_worker *)arg;
+    for (uint64_t i = w->lo; i < w->hi; i++)
+    {
+        w->hashes[i] = kv_hash(w->hmap, w->recs[i].key, w->recs[i].key_len);
+    }
+    return NULL;
+}
+
+static void *load_insert(void *arg)
+{
+    struct load_worker *w = (struct load_worker *)arg;
+    struct hash_map *hmap = w->hmap;
+    bool spill = false; // after a failed allocation, so records for one key stay in order
+
+    for (uint64_t i = 0; i < w->n; i++)
+    {
+        const struct KV_record *rec = &w->recs[i];
+        uint64_t slot = first_slot(w->hashes[i], hmap->capacity);
+        if (slot < w->lo || slot >= w->hi)
+        {
+            continue;
+        }
+
+        for (;; slot++)
+        {
+            struct KV *entry = (struct KV *)&hmap->arr[slot * sizeof(struct KV)];
+            if (spill || slot == w->hi || (!slot_empty(entry) && entry->data != TOMBSTONE && entry->key_len == rec->key_len &&
+                                           memcmp(entry->data, rec->key, rec->key_len) == 0))
+            {
+                w->deferred[i] = true;
+                break;
+            }
+            if (!slot_empty(entry))
+            {
+                continue;
+            }
+
+            entry->key_len = rec->key_len;
+            entry->val_len = rec->val_len + 1;
+#if USE_CUSTOM_ALLOC
+            // A pool not made for sharing takes one thread at a time; hashing, probing and copying still run in parallel
+            if (!hmap->alloc_concurrent_access)
+            {
+                pthread_mutex_lock(&load_pool_lock);
+            }
+#endif
+            int ret = entry_init(hmap, entry);
+#if USE_CUSTOM_ALLOC
+            if (!hmap->alloc_concurrent_access)
+            {
+                pthread_mutex_unlock(&load_pool_lock);
+            }
+#endif
+            if (ret < 0)
+            {
+                memset(entry, EMPTY, sizeof(struct KV));
+                spill = true;
+                w->deferred[i] = true;
+                break;
+            }
+            memcpy(entry->data, rec->key, rec->key_len);
+            memcpy(&entry->data[rec->key_len], rec->val, rec->val_len);
+            entry->data[rec->key_len + rec->val_len] = '\0';
+            entry->version = w->version + i + 1;
+            w->len++;
+            w->size += rec->key_len + rec->val_len + 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Run fn on every worker, the first on this thread
+static void load_run(struct load_worker *workers, int nr_threads, void *(*fn)(void *))
+{
+    int started = 1;
+    for (; started < nr_threads; started++)
+    {
+        if (pthread_create(&workers[started].thread, NULL, fn, &workers[started]) != 0)
+        {
+            break;
+        }
+    }
+    fn(&workers[0]);
+    for (int i = 1; i < nr_threads; i++)
+    {
+        // Whatever a thread could not be started for is done here
+        if (i < started)
+        {
+            pthread_join(workers[i].thread, NULL);
+        }
+        else
+        {
+            fn(&workers[i]);
+        }
+    }
+}
+
+/*
+ * Store n records using up to nr_threads threads. The caller must keep every other thread off the
+ * table meanwhile. Watchers are told once that everything may have changed. Returns how many were
+ * stored; fewer than n means some failed, with errno set
+ */
+uint64_t KV_load(struct hash_map *hmap, const struct KV_record *recs, uint64_t n, int nr_threads)
+{
+    uint64_t stored = 0;
+    struct load_worker *workers = NULL;
+    uint64_t *hashes = NULL;
+    bool *deferred = NULL;
+    int err = 0;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (KV_reserve(hmap, n) < 0)
+    {
+        return 0;
+    }
+
+    if ((uint64_t)nr_threads > n / LOAD_MIN_PER_THREAD)
+    {
+        nr_threads = n / LOAD_MIN_PER_THREAD;
+    }
+    // The limit and the index are kept per write, so those tables take the serial path
+    if (nr_threads > 1 && hmap->max_memory == 0 && hmap->index == NULL)
+    {
+        workers = (struct load_worker *)calloc(nr_threads, sizeof(struct load_worker));
+        hashes = (uint64_t *)malloc(n * sizeof(uint64_t));
+        deferred = (bool *)calloc(n, sizeof(bool));
+    }
+
+    if (workers && hashes && deferred)
+    {
+        // The workers split arr by slot range, so they need the rebuild KV_reserve started finished
+        if (hmap->rebuild_arr)
+        {
+            rebuild_step(hmap, UINT64_MAX);
+        }
+        for (int i = 0; i < nr_threads; i++)
+        {
+            workers[i] = (struct load_worker){.hmap = hmap, .recs = recs, .hashes = hashes, .n = n, .lo = n * i / nr_threads, .hi = n * (i + 1) / nr_threads};
+        }
+        load_run(workers, nr_threads, load_hash);
+
+        for (int i = 0; i < nr_threads; i++)
+        {
+            workers[i].lo = hmap->capacity * i / nr_threads;
+            workers[i].hi = hmap->capacity * (i + 1) / nr_threads;
+            workers[i].version = hmap->version;
+            workers[i].deferred = deferred;
+        }
+        load_run(workers, nr_threads, load_insert);
+
+        hmap->version += n;
+        for (int i = 0; i < nr_threads; i++)
+        {
+            hmap->len += workers[i].len;
+            hmap->size += workers[i].size;
+            stored += workers[i].len;
+        }
+    }
+    else
+    {
+        // Everything goes through the serial pass
+        free(deferred);
+        deferred = NULL;
+    }
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if (deferred && !deferred[i])
+        {
+            continue;
+        }
+        errno = 0;
+        if (set_key(hmap, (char *)recs[i].key, recs[i].key_len, (char *)recs[i].val, recs[i].val_len + 1, NULL) < 0)
+        {
+            err = err ? err : (errno ? errno : ENOMEM);
+            continue;
+        }
+        stored++;
+    }
+    free(workers);
+    free(hashes);
+    free(deferred);
+
+    if (hmap->notify)
+    {
+        hmap->notify(hmap->notify_arg, hmap, NULL, 0);
+    }
+    errno = err;
+    return stored;
+}
+
+void *KV_get(struct hash_map *hmap, char *key, int key_len)
+{
+    return KV_get_value(hmap, key, key_len, NULL);
+}
+
+// Like KV_get, also giving the value length (terminating '\0' included) when val_len is not NULL
+void *KV_get_value(struct hash_map *hmap, char *key, int key_len, int *val_len)
+{
+    struct KV *entry = find(hmap, key, key_len);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    if (val_len)
+    {
+        *val_len = entry->val_len;
+    }
+    return (void *)&entry->data[key_len];
+}
+
+/*
+ * Like KV_get_value, and for a large value *block is set to the entry's buffer with a reference
+ * taken, so the value stays readable until KV_large_release whatever is done to the key meanwhile.
+ * *block is NULL for other values, which are only good until the next write
+ */
+void *KV_get_ref(struct hash_map *hmap, char *key, int key_len, int *val_len, char **block)
+{
+    struct KV *entry = find(hmap, key, key_len);
+    *block = NULL;
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    if (is_large(entry->key_len + entry->val_len))
+    {
+        __atomic_add_fetch(&large_header(entry->data)->refs, 1, __ATOMIC_RELAXED);
+        *block = entry->data;
+    }
+    *val_len = entry->val_len;
+    return (void *)&entry->data[key_len];
+}
+
+static int delete_key(struct hash_map *hmap, char *key, int key_len, bool lazy)
+{
+    if (hmap->rebuild_arr)
+    {
+        rebuild_step(hmap, REBUILD_OP_STEP);
+    }
+
+    struct KV *entry = find(hmap, key, key_len);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+
+    entry_free(hmap, entry, lazy);
+    hmap->size -= (entry->key_len + entry->val_len);
+    entry->data = TOMBSTONE;
+    if (in_rebuild_arr(hmap, entry))
+    {
+        hmap->rebuild_tombstones += 1;
+    }
+    else
+    {
+        hmap->tombstones += 1;
+    }
+
+    if (hmap->index)
+    {
+        index_delete(hmap, key, key_len);
+    }
+    if (hmap->notify)
+    {
+        hmap->notify(hmap->notify_arg, hmap, key, key_len);
+    }
+    return 0;
+}
+
+int KV_delete(struct hash_map *hmap, char *key, int key_len)
+{
+    return delete_key(hmap, key, key_len, false);
+}
+
+// Like KV_delete, but a large value is freed by the lazy free thread
+int KV_unlink(struct hash_map *hmap, char *key, int key_len)
+{
+    return delete_key(hmap, key, key_len, true);
+}
+
+// Have fn called after every change to the table's keys, e.g to invalidate copies cached elsewhere. NULL turns it off
+void KV_set_notify(struct hash_map *hmap, KV_notify_fn fn, void *arg)
+{
+    hmap->notify = fn;
+    hmap->notify_arg = arg;
+}
+
+/*
+ * Build an ordered index over the keys already in the table. Kept in sync by KV_set/KV_delete from
+ * then on. Its nodes count towards the memory limit; fails with ENOMEM if they do not fit under it
+ */
+int KV_index_enable(struct hash_map *hmap)
+{
+    if (hmap->index)
+    {
+        return 0;
+    }
+
+    struct skiplist *index = skiplist_init();
+    if (index == NULL)
+    {
+        return -1;
+    }
+
+    // Both arrays hold keys while a rebuild is in progress
+    char *arrs[] = {hmap->arr, hmap->rebuild_arr};
+    uint64_t capacities[] = {hmap->capacity, hmap->rebuild_capacity};
+    for (int a = 0; a < 2; a++)
+    {
+        for (size_t i = 0; arrs[a] && i < capacities[a]; i++)
+        {
+            struct KV *entry = (struct KV *)&arrs[a][i * sizeof(struct KV)];
+            if (slot_empty(entry) || entry->data == TOMBSTONE)
+            {
+                continue;
+            }
+            if (skiplist_insert(index, entry->data, entry->key_len) < 0)
+            {
+                skiplist_destroy(index);
+                return -1;
+            }
+        }
+    }
+    if (hmap->max_memory && hmap->size + index->size > hmap->max_memory)
+    {
+        skiplist_destroy(index);
+        errno = ENOMEM;
+        return -1;
+    }
+    hmap->index = index;
+    hmap->size += index->size;
+    return 0;
+}
+
+/*
+ * Visit up to limit keys in order from start to end. A NULL start or end is unbounded. Values are
+ * not looked up; fn gets val=NULL. Returns the number of keys visited or -1 if the index is disabled
+ */
+int KV_range(struct hash_map *hmap, const char *start, int start_len, bool start_exclusive, const char *end, int end_len, bool end_exclusive, int limit, KV_scan_fn fn, void *arg)
+{
+    if (hmap->index == NULL)
+    {
+        return -1;
+    }
+
+    struct skiplist_node *node = start ? skiplist_seek(hmap->index, start, start_len, start_exclusive) : skiplist_first(hmap->index);
+    int nr_found = 0;
+
+    for (; node && nr_found < limit; node = skiplist_next(node))
+    {
+        if (end)
+        {
+            int cmp = skiplist_cmp(node->key, node->key_len, end, end_len);
+            if (cmp > 0 || (cmp == 0 && end_exclusive))
+            {
+                break;
+            }
+        }
+        fn(arg, node->key, node->key_len, NULL, 0);
+        nr_found++;
+    }
+    return nr_found;
+}
+
+/*
+ * Visit up to limit keys starting with prefix in order, resuming after the key `after` when given.
+ * An `after` that sorts before every key with the prefix starts from the prefix instead
+ */
+int KV_prefix(struct hash_map *hmap, const char *prefix, int prefix_len, const char *after, int after_len, int limit, KV_scan_fn fn, void *arg)
+{
+    if (hmap->index == NULL)
+    {
+        return -1;
+    }
+
+    struct skiplist_node *node = after && skiplist_cmp(after, after_len, prefix, prefix_len) >= 0 ? skiplist_seek(hmap->index, after, after_len, true)
+                                                                                                    : skiplist_seek(hmap->index, prefix, prefix_len, false);
+    int nr_found = 0;
+
+    for (; node && nr_found < limit; node = skiplist_next(node))
+    {
+        if (node->key_len < prefix_len || memcmp(node->key, prefix, prefix_len) != 0)
+        {
+            break;
+        }
+        fn(arg, node->key, node->key_len, NULL, 0);
+        nr_found++;
+    }
+    return nr_found;
+}
+
+// Glob style matching supporting '*' and '?'
+static bool pattern_match(const char *pattern, int pattern_len, const char *str, int str_len)
+{
+    int p = 0, s = 0;
+    int star = -1, mark = 0;
+
+    while (s < str_len)
+    {
+        if (p < pattern_len && (pattern[p] == '?' || pattern[p] == str[s]))
+        {
+            p++;
+            s++;
+        }
+        else if (p < pattern_len && pattern[p] == '*')
+        {
+            star = p++;
+            mark = s;
+        }
+        else if (star != -1)
+        {
+            p = star + 1;
+            s = ++mark;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (p < pattern_len && pattern[p] == '*')
+    {
+        p++;
+    }
+    return p == pattern_len;
+}
+
+static uint64_t rev(uint64_t v)
+{
+    uint64_t s = 8 * sizeof(v);
+    uint64_t mask = ~0UL;
+    while ((s >>= 1) > 0)
+    {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+// Visit the keys of arr whose home slot is home
+static void scan_home(struct hash_map *hmap, char *arr, uint64_t capacity, uint64_t home, const char *pattern, int pattern_len, KV_scan_fn fn, void *arg, int *nr_found)
+{
+    uint64_t slot = home;
+
+    for (size_t i = 0; i < capacity; i++)
+    {
+        struct KV *entry = (struct KV *)&arr[slot * sizeof(struct KV)];
+        if (slot_empty(entry))
+        {
+            break;
+        }
+
+        if (entry->data != TOMBSTONE && first_slot(kv_hash(hmap, entry->data, entry->key_len), capacity) == home)
+        {
+            if (pattern == NULL || pattern_match(pattern, pattern_len, entry->data, entry->key_len))
+            {
+                fn(arg, entry->data, entry->key_len, &entry->data[entry->key_len], entry->val_len);
+                *nr_found += 1;
+            }
+        }
+        slot = next_slot(slot, capacity);
+    }
+}
+
+/*
+ * Visit the keys whose home slot is the one at cursor and return the next cursor; 0 means the
+ * iteration is complete. The cursor is incremented on its reversed bits (as Redis does) so slots
+ * already visited at a smaller capacity map onto slots already visited after the table grows.
+ * A key is reported by the slot its hash maps to, not the slot it was probed into, which keeps
+ * that guarantee for linear probing. Keys may be reported more than once across a resize.
+ *
+ * During a rebuild the cursor indexes the smaller of the two arrays, and every slot of the larger
+ * one that expands it is visited in the same step.
+ */
+static uint64_t scan_slot(struct hash_map *hmap, uint64_t cursor, const char *pattern, int pattern_len, KV_scan_fn fn, void *arg, int *nr_found)
+{
+    if (hmap->rebuild_arr == NULL)
+    {
+        uint64_t mask = hmap->capacity - 1;
+        scan_home(hmap, hmap->arr, hmap->capacity, cursor & mask, pattern, pattern_len, fn, arg, nr_found);
+
+        cursor |= ~mask;
+        cursor = rev(cursor);
+        cursor++;
+        cursor = rev(cursor);
+        return cursor;
+    }
+
+    char *small = hmap->arr, *large = hmap->rebuild_arr;
+    uint64_t small_cap = hmap->capacity, large_cap = hmap->rebuild_capacity;
+    if (small_cap > large_cap)
+    {
+        small = hmap->rebuild_arr;
+        large = hmap->arr;
+        small_cap = hmap->rebuild_capacity;
+        large_cap = hmap->capacity;
+    }
+    uint64_t m0 = small_cap - 1, m1 = large_cap - 1;
+
+    scan_home(hmap, small, small_cap, cursor & m0, pattern, pattern_len, fn, arg, nr_found);
+    do
+    {
+        scan_home(hmap, large, large_cap, cursor & m1, pattern, pattern_len, fn, arg, nr_found);
+
+        // Increment the reversed bits not covered by the smaller mask
+        cursor |= ~m1;
+        cursor = rev(cursor);
+        cursor++;
+        cursor = rev(cursor);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
+
+uint64_t KV_scan(struct hash_map *hmap, uint64_t cursor, const char *pattern, int pattern_len, int count, KV_scan_fn fn, void *arg)
+{
+    int nr_found = 0;
+
+    if (count <= 0)
+    {
+        count = SCAN_DEFAULT_COUNT;
+    }
+    // Bound the work per call for sparse tables or selective patterns
+    int max_iterations = count * 10;
+
+    do
+    {
+        cursor = scan_slot(hmap, cursor, pattern, pattern_len, fn, arg, &nr_found);
+    } while (cursor && max_iterations-- && nr_found < count);
+
+    return cursor;
+}
+
+// Memory usage and how much of it is backed by huge pages
+char *KV_memory_stats(struct hash_map *hmap)
+{
+    char buf[512];
+    size_t slots = hmap->capacity * sizeof(struct KV);
+    size_t rebuild_slots = hmap->rebuild_capacity * sizeof(struct KV);
+    uint64_t pool = 0, pool_huge = 0;
+
+#if USE_CUSTOM_ALLOC
+    pool = MIN_ALLOCATION_POOL_SIZE;
+    pool_huge = KV_huge_backed(((struct KV_alloc_pool *)hmap->pool)->data, pool);
+#endif
+
+    uint64_t rss = KV_rss();
+    uint64_t total = KV_used_memory();
+    int n = snprintf(buf, sizeof(buf), "used_memory=%lu max_memory=%lu total_used_memory=%lu rss=%lu fragmentation=%.2f slot_array=%zu slot_array_huge=%lu rebuild_array=%zu pool=%lu pool_huge=%lu hugepages=%s "
+                                       "active_defrag=%s defrag_running=%d defrag_moved=%lu lazyfree_pending=%lu",
+                     hmap->size, hmap->max_memory, total, rss, total ? (double)rss / total : 0.0, slots, KV_huge_backed(hmap->arr, slots), rebuild_slots,
+                     pool, pool_huge, KV_hugepage_mode_name(KV_hugepage_mode()), hmap->active_defrag ? "yes" : "no", hmap->defrag_phase != DEFRAG_IDLE, hmap->defrag_moved, KV_lazyfree_pending());
+    reply_len = 0;
+    if (reply_append(buf, n) < 0)
+    {
+        return NULL;
+    }
+    return reply_buf;
+}
+
+/*
+ * Probe distances, cluster lengths and slot occupancy. With samples below the capacity only a
+ * window of about that many slots, starting at a random cluster boundary and extended to the end
+ * of its last cluster, is examined so the cost is bounded on very large tables.
+ */
+int KV_table_stats(struct hash_map *hmap, uint64_t samples, struct KV_table_stats *stats)
+{
+    uint64_t capacity = hmap->capacity;
+    uint64_t start = 0, cluster = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = capacity;
+    // Only arr is examined; a rebuild in progress is reported by its progress
+    stats->rebuild_capacity = hmap->rebuild_capacity;
+    stats->rebuild_pos = hmap->rebuild_pos;
+    stats->rebuild_len = hmap->rebuild_len;
+
+    if (samples && samples < capacity)
+    {
+        // Begin on an empty slot, which counts towards the window, so the cluster after it is seen whole
+        start = (((uint64_t)rand() << 31) | rand()) & (capacity - 1);
+        for (uint64_t i = 0; i < capacity; i++, start = (start + 1) & (capacity - 1))
+        {
+            if (slot_empty(&hmap->arr[start * sizeof(struct KV)]))
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        samples = capacity;
+    }
+
+    for (uint64_t i = 0; i < capacity; i++)
+    {
+        uint64_t slot = (start + i) & (capacity - 1);
+        struct KV *entry = (struct KV *)&hmap->arr[slot * sizeof(struct KV)];
+
+        if (slot_empty(entry))
+        {
+            stats->empty++;
+            cluster = 0;
+            if (i >= samples)
+            {
+                stats->scanned = i + 1;
+                return 0;
+            }
+            continue;
+        }
+
+        if (++cluster > stats->longest_cluster)
+        {
+            stats->longest_cluster = cluster;
+        }
+
+        if (entry->data == TOMBSTONE)
+        {
+            stats->tombstones++;
+            continue;
+        }
+
+        uint64_t home = first_slot(kv_hash(hmap, entry->data, entry->key_len), capacity);
+        uint64_t distance = (slot - home) & (capacity - 1);
+        int bucket = distance ? 64 - __builtin_clzll(distance) : 0;
+
+        stats->live++;
+        stats->total_probe += distance;
+        stats->probe_hist[bucket < HTSTATS_BUCKETS ? bucket : HTSTATS_BUCKETS - 1]++;
+        if (distance > stats->max_probe)
+        {
+            stats->max_probe = distance;
+        }
+    }
+
+    stats->scanned = capacity;
     return 0;
 }
 
-void KV_destroy()
+// Remove every key, keeping the slot array at its current capacity. A rebuild in progress is dropped
+void KV_clear(struct hash_map *hmap)
 {
-    struct hash_map *hmap = HMAP;
-    if (hmap)
+    if (hmap->rebuild_arr)
     {
-#if !USE_CUSTOM_ALLOC
-        int len = hmap->capacity * sizeof(struct KV);
-        for (size_t i = 0; i < len; i += sizeof(struct KV))
+        for (uint64_t i = 0; i < hmap->rebuild_capacity; i++)
+        {
+            struct KV *entry = (struct KV *)&hmap->rebuild_arr[i * sizeof(struct KV)];
+            if (!slot_empty(entry) && entry->data != TOMBSTONE)
+            {
+                entry_free(hmap, entry, false);
+            }
+        }
+        slots_free(hmap, hmap->rebuild_arr, hmap->rebuild_map_len);
+        hmap->rebuild_arr = NULL;
+        hmap->rebuild_map_len = 0;
+        hmap->rebuild_capacity = 0;
+    }
+
+    uint64_t len = hmap->capacity * sizeof(struct KV);
+    for (uint64_t i = 0; i < len; i += sizeof(struct KV))
+    {
+        struct KV *entry = (struct KV *)&hmap->arr[i];
+        if (!slot_empty(entry) && entry->data != TOMBSTONE)
+        {
+            entry_free(hmap, entry, false);
+        }
+    }
+    memset(hmap->arr, EMPTY, len);
+    if (hmap->defrag_phase != DEFRAG_IDLE)
+    {
+        defrag_done(hmap);
+    }
+    hmap->size = len;
+    hmap->len = 0;
+    hmap->tombstones = 0;
+
+    if (hmap->index)
+    {
+        skiplist_destroy(hmap->index);
+        hmap->index = NULL;
+        KV_index_enable(hmap);
+    }
+}
+
+// Everything a table owns, detached from it so it can be freed off the request path
+struct lazy_table
+{
+    char *arr;
+    size_t arr_map_len;
+    uint64_t capacity;
+    // A rebuild in progress goes with the table unfinished; keys already moved are tombstones in arr
+    char *rebuild_arr;
+    size_t rebuild_map_len;
+    uint64_t rebuild_capacity;
+#if USE_CUSTOM_ALLOC
+    char *pool;
+#endif
+    struct skiplist *index;
+    struct defrag_page *defrag_pages;
+};
+
+static void table_free(void *arg)
+{
+    struct lazy_table *table = (struct lazy_table *)arg;
+    char *arrs[] = {table->arr, table->rebuild_arr};
+    size_t map_lens[] = {table->arr_map_len, table->rebuild_map_len};
+    uint64_t capacities[] = {table->capacity, table->rebuild_capacity};
+
+    for (int a = 0; a < 2; a++)
+    {
+        for (uint64_t i = 0; arrs[a] && i < capacities[a]; i++)
         {
-            if (hmap->arr[i] != EMPTY)
+            struct KV *entry = (struct KV *)&arrs[a][i * sizeof(struct KV)];
+            if (slot_empty(entry) || entry->data == TOMBSTONE)
+            {
+                continue;
+            }
+            // The server may still be sending a large value, so it only goes with its last reference
+            if (is_large(entry->key_len + entry->val_len))
+            {
+                large_release(entry->data, false);
+            }
+#if !USE_CUSTOM_ALLOC
+            else
             {
-                struct KV *entry = (struct KV *)&hmap->arr[i];
                 free(entry->data);
-                // free(entry->val);
             }
+#endif
+        }
+    }
+    for (int a = 0; a < 2; a++)
+    {
+#if !USE_CUSTOM_ALLOC
+        if (map_lens[a])
+        {
+            KV_page_free(arrs[a], map_lens[a]);
+        }
+        else
+        {
+            free(arrs[a]);
         }
-        free(hmap->arr);
 #else
-        KV_alloc_pool_free((struct KV_alloc_pool *)hmap->pool);
+        // The other values and small slot arrays all live in the pool
+        KV_page_free(arrs[a], map_lens[a]);
 #endif
-        free(hmap);
     }
+#if USE_CUSTOM_ALLOC
+    KV_alloc_pool_free((struct KV_alloc_pool *)table->pool);
+#endif
+    skiplist_destroy(table->index);
+    free(table->defrag_pages);
+    free(table);
+}
+
+static struct lazy_table *table_detach(struct hash_map *hmap)
+{
+    struct lazy_table *table = (struct lazy_table *)malloc(sizeof(struct lazy_table));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    table->arr = hmap->arr;
+    table->arr_map_len = hmap->arr_map_len;
+    table->capacity = hmap->capacity;
+    table->rebuild_arr = hmap->rebuild_arr;
+    table->rebuild_map_len = hmap->rebuild_map_len;
+    table->rebuild_capacity = hmap->rebuild_capacity;
+#if USE_CUSTOM_ALLOC
+    table->pool = hmap->pool;
+#endif
+    table->index = hmap->index;
+    table->defrag_pages = hmap->defrag_pages;
+    return table;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Remove every key. An async flush swaps in an empty table (and allocator pool) and leaves freeing
+ * the old one to the lazy free thread, so it costs the same whatever the table holds. Falls back to
+ * KV_clear when the new table cannot be allocated.
+ */
+static int flush_table(struct hash_map *hmap, bool async)
 {
+    if (!async)
+    {
+        KV_clear(hmap);
+        return 0;
+    }
+
+    struct skiplist *index = NULL;
+    if (hmap->index && (index = skiplist_init()) == NULL)
+    {
+        KV_clear(hmap);
+        return 0;
+    }
+
+#if USE_CUSTOM_ALLOC
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, hmap->alloc_concurrent_access);
+    if (pool == NULL)
+    {
+        skiplist_destroy(index);
+        KV_clear(hmap);
+        return 0;
+    }
+    KV_page_advise(pool->data, MIN_ALLOCATION_POOL_SIZE);
+    memset(pool->data, EMPTY, MIN_ALLOCATION_POOL_SIZE);
+#endif
 
-    serve(argc, argv); // We should never return
+    struct lazy_table *table = table_detach(hmap);
+    if (table == NULL)
+    {
+#if USE_CUSTOM_ALLOC
+        KV_alloc_pool_free(pool);
+#endif
+        skiplist_destroy(index);
+        KV_clear(hmap);
+        return 0;
+    }
+
+#if USE_CUSTOM_ALLOC
+    hmap->pool = (char *)pool;
+#endif
+    size_t map_len;
+    uint64_t capacity = initial_capacity;
+    char *arr = slots_alloc(hmap, capacity * sizeof(struct KV), &map_len);
+    if (arr == NULL)
+    {
+        // Put the old table back rather than lose it
+#if USE_CUSTOM_ALLOC
+        hmap->pool = table->pool;
+        KV_alloc_pool_free(pool);
+#endif
+        free(table);
+        skiplist_destroy(index);
+        KV_clear(hmap);
+        return 0;
+    }
+    memset(arr, EMPTY, capacity * sizeof(struct KV));
 
+    hmap->arr = arr;
+    hmap->arr_map_len = map_len;
+    hmap->capacity = capacity;
+    hmap->len = 0;
+    hmap->tombstones = 0;
+    hmap->size = capacity * sizeof(struct KV);
+    hmap->rebuild_arr = NULL;
+    hmap->rebuild_map_len = 0;
+    hmap->rebuild_capacity = 0;
+    hmap->index = index;
+    hmap->defrag_pages = NULL;
+    hmap->defrag_pages_cap = 0;
+    hmap->defrag_pages_len = 0;
+    hmap->defrag_phase = DEFRAG_IDLE;
+
+    KV_lazyfree(table_free, table);
     return 0;
-}
\ No newline at end of file
+}
+
+int KV_flush(struct hash_map *hmap, bool async)
+{
+    int ret = flush_table(hmap, async);
+    if (hmap->notify)
+    {
+        hmap->notify(hmap->notify_arg, hmap, NULL, 0);
+    }
+    return ret;
+}
+
+// Release a table and all its keys. The memory is freed by the lazy free thread, which is joined at exit
+void KV_drop(struct hash_map *hmap)
+{
+    struct lazy_table *table = table_detach(hmap);
+    if (table)
+    {
+        KV_lazyfree(table_free, table);
+    }
+    else
+    {
+        KV_log(LL_WARNING, "KV_drop: Unable to detach table, its memory is leaked");
+    }
+
+    pthread_mutex_lock(&hmaps_lock);
+    for (struct hash_map **link = &hmaps; *link; link = &(*link)->next)
+    {
+        if (*link == hmap)
+        {
+            *link = hmap->next;
+            break;
+        }
+    }
+    if (hmap == HMAP)
+    {
+        HMAP = NULL;
+    }
+    pthread_mutex_unlock(&hmaps_lock);
+    free(hmap);
+}
+
+// Bytes used by every table
+uint64_t KV_used_memory(void)
+{
+    uint64_t size = 0;
+    pthread_mutex_lock(&hmaps_lock);
+    for (struct hash_map *hmap = hmaps; hmap; hmap = hmap->next)
+    {
+        // Other tables may be written by other threads when embedded; a slightly stale total is fine
+        size += __atomic_load_n(&hmap->size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&hmaps_lock);
+    return size;
+}
+
+void KV_destroy()
+{
+    if (HMAP)
+    {
+        KV_drop(HMAP);
+    }
+    free(reply_buf);
+    reply_buf = NULL;
+    reply_cap = 0;
+    pthread_once(&reply_key_once, reply_key_create);
+    pthread_setspecific(reply_key, NULL);
+}
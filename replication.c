@@ -0,0 +1,550 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "sikv.h"
+#include "server.h"
+#include "log.h"
+
+/*
+ * Primary/replica replication.
+ *
+ * The primary appends every successful write, as a command line, to the stream sent to its
+ * replicas and to a fixed size backlog ring. The stream position is the replication offset. A
+ * `SELECT <db>` line goes before a write to a different keyspace than the one before it.
+ *
+ * A replica connects and sends `PSYNC <replid> <offset>` (`PSYNC ? -1` the first time). If the
+ * primary still holds everything after that offset in its backlog it answers `CONTINUE` followed by
+ * the missing bytes. Otherwise it answers `FULLRESYNC <replid> <offset> <db>`, db being the keyspace
+ * the stream continues in, followed by the live stream from there on. The snapshot goes out in
+ * between, a chunk at a time whenever the replica has taken everything queued for it: a
+ * `SNAPSHOT BEGIN` line, a SELECT, a SET line per key up to REPL_SNAPSHOT_CHUNK bytes, a SELECT of
+ * the stream's keyspace and `SNAPSHOT END`. These lines do not count towards the offset.
+ * `SNAPSHOT DONE` follows the last chunk.
+ *
+ * Writes made while the snapshot is going out reach the replica through the stream, before or after
+ * the chunk holding their key. Either way the replica ends up with the primary's value: a SET from
+ * the snapshot carries the whole current value, and a key the snapshot has not got to by the time it
+ * is written is sent again once it has.
+ */
+
+#define MAX_REPLICAS 64
+
+typedef enum
+{
+    REPL_DISCONNECTED,
+    REPL_HANDSHAKE,
+    REPL_TRANSFER,
+    REPL_STREAMING
+} repl_state;
+
+static char repl_id[REPL_ID_LEN + 1];
+static uint64_t repl_offset = 0; // bytes of mutation stream produced (primary) or applied (replica)
+
+static char *backlog = NULL;
+static uint64_t backlog_histlen = 0;
+
+struct replica
+{
+    struct connection *conn;
+    bool syncing;     // the snapshot is still being sent
+    int db;           // where the snapshot carries on from
+    uint64_t cursor;
+    size_t chunk_len; // bytes of the last chunk, which may still be queued
+};
+
+static struct replica replicas[MAX_REPLICAS];
+static int nr_replicas = 0;
+
+static char *primary_host = NULL;
+static unsigned short primary_port = 0;
+static struct sockaddr_in primary_addr;
+static struct connection *primary_conn = NULL;
+static repl_state state = REPL_DISCONNECTED;
+static bool in_snapshot = false; // between SNAPSHOT BEGIN and END (replica)
+static uint64_t last_connect_ms = 0;
+
+static int stream_db = 0; // keyspace the stream last selected (primary)
+static int apply_db = 0;  // keyspace replicated writes go to, -1 when it does not exist here (replica)
+
+static char role_buf[128];
+
+static void generate_repl_id(void)
+{
+    static const char hex[] = "0123456789abcdef";
+    srand(time(NULL) ^ getpid());
+    for (int i = 0; i < REPL_ID_LEN; i++)
+    {
+        repl_id[i] = hex[rand() & 15];
+    }
+    repl_id[REPL_ID_LEN] = '\0';
+}
+
+void repl_init(void)
+{
+    generate_repl_id();
+    repl_offset = 0;
+}
+
+// Resolved once here, at startup, so that reconnecting never waits on a name lookup
+void repl_set_primary(const char *host, unsigned short port)
+{
+    struct hostent *hostent = gethostbyname(host);
+    if (hostent == NULL)
+    {
+        fprintf(stderr, "Unable to resolve primary %s: %s\n", host, hstrerror(h_errno));
+        exit(EXIT_FAILURE);
+    }
+    memset(&primary_addr, 0, sizeof(primary_addr));
+    primary_addr.sin_family = AF_INET;
+    primary_addr.sin_port = htons(port);
+    memcpy(&primary_addr.sin_addr, hostent->h_addr_list[0], sizeof(primary_addr.sin_addr));
+
+    primary_host = strdup(host);
+    primary_port = port;
+    // Never matches a primary's id so the first sync is a full one
+    strcpy(repl_id, "?");
+    repl_offset = 0;
+}
+
+bool repl_is_replica(void)
+{
+    return primary_host != NULL;
+}
+
+static void backlog_feed(const char *buf, size_t len)
+{
+    if (backlog == NULL)
+    {
+        backlog = (char *)malloc(REPL_BACKLOG_SIZE);
+        if (backlog == NULL)
+        {
+            perror("backlog_feed: Unable to allocate replication backlog");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t done = 0; done < len;)
+    {
+        size_t pos = (repl_offset + done) % REPL_BACKLOG_SIZE;
+        size_t n = REPL_BACKLOG_SIZE - pos;
+        if (n > len - done)
+        {
+            n = len - done;
+        }
+        memcpy(&backlog[pos], &buf[done], n);
+        done += n;
+    }
+
+    repl_offset += len;
+    backlog_histlen += len;
+    if (backlog_histlen > REPL_BACKLOG_SIZE)
+    {
+        backlog_histlen = REPL_BACKLOG_SIZE;
+    }
+}
+
+static void replica_remove(struct connection *conn)
+{
+    for (int i = 0; i < nr_replicas; i++)
+    {
+        if (replicas[i].conn == conn)
+        {
+            replicas[i] = replicas[--nr_replicas];
+            return;
+        }
+    }
+}
+
+static void propagate_line(const char *line, size_t len)
+{
+    backlog_feed(line, len);
+    for (int i = 0; i < nr_replicas;)
+    {
+        struct connection *conn = replicas[i].conn;
+        // Only the stream counts towards the limit, not a snapshot chunk still queued ahead of it
+        size_t pending = conn->wlen - conn->woff + conn->slen - conn->soff;
+        if (pending + len > REPL_OUTPUT_LIMIT + replicas[i].chunk_len)
+        {
+            // Too far behind; it reconnects and resyncs
+            KV_log(LL_WARNING, "Dropping replica: output buffer limit reached");
+            conn_close(conn); // removes it from replicas
+            continue;
+        }
+        conn_write(conn, line, len);
+        i++;
+    }
+}
+
+void repl_propagate(int db, int argc, char *argv[])
+{
+    char *line = NULL;
+    size_t len = 0;
+
+    if (db != stream_db)
+    {
+        char select[32];
+        int n = snprintf(select, sizeof(select), "SELECT %d\n", db);
+        propagate_line(select, n);
+        stream_db = db;
+    }
+
+    for (int i = 0; i < argc; i++)
+    {
+        len += strlen(argv[i]) + 1;
+    }
+
+    line = (char *)malloc(len);
+    if (line == NULL)
+    {
+        KV_log(LL_WARNING, "repl_propagate: Unable to allocate command");
+        return;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        size_t n = strlen(argv[i]);
+        memcpy(&line[off], argv[i], n);
+        off += n;
+        line[off++] = i + 1 < argc ? ' ' : '\n';
+    }
+
+    propagate_line(line, len);
+    free(line);
+}
+
+static void snapshot_write(void *arg, const char *key, int key_len, const char *val, int val_len)
+{
+    struct connection *conn = (struct connection *)arg;
+    conn_write(conn, "SET ", 4);
+    conn_write(conn, key, key_len);
+    conn_write(conn, " ", 1);
+    conn_write(conn, val, strnlen(val, val_len));
+    conn_write(conn, "\n", 1);
+}
+
+// The next REPL_SNAPSHOT_CHUNK bytes or so of the snapshot, the last chunk followed by SNAPSHOT DONE
+static void snapshot_chunk(struct replica *replica)
+{
+    // A failed write closes the connection, which takes it out of replicas; the copy is only put back if not
+    struct replica r = *replica;
+    int nr_dbs = server_nr_dbs();
+    char line[32];
+
+    conn_write(r.conn, "SNAPSHOT BEGIN\n", 15);
+    int n = snprintf(line, sizeof(line), "SELECT %d\n", r.db);
+    conn_write(r.conn, line, n);
+    while (r.db < nr_dbs && !r.conn->closing && r.conn->wlen - r.conn->woff < REPL_SNAPSHOT_CHUNK)
+    {
+        r.cursor = KV_scan(server_db(r.db), r.cursor, NULL, 0, REPL_SNAPSHOT_SCAN, snapshot_write, r.conn);
+        if (r.cursor == 0 && ++r.db < nr_dbs)
+        {
+            n = snprintf(line, sizeof(line), "SELECT %d\n", r.db);
+            conn_write(r.conn, line, n);
+        }
+    }
+
+    // Leave the replica where the live stream continues from
+    n = snprintf(line, sizeof(line), "SELECT %d\n", stream_db);
+    conn_write(r.conn, line, n);
+    conn_write(r.conn, "SNAPSHOT END\n", 13);
+    if (r.db == nr_dbs)
+    {
+        conn_write(r.conn, "SNAPSHOT DONE\n", 14);
+        r.syncing = false;
+    }
+    if (r.conn->closing)
+    {
+        return;
+    }
+    if (!r.syncing)
+    {
+        KV_log(LL_NOTICE, "Replica fully resynced at offset %lu", repl_offset);
+    }
+    r.chunk_len = r.conn->wlen - r.conn->woff;
+    *replica = r;
+}
+
+// Whether the replica took all its output, so that the next chunk can be produced
+static bool replica_drained(struct connection *conn)
+{
+    return !conn->closing && conn->woff == conn->wlen && !conn->send_inflight;
+}
+
+/*
+ * Called on every event loop iteration before the output is flushed. A replica gets its next chunk
+ * only once the last one has left, so a snapshot never takes more memory than a chunk per replica
+ * and the event loop is never held up for longer than producing one.
+ */
+void repl_snapshot_step(void)
+{
+    for (int i = 0; i < nr_replicas; i++)
+    {
+        struct replica *replica = &replicas[i];
+        if (!replica_drained(replica->conn))
+        {
+            continue;
+        }
+        replica->chunk_len = 0;
+        if (replica->syncing)
+        {
+            snapshot_chunk(replica);
+        }
+    }
+}
+
+// Whether repl_snapshot_step has a chunk to produce right away, in which case the loop must not sleep
+bool repl_snapshot_ready(void)
+{
+    for (int i = 0; i < nr_replicas; i++)
+    {
+        if (replicas[i].syncing && replica_drained(replicas[i].conn))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void repl_psync(struct connection *conn, int argc, char *argv[])
+{
+    if (repl_is_replica())
+    {
+        char *ret = "ERR Replicas can not be synced from\n";
+        conn_write(conn, ret, strlen(ret));
+        return;
+    }
+
+    if (nr_replicas == MAX_REPLICAS)
+    {
+        char *ret = "ERR Too many replicas\n";
+        conn_write(conn, ret, strlen(ret));
+        return;
+    }
+
+    conn->type = CONN_REPLICA;
+    struct replica *replica = &replicas[nr_replicas++];
+    *replica = (struct replica){.conn = conn};
+
+    uint64_t offset = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+    if (argc > 2 && strcmp(argv[1], repl_id) == 0 && offset <= repl_offset && repl_offset - offset <= backlog_histlen)
+    {
+        conn_write(conn, "CONTINUE\n", 9);
+        for (uint64_t off = offset; off < repl_offset;)
+        {
+            size_t pos = off % REPL_BACKLOG_SIZE;
+            size_t n = REPL_BACKLOG_SIZE - pos;
+            if (n > repl_offset - off)
+            {
+                n = repl_offset - off;
+            }
+            conn_write(conn, &backlog[pos], n);
+            off += n;
+        }
+        KV_log(LL_NOTICE, "Replica partially resynced from offset %lu", offset);
+        return;
+    }
+
+    char line[96];
+    int n = snprintf(line, sizeof(line), "FULLRESYNC %s %lu %d\n", repl_id, repl_offset, stream_db);
+    conn_write(conn, line, n);
+    replica->syncing = true;
+    KV_log(LL_NOTICE, "Replica full resync at offset %lu", repl_offset);
+}
+
+static void apply(char *line, size_t len)
+{
+    int argc;
+    char **argv = parse_input(line, len, &argc);
+    if (argc > 1 && strcmp(argv[0], "SELECT") == 0)
+    {
+        apply_db = strtol(argv[1], NULL, 10);
+        if (server_db(apply_db) == NULL)
+        {
+            KV_log(LL_WARNING, "Primary selected keyspace %s, which does not exist here; its writes are dropped", argv[1]);
+            apply_db = -1;
+        }
+    }
+    else if (argc > 0 && apply_db >= 0)
+    {
+        process_cmd(server_db(apply_db), argc, argv);
+    }
+    free_input_buffer(argv);
+}
+
+static bool is_line(const char *line, size_t len, const char *expect)
+{
+    size_t n = strlen(expect);
+    return len >= n && memcmp(line, expect, n) == 0 && (len == n || line[n] == '\n' || line[n] == '\r');
+}
+
+void repl_feed_line(struct connection *conn, char *line, size_t len)
+{
+    char id[REPL_ID_LEN + 1];
+    uint64_t offset;
+    int db;
+
+    switch (state)
+    {
+    case REPL_HANDSHAKE:
+        if (len >= 8 && memcmp(line, "CONTINUE", 8) == 0)
+        {
+            state = REPL_STREAMING;
+            KV_log(LL_NOTICE, "Partial resync with primary from offset %lu", repl_offset);
+        }
+        else if (sscanf(line, "FULLRESYNC %16s %lu %d", id, &offset, &db) == 3)
+        {
+            for (int i = 0; i < server_nr_dbs(); i++)
+            {
+                KV_flush(server_db(i), true);
+            }
+            apply_db = server_db(db) ? db : -1;
+            strcpy(repl_id, id);
+            repl_offset = offset;
+            in_snapshot = false;
+            state = REPL_TRANSFER;
+            KV_log(LL_NOTICE, "Full resync with primary at offset %lu", offset);
+        }
+        else
+        {
+            KV_log(LL_WARNING, "Unexpected reply from primary: %.*s", (int)len, line);
+            conn_close(conn);
+        }
+        break;
+    case REPL_TRANSFER:
+        if (is_line(line, len, "SNAPSHOT BEGIN"))
+        {
+            in_snapshot = true;
+        }
+        else if (is_line(line, len, "SNAPSHOT END"))
+        {
+            in_snapshot = false;
+        }
+        else if (is_line(line, len, "SNAPSHOT DONE"))
+        {
+            state = REPL_STREAMING;
+            KV_log(LL_NOTICE, "Full resync with primary done at offset %lu", repl_offset);
+        }
+        else
+        {
+            apply(line, len);
+            repl_offset += in_snapshot ? 0 : len;
+        }
+        break;
+    case REPL_STREAMING:
+        apply(line, len);
+        repl_offset += len;
+        break;
+    default:
+        break;
+    }
+}
+
+void repl_conn_closed(struct connection *conn)
+{
+    if (conn->type == CONN_REPLICA)
+    {
+        replica_remove(conn);
+    }
+    else if (conn == primary_conn)
+    {
+        primary_conn = NULL;
+        // A transfer cut short leaves a partial table; only a full resync fixes that
+        if (state == REPL_TRANSFER)
+        {
+            strcpy(repl_id, "?");
+        }
+        // Also how a failed connect ends, which is logged once per attempt
+        KV_log(state == REPL_HANDSHAKE ? LL_VERBOSE : LL_WARNING, "Lost connection to primary");
+        state = REPL_DISCONNECTED;
+    }
+}
+
+/*
+ * The connect does not wait for the primary. PSYNC is queued right away but the socket only becomes
+ * writable once connected, so it leaves through EPOLLOUT, or the poll io_uring arms for a send that
+ * would block, like any other output. A refused connect shows up as an error on the connection.
+ */
+static void connect_primary(void)
+{
+    char psync[96];
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+    {
+        KV_log(LL_WARNING, "socket: %s", strerror(errno));
+        return;
+    }
+
+    if (connect(fd, (struct sockaddr *)&primary_addr, sizeof(primary_addr)) == -1 && errno != EINPROGRESS)
+    {
+        KV_log(LL_VERBOSE, "connect: %s:%d: %s", primary_host, primary_port, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    primary_conn = conn_create(fd, CONN_PRIMARY);
+    if (primary_conn == NULL)
+    {
+        close(fd);
+        return;
+    }
+
+    int n = snprintf(psync, sizeof(psync), "PSYNC %s %lu\n", repl_id, repl_offset);
+    conn_write(primary_conn, psync, n);
+    state = REPL_HANDSHAKE;
+    KV_log(LL_VERBOSE, "Connecting to primary %s:%d", primary_host, primary_port);
+}
+
+void repl_cron(void)
+{
+    struct timespec ts;
+
+    if (!repl_is_replica())
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (primary_conn != NULL)
+    {
+        // A primary that is unreachable, or never answers PSYNC, is given up on and tried again
+        if (state == REPL_HANDSHAKE && now - last_connect_ms >= REPL_HANDSHAKE_MS)
+        {
+            KV_log(LL_WARNING, "Timed out connecting to primary %s:%d", primary_host, primary_port);
+            conn_close(primary_conn);
+        }
+        return;
+    }
+
+    if (now - last_connect_ms >= REPL_RECONNECT_MS)
+    {
+        last_connect_ms = now;
+        connect_primary();
+    }
+}
+
+char *repl_role(void)
+{
+    static const char *states[] = {"disconnected", "handshake", "transfer", "streaming"};
+
+    if (repl_is_replica())
+    {
+        snprintf(role_buf, sizeof(role_buf), "replica %s %d %s %lu", primary_host, primary_port, states[state], repl_offset);
+    }
+    else
+    {
+        snprintf(role_buf, sizeof(role_buf), "primary %s %lu %d", repl_id, repl_offset, nr_replicas);
+    }
+    return role_buf;
+}
@@ -3,101 +3,1107 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 
 #include "sikv.h"
+#include "server.h"
+#include "shm.h"
+#include "log.h"
+#include "trace.h"
 
-#define PORT 8007
+size_t strlen0(char *buf)
+{
+    size_t len = 0;
+    while (*buf != '\0')
+    {
+        buf++;
+        len++;
+    }
+    return len;
+}
+
+void free_input_buffer(char **input_buf)
+{
+    for (size_t i = 0; input_buf[i] != NULL; i++)
+    {
+        free(input_buf[i]);
+    }
+
+    free(input_buf);
+}
+
+// Set by SIGINT; the event loop sees it and cleans up, which is not safe to do in the handler
+static volatile sig_atomic_t stopping = 0;
+
+static void sigint_handler(int sig)
+{
+    stopping = 1;
+}
+
+bool server_stopping(void)
+{
+    return stopping;
+}
+
+static bool is_separator(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r';
+}
+
+// Split a command line into a NULL terminated argument vector
+char **parse_input(char *str, size_t len, int *argc)
+{
+    size_t cap = 4;
+    char **buf = malloc(sizeof(char *) * cap);
+    if (buf == NULL)
+    {
+        perror("failed malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t i = 0;
+    size_t off = 0;
+    size_t j = 0;
+
+    while (i < len)
+    {
+        while (i < len && is_separator(str[i]))
+        {
+            i++;
+        }
+        if (i >= len)
+        {
+            break;
+        }
+
+        off = i;
+        while (i < len && !is_separator(str[i]))
+        {
+            i++;
+        }
+
+        if (j + 1 >= cap)
+        {
+            cap *= 2;
+            char **temp = realloc(buf, sizeof(char *) * cap);
+            if (temp == NULL)
+            {
+                perror("failed realloc");
+                exit(EXIT_FAILURE);
+            }
+            buf = temp;
+        }
+
+        buf[j] = malloc((i - off) + 1);
+        if (buf[j] == NULL)
+        {
+            perror("failed malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(buf[j], (char *)&str[off], i - off);
+        buf[j][i - off] = '\0';
+        j++;
+    }
+    buf[j] = NULL;
+    *argc = j;
+    return buf;
+}
+
+static int epfd = -1;
+static bool use_uring = false;
+static int unix_fd = -1;
+static const char *unix_path = NULL;
+static char unix_listener; // epoll tag of the unix socket; the TCP listener's is NULL
+static int nr_shm_conns = 0;
+static uint64_t shm_active_ns = 0; // last time a shared memory ring had traffic
+static bool shm_worked = false;    // in the current event loop iteration
+// Keyspaces selectable with SELECT, each a separate table with its own allocator pool. Keyspace 0 is the default table
+static struct hash_map **server_dbs = NULL;
+static int nr_dbs = DEFAULT_DATABASES;
+static struct connection *connections = NULL;
+
+struct hash_map *server_db(int db)
+{
+    return db >= 0 && db < nr_dbs ? server_dbs[db] : NULL;
+}
+
+int server_nr_dbs(void)
+{
+    return nr_dbs;
+}
+
+static void dbs_destroy(void)
+{
+    for (int i = nr_dbs - 1; server_dbs && i > 0; i--)
+    {
+        KV_drop(server_dbs[i]);
+    }
+    KV_destroy();
+}
+
+// Leaving the event loop, on SIGINT or an error it cannot go on from
+static void server_shutdown(void)
+{
+    if (stopping)
+    {
+        KV_log(LL_NOTICE, "SIGINT, cleaning up");
+    }
+    dbs_destroy();
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct connection *conn_create(int fd, conn_type type)
+{
+    struct connection *conn = (struct connection *)calloc(1, sizeof(struct connection));
+    if (conn == NULL)
+    {
+        perror("conn_create: Unable to allocate connection");
+        return NULL;
+    }
+
+    static uint64_t next_id = 1;
+
+    conn->fd = fd;
+    conn->type = type;
+    conn->id = next_id++;
+
+    if (!use_uring)
+    {
+        if (set_nonblocking(fd) == -1)
+        {
+            perror("fcntl");
+            free(conn);
+            return NULL;
+        }
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            free(conn);
+            return NULL;
+        }
+    }
+
+    conn->next = connections;
+    if (connections)
+    {
+        connections->prev = conn;
+    }
+    connections = conn;
+    KV_TRACE2(conn__open, fd, type);
+
+    if (use_uring)
+    {
+        uring_conn_add(conn);
+    }
+    return conn;
+}
+
+static int out_append(struct connection *conn, char **out, size_t *out_len, size_t *out_cap, const char *buf, size_t len)
+{
+    if (*out_len + len > *out_cap)
+    {
+        size_t cap = *out_cap ? *out_cap : server_config.io_buffer_size;
+        while (*out_len + len > cap)
+        {
+            cap *= 2;
+        }
+        char *grown = realloc(*out, cap);
+        if (grown == NULL)
+        {
+            perror("conn_write: Unable to grow output buffer");
+            conn_close(conn);
+            return -1;
+        }
+        *out = grown;
+        *out_cap = cap;
+    }
+    memcpy(&(*out)[*out_len], buf, len);
+    *out_len += len;
+    return 0;
+}
+
+// Queue output for conn. It is flushed before the event loop goes back to sleep
+int conn_write(struct connection *conn, const char *buf, size_t len)
+{
+    if (conn->closing)
+    {
+        return -1;
+    }
+    // Pushes may come in while a large reply is going out; they wait for it
+    if (conn->stream)
+    {
+        return out_append(conn, &conn->hbuf, &conn->hlen, &conn->hcap, buf, len);
+    }
+    return out_append(conn, &conn->wbuf, &conn->wlen, &conn->wcap, buf, len);
+}
+
+/*
+ * GET of a large value. Rather than being copied into the output buffer, the reply is sent from
+ * the value itself once the output queued before it is out, with a reference keeping the value
+ * alive whatever later commands do to the key. The connection's next commands wait for it.
+ */
+static void stream_start(struct connection *conn, char *block, const char *val, size_t len)
+{
+    conn->stream = block;
+    conn->stream_pos = val;
+    conn->stream_left = len;
+}
+
+static void stream_sent(struct connection *conn, size_t len)
+{
+    conn->stream_pos += len;
+    conn->stream_left -= len;
+    if (conn->stream_left)
+    {
+        return;
+    }
+
+    KV_large_release(conn->stream);
+    conn->stream = NULL;
+    conn->resume = true;
+    out_append(conn, &conn->wbuf, &conn->wlen, &conn->wcap, "\n", 1);
+    if (conn->hlen && !conn->closing)
+    {
+        out_append(conn, &conn->wbuf, &conn->wlen, &conn->wcap, conn->hbuf, conn->hlen);
+    }
+    conn->hlen = 0;
+}
+
+// For io_uring, whose sends need a buffer of the connection's own: a chunk at a time is copied out
+static void stream_refill(struct connection *conn)
+{
+    size_t len = conn->stream_left < STREAM_CHUNK ? conn->stream_left : STREAM_CHUNK;
+    if (out_append(conn, &conn->wbuf, &conn->wlen, &conn->wcap, conn->stream_pos, len) == 0)
+    {
+        stream_sent(conn, len);
+    }
+}
+
+// Connections are released after the current event is handled since callers may still hold them
+void conn_close(struct connection *conn)
+{
+    if (conn->closing)
+    {
+        return;
+    }
+    conn->closing = true;
+    KV_TRACE2(conn__close, conn->fd, conn->type);
+    if (use_uring)
+    {
+        uring_conn_close(conn);
+    }
+    else
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    close(conn->fd);
+    repl_conn_closed(conn);
+    tracking_conn_closed(conn);
+}
+
+static void conn_free(struct connection *conn)
+{
+    if (conn->prev)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        connections = conn->next;
+    }
+    if (conn->next)
+    {
+        conn->next->prev = conn->prev;
+    }
+    if (conn->shm)
+    {
+        shm_detach(conn->shm);
+        nr_shm_conns--;
+    }
+    if (conn->stream)
+    {
+        KV_large_release(conn->stream);
+    }
+    if (conn->bulk && conn->bulk_val != conn->bulk)
+    {
+        KV_large_release(conn->bulk);
+    }
+    else
+    {
+        free(conn->bulk);
+    }
+    free(conn->bulk_key);
+    free(conn->rbuf);
+    free(conn->wbuf);
+    free(conn->hbuf);
+    free(conn->sbuf);
+    free(conn);
+}
+
+static void conn_flush(struct connection *conn)
+{
+    while (!conn->closing && (conn->woff < conn->wlen || conn->stream))
+    {
+        // A large reply goes out straight from the value, after what was queued before it
+        bool from_stream = conn->woff == conn->wlen;
+        const char *buf = from_stream ? conn->stream_pos : &conn->wbuf[conn->woff];
+        size_t len = from_stream ? conn->stream_left : conn->wlen - conn->woff;
+        ssize_t n = write(conn->fd, buf, len);
+        if (n > 0 && from_stream)
+        {
+            stream_sent(conn, n);
+            continue;
+        }
+        if (n > 0)
+        {
+            conn->woff += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!conn->want_write)
+            {
+                struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = conn};
+                epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+                conn->want_write = true;
+            }
+            return;
+        }
+        KV_log(LL_VERBOSE, "write error: %s", strerror(errno));
+        conn_close(conn);
+        return;
+    }
+
+    conn->woff = conn->wlen = 0;
+    if (conn->want_write)
+    {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->want_write = false;
+    }
+}
+
+// Reply bytes go into the response ring; whatever does not fit waits for the client to make room
+static void shm_flush(struct connection *conn)
+{
+    struct shm_header *hdr = conn->shm->hdr;
+
+    if (hdr->resp.producer_waiting)
+    {
+        shm_set_waiting(&hdr->resp.producer_waiting, false);
+    }
+    while (!conn->closing && (conn->woff < conn->wlen || conn->stream))
+    {
+        bool from_stream = conn->woff == conn->wlen;
+        const char *buf = from_stream ? conn->stream_pos : &conn->wbuf[conn->woff];
+        size_t len = from_stream ? conn->stream_left : conn->wlen - conn->woff;
+        size_t n = shm_ring_write(&hdr->resp, conn->shm->resp_data, hdr->ring_size, buf, len);
+        if (n)
+        {
+            if (from_stream)
+            {
+                stream_sent(conn, n);
+            }
+            else
+            {
+                conn->woff += n;
+            }
+            shm_worked = true;
+            continue;
+        }
+        // Full. The client rings the socket once it has read some; check again in case it already has
+        shm_set_waiting(&hdr->resp.producer_waiting, true);
+        if (hdr->resp.tail - __atomic_load_n(&hdr->resp.head, __ATOMIC_ACQUIRE) >= hdr->ring_size)
+        {
+            break;
+        }
+    }
+    if (shm_consumer_waiting(&hdr->resp))
+    {
+        shm_wake_client(hdr);
+    }
+    if (conn->woff == conn->wlen)
+    {
+        conn->woff = conn->wlen = 0;
+    }
+}
+
+// SHM name: map the client's segment and serve the connection through it from the next command on
+static void shm_cmd(struct connection *conn, int argc, char *argv[])
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if (argc < 2 || conn->shm)
+    {
+        char *ret = "ERR SHM takes a segment name, once\n";
+        conn_write(conn, ret, strlen(ret));
+        return;
+    }
+    // The segment has to be on this host, and the socket is needed for wakeups
+    if (getsockname(conn->fd, (struct sockaddr *)&addr, &addr_len) == -1 || addr.ss_family != AF_UNIX)
+    {
+        char *ret = "ERR SHM needs a unix socket connection\n";
+        conn_write(conn, ret, strlen(ret));
+        return;
+    }
+
+    conn->shm = shm_attach(argv[1]);
+    if (conn->shm == NULL)
+    {
+        KV_log(LL_VERBOSE, "SHM Error: Unable to map %s: %s", argv[1], strerror(errno));
+        char *ret = "ERR SHM unable to map segment\n";
+        conn_write(conn, ret, strlen(ret));
+        return;
+    }
+    nr_shm_conns++;
+    conn_write(conn, "Ok\n", 3);
+}
+
+static bool is_write_cmd(KV_CMD cmd)
+{
+    return cmd == CMD_SET || cmd == CMD_PUT || cmd == CMD_DEL || cmd == CMD_UNLINK || cmd == CMD_FLUSH || cmd == CMD_SETBULK ||
+           cmd == CMD_APPEND || cmd == CMD_SETRANGE || cmd == CMD_CAS || cmd == CMD_SETNX || cmd == CMD_SETXX;
+}
+
+static void reply_cmd(struct connection *conn, KV_CMD cmd, int argc, char *argv[], char *ret)
+{
+    if (ret == NULL)
+    {
+        ret = "GET Not found\n";
+        KV_log(LL_DEBUG, "GET Not found");
+        conn_write(conn, ret, strlen(ret));
+    }
+    else if (ret == SUCCESS)
+    {
+        ret = "Ok\n";
+        KV_log(LL_DEBUG, "Ok");
+        conn_write(conn, ret, strlen(ret));
+        if (cmd == CMD_CAS || cmd == CMD_SETNX || cmd == CMD_SETXX)
+        {
+            // Replicas have versions of their own, and need not check a condition already met here
+            char *set_argv[] = {"SET", argv[1], argv[argc - 1]};
+            repl_propagate(conn->db, 3, set_argv);
+        }
+        else if (is_write_cmd(cmd))
+        {
+            repl_propagate(conn->db, argc, argv);
+        }
+    }
+    else
+    {
+        conn_write(conn, ret, strlen(ret));
+        conn_write(conn, "\n", 1);
+        // Writes that reply with more than Ok: APPEND and SETRANGE give the new length
+        if ((cmd == CMD_APPEND || cmd == CMD_SETRANGE) && strncmp(ret, "ERR", 3) != 0)
+        {
+            repl_propagate(conn->db, argc, argv);
+        }
+    }
+}
+
+/*
+ * SETBULK key len, followed by len bytes of value and a newline. The value skips the input buffer
+ * and is read straight into the buffer it is stored in: a KV_large_alloc block the table takes
+ * over when it is large. The connection's next commands wait for it. A value that cannot be taken
+ * is still read, and dropped.
+ */
+static void bulk_start(struct connection *conn, int argc, char *argv[])
+{
+    char *end = NULL;
+    unsigned long long len = argc == 3 ? strtoull(argv[2], &end, 10) : 0;
+    char *err = NULL;
+
+    if (end == NULL || end == argv[2] || *end != '\0')
+    {
+        // Without a length there is no telling where the value ends
+        KV_log(LL_VERBOSE, "SETBULK Error: Malformed length, closing connection");
+        conn_close(conn);
+        return;
+    }
+    if (len == 0 || len > BULK_MAX_LEN)
+    {
+        err = "ERR SETBULK length is out of range\n";
+    }
+    else if (repl_is_replica())
+    {
+        err = "ERR READONLY You can't write against a replica\n";
+    }
+    else if ((conn->bulk = KV_large_alloc(argv[1], strlen(argv[1]), len + 1)) != NULL)
+    {
+        conn->bulk_val = &conn->bulk[strlen(argv[1])];
+    }
+    else if (errno == EINVAL && (conn->bulk = malloc(len + 1)) != NULL)
+    {
+        conn->bulk_val = conn->bulk;
+        conn->bulk_val[len] = '\0';
+    }
+    if (err == NULL && (conn->bulk == NULL || (conn->bulk_key = strdup(argv[1])) == NULL))
+    {
+        err = "ERR SETBULK out of memory\n";
+    }
+    if (err)
+    {
+        conn_write(conn, err, strlen(err));
+    }
+    conn->bulk_got = 0;
+    conn->bulk_left = len > BULK_MAX_LEN ? 0 : len;
+}
+
+static void bulk_done(struct connection *conn)
+{
+    char *val = conn->bulk_val;
+    bool large = conn->bulk != conn->bulk_val;
+
+    if (conn->bulk == NULL || conn->bulk_key == NULL)
+    {
+        // Dropped, the error has been sent
+    }
+    // GET replies are lines, and replicas get the value in a SET line
+    else if (strcspn(val, " \n\r") != conn->bulk_got)
+    {
+        char *ret = "ERR SETBULK value may not hold spaces, newlines or NUL\n";
+        conn_write(conn, ret, strlen(ret));
+    }
+    else
+    {
+        char *argv[] = {"SET", conn->bulk_key, val, NULL};
+        char *block = large ? conn->bulk : NULL;
+        char *ret = large ? process_cmd_large(server_dbs[conn->db], 3, argv, &block, NULL) : process_cmd(server_dbs[conn->db], 3, argv);
+        // The table owns the block now, or has released it
+        conn->bulk = large ? NULL : conn->bulk;
+        reply_cmd(conn, CMD_SET, 3, argv, ret ? ret : "ERR SETBULK failed");
+    }
+
+    if (conn->bulk && large)
+    {
+        KV_large_release(conn->bulk);
+    }
+    else
+    {
+        free(conn->bulk);
+    }
+    free(conn->bulk_key);
+    conn->bulk = conn->bulk_val = conn->bulk_key = NULL;
+    conn->resume = true;
+}
+
+// len more bytes of the value have been read to bulk_val
+static void bulk_received(struct connection *conn, size_t len)
+{
+    conn->bulk_got += len;
+    conn->bulk_left -= len;
+    if (conn->bulk_left == 0)
+    {
+        bulk_done(conn);
+    }
+}
+
+// Value bytes that came in with other input. Returns how many of len were taken
+static size_t bulk_feed(struct connection *conn, const char *buf, size_t len)
+{
+    len = len < conn->bulk_left ? len : conn->bulk_left;
+    if (conn->bulk)
+    {
+        memcpy(&conn->bulk_val[conn->bulk_got], buf, len);
+    }
+    bulk_received(conn, len);
+    return len;
+}
+
+static void process_line(struct connection *conn, char *line, size_t len)
+{
+    int argc;
+    char **argv = parse_input(line, len, &argc);
+    if (argc == 0)
+    {
+        free_input_buffer(argv);
+        return;
+    }
+
+    KV_CMD cmd = parse_cmd(argv[0], strlen(argv[0]));
+    if (cmd == CMD_PSYNC)
+    {
+        repl_psync(conn, argc, argv);
+    }
+    else if (cmd == CMD_ROLE)
+    {
+        char *role = repl_role();
+        conn_write(conn, role, strlen(role));
+        conn_write(conn, "\n", 1);
+    }
+    else if (cmd == CMD_SHM)
+    {
+        shm_cmd(conn, argc, argv);
+    }
+    else if (cmd == CMD_TRACKING)
+    {
+        tracking_cmd(conn, argc, argv);
+    }
+    else if (cmd == CMD_SETBULK)
+    {
+        bulk_start(conn, argc, argv);
+    }
+    else if (cmd == CMD_CONFIG)
+    {
+        config_cmd(conn, argc, argv);
+    }
+    else if (cmd == CMD_SELECT)
+    {
+        char *end = NULL;
+        long db = argc > 1 ? strtol(argv[1], &end, 10) : -1;
+        if (end == NULL || *end != '\0' || server_db(db) == NULL)
+        {
+            char *ret = "ERR DB index is out of range\n";
+            conn_write(conn, ret, strlen(ret));
+        }
+        else
+        {
+            conn->db = db;
+            conn_write(conn, "Ok\n", 3);
+        }
+    }
+    else if (is_write_cmd(cmd) && repl_is_replica())
+    {
+        char *ret = "ERR READONLY You can't write against a replica\n";
+        conn_write(conn, ret, strlen(ret));
+    }
+    else if (cmd == CMD_GET || cmd == CMD_GETRANGE || cmd == CMD_GETS)
+    {
+        char *block = NULL;
+        int val_len = 0;
+        char *ret = process_cmd_large(server_dbs[conn->db], argc, argv, &block, &val_len);
+        if (argc > 1 && conn->tracking)
+        {
+            tracking_read(conn, argv[1]);
+        }
 
-size_t strlen0(char *buf)
-{
-    size_t len = 0;
-    while (*buf != '\0')
+        if (cmd == CMD_GETS && ret)
+        {
+            char version[24];
+            int n = snprintf(version, sizeof(version), "%lu ", KV_version(server_dbs[conn->db], argv[1], strlen(argv[1])));
+            conn_write(conn, version, n);
+        }
+
+        if (block)
+        {
+            stream_start(conn, block, ret, val_len - 1);
+        }
+        else if (ret)
+        {
+            conn_write(conn, ret, val_len - 1);
+            conn_write(conn, "\n", 1);
+        }
+        else
+        {
+            reply_cmd(conn, cmd, argc, argv, NULL);
+        }
+    }
+    else
     {
-        buf++;
-        len++;
+        reply_cmd(conn, cmd, argc, argv, process_cmd(server_dbs[conn->db], argc, argv));
     }
-    return len;
+    free_input_buffer(argv);
 }
 
-void free_input_buffer(char **input_buf)
+// Handle every complete line in the input buffer and keep the partial tail for the next read
+static void conn_process(struct connection *conn)
 {
-    for (size_t i = 0; i < 3; i++)
+    size_t off = 0;
+    char *nl;
+
+    // Commands wait while a large value is read in or sent out
+    while (!conn->closing && conn->stream == NULL)
     {
-        free(input_buf[i]);
+        if (conn->bulk_left)
+        {
+            if (off == conn->rlen)
+            {
+                break;
+            }
+            off += bulk_feed(conn, &conn->rbuf[off], conn->rlen - off);
+            continue;
+        }
+        // A long line coming in over many reads is not searched from its start again on each of them
+        size_t from = off == 0 ? conn->rscan : 0;
+        if ((nl = memchr(&conn->rbuf[off + from], '\n', conn->rlen - off - from)) == NULL)
+        {
+            conn->rscan = conn->rlen - off;
+            break;
+        }
+        conn->rscan = 0;
+        size_t len = nl - &conn->rbuf[off] + 1;
+        if (conn->type == CONN_PRIMARY)
+        {
+            repl_feed_line(conn, &conn->rbuf[off], len);
+        }
+        else
+        {
+            process_line(conn, &conn->rbuf[off], len);
+        }
+        off += len;
     }
 
-    free(input_buf);
+    if (off > 0)
+    {
+        memmove(conn->rbuf, &conn->rbuf[off], conn->rlen - off);
+        conn->rlen -= off;
+    }
 }
 
-static void sigint_handler(int sig)
+static int rbuf_reserve(struct connection *conn, size_t len)
 {
-    if (write(STDERR_FILENO, "SIGINT\nCleaning up....\n", 23) == -1)
+    if (conn->rcap - conn->rlen >= len)
     {
-        fprintf(stderr, "write error");
+        return 0;
     }
-    KV_destroy();
-    exit(EXIT_FAILURE);
+
+    size_t cap = conn->rcap ? conn->rcap * 2 : server_config.io_buffer_size;
+    while (cap - conn->rlen < len)
+    {
+        cap *= 2;
+    }
+    char *rbuf = realloc(conn->rbuf, cap);
+    if (rbuf == NULL)
+    {
+        perror("rbuf_reserve: Unable to grow input buffer");
+        conn_close(conn);
+        return -1;
+    }
+    conn->rbuf = rbuf;
+    conn->rcap = cap;
+    return 0;
 }
 
-char **parse_input(char *str, size_t len)
+// Input received by a completion based backend
+int conn_feed(struct connection *conn, const char *buf, size_t len)
 {
-    char **buf = malloc(sizeof(char *) * 3);
-    if (buf == NULL)
+    // On shared memory the socket only carries wakeups
+    if (conn->shm)
     {
-        perror("failed malloc");
-        exit(EXIT_FAILURE);
+        return 0;
     }
-    memset(buf, 0, sizeof(char *) * 3);
-    size_t i = 0;
-    size_t off = 0;
-    size_t j = 0;
-    char *start = str;
-    while (*str == ' ')
+    if (rbuf_reserve(conn, len) < 0)
     {
-        i++;
-        str++;
+        return -1;
     }
+    memcpy(&conn->rbuf[conn->rlen], buf, len);
+    conn->rlen += len;
+    conn_process(conn);
+    return 0;
+}
 
-    while (i < len)
+static void conn_read(struct connection *conn)
+{
+    char wakeups[64];
+
+    while (!conn->closing)
+    {
+        if (rbuf_reserve(conn, server_config.io_buffer_size) < 0)
+        {
+            return;
+        }
+
+        // On shared memory the socket only carries wakeups, which are dropped. A SETBULK value is
+        // read straight to where it is stored once the input before it is used up
+        bool to_bulk = !conn->shm && conn->bulk && conn->bulk_left && conn->rlen == 0;
+        char *buf = conn->shm ? wakeups : to_bulk ? &conn->bulk_val[conn->bulk_got] : &conn->rbuf[conn->rlen];
+        size_t len = conn->shm ? sizeof(wakeups) : to_bulk ? conn->bulk_left : conn->rcap - conn->rlen;
+        ssize_t nr_read = read(conn->fd, buf, len);
+        if (nr_read > 0 && conn->shm)
+        {
+            continue;
+        }
+        if (nr_read > 0 && to_bulk)
+        {
+            bulk_received(conn, nr_read);
+            continue;
+        }
+        if (nr_read > 0)
+        {
+            conn->rlen += nr_read;
+            conn_process(conn);
+            continue;
+        }
+        if (nr_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nr_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        conn_close(conn);
+    }
+}
+
+static void accept_connections(int server_fd)
+{
+    while (1)
     {
-        if (*str == ' ')
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd == -1)
         {
-            buf[j] = realloc(buf[j], (i - off) + 1);
-            if (buf[j] == NULL)
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
             {
-                free(buf);
-                perror("failed realloc");
-                exit(EXIT_FAILURE);
+                KV_log(LL_WARNING, "accept: %s", strerror(errno));
             }
-            memcpy(buf[j], (char *)&start[off], i - off);
-            buf[j][i - off] = '\0';
-            off = i;
-            j++;
+            return;
+        }
+
+        if (conn_create(client_fd, CONN_CLIENT) == NULL)
+        {
+            close(client_fd);
+        }
+    }
+}
+
+// Flush pending output and release closed connections before blocking for events again
+static void conn_output(struct connection *conn)
+{
+    if (conn->closing || (conn->woff == conn->wlen && conn->stream == NULL))
+    {
+        return;
+    }
+    if (conn->shm_ready)
+    {
+        shm_flush(conn);
+    }
+    else if (use_uring)
+    {
+        if (conn->stream && conn->woff == conn->wlen)
+        {
+            stream_refill(conn);
+        }
+        uring_flush(conn);
+    }
+    else
+    {
+        conn_flush(conn);
+    }
+}
+
+static void before_sleep(void)
+{
+    struct connection *conn = connections;
+    while (conn)
+    {
+        struct connection *next = conn->next;
+        conn_output(conn);
+        // Commands held up behind a large value, which may hold up the rest in turn
+        while (conn->resume && !conn->closing && conn->stream == NULL && conn->bulk_left == 0)
+        {
+            conn->resume = false;
+            conn_process(conn);
+            conn_output(conn);
+        }
+        // Output queued before SHM was answered, the Ok included, leaves through the socket
+        if (conn->shm && !conn->shm_ready && conn->woff == conn->wlen && conn->stream == NULL)
+        {
+            conn->shm_ready = true;
+        }
+        if (conn->closing && conn->inflight == 0)
+        {
+            conn_free(conn);
+        }
+        conn = next;
+    }
+}
+
+// Move requests from the shared memory rings into the input buffers and run them
+static void shm_poll(void)
+{
+    shm_worked = false;
+    if (nr_shm_conns == 0)
+    {
+        return;
+    }
+
+    for (struct connection *conn = connections; conn; conn = conn->next)
+    {
+        if (conn->shm == NULL || conn->closing)
+        {
+            continue;
+        }
+
+        struct shm_header *hdr = conn->shm->hdr;
+        if (hdr->req.consumer_waiting)
+        {
+            shm_set_waiting(&hdr->req.consumer_waiting, false);
+        }
+        int64_t queued = shm_ring_readable(&hdr->req, hdr->ring_size);
+        if (queued < 0)
+        {
+            KV_log(LL_VERBOSE, "shm_poll: Request ring is corrupt, closing connection");
+            conn_close(conn);
+            continue;
+        }
+        if (queued == 0)
+        {
+            continue;
+        }
+
+        // A SETBULK value goes straight to where it is stored once the input before it is used up
+        if (conn->bulk && conn->bulk_left && conn->rlen == 0)
+        {
+            size_t len = (size_t)queued < conn->bulk_left ? (size_t)queued : conn->bulk_left;
+            len = shm_ring_read(&hdr->req, conn->shm->req_data, hdr->ring_size, &conn->bulk_val[conn->bulk_got], len);
+            queued -= len;
+            bulk_received(conn, len);
+        }
+        if (queued && rbuf_reserve(conn, queued) == 0)
+        {
+            conn->rlen += shm_ring_read(&hdr->req, conn->shm->req_data, hdr->ring_size, &conn->rbuf[conn->rlen], queued);
         }
-        else if (*str == '\n')
+        if (shm_producer_waiting(&hdr->req))
         {
-            buf[j] = realloc(buf[j], (i - off) + 1);
-            if (buf[j] == NULL)
+            shm_wake_client(hdr);
+        }
+        shm_worked = true;
+        conn_process(conn);
+    }
+}
+
+/*
+ * Whether the event loop may block. Shared memory clients do not make the socket readable, so while
+ * any of them had traffic in the last SHM_SPIN_US the loop keeps polling; after that the clients are
+ * told to ring the socket, and the rings checked once more so a request that raced in is not missed.
+ */
+bool server_can_sleep(void)
+{
+    // A replica has taken the last snapshot chunk and the next one is produced in server_tick
+    if (repl_snapshot_ready())
+    {
+        return false;
+    }
+    if (nr_shm_conns == 0)
+    {
+        return true;
+    }
+
+    uint64_t now = KV_now_ns();
+    if (shm_worked)
+    {
+        shm_active_ns = now;
+    }
+    if (now - shm_active_ns < SHM_SPIN_US * 1000UL)
+    {
+        if (!shm_worked)
+        {
+            // Let a client sharing the CPU run
+            sched_yield();
+        }
+        return false;
+    }
+
+    for (struct connection *conn = connections; conn; conn = conn->next)
+    {
+        if (conn->shm_ready && !conn->closing)
+        {
+            struct shm_header *hdr = conn->shm->hdr;
+            shm_set_waiting(&hdr->req.consumer_waiting, true);
+            if (shm_ring_readable(&hdr->req, hdr->ring_size) != 0)
             {
-                free(buf);
-                perror("failed realloc");
-                exit(EXIT_FAILURE);
+                return false;
             }
+        }
+    }
+    return true;
+}
 
-            memcpy(buf[j], (char *)&start[off], i - off);
-            buf[j][i - off] = '\0';
-            off = i;
-            j++;
+void server_tick(void)
+{
+    static uint64_t last_cron = 0;
+
+    uint64_t now = now_ms();
+    if (now - last_cron >= CRON_INTERVAL_MS)
+    {
+        repl_cron();
+        for (int i = 0; i < nr_dbs; i++)
+        {
+            KV_cron(server_dbs[i]);
         }
+        last_cron = now;
+    }
+    shm_poll();
+    repl_snapshot_step();
+    before_sleep();
+}
+
+static void unix_socket_cleanup(void)
+{
+    if (unix_path)
+    {
+        unlink(unix_path);
+    }
+}
+
+static int unix_socket_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
 
-        i++;
-        str++;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "--unixsocket path is too long\n");
+        return -1;
     }
-    return buf;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by a previous run would make bind fail; anything else at the path is kept
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1 || set_nonblocking(fd) == -1)
+    {
+        perror("unix socket");
+        close(fd);
+        return -1;
+    }
+    unix_path = path;
+    atexit(unix_socket_cleanup);
+    return fd;
 }
 
 void serve(int argc, char *argv[])
@@ -108,19 +1114,11 @@ void serve(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (MIN_ENTRY_NUM && CHECK_POWER_OF_2(MIN_ENTRY_NUM) != 0)
-    {
-        fprintf(stderr, "ERROR: Hmap size must be a power of two\n");
-        exit(EXIT_FAILURE);
-    }
-
-    char buf[BUFFSZ];
-    int server_fd, client_fd;
-    size_t nr_read;
+    int server_fd;
     int enable = 1;
-    socklen_t client_len;
     struct protoent *proto;
-    struct sockaddr_in server_sock, client_sock;
+    struct sockaddr_in server_sock;
+    struct epoll_event events[MAX_EVENTS];
     unsigned short server_port = strtol(argv[2], NULL, 10);
 
     proto = getprotobyname("tcp");
@@ -153,72 +1151,189 @@ void serve(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) == -1)
+    if (listen(server_fd, SOMAXCONN) == -1)
     {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
-    if (signal(SIGINT, sigint_handler) == SIG_ERR)
+    // Port 0 lets the kernel pick one, so log the port actually bound
+    socklen_t sock_len = sizeof(server_sock);
+    if (getsockname(server_fd, (struct sockaddr *)&server_sock, &sock_len) == -1)
     {
+        perror("getsockname");
         exit(EXIT_FAILURE);
     }
+    server_port = ntohs(server_sock.sin_port);
 
-    printf("SiKV InMemory Database Server\nListening for connections on port %d\n", PORT);
-    struct hash_map *hmap = KV_init(MIN_ENTRY_NUM, KV_hash_function, KV_STRING, false);
+    if (set_nonblocking(server_fd) == -1)
+    {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
 
-    while (1)
+    // Without SA_RESTART, so a blocked epoll_wait returns and sees the flag
+    struct sigaction sa = {.sa_handler = sigint_handler};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Peers going away are handled where write fails
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    config_init(argc, argv);
+    if (server_config.unixsocket)
     {
-        client_len = sizeof(struct sockaddr_in);
-        client_fd = accept(server_fd, (struct sockaddr *)&client_sock, &client_len);
+        unix_fd = unix_socket_listen(server_config.unixsocket);
+        if (unix_fd == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (KV_log_init(server_config.logfile) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    KV_log(LL_NOTICE, "SiKV InMemory Database Server");
+    KV_log(LL_NOTICE, "Listening for connections on port %d", server_port);
+    nr_dbs = server_config.databases;
+    server_dbs = (struct hash_map **)malloc(nr_dbs * sizeof(struct hash_map *));
+    if (server_dbs == NULL)
+    {
+        perror("serve: Unable to allocate keyspaces");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nr_dbs; i++)
+    {
+        server_dbs[i] = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+        if (server_dbs[i] == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+        // The limit applies to each keyspace; MEMORY LIMIT changes it for one
+        KV_set_max_memory(server_dbs[i], server_config.maxmemory);
+    }
+    tracking_init();
+    repl_init();
+
+    // Before the ordered index is built, which would have every key go through the serial path
+    if (server_config.load)
+    {
+        uint64_t start = KV_now_ns();
+        int64_t loaded = KV_load_file(server_dbs[0], server_config.load, server_config.load_threads);
+        if (loaded < 0)
+        {
+            fprintf(stderr, "Unable to load %s\n", server_config.load);
+            exit(EXIT_FAILURE);
+        }
+        KV_log(LL_NOTICE, "Loaded %ld records from %s in %.2fs", loaded, server_config.load, (KV_now_ns() - start) / 1e9);
+    }
+
+    if (server_config.io_uring)
+    {
+        use_uring = uring_init(server_fd) == 0;
+        if (use_uring && unix_fd != -1 && uring_listen(unix_fd) < 0)
+        {
+            fprintf(stderr, "Unable to accept on the unix socket\n");
+            exit(EXIT_FAILURE);
+        }
+        KV_log(LL_NOTICE, "Network backend: %s", use_uring ? "io_uring" : "epoll (io_uring not supported)");
+    }
+
+    if (!use_uring)
+    {
+        epfd = epoll_create1(0);
+        if (epfd == -1)
+        {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
 
-        while ((nr_read = read(client_fd, buf, BUFFSZ)) > 0)
+        ev.data.ptr = &unix_listener;
+        if (unix_fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, unix_fd, &ev) == -1)
         {
-            if (buf[nr_read - 1] == '\n')
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int db = 0; db < nr_dbs; db++)
+    {
+        if (server_config.ordered_index && KV_index_enable(server_dbs[db]) < 0)
+        {
+            fprintf(stderr, "Unable to enable ordered index\n");
+            exit(EXIT_FAILURE);
+        }
+        KV_set_active_defrag(server_dbs[db], server_config.active_defrag);
+    }
+    if (server_config.replicaof_host)
+    {
+        repl_set_primary(server_config.replicaof_host, server_config.replicaof_port);
+    }
+
+    if (use_uring)
+    {
+        uring_run();
+        server_shutdown();
+        return;
+    }
+
+    while (!stopping)
+    {
+        int nr_events = epoll_wait(epfd, events, MAX_EVENTS, server_can_sleep() ? CRON_INTERVAL_MS : 0);
+        if (nr_events == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nr_events; i++)
+        {
+            struct connection *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                accept_connections(server_fd);
+                continue;
+            }
+            if ((void *)conn == &unix_listener)
+            {
+                accept_connections(unix_fd);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                conn_read(conn);
+            }
+            if ((events[i].events & EPOLLOUT) && !conn->closing)
             {
-                char **input_buf = parse_input(buf, nr_read);
-                char *ret = process_cmd(hmap, sizeof(input_buf), input_buf);
-
-                if (ret == NULL)
-                {
-                    ret = "GET Not found\n";
-                    printf("%s\n", ret);
-                    if (write(client_fd, ret, strlen(ret)) == -1)
-                    {
-                        fprintf(stderr, "write error");
-                    }
-                }
-                else if (ret == SUCCESS)
-                {
-                    ret = "Ok\n";
-                    printf("%s\n", ret);
-                    if (write(client_fd, ret, strlen(ret)) == -1)
-                    {
-                        fprintf(stderr, "write error");
-                    }
-                }
-                else
-                {
-                    size_t n = strlen(ret);
-                    char *temp = malloc(n + 1);
-                    if (temp == NULL)
-                    {
-                        perror("malloc");
-                    }
-
-                    memcpy(temp, ret, n);
-                    temp[n] = '\n';
-                    if (write(client_fd, temp, n + 1) == -1)
-                    {
-                        fprintf(stderr, "write error");
-                    }
-                    free(temp);
-                }
-
-                free_input_buffer(input_buf);
+                conn_flush(conn);
             }
         }
-        close(client_fd);
+
+        server_tick();
     }
-    KV_destroy();
+    server_shutdown();
+}
+
+int main(int argc, char *argv[])
+{
+
+    serve(argc, argv); // We should never return
+
+    return 0;
 }
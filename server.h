@@ -0,0 +1,145 @@
+#ifndef _SIKV_SERVER_
+#define _SIKV_SERVER_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sikv.h"
+
+struct shm_seg;
+
+#define MAX_EVENTS 64
+#define CRON_INTERVAL_MS 100
+#define REPL_ID_LEN 16
+#define REPL_BACKLOG_SIZE (1024 * 1024)       // bytes of mutation stream kept for partial resync
+#define REPL_OUTPUT_LIMIT (64 * 1024 * 1024)  // drop replicas that fall further behind than this
+#define REPL_RECONNECT_MS 1000
+#define REPL_HANDSHAKE_MS 5000                // give up on a primary that has not answered PSYNC by then
+#define REPL_SNAPSHOT_CHUNK (1024 * 1024)     // snapshot bytes queued for a replica before waiting for them to leave
+#define REPL_SNAPSHOT_SCAN 64                 // keys per KV_scan call while producing a chunk
+#define DEFAULT_DATABASES 16
+#define STREAM_CHUNK (256 * 1024)            // bytes of a large reply copied out at a time where it cannot be sent from the value
+#define BULK_MAX_LEN (512UL * 1024 * 1024)   // largest SETBULK value
+#define IO_BUFFER_MIN 128
+#define IO_BUFFER_MAX (64UL * 1024 * 1024)
+
+typedef enum
+{
+    CONN_CLIENT,
+    CONN_REPLICA, // a replica streaming from us
+    CONN_PRIMARY  // our link to the primary when running as a replica
+} conn_type;
+
+// Settings serve applies at startup, from config.c. Engine wide ones are kept by the engine
+struct server_config
+{
+    int databases;
+    uint64_t maxmemory;      // per keyspace; 0 is no limit
+    uint64_t io_buffer_size; // first size of a connection's buffers, and the most read at once
+    int load_threads;
+    bool io_uring;
+    bool ordered_index;
+    bool active_defrag;
+    char *logfile;
+    char *unixsocket;
+    char *load;
+    char *replicaof_host;
+    unsigned short replicaof_port;
+};
+
+struct connection
+{
+    int fd;
+    conn_type type;
+    int db; // keyspace selected with SELECT
+    bool closing;
+    bool want_write; // EPOLLOUT is armed
+    char *rbuf;
+    size_t rlen;
+    size_t rcap;
+    size_t rscan; // input before this, the start of a line, holds no newline
+    char *wbuf;
+    size_t wlen;
+    size_t woff;
+    size_t wcap;
+    // Output queued while a large reply is going out, which follows it
+    char *hbuf;
+    size_t hlen;
+    size_t hcap;
+    // Large values. Both hold up the connection's later commands until they are done
+    char *bulk;             // SETBULK value being read, into a KV_large_alloc block when large; see bulk_start
+    char *bulk_val;         // where the value starts in bulk
+    char *bulk_key;
+    size_t bulk_got;
+    size_t bulk_left;       // value bytes still to come; they are skipped when bulk is NULL
+    char *stream;           // GET reply being sent from the value, a reference from KV_get_ref; see stream_start
+    const char *stream_pos;
+    size_t stream_left;
+    bool resume;            // the large value is done with, run the commands held up behind it
+    // io_uring backend: output handed to the kernel, which must not move until the send completes
+    char *sbuf;
+    size_t slen;
+    size_t soff;
+    size_t scap;
+    bool send_inflight;
+    int inflight; // submitted operations still referencing the connection
+    // Shared memory transport, see shm.c: requests and replies go through the rings once shm_ready
+    struct shm_seg *shm;
+    bool shm_ready; // set once the reply to SHM has left through the socket
+    // Client side caching, see tracking.c
+    uint64_t id;
+    bool tracking;
+    bool tracking_bcast;
+    char **prefixes;
+    int nr_prefixes;
+    struct connection *prev;
+    struct connection *next;
+};
+
+// server.c
+struct connection *conn_create(int fd, conn_type type);
+int conn_write(struct connection *conn, const char *buf, size_t len);
+int conn_feed(struct connection *conn, const char *buf, size_t len);
+void conn_close(struct connection *conn);
+void server_tick(void);
+bool server_can_sleep(void);
+bool server_stopping(void);
+struct hash_map *server_db(int db);
+int server_nr_dbs(void);
+char **parse_input(char *str, size_t len, int *argc);
+void free_input_buffer(char **input_buf);
+
+// uring.c
+int uring_init(int server_fd);
+int uring_listen(int fd);
+void uring_conn_add(struct connection *conn);
+void uring_conn_close(struct connection *conn);
+void uring_flush(struct connection *conn);
+void uring_run(void);
+
+// replication.c
+void repl_init(void);
+void repl_set_primary(const char *host, unsigned short port);
+bool repl_is_replica(void);
+void repl_propagate(int db, int argc, char *argv[]);
+void repl_psync(struct connection *conn, int argc, char *argv[]);
+void repl_feed_line(struct connection *conn, char *line, size_t len);
+void repl_conn_closed(struct connection *conn);
+void repl_cron(void);
+void repl_snapshot_step(void);
+bool repl_snapshot_ready(void);
+char *repl_role(void);
+
+// config.c
+extern struct server_config server_config;
+void config_init(int argc, char *argv[]);
+void config_cmd(struct connection *conn, int argc, char *argv[]);
+
+// tracking.c
+void tracking_init(void);
+void tracking_cmd(struct connection *conn, int argc, char *argv[]);
+void tracking_read(struct connection *conn, const char *key);
+void tracking_conn_closed(struct connection *conn);
+
+#endif // _SIKV_SERVER_
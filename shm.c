@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "shm.h"
+
+/*
+ * Shared memory transport for clients on the same host.
+ *
+ * The client creates a POSIX shared memory segment holding two rings, one per direction, and names
+ * it to the server with `SHM <name>` over a unix socket connection. Once the server has mapped it
+ * and answered Ok, the client unlinks the name and both sides exchange the usual command lines and
+ * replies through the rings instead of the socket.
+ *
+ * While there is traffic neither side makes a syscall to move data: the server polls the request
+ * rings from its event loop and the client polls the response ring. A side that finds its ring idle
+ * for SHM_SPIN_US sets its waiting flag and sleeps; the other side checks the flag after publishing
+ * and wakes it. The client sleeps on the client_wake futex in the header, whether it waits for
+ * replies or for room to send, and anything that wakes it bumps the word first; that lets a
+ * multithreaded client wake its own I/O thread the same way. The server sleeps in its event loop,
+ * so the client wakes it by writing a single newline (an empty command) to the socket. Setting the
+ * flag and re-checking the ring on one side, and publishing and checking the flag on the other, are
+ * ordered by full fences so a wakeup cannot be missed.
+ */
+
+static uint64_t shm_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Not FUTEX_PRIVATE_FLAG: the waiter and the waker are different processes
+static int futex_wait(uint32_t *addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+void shm_wake_client(struct shm_header *hdr)
+{
+    __atomic_add_fetch(&hdr->client_wake, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &hdr->client_wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void shm_set_waiting(uint32_t *flag, bool waiting)
+{
+    __atomic_store_n(flag, waiting, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Called by the producer after publishing
+bool shm_consumer_waiting(struct shm_ring *ring)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED);
+}
+
+// Called by the consumer after making room
+bool shm_producer_waiting(struct shm_ring *ring)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->producer_waiting, __ATOMIC_RELAXED);
+}
+
+// Bytes queued, or -1 when the positions make no sense (the other side is broken)
+int64_t shm_ring_readable(struct shm_ring *ring, uint32_t size)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t queued = tail - ring->head;
+    return queued <= size ? queued : -1;
+}
+
+size_t shm_ring_read(struct shm_ring *ring, const char *data, uint32_t size, char *buf, size_t len)
+{
+    int64_t queued = shm_ring_readable(ring, size);
+    if (queued <= 0)
+    {
+        return 0;
+    }
+
+    uint32_t n = queued < len ? queued : len;
+    uint32_t off = ring->head & (size - 1);
+    uint32_t first = size - off < n ? size - off : n;
+    memcpy(buf, &data[off], first);
+    memcpy(&buf[first], data, n - first);
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+size_t shm_ring_write(struct shm_ring *ring, char *data, uint32_t size, const char *buf, size_t len)
+{
+    uint32_t used = ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (used >= size)
+    {
+        return 0;
+    }
+
+    uint32_t n = size - used < len ? size - used : len;
+    uint32_t off = ring->tail & (size - 1);
+    uint32_t first = size - off < n ? size - off : n;
+    memcpy(&data[off], buf, first);
+    memcpy(data, &buf[first], n - first);
+    __atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+static struct shm_seg *seg_map(int fd, size_t len)
+{
+    struct shm_seg *seg = (struct shm_seg *)malloc(sizeof(struct shm_seg));
+    if (seg == NULL)
+    {
+        return NULL;
+    }
+
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        free(seg);
+        return NULL;
+    }
+    seg->hdr = (struct shm_header *)addr;
+    seg->map_len = len;
+    return seg;
+}
+
+static bool valid_ring_size(uint64_t size)
+{
+    return size >= SHM_MIN_RING_SIZE && size <= SHM_MAX_RING_SIZE && (size & (size - 1)) == 0;
+}
+
+static void seg_rings(struct shm_seg *seg)
+{
+    seg->req_data = (char *)seg->hdr + sizeof(struct shm_header);
+    seg->resp_data = seg->req_data + seg->hdr->ring_size;
+}
+
+// Map a segment created by a client. Only names the client side generates are accepted
+struct shm_seg *shm_attach(const char *name)
+{
+    struct stat st;
+
+    if (strncmp(name, "/sikv-", 6) != 0 || strlen(name) >= SHM_NAME_LEN || strchr(&name[1], '/') != NULL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct shm_header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct shm_seg *seg = seg_map(fd, st.st_size);
+    close(fd);
+    if (seg == NULL)
+    {
+        return NULL;
+    }
+
+    uint32_t ring_size = seg->hdr->ring_size;
+    if (seg->hdr->magic != SHM_MAGIC || !valid_ring_size(ring_size) ||
+        st.st_size != sizeof(struct shm_header) + 2 * (uint64_t)ring_size)
+    {
+        shm_detach(seg);
+        errno = EINVAL;
+        return NULL;
+    }
+    seg_rings(seg);
+    return seg;
+}
+
+void shm_detach(struct shm_seg *seg)
+{
+    munmap(seg->hdr, seg->map_len);
+    free(seg);
+}
+
+// Wake a sleeping server; the empty line is ignored by the command parser
+static int doorbell(int fd)
+{
+    while (send(fd, "\n", 1, MSG_NOSIGNAL) == -1)
+    {
+        if (errno != EINTR && errno != EAGAIN)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The server never writes to the socket once the rings are in use, so readable means it has gone
+static bool server_gone(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+// Create a segment and switch the connection over to it. Returns NULL with errno set on failure
+struct shm_seg *shm_client_open(int fd, uint32_t ring_size)
+{
+    static uint32_t counter = 0;
+    char name[SHM_NAME_LEN];
+    char line[SHM_NAME_LEN + 8];
+    char reply[128];
+    size_t reply_len = 0;
+
+    if (!valid_ring_size(ring_size))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snprintf(name, sizeof(name), "/sikv-%d-%u-%lu", getpid(), counter++, shm_now_us());
+    int shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (shm_fd == -1)
+    {
+        return NULL;
+    }
+
+    size_t len = sizeof(struct shm_header) + 2 * (size_t)ring_size;
+    struct shm_seg *seg = NULL;
+    if (ftruncate(shm_fd, len) == 0)
+    {
+        seg = seg_map(shm_fd, len);
+    }
+    close(shm_fd);
+    if (seg == NULL)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+    seg->hdr->ring_size = ring_size;
+    seg->hdr->magic = SHM_MAGIC;
+    seg_rings(seg);
+
+    int n = snprintf(line, sizeof(line), "SHM %s\n", name);
+    bool ok = send(fd, line, n, MSG_NOSIGNAL) == n;
+    while (ok && (reply_len == 0 || reply[reply_len - 1] != '\n') && reply_len < sizeof(reply))
+    {
+        ssize_t nr_read = read(fd, &reply[reply_len], sizeof(reply) - reply_len);
+        if (nr_read <= 0 && !(nr_read == -1 && errno == EINTR))
+        {
+            ok = false;
+        }
+        reply_len += nr_read > 0 ? nr_read : 0;
+    }
+    // Mapped on both sides by now, or never will be
+    shm_unlink(name);
+
+    if (!ok || reply_len < 3 || memcmp(reply, "Ok\n", 3) != 0)
+    {
+        shm_detach(seg);
+        errno = EPROTO;
+        return NULL;
+    }
+    return seg;
+}
+
+// Queue as much of buf as fits without blocking. Returns the bytes queued, 0 when the ring is full
+ssize_t shm_client_send(struct shm_seg *seg, int fd, const char *buf, size_t len)
+{
+    struct shm_ring *ring = &seg->hdr->req;
+
+    size_t n = shm_ring_write(ring, seg->req_data, seg->hdr->ring_size, buf, len);
+    if (n && shm_consumer_waiting(ring) && doorbell(fd) < 0)
+    {
+        return -1;
+    }
+    return n;
+}
+
+// Take whatever reply bytes are queued without blocking. Returns 0 when there are none
+ssize_t shm_client_recv(struct shm_seg *seg, int fd, char *buf, size_t len)
+{
+    struct shm_ring *ring = &seg->hdr->resp;
+    uint32_t size = seg->hdr->ring_size;
+
+    int64_t queued = shm_ring_readable(ring, size);
+    if (queued < 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (queued == 0)
+    {
+        return 0;
+    }
+
+    size_t n = shm_ring_read(ring, seg->resp_data, size, buf, len);
+    if (shm_producer_waiting(ring) && doorbell(fd) < 0)
+    {
+        return -1;
+    }
+    return n;
+}
+
+// Read before checking for work, then pass to shm_client_sleep so a wakeup in between is not lost
+uint32_t shm_client_wake_seq(struct shm_seg *seg)
+{
+    return __atomic_load_n(&seg->hdr->client_wake, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Sleep until a reply is queued, or also until the request ring has room when want_space, or until
+ * someone calls shm_client_wake. Returns early if seq is already stale. Fails with EPIPE when the
+ * server has gone away.
+ */
+int shm_client_sleep(struct shm_seg *seg, int fd, uint32_t seq, bool want_space, int timeout_ms)
+{
+    struct shm_header *hdr = seg->hdr;
+    uint32_t size = hdr->ring_size;
+    int ret = 0;
+
+    shm_set_waiting(&hdr->resp.consumer_waiting, true);
+    if (want_space)
+    {
+        shm_set_waiting(&hdr->req.producer_waiting, true);
+    }
+
+    bool ready = shm_ring_readable(&hdr->resp, size) != 0 ||
+                 (want_space && hdr->req.tail - __atomic_load_n(&hdr->req.head, __ATOMIC_ACQUIRE) < size);
+    if (!ready && futex_wait(&hdr->client_wake, seq, timeout_ms) == -1 && errno == ETIMEDOUT && server_gone(fd))
+    {
+        errno = EPIPE;
+        ret = -1;
+    }
+
+    shm_set_waiting(&hdr->resp.consumer_waiting, false);
+    if (want_space)
+    {
+        shm_set_waiting(&hdr->req.producer_waiting, false);
+    }
+    return ret;
+}
+
+void shm_client_wake(struct shm_seg *seg)
+{
+    shm_wake_client(seg->hdr);
+}
+
+int shm_client_write(struct shm_seg *seg, int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        uint32_t seq = shm_client_wake_seq(seg);
+        ssize_t n = shm_client_send(seg, fd, buf, len);
+        if (n < 0)
+        {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+
+        // Full; wait for the server to make room
+        if (n == 0 && shm_client_sleep(seg, fd, seq, true, SHM_WAIT_MS) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Blocks until at least one byte of reply is available. Returns 0 when the server has gone away
+ssize_t shm_client_read(struct shm_seg *seg, int fd, char *buf, size_t len)
+{
+    uint64_t idle_since = 0;
+
+    while (1)
+    {
+        uint32_t seq = shm_client_wake_seq(seg);
+        ssize_t n = shm_client_recv(seg, fd, buf, len);
+        if (n != 0)
+        {
+            return n;
+        }
+
+        uint64_t now = shm_now_us();
+        if (idle_since == 0)
+        {
+            idle_since = now;
+        }
+        if (now - idle_since < SHM_SPIN_US)
+        {
+            // Give the CPU to the server in case both share one
+            sched_yield();
+            continue;
+        }
+
+        if (shm_client_sleep(seg, fd, seq, false, SHM_WAIT_MS) < 0)
+        {
+            return 0;
+        }
+    }
+}
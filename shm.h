@@ -0,0 +1,74 @@
+#ifndef _SIKV_SHM_
+#define _SIKV_SHM_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define SHM_MAGIC 0x314d4853564b6953ULL         // "SiKVSHM1"
+#define SHM_DEFAULT_RING_SIZE (1024 * 1024)     // bytes per direction, power of two
+#define SHM_MIN_RING_SIZE 4096
+#define SHM_MAX_RING_SIZE (64 * 1024 * 1024)
+#define SHM_NAME_LEN 64
+#define SHM_SPIN_US 50       // how long either side polls an idle ring before going to sleep
+#define SHM_WAIT_MS 100      // a sleeping client checks the server is still there this often
+
+/*
+ * Single producer, single consumer byte ring. head and tail are free running positions, so
+ * tail - head is the number of bytes queued. Each side writes only its own cache line; the waiting
+ * flags tell the other side that a wakeup is needed (see shm.c).
+ */
+struct shm_ring
+{
+    // Written by the consumer
+    uint32_t head;
+    uint32_t consumer_waiting;
+    char pad0[56];
+    // Written by the producer
+    uint32_t tail;
+    uint32_t producer_waiting;
+    char pad1[56];
+};
+
+// Start of the shared segment; the request ring's data and then the response ring's follow it
+struct shm_header
+{
+    uint64_t magic;
+    uint32_t ring_size;
+    uint32_t client_wake; // futex the client sleeps on, bumped by whoever wakes it
+    char pad[48];
+    struct shm_ring req;  // client to server
+    struct shm_ring resp; // server to client
+};
+
+struct shm_seg
+{
+    struct shm_header *hdr;
+    char *req_data;
+    char *resp_data;
+    size_t map_len;
+};
+
+// Server side
+struct shm_seg *shm_attach(const char *name);
+void shm_detach(struct shm_seg *seg);
+int64_t shm_ring_readable(struct shm_ring *ring, uint32_t size);
+size_t shm_ring_read(struct shm_ring *ring, const char *data, uint32_t size, char *buf, size_t len);
+size_t shm_ring_write(struct shm_ring *ring, char *data, uint32_t size, const char *buf, size_t len);
+bool shm_consumer_waiting(struct shm_ring *ring);
+bool shm_producer_waiting(struct shm_ring *ring);
+void shm_set_waiting(uint32_t *flag, bool waiting);
+void shm_wake_client(struct shm_header *hdr);
+
+// Client side; fd is the unix socket connection the segment is attached over
+struct shm_seg *shm_client_open(int fd, uint32_t ring_size);
+ssize_t shm_client_send(struct shm_seg *seg, int fd, const char *buf, size_t len);
+ssize_t shm_client_recv(struct shm_seg *seg, int fd, char *buf, size_t len);
+uint32_t shm_client_wake_seq(struct shm_seg *seg);
+int shm_client_sleep(struct shm_seg *seg, int fd, uint32_t seq, bool want_space, int timeout_ms);
+void shm_client_wake(struct shm_seg *seg);
+int shm_client_write(struct shm_seg *seg, int fd, const char *buf, size_t len);
+ssize_t shm_client_read(struct shm_seg *seg, int fd, char *buf, size_t len);
+
+#endif // _SIKV_SHM_
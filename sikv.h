@@ -5,19 +5,50 @@
 #include <stdbool.h>
 // #include <stdatomic.h>
 
-#define LOAD_FACTOR (float)0.85 // 0-100
-#define MAXIMUM_SIZE 1073741824UL // maximum limit of hashmap; default 1GB
+#define LOAD_FACTOR (float)0.85 // default, see KV_set_load_factor
+#define LOAD_FACTOR_MIN (float)0.1
+#define LOAD_FACTOR_MAX (float)0.95 // a table must always keep empty slots for probes to stop at
 // #define EMPTY (uint64_t)18446744073709551616
 #define EVICT 1
-#define RESIZE_POLICY 2
-#define EMPTY (int8_t)-1
+#define RESIZE_POLICY 2 // default growth factor, see KV_set_growth_factor
+#define GROWTH_FACTOR_MAX 16
+#define EMPTY (int8_t)-1 // fill byte of unused slots, which leaves key_len at -1
 #define TOMBSTONE NULL
 #define SUCCESS (void *)-1
 #define BUFFSZ 1024
 #define SIKV_VERBOSE 1
-#define MIN_ENTRY_NUM 4UL
+#define MIN_ENTRY_NUM 4UL // default and smallest initial capacity, see KV_set_initial_capacity
 #define CHECK_POWER_OF_2(num) ((num) & ((num) - 1L))
-#define USE_CUSTOM_ALLOC 1
+#ifndef USE_CUSTOM_ALLOC
+#define USE_CUSTOM_ALLOC 1 // the Makefile passes 0 unless built with USE_CUSTOM_ALLOC=yes
+#endif
+#define SCAN_DEFAULT_COUNT 10
+#define INDEX_DEFAULT_LIMIT 100
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define LATENCY_BUCKETS 40 // power of two nanosecond buckets, up to ~9 minutes
+#define SLOWLOG_LEN 128
+#define SLOWLOG_DEFAULT_THRESHOLD_US 10000
+#define SLOWLOG_CMD_LEN 16
+#define SLOWLOG_KEY_LEN 64
+#define LATENCY_REPORT_SIZE (BUFFSZ * 4)
+#define HTSTATS_BUCKETS 24 // power of two probe distance buckets
+#define HTSTATS_DEFAULT_SAMPLES (1UL << 20)
+#define SHRINK_LOAD_FACTOR (float)0.1     // live keys per slot below which the cron shrinks the table
+#define TOMBSTONE_LOAD_FACTOR (float)0.25 // tombstones per slot above which the cron compacts the table
+#define REBUILD_OP_STEP 16                // slots moved by each write during a rebuild
+#define REBUILD_CRON_STEP 1024            // slots moved between clock checks in KV_cron
+#define REBUILD_CRON_US 1000              // time KV_cron spends on a rebuild per call
+#define DEFRAG_THRESHOLD (float)1.5       // rss per byte of used memory above which a defrag pass starts
+#define DEFRAG_MIN_BYTES (64UL * 1024 * 1024) // and the least excess worth a pass
+#define DEFRAG_CHECK_MS 1000
+#define DEFRAG_CRON_STEP 256              // slots between clock checks
+#define DEFRAG_CRON_US 500                // time KV_cron spends defragmenting per call
+#define DEFRAG_CANDIDATES 16              // free blocks each moved value picks the lowest of
+#define DEFRAG_PAGE_SIZE 4096
+#define LARGE_VALUE_SIZE (64UL * 1024) // entries this large get a reference counted block of their own, freed by the lazy free thread on UNLINK
+#define LOAD_BATCH (1UL << 20)         // records KV_load_file hands to KV_load at a time
+#define LOAD_MIN_PER_THREAD 16384      // records below which another KV_load thread is not worth starting
+#define LOAD_MAGIC "SiKVLOAD"          // first bytes of a binary dump, see KV_load_file
 
 typedef enum
 {
@@ -25,6 +56,31 @@ typedef enum
     CMD_GET,
     CMD_PUT,
     CMD_DEL,
+    CMD_SCAN,
+    CMD_RANGE,
+    CMD_PREFIX,
+    CMD_PSYNC,
+    CMD_ROLE,
+    CMD_MEMORY,
+    CMD_LATENCY,
+    CMD_SLOWLOG,
+    CMD_DEBUG,
+    CMD_LOGLEVEL,
+    CMD_COMPACT,
+    CMD_UNLINK,
+    CMD_FLUSH,
+    CMD_SELECT,
+    CMD_SHM,
+    CMD_TRACKING,
+    CMD_SETBULK,
+    CMD_APPEND,
+    CMD_GETRANGE,
+    CMD_SETRANGE,
+    CMD_GETS,
+    CMD_CAS,
+    CMD_SETNX,
+    CMD_SETXX,
+    CMD_CONFIG,
     CMD_NOOP
 } KV_CMD;
 
@@ -38,13 +94,70 @@ typedef enum
     KV_STRING
 } KV_TYPE;
 
-typedef uint32_t (*hash_function)(const void *key, int len, int seed);
+typedef enum
+{
+    HUGEPAGE_OFF,
+    HUGEPAGE_MADVISE, // transparent huge pages
+    HUGEPAGE_ON       // explicit huge pages (MAP_HUGETLB), falling back to transparent huge pages
+} KV_HUGEPAGE_MODE;
+
+typedef enum
+{
+    DEFRAG_IDLE,
+    DEFRAG_SURVEY, // adding up live bytes per page
+    DEFRAG_MOVE    // moving values to fuller pages
+} KV_DEFRAG_PHASE;
+
+// Conditions for KV_set_if
+typedef enum
+{
+    KV_SET_NX,     // only if the key is missing
+    KV_SET_XX,     // only if the key exists
+    KV_SET_VERSION // only if the key exists at the given version
+} KV_SET_COND;
+
+typedef uint64_t (*hash_function)(const void *key, int len, int seed);
+typedef void (*KV_free_fn)(void *arg);
+typedef void (*KV_scan_fn)(void *arg, const char *key, int key_len, const char *val, int val_len);
+struct hash_map;
+// Called after a key is written or removed, with key NULL when the whole table is flushed
+typedef void (*KV_notify_fn)(void *arg, struct hash_map *hmap, const char *key, int key_len);
 
 struct KV
 {
     int32_t key_len;
     int32_t val_len;
     char *data;
+    uint64_t version; // see KV_version
+};
+
+struct skiplist;
+struct defrag_page;
+
+// Slot array health, from KV_table_stats
+struct KV_table_stats
+{
+    uint64_t capacity;
+    uint64_t scanned; // slots examined; less than capacity when sampled
+    uint64_t live;
+    uint64_t tombstones;
+    uint64_t empty;
+    uint64_t longest_cluster; // longest run of non empty slots, tombstones included
+    uint64_t max_probe;
+    uint64_t total_probe;
+    uint64_t probe_hist[HTSTATS_BUCKETS]; // bucket 0 counts keys in their home slot, bucket i distances in [2^(i-1), 2^i)
+    uint64_t rebuild_capacity;            // 0 when no rebuild is in progress
+    uint64_t rebuild_pos;
+    uint64_t rebuild_len;
+};
+
+// A key and value for KV_load; val_len does not count a '\0'
+struct KV_record
+{
+    const char *key;
+    const char *val;
+    int32_t key_len;
+    int32_t val_len;
 };
 
 struct KV_item_array
@@ -56,33 +169,127 @@ struct KV_item_array
 
 struct hash_map
 {
-    int size; // size of hash map in bytes
-    int len;
-    int capacity;
+    uint64_t size; // size of hash map in bytes
+    uint64_t len;  // used slots, tombstones included
+    uint64_t capacity;
+    uint64_t max_memory; // bytes; 0 is no limit
     int seed;
     KV_TYPE val_type;
 #if USE_CUSTOM_ALLOC
     char *pool;
 #endif
+    bool alloc_concurrent_access;
 #ifdef ALLOW_STATS
     uint64_t misses;
     uint64_t hits;
     uint64_t ref_count;
 #endif
     char *arr;
+    size_t arr_map_len; // non zero when arr is a page mapping from KV_page_alloc
+    struct skiplist *index; // optional ordered index over keys; NULL when disabled
+    uint64_t tombstones;    // of the len used slots in arr
+    // Incremental rebuild, see rebuild_start; rebuild_arr is NULL when none is in progress
+    char *rebuild_arr;
+    size_t rebuild_map_len;
+    uint64_t rebuild_capacity;
+    uint64_t rebuild_len;
+    uint64_t rebuild_tombstones;
+    uint64_t rebuild_pos; // next slot of arr to move
+    uint64_t rebuild_start_ns;
+    // Active defragmentation, see struct defrag_page
+    bool active_defrag;
+    KV_DEFRAG_PHASE defrag_phase;
+    uint64_t defrag_pos; // next slot of arr to visit
+    struct defrag_page *defrag_pages; // live bytes per page, from the survey
+    uint64_t defrag_pages_cap;
+    uint64_t defrag_pages_len;
+    uint64_t defrag_bytes; // live bytes found by the survey
+    uint64_t defrag_moved;
+    uint64_t defrag_checked_ns;
     struct KV_item_array item_arr;
     hash_function hash_fn;
+    KV_notify_fn notify; // see KV_set_notify
+    void *notify_arg;
+    uint64_t version; // last handed out to a write
+    struct hash_map *next; // list of every table, see KV_used_memory
 };
 
-struct hash_map *KV_init(unsigned long capacity, hash_function hash_fn, KV_TYPE val_type, bool alloc_concurrent_access);
+struct hash_map *KV_init(uint64_t capacity, hash_function hash_fn, KV_TYPE val_type, bool alloc_concurrent_access);
 int KV_set(struct hash_map *hmap, char *key, int key_len, char *val, int val_len);
 void *KV_get(struct hash_map *hmap, char *key, int key_len);
+void *KV_get_value(struct hash_map *hmap, char *key, int key_len, int *val_len);
+void *KV_get_ref(struct hash_map *hmap, char *key, int key_len, int *val_len, char **block);
+char *KV_large_alloc(char *key, int key_len, int val_len);
+int KV_set_large(struct hash_map *hmap, char *block);
+void KV_large_release(char *block);
+int64_t KV_append(struct hash_map *hmap, char *key, int key_len, const char *val, size_t len);
+int64_t KV_setrange(struct hash_map *hmap, char *key, int key_len, uint64_t offset, const char *val, size_t len);
+uint64_t KV_version(struct hash_map *hmap, char *key, int key_len);
+int KV_set_if(struct hash_map *hmap, char *key, int key_len, char *val, int val_len, KV_SET_COND cond, uint64_t version);
+int KV_reserve(struct hash_map *hmap, uint64_t nr_keys);
+uint64_t KV_load(struct hash_map *hmap, const struct KV_record *recs, uint64_t n, int nr_threads);
+int64_t KV_load_file(struct hash_map *hmap, const char *path, int nr_threads);
 int KV_delete(struct hash_map *hmap, char *key, int key_len);
+int KV_unlink(struct hash_map *hmap, char *key, int key_len);
+void KV_set_notify(struct hash_map *hmap, KV_notify_fn fn, void *arg);
 void KV_destroy();
+void KV_drop(struct hash_map *hmap);
+uint64_t KV_used_memory(void);
+int KV_index_enable(struct hash_map *hmap);
+int KV_range(struct hash_map *hmap, const char *start, int start_len, bool start_exclusive, const char *end, int end_len, bool end_exclusive, int limit, KV_scan_fn fn, void *arg);
+int KV_prefix(struct hash_map *hmap, const char *prefix, int prefix_len, const char *after, int after_len, int limit, KV_scan_fn fn, void *arg);
+uint64_t KV_scan(struct hash_map *hmap, uint64_t cursor, const char *pattern, int pattern_len, int count, KV_scan_fn fn, void *arg);
+void KV_clear(struct hash_map *hmap);
+int KV_flush(struct hash_map *hmap, bool async);
+KV_CMD parse_cmd(char *cmd, int len);
 void *process_cmd(struct hash_map *hmap, int argc, char *argv[]);
-uint32_t KV_hash_function(const void *key, int len, int seed);
+void *process_cmd_large(struct hash_map *hmap, int argc, char *argv[], char **block, int *val_len);
+uint64_t KV_hash_function(const void *key, int len, int seed);
+void KV_set_max_memory(struct hash_map *hmap, uint64_t bytes);
+int KV_set_initial_capacity(uint64_t capacity);
+uint64_t KV_initial_capacity(void);
+int KV_set_load_factor(float lf);
+float KV_load_factor(void);
+int KV_set_growth_factor(int factor);
+int KV_growth_factor(void);
 void serve(int argc, char *argv[]);
 struct hash_map *KV_hmap(bool alloc_concurrent_access);
 void set_hmap(struct hash_map *hmap);
+char *KV_memory_stats(struct hash_map *hmap);
+const char *KV_cmd_name(KV_CMD cmd);
+uint32_t KV_probes(void);
+int KV_table_stats(struct hash_map *hmap, uint64_t samples, struct KV_table_stats *stats);
+int KV_compact(struct hash_map *hmap);
+void KV_cron(struct hash_map *hmap);
+int KV_defrag(struct hash_map *hmap);
+void KV_set_active_defrag(struct hash_map *hmap, bool enable);
+
+// latency.c
+uint64_t KV_now_ns(void);
+void KV_latency_record(KV_CMD cmd, uint64_t ns);
+void KV_latency_reset(void);
+int KV_latency_report(char *buf, size_t len);
+void KV_slowlog_set_threshold(uint64_t us);
+uint64_t KV_slowlog_threshold(void);
+void KV_slowlog_record(const char *cmd, const char *key, size_t key_len, size_t val_len, uint32_t probes, uint64_t ns);
+void KV_slowlog_reset(void);
+uint64_t KV_slowlog_len(void);
+int KV_slowlog_report(char *buf, size_t len, int count);
+
+// lazyfree.c
+void KV_lazyfree(KV_free_fn fn, void *arg);
+uint64_t KV_lazyfree_pending(void);
+void KV_lazyfree_shutdown(void);
+
+// hugepage.c
+void KV_set_hugepage_mode(KV_HUGEPAGE_MODE mode);
+KV_HUGEPAGE_MODE KV_hugepage_mode(void);
+const char *KV_hugepage_mode_name(KV_HUGEPAGE_MODE mode);
+int KV_parse_hugepage_mode(const char *name, KV_HUGEPAGE_MODE *mode);
+void KV_page_advise(void *addr, size_t len);
+void *KV_page_alloc(size_t size, size_t *map_len);
+void KV_page_free(void *addr, size_t map_len);
+uint64_t KV_huge_backed(void *addr, size_t len);
+uint64_t KV_rss(void);
 
 #endif // _KV_DB_
\ No newline at end of file
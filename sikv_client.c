@@ -0,0 +1,1390 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sikv_client.h"
+#include "shm.h"
+
+/*
+ * Connection pool over the text protocol, see sikv_client.h.
+ *
+ * Each connection has an I/O thread and a queue. Senders append the encoded command to the queue
+ * and its callback to the FIFO of replies due, under the connection lock, and only wake the thread
+ * if it is asleep. Whenever its previous batch has gone out the thread takes the whole queue at
+ * once by swapping buffers, so commands that piled up meanwhile go out in a single write. Replies
+ * come back in command order, one line each, and are matched to the FIFO front to back; the read
+ * buffer grows as needed, so replies of any size are framed correctly.
+ *
+ * A socket connection sleeps in poll on the socket and an eventfd senders write. A shared memory
+ * connection spins on its rings for a while and then sleeps on the segment's client futex, which
+ * senders bump as well (see shm.c). When a connection drops, the replies due are failed and the
+ * thread reconnects in the background.
+ *
+ * With cache_keys set every connection turns on TRACKING (see tracking.c) and sikv_pool_get keeps
+ * what it reads in a sharded LRU cache. A GET result is cached by the I/O thread as its reply is
+ * dispatched and invalidations are applied as they are read, so on each connection they take effect
+ * in the order the server sent them. A dropped connection loses its invalidations, so the whole
+ * cache is cleared with it.
+ */
+
+#define CLIENT_DEFAULT_CONNECTIONS 4
+#define CLIENT_MAX_QUEUED (16 * 1024 * 1024) // senders wait for the I/O thread past this
+#define CLIENT_READ_SIZE (16 * 1024)
+#define CLIENT_RECONNECT_MS 1000
+#define CLIENT_BULK_SIZE (64 * 1024) // SET values this large are sent with SETBULK
+#define CACHE_SHARDS 16
+#define GET_NOT_FOUND "GET Not found"
+
+struct cache_entry
+{
+    struct cache_entry *next; // in the bucket
+    struct cache_entry *lru_prev, *lru_next;
+    uint64_t hash;
+    bool missing; // the key does not exist
+    size_t key_len, val_len;
+    char data[]; // key then value, '\0' terminated
+};
+
+struct cache_shard
+{
+    pthread_mutex_t lock;
+    struct cache_entry **buckets;
+    size_t nr_buckets, nr_entries, max_entries;
+    struct cache_entry lru; // most recently used first
+};
+
+struct pending_reply
+{
+    sikv_reply_fn fn;
+    void *arg;
+};
+
+struct client_conn
+{
+    sikv_pool_t *pool;
+    pthread_t thread;
+    int fd;
+    struct shm_seg *shm;
+    int wake_fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // queue taken, connection state changed or all replies in
+    // Guarded by lock
+    char *qbuf;
+    size_t qlen, qcap;
+    struct pending_reply *due; // ring of callbacks in command order
+    size_t due_head, nr_due, due_cap;
+    size_t nr_running; // callbacks taken off the ring but not yet returned
+    bool connected;
+    bool sleeping;
+    bool stopping;
+    int nr_waiters;
+
+    // Only touched by the I/O thread
+    char *obuf;
+    size_t olen, ooff, ocap;
+    char *rbuf;
+    size_t rlen, rscan, rcap;
+};
+
+struct sikv_pool
+{
+    struct sikv_client_options options;
+    char *host;
+    char *unix_path;
+    int nr_conns;
+    struct client_conn *conns;
+    struct cache_shard *cache; // NULL when cache_keys is 0
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+};
+
+struct sikv_future
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int err;
+    char *reply;
+    size_t len;
+};
+
+// The connection whose I/O thread this is, so callbacks send on their own connection
+static __thread struct client_conn *current_conn = NULL;
+static __thread int thread_slot = -1;
+static int next_slot = 0;
+
+static int connect_socket(sikv_pool_t *pool)
+{
+    int fd = -1;
+
+    if (pool->unix_path)
+    {
+        struct sockaddr_un addr;
+        if (strlen(pool->unix_path) >= sizeof(addr.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, pool->unix_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res, *ai;
+    char port[8];
+    snprintf(port, sizeof(port), "%u", pool->options.port);
+    int ret = getaddrinfo(pool->host, port, &hints, &res);
+    if (ret != 0)
+    {
+        errno = ret == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            // Batches are already coalesced here, so don't let Nagle hold them back
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static uint64_t cache_hash(const char *key, size_t len)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct cache_shard *cache_shard(sikv_pool_t *pool, uint64_t hash)
+{
+    return &pool->cache[hash % CACHE_SHARDS];
+}
+
+// Called with the shard lock held. Returns the link pointing at the entry, or at the bucket's end
+static struct cache_entry **cache_find(struct cache_shard *shard, uint64_t hash, const char *key, size_t key_len)
+{
+    struct cache_entry **link = &shard->buckets[(hash / CACHE_SHARDS) & (shard->nr_buckets - 1)];
+    while (*link && ((*link)->hash != hash || (*link)->key_len != key_len || memcmp((*link)->data, key, key_len) != 0))
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void lru_unlink(struct cache_entry *entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push(struct cache_shard *shard, struct cache_entry *entry)
+{
+    entry->lru_next = shard->lru.lru_next;
+    entry->lru_prev = &shard->lru;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+}
+
+// Called with the shard lock held
+static void cache_remove(struct cache_shard *shard, struct cache_entry **link)
+{
+    struct cache_entry *entry = *link;
+    *link = entry->next;
+    lru_unlink(entry);
+    shard->nr_entries--;
+    free(entry);
+}
+
+// Returns 0 with a copy of the value, 1 for a cached miss, -1 when the key is not cached
+static int cache_get(sikv_pool_t *pool, const char *key, size_t key_len, char **val, size_t *len)
+{
+    uint64_t hash = cache_hash(key, key_len);
+    struct cache_shard *shard = cache_shard(pool, hash);
+    int ret = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry *entry = *cache_find(shard, hash, key, key_len);
+    if (entry && entry->missing)
+    {
+        ret = 1;
+    }
+    else if (entry && (*val = (char *)malloc(entry->val_len + 1)) != NULL)
+    {
+        memcpy(*val, &entry->data[key_len], entry->val_len + 1);
+        *len = entry->val_len;
+        ret = 0;
+    }
+    if (entry)
+    {
+        lru_unlink(entry);
+        lru_push(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    __atomic_add_fetch(ret < 0 ? &pool->cache_misses : &pool->cache_hits, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// Cache a GET result; val is NULL for a missing key. Runs on the I/O thread the reply came in on
+static void cache_put(sikv_pool_t *pool, const char *key, size_t key_len, const char *val, size_t val_len)
+{
+    uint64_t hash = cache_hash(key, key_len);
+    struct cache_shard *shard = cache_shard(pool, hash);
+    struct cache_entry *entry = (struct cache_entry *)malloc(sizeof(struct cache_entry) + key_len + val_len + 1);
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->hash = hash;
+    entry->missing = val == NULL;
+    entry->key_len = key_len;
+    entry->val_len = val ? val_len : 0;
+    memcpy(entry->data, key, key_len);
+    memcpy(&entry->data[key_len], val ? val : "", entry->val_len);
+    entry->data[key_len + entry->val_len] = '\0';
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry **link = cache_find(shard, hash, key, key_len);
+    if (*link)
+    {
+        cache_remove(shard, link);
+    }
+    while (shard->nr_entries >= shard->max_entries)
+    {
+        struct cache_entry *oldest = shard->lru.lru_prev;
+        cache_remove(shard, cache_find(shard, oldest->hash, oldest->data, oldest->key_len));
+    }
+    entry->next = NULL;
+    *cache_find(shard, hash, key, key_len) = entry;
+    lru_push(shard, entry);
+    shard->nr_entries++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void cache_invalidate(sikv_pool_t *pool, const char *key, size_t key_len)
+{
+    if (pool->cache == NULL)
+    {
+        return;
+    }
+    uint64_t hash = cache_hash(key, key_len);
+    struct cache_shard *shard = cache_shard(pool, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry **link = cache_find(shard, hash, key, key_len);
+    if (*link)
+    {
+        cache_remove(shard, link);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void cache_clear(sikv_pool_t *pool)
+{
+    for (int i = 0; pool->cache && i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *shard = &pool->cache[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru.lru_next != &shard->lru)
+        {
+            struct cache_entry *entry = shard->lru.lru_next;
+            cache_remove(shard, cache_find(shard, entry->hash, entry->data, entry->key_len));
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static int cache_init(sikv_pool_t *pool, size_t max_keys)
+{
+    pool->cache = (struct cache_shard *)calloc(CACHE_SHARDS, sizeof(struct cache_shard));
+    if (pool->cache == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *shard = &pool->cache[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->max_entries = (max_keys + CACHE_SHARDS - 1) / CACHE_SHARDS;
+        shard->nr_buckets = 1;
+        while (shard->nr_buckets < shard->max_entries)
+        {
+            shard->nr_buckets *= 2;
+        }
+        shard->buckets = (struct cache_entry **)calloc(shard->nr_buckets, sizeof(struct cache_entry *));
+        shard->lru.lru_next = shard->lru.lru_prev = &shard->lru;
+        if (shard->buckets == NULL)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void cache_free(sikv_pool_t *pool)
+{
+    if (pool->cache == NULL)
+    {
+        return;
+    }
+    cache_clear(pool);
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_destroy(&pool->cache[i].lock);
+        free(pool->cache[i].buckets);
+    }
+    free(pool->cache);
+}
+
+/*
+ * One blocking command on a fresh connection, before the I/O thread takes it over, over the shm
+ * rings once they are set up. Invalidations pushed meanwhile are skipped; nothing is cached through
+ * the connection yet.
+ */
+static int setup_command(int fd, struct shm_seg *shm, const char *line)
+{
+    char reply[128];
+    size_t len = 0;
+    bool in_push = false;
+    ssize_t n = strlen(line);
+
+    if (shm ? shm_client_write(shm, fd, line, n) < 0 : send(fd, line, n, MSG_NOSIGNAL) != n)
+    {
+        return -1;
+    }
+    while (1)
+    {
+        n = shm ? shm_client_read(shm, fd, &reply[len], sizeof(reply) - len) : read(fd, &reply[len], sizeof(reply) - len);
+        if (n <= 0)
+        {
+            errno = n == -1 ? errno : EPROTO;
+            return -1;
+        }
+        len += n;
+
+        char *nl;
+        while (len && (in_push || reply[0] == '\r'))
+        {
+            nl = memchr(reply, '\n', len);
+            size_t skip = nl ? (size_t)(nl - reply) + 1 : len;
+            in_push = nl == NULL;
+            memmove(reply, &reply[skip], len - skip);
+            len -= skip;
+        }
+        if (len && reply[len - 1] == '\n')
+        {
+            break;
+        }
+        if (len == sizeof(reply))
+        {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    if (len != 3 || memcmp(reply, "Ok\n", 3) != 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+static int conn_connect(struct client_conn *conn)
+{
+    sikv_pool_t *pool = conn->pool;
+    char line[32];
+
+    int fd = connect_socket(pool);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (pool->options.db != 0)
+    {
+        snprintf(line, sizeof(line), "SELECT %d\n", pool->options.db);
+        if (setup_command(fd, NULL, line) < 0)
+        {
+            goto fail;
+        }
+    }
+    if (pool->options.shm)
+    {
+        conn->shm = shm_client_open(fd, pool->options.shm_ring_size ? pool->options.shm_ring_size : SHM_DEFAULT_RING_SIZE);
+        if (conn->shm == NULL)
+        {
+            goto fail;
+        }
+    }
+    // Last, so the SHM handshake has no pushes to skip
+    if (pool->cache && setup_command(fd, conn->shm, "TRACKING ON\n") < 0)
+    {
+        goto fail;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        goto fail;
+    }
+
+    conn->fd = fd;
+    conn->olen = conn->ooff = 0;
+    conn->rlen = conn->rscan = 0;
+    pthread_mutex_lock(&conn->lock);
+    conn->connected = true;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+
+fail:;
+    int err = errno;
+    if (conn->shm)
+    {
+        shm_detach(conn->shm);
+        conn->shm = NULL;
+    }
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+// Called with the lock held
+static int due_push(struct client_conn *conn, sikv_reply_fn fn, void *arg)
+{
+    if (conn->nr_due == conn->due_cap)
+    {
+        size_t cap = conn->due_cap ? conn->due_cap * 2 : 64;
+        struct pending_reply *due = (struct pending_reply *)malloc(cap * sizeof(struct pending_reply));
+        if (due == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < conn->nr_due; i++)
+        {
+            due[i] = conn->due[(conn->due_head + i) % conn->due_cap];
+        }
+        free(conn->due);
+        conn->due = due;
+        conn->due_head = 0;
+        conn->due_cap = cap;
+    }
+    struct pending_reply *p = &conn->due[(conn->due_head + conn->nr_due) % conn->due_cap];
+    p->fn = fn;
+    p->arg = arg;
+    conn->nr_due++;
+    return 0;
+}
+
+static void conn_callbacks_done(struct client_conn *conn, size_t n)
+{
+    pthread_mutex_lock(&conn->lock);
+    conn->nr_running -= n;
+    if (conn->nr_due == 0 && conn->nr_running == 0 && conn->nr_waiters)
+    {
+        pthread_cond_broadcast(&conn->cond);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Drop the connection and fail every reply still due, with errno set to err
+static void conn_fail(struct client_conn *conn, int err)
+{
+    pthread_mutex_lock(&conn->lock);
+    conn->connected = false;
+    conn->sleeping = false;
+    conn->qlen = 0;
+    struct pending_reply *due = conn->due;
+    size_t head = conn->due_head, nr_due = conn->nr_due, cap = conn->due_cap;
+    conn->due = NULL;
+    conn->due_head = conn->nr_due = conn->due_cap = 0;
+    conn->nr_running += nr_due;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+
+    if (conn->shm)
+    {
+        shm_detach(conn->shm);
+        conn->shm = NULL;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    // Invalidations meant for this connection are lost with it
+    cache_clear(conn->pool);
+
+    for (size_t i = 0; i < nr_due; i++)
+    {
+        struct pending_reply *p = &due[(head + i) % cap];
+        errno = err;
+        p->fn(p->arg, NULL, 0);
+    }
+    free(due);
+    conn_callbacks_done(conn, nr_due);
+}
+
+// Take everything queued once the previous batch is out. Returns false when stopping with nothing left to do
+static bool conn_take_queue(struct client_conn *conn)
+{
+    bool run = true;
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->ooff == conn->olen && conn->qlen)
+    {
+        char *buf = conn->obuf;
+        size_t cap = conn->ocap;
+        conn->obuf = conn->qbuf;
+        conn->ocap = conn->qcap;
+        conn->olen = conn->qlen;
+        conn->ooff = 0;
+        conn->qbuf = buf;
+        conn->qcap = cap;
+        conn->qlen = 0;
+        if (conn->nr_waiters)
+        {
+            pthread_cond_broadcast(&conn->cond);
+        }
+    }
+    if (conn->stopping && conn->nr_due == 0)
+    {
+        run = false;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return run;
+}
+
+// Returns 1 if anything went out, 0 if it would block, -1 on error
+static int conn_send(struct client_conn *conn)
+{
+    if (conn->ooff == conn->olen)
+    {
+        return 0;
+    }
+
+    ssize_t n;
+    if (conn->shm)
+    {
+        n = shm_client_send(conn->shm, conn->fd, &conn->obuf[conn->ooff], conn->olen - conn->ooff);
+    }
+    else
+    {
+        // No SIGPIPE for the application when the server has gone
+        n = send(conn->fd, &conn->obuf[conn->ooff], conn->olen - conn->ooff, MSG_NOSIGNAL);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        {
+            n = 0;
+        }
+    }
+    if (n < 0)
+    {
+        return -1;
+    }
+    conn->ooff += n;
+    return n > 0;
+}
+
+// Hand every complete line in the read buffer to the callback due for it
+static int conn_dispatch(struct client_conn *conn)
+{
+    size_t off = 0;
+    char *nl;
+
+    while ((nl = memchr(&conn->rbuf[conn->rscan], '\n', conn->rlen - conn->rscan)) != NULL)
+    {
+        size_t len = nl - &conn->rbuf[off];
+        *nl = '\0';
+        conn->rscan = len + off + 1;
+
+        // Pushed by the server, not a reply
+        if (conn->rbuf[off] == '\r')
+        {
+            if (len > 12 && memcmp(&conn->rbuf[off], "\rINVALIDATE ", 12) == 0)
+            {
+                cache_invalidate(conn->pool, &conn->rbuf[off + 12], len - 12);
+            }
+            else
+            {
+                cache_clear(conn->pool);
+            }
+            off = conn->rscan;
+            continue;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        if (conn->nr_due == 0)
+        {
+            pthread_mutex_unlock(&conn->lock);
+            errno = EPROTO;
+            return -1;
+        }
+        struct pending_reply p = conn->due[conn->due_head];
+        conn->due_head = (conn->due_head + 1) % conn->due_cap;
+        conn->nr_due--;
+        conn->nr_running++;
+        pthread_mutex_unlock(&conn->lock);
+
+        p.fn(p.arg, &conn->rbuf[off], len);
+        conn_callbacks_done(conn, 1);
+        off = conn->rscan;
+    }
+
+    if (off > 0)
+    {
+        memmove(conn->rbuf, &conn->rbuf[off], conn->rlen - off);
+        conn->rlen -= off;
+        conn->rscan -= off;
+    }
+    // Everything read so far has been searched
+    conn->rscan = conn->rlen;
+    return 0;
+}
+
+// Returns 1 if anything came in, 0 if it would block, -1 on error
+static int conn_recv(struct client_conn *conn)
+{
+    if (conn->rcap - conn->rlen < CLIENT_READ_SIZE)
+    {
+        size_t cap = conn->rcap ? conn->rcap * 2 : CLIENT_READ_SIZE * 2;
+        char *rbuf = (char *)realloc(conn->rbuf, cap);
+        if (rbuf == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        conn->rbuf = rbuf;
+        conn->rcap = cap;
+    }
+
+    ssize_t n;
+    if (conn->shm)
+    {
+        n = shm_client_recv(conn->shm, conn->fd, &conn->rbuf[conn->rlen], conn->rcap - conn->rlen);
+    }
+    else
+    {
+        n = read(conn->fd, &conn->rbuf[conn->rlen], conn->rcap - conn->rlen);
+        if (n == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        {
+            n = 0;
+        }
+    }
+    if (n <= 0)
+    {
+        return n;
+    }
+    conn->rlen += n;
+    return conn_dispatch(conn) < 0 ? -1 : 1;
+}
+
+/*
+ * Called with the lock held, and only while connected: the segment is detached once a dropped
+ * connection has been marked so under the lock.
+ */
+static void conn_wake(struct client_conn *conn)
+{
+    if (conn->shm)
+    {
+        shm_client_wake(conn->shm);
+        return;
+    }
+    uint64_t one = 1;
+    if (write(conn->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        perror("conn_wake: Unable to wake I/O thread");
+    }
+}
+
+/*
+ * Senders wake the thread when this says it is going to sleep. Commands queued behind a batch that
+ * is still going out can't be taken yet, so they don't keep it awake.
+ */
+static bool conn_set_sleeping(struct client_conn *conn, bool sleeping)
+{
+    pthread_mutex_lock(&conn->lock);
+    conn->sleeping = sleeping && (conn->qlen == 0 || conn->ooff < conn->olen);
+    sleeping = conn->sleeping;
+    pthread_mutex_unlock(&conn->lock);
+    return sleeping;
+}
+
+static int conn_sleep(struct client_conn *conn)
+{
+    int ret = 0;
+
+    if (conn->shm)
+    {
+        // The sequence is read before looking at the queue, so a sender bumping it in between is seen
+        uint32_t seq = shm_client_wake_seq(conn->shm);
+        if (conn_set_sleeping(conn, true))
+        {
+            ret = shm_client_sleep(conn->shm, conn->fd, seq, conn->ooff < conn->olen, SHM_WAIT_MS);
+            conn_set_sleeping(conn, false);
+        }
+        return ret;
+    }
+
+    if (!conn_set_sleeping(conn, true))
+    {
+        return 0;
+    }
+    struct pollfd pfd[2] = {
+        {.fd = conn->fd, .events = POLLIN | (conn->ooff < conn->olen ? POLLOUT : 0)},
+        {.fd = conn->wake_fd, .events = POLLIN},
+    };
+    ret = poll(pfd, 2, -1);
+    conn_set_sleeping(conn, false);
+    if (ret > 0 && (pfd[1].revents & POLLIN))
+    {
+        uint64_t count;
+        if (read(conn->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        {
+            return -1;
+        }
+    }
+    return ret == -1 && errno != EINTR ? -1 : 0;
+}
+
+// Wait to reconnect. Returns false once the pool is closing
+static bool conn_backoff(struct client_conn *conn)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += CLIENT_RECONNECT_MS / 1000;
+    pthread_mutex_lock(&conn->lock);
+    while (!conn->stopping && pthread_cond_timedwait(&conn->cond, &conn->lock, &ts) == 0)
+        ;
+    bool stopping = conn->stopping;
+    pthread_mutex_unlock(&conn->lock);
+    return !stopping;
+}
+
+static void *conn_main(void *arg)
+{
+    struct client_conn *conn = (struct client_conn *)arg;
+    uint64_t idle_spins = 0;
+
+    current_conn = conn;
+    while (1)
+    {
+        if (conn->fd == -1)
+        {
+            if (!conn_backoff(conn))
+            {
+                break;
+            }
+            conn_connect(conn);
+            continue;
+        }
+        if (!conn_take_queue(conn))
+        {
+            break;
+        }
+
+        int sent = conn_send(conn);
+        int received = sent < 0 ? -1 : conn_recv(conn);
+        if (sent < 0 || received < 0)
+        {
+            conn_fail(conn, errno == EPROTO ? EPROTO : ECONNRESET);
+            continue;
+        }
+        if (sent || received)
+        {
+            idle_spins = 0;
+            continue;
+        }
+
+        // The server answers in microseconds over shared memory, so poll the rings a little first
+        if (conn->shm && idle_spins++ < SHM_SPIN_US)
+        {
+            sched_yield();
+            continue;
+        }
+        idle_spins = 0;
+        if (conn_sleep(conn) < 0)
+        {
+            conn_fail(conn, ECONNRESET);
+        }
+    }
+    return NULL;
+}
+
+static struct client_conn *pick_conn(sikv_pool_t *pool)
+{
+    if (current_conn && current_conn->pool == pool)
+    {
+        return current_conn;
+    }
+    if (thread_slot == -1)
+    {
+        thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) & INT32_MAX;
+    }
+    return &pool->conns[thread_slot % pool->nr_conns];
+}
+
+static bool refused_cmd(const char *cmd, size_t len)
+{
+    const char *refused[] = {"PSYNC", "SHM", "SELECT", "TRACKING", "SETBULK"};
+    for (size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); i++)
+    {
+        if (len == strlen(refused[i]) && strncasecmp(cmd, refused[i], len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Append an encoded command to the connection's queue. Called with the lock held
+static int queue_reserve(struct client_conn *conn, size_t len)
+{
+    if (conn->qcap - conn->qlen >= len)
+    {
+        return 0;
+    }
+    size_t cap = conn->qcap ? conn->qcap * 2 : CLIENT_READ_SIZE;
+    while (cap - conn->qlen < len)
+    {
+        cap *= 2;
+    }
+    char *qbuf = (char *)realloc(conn->qbuf, cap);
+    if (qbuf == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    conn->qbuf = qbuf;
+    conn->qcap = cap;
+    return 0;
+}
+
+static int pool_send(sikv_pool_t *pool, int argc, const char *const argv[], const size_t arg_lens[], const char *line, size_t line_len, sikv_reply_fn fn, void *arg)
+{
+    struct client_conn *conn = pick_conn(pool);
+    size_t len = line ? line_len + 1 : 0;
+    char bulk[64];
+    int bulk_len = 0;
+
+    for (int i = 0; !line && i < argc; i++)
+    {
+        len += (arg_lens ? arg_lens[i] : strlen(argv[i])) + 1;
+    }
+    // A large SET goes as SETBULK, which the server reads straight into place
+    size_t val_len = !line && argc == 3 ? (arg_lens ? arg_lens[2] : strlen(argv[2])) : 0;
+    if (val_len >= CLIENT_BULK_SIZE && (strcasecmp(argv[0], "SET") == 0 || strcasecmp(argv[0], "PUT") == 0))
+    {
+        bulk_len = snprintf(bulk, sizeof(bulk), " %zu\n", val_len);
+        len = strlen("SETBULK ") + (arg_lens ? arg_lens[1] : strlen(argv[1])) + bulk_len + val_len + 1;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    // Let the I/O thread catch up, unless this is it
+    while (conn->connected && conn->qlen >= CLIENT_MAX_QUEUED && conn != current_conn)
+    {
+        conn->nr_waiters++;
+        pthread_cond_wait(&conn->cond, &conn->lock);
+        conn->nr_waiters--;
+    }
+    if (!conn->connected || conn->stopping)
+    {
+        pthread_mutex_unlock(&conn->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (queue_reserve(conn, len) < 0 || due_push(conn, fn, arg) < 0)
+    {
+        pthread_mutex_unlock(&conn->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char *p = &conn->qbuf[conn->qlen];
+    if (line)
+    {
+        memcpy(p, line, line_len);
+        p += line_len;
+    }
+    if (bulk_len)
+    {
+        size_t key_len = arg_lens ? arg_lens[1] : strlen(argv[1]);
+        memcpy(p, "SETBULK ", 8);
+        p += 8;
+        memcpy(p, argv[1], key_len);
+        p += key_len;
+        memcpy(p, bulk, bulk_len);
+        p += bulk_len;
+        memcpy(p, argv[2], val_len);
+        p += val_len;
+        *p = '\n';
+    }
+    for (int i = 0; !line && !bulk_len && i < argc; i++)
+    {
+        size_t arg_len = arg_lens ? arg_lens[i] : strlen(argv[i]);
+        memcpy(p, argv[i], arg_len);
+        p += arg_len;
+        *p++ = i + 1 < argc ? ' ' : '\n';
+    }
+    if (line)
+    {
+        *p = '\n';
+    }
+    conn->qlen += len;
+
+    if (conn->sleeping)
+    {
+        conn->sleeping = false;
+        conn_wake(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+int sikv_pool_send(sikv_pool_t *pool, int argc, const char *const argv[], const size_t arg_lens[], sikv_reply_fn fn, void *arg)
+{
+    if (argc < 1 || refused_cmd(argv[0], arg_lens ? arg_lens[0] : strlen(argv[0])))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < argc; i++)
+    {
+        size_t len = arg_lens ? arg_lens[i] : strlen(argv[i]);
+        if (len == 0 || memchr(argv[i], ' ', len) || memchr(argv[i], '\n', len) || memchr(argv[i], '\r', len) ||
+            memchr(argv[i], '\0', len))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return pool_send(pool, argc, argv, arg_lens, NULL, 0, fn, arg);
+}
+
+int sikv_pool_send_line(sikv_pool_t *pool, const char *line, size_t len, sikv_reply_fn fn, void *arg)
+{
+    // A blank line gets no reply, so it would never complete
+    size_t start = 0;
+    while (start < len && (line[start] == ' ' || line[start] == '\r'))
+    {
+        start++;
+    }
+    size_t end = start;
+    while (end < len && line[end] != ' ' && line[end] != '\r')
+    {
+        end++;
+    }
+    if (start == len || memchr(line, '\n', len) || memchr(line, '\0', len) || refused_cmd(&line[start], end - start))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return pool_send(pool, 0, NULL, NULL, line, len, fn, arg);
+}
+
+void sikv_pool_drain(sikv_pool_t *pool)
+{
+    for (int i = 0; i < pool->nr_conns; i++)
+    {
+        struct client_conn *conn = &pool->conns[i];
+        pthread_mutex_lock(&conn->lock);
+        while (conn->nr_due || conn->nr_running)
+        {
+            conn->nr_waiters++;
+            pthread_cond_wait(&conn->cond, &conn->lock);
+            conn->nr_waiters--;
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+}
+
+static void conn_free(struct client_conn *conn)
+{
+    if (conn->shm)
+    {
+        shm_detach(conn->shm);
+    }
+    if (conn->fd != -1)
+    {
+        close(conn->fd);
+    }
+    close(conn->wake_fd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+    free(conn->qbuf);
+    free(conn->obuf);
+    free(conn->rbuf);
+    free(conn->due);
+}
+
+static void pool_free(sikv_pool_t *pool, int nr_started)
+{
+    for (int i = 0; i < nr_started; i++)
+    {
+        struct client_conn *conn = &pool->conns[i];
+        pthread_mutex_lock(&conn->lock);
+        conn->stopping = true;
+        pthread_cond_broadcast(&conn->cond);
+        if (conn->connected)
+        {
+            conn_wake(conn);
+        }
+        pthread_mutex_unlock(&conn->lock);
+        pthread_join(conn->thread, NULL);
+    }
+    for (int i = 0; i < pool->nr_conns; i++)
+    {
+        conn_free(&pool->conns[i]);
+    }
+    free(pool->conns);
+    free(pool->host);
+    free(pool->unix_path);
+    cache_free(pool);
+    free(pool);
+}
+
+sikv_pool_t *sikv_pool_open(const struct sikv_client_options *options)
+{
+    int i, err;
+
+    if (options == NULL || (options->unix_path == NULL && options->host == NULL) || (options->shm && options->unix_path == NULL) ||
+        options->connections < 0 || options->db < 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sikv_pool_t *pool = (sikv_pool_t *)calloc(1, sizeof(sikv_pool_t));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->options = *options;
+    pool->host = options->host ? strdup(options->host) : NULL;
+    pool->unix_path = options->unix_path ? strdup(options->unix_path) : NULL;
+    pool->nr_conns = options->connections ? options->connections : CLIENT_DEFAULT_CONNECTIONS;
+    pool->conns = (struct client_conn *)calloc(pool->nr_conns, sizeof(struct client_conn));
+    if (pool->conns == NULL || (options->host && pool->host == NULL) || (options->unix_path && pool->unix_path == NULL) ||
+        (options->cache_keys && cache_init(pool, options->cache_keys) < 0))
+    {
+        free(pool->conns);
+        free(pool->host);
+        free(pool->unix_path);
+        cache_free(pool);
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    // The host is only used when there is no unix socket
+    if (pool->unix_path)
+    {
+        free(pool->host);
+        pool->host = NULL;
+    }
+
+    for (i = 0; i < pool->nr_conns; i++)
+    {
+        struct client_conn *conn = &pool->conns[i];
+        conn->pool = pool;
+        conn->fd = -1;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+        conn->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    for (i = 0; i < pool->nr_conns; i++)
+    {
+        struct client_conn *conn = &pool->conns[i];
+        if (conn->wake_fd == -1 || conn_connect(conn) < 0)
+        {
+            break;
+        }
+        if ((err = pthread_create(&conn->thread, NULL, conn_main, conn)) != 0)
+        {
+            errno = err;
+            break;
+        }
+    }
+    if (i < pool->nr_conns)
+    {
+        err = errno;
+        pool_free(pool, i);
+        errno = err;
+        return NULL;
+    }
+    return pool;
+}
+
+void sikv_pool_close(sikv_pool_t *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    pool_free(pool, pool->nr_conns);
+}
+
+static void future_done(void *arg, const char *reply, size_t len)
+{
+    sikv_future_t *future = (sikv_future_t *)arg;
+    int err = reply ? 0 : errno;
+    char *copy = reply ? (char *)malloc(len + 1) : NULL;
+
+    if (reply && copy == NULL)
+    {
+        err = ENOMEM;
+    }
+    else if (copy)
+    {
+        memcpy(copy, reply, len + 1);
+    }
+
+    pthread_mutex_lock(&future->lock);
+    future->reply = copy;
+    future->len = copy ? len : 0;
+    future->err = err;
+    future->done = true;
+    pthread_cond_signal(&future->cond);
+    pthread_mutex_unlock(&future->lock);
+}
+
+static sikv_future_t *future_new(void)
+{
+    sikv_future_t *future = (sikv_future_t *)calloc(1, sizeof(sikv_future_t));
+    if (future)
+    {
+        pthread_mutex_init(&future->lock, NULL);
+        pthread_cond_init(&future->cond, NULL);
+    }
+    return future;
+}
+
+sikv_future_t *sikv_pool_submit(sikv_pool_t *pool, int argc, const char *const argv[], const size_t arg_lens[])
+{
+    sikv_future_t *future = future_new();
+    if (future && sikv_pool_send(pool, argc, argv, arg_lens, future_done, future) < 0)
+    {
+        int err = errno;
+        sikv_future_free(future);
+        errno = err;
+        return NULL;
+    }
+    return future;
+}
+
+sikv_future_t *sikv_pool_submit_line(sikv_pool_t *pool, const char *line, size_t len)
+{
+    sikv_future_t *future = future_new();
+    if (future && sikv_pool_send_line(pool, line, len, future_done, future) < 0)
+    {
+        int err = errno;
+        sikv_future_free(future);
+        errno = err;
+        return NULL;
+    }
+    return future;
+}
+
+bool sikv_future_ready(sikv_future_t *future)
+{
+    pthread_mutex_lock(&future->lock);
+    bool done = future->done;
+    pthread_mutex_unlock(&future->lock);
+    return done;
+}
+
+int sikv_future_wait(sikv_future_t *future, const char **reply, size_t *len)
+{
+    pthread_mutex_lock(&future->lock);
+    while (!future->done)
+    {
+        pthread_cond_wait(&future->cond, &future->lock);
+    }
+    pthread_mutex_unlock(&future->lock);
+
+    if (future->err)
+    {
+        errno = future->err;
+        return -1;
+    }
+    if (reply)
+    {
+        *reply = future->reply;
+    }
+    if (len)
+    {
+        *len = future->len;
+    }
+    return 0;
+}
+
+// Must not be freed while its reply is still due
+void sikv_future_free(sikv_future_t *future)
+{
+    if (future == NULL)
+    {
+        return;
+    }
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->cond);
+    free(future->reply);
+    free(future);
+}
+
+int sikv_pool_call(sikv_pool_t *pool, int argc, const char *const argv[], const size_t arg_lens[], char **reply, size_t *len)
+{
+    sikv_future_t *future = sikv_pool_submit(pool, argc, argv, arg_lens);
+    if (future == NULL)
+    {
+        return -1;
+    }
+    int ret = sikv_future_wait(future, NULL, len);
+    if (ret == 0)
+    {
+        // Hand the copy over rather than copying again
+        *reply = future->reply;
+        future->reply = NULL;
+    }
+    sikv_future_free(future);
+    return ret;
+}
+
+struct cache_fill
+{
+    sikv_pool_t *pool;
+    sikv_future_t *future;
+    size_t key_len;
+    char key[];
+};
+
+// Caches the reply before passing it on, on the I/O thread so no invalidation read after it is missed
+static void cache_filled(void *arg, const char *reply, size_t len)
+{
+    struct cache_fill *fill = (struct cache_fill *)arg;
+
+    if (reply && fill->pool->cache && strncmp(reply, "ERR ", 4) != 0)
+    {
+        bool missing = len == strlen(GET_NOT_FOUND) && memcmp(reply, GET_NOT_FOUND, len) == 0;
+        cache_put(fill->pool, fill->key, fill->key_len, missing ? NULL : reply, len);
+    }
+    future_done(fill->future, reply, len);
+}
+
+int sikv_pool_get(sikv_pool_t *pool, const char *key, size_t key_len, char **val, size_t *len)
+{
+    size_t val_len;
+
+    if (pool->cache)
+    {
+        int cached = cache_get(pool, key, key_len, val, &val_len);
+        if (cached == 0 && len)
+        {
+            *len = val_len;
+        }
+        else if (cached == 1)
+        {
+            errno = ENOENT;
+            return -1;
+        }
+        if (cached >= 0)
+        {
+            return 0;
+        }
+    }
+
+    struct cache_fill *fill = (struct cache_fill *)malloc(sizeof(struct cache_fill) + key_len);
+    sikv_future_t *future = future_new();
+    if (fill == NULL || future == NULL)
+    {
+        free(fill);
+        sikv_future_free(future);
+        errno = ENOMEM;
+        return -1;
+    }
+    fill->pool = pool;
+    fill->future = future;
+    fill->key_len = key_len;
+    memcpy(fill->key, key, key_len);
+
+    int ret = sikv_pool_send(pool, 2, (const char *[]){"GET", key}, (const size_t[]){3, key_len}, cache_filled, fill);
+    if (ret == 0)
+    {
+        ret = sikv_future_wait(future, NULL, &val_len);
+    }
+    if (ret == 0 && strncmp(future->reply, "ERR ", 4) == 0)
+    {
+        errno = EPROTO;
+        ret = -1;
+    }
+    else if (ret == 0 && val_len == strlen(GET_NOT_FOUND) && memcmp(future->reply, GET_NOT_FOUND, val_len) == 0)
+    {
+        errno = ENOENT;
+        ret = -1;
+    }
+    else if (ret == 0)
+    {
+        *val = future->reply;
+        future->reply = NULL;
+        if (len)
+        {
+            *len = val_len;
+        }
+    }
+    int err = errno;
+    sikv_future_free(future);
+    free(fill);
+    errno = err;
+    return ret;
+}
+
+void sikv_pool_cache_stats(sikv_pool_t *pool, uint64_t *hits, uint64_t *misses)
+{
+    *hits = __atomic_load_n(&pool->cache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&pool->cache_misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,97 @@
+#ifndef _SIKV_CLIENT_
+#define _SIKV_CLIENT_
+
+/*
+ * Client library for a SiKV server.
+ *
+ * Link with libsikvclient.a or libsikvclient.so (and -lpthread -lrt). A pool keeps a few connections
+ * to one server over TCP, a unix socket or shared memory rings, each driven by its own I/O thread.
+ * Commands are queued without blocking and their replies delivered to a callback or a future, so
+ * any number of commands can be in flight at once. Commands queued while a connection is busy are
+ * written together in one batch, so many threads sending at once share syscalls rather than each
+ * paying for their own, e.g.
+ *
+ *     sikv_pool_t *pool = sikv_pool_open(&(struct sikv_client_options){.host = "127.0.0.1", .port = 8007});
+ *
+ *     sikv_future_t *f = sikv_pool_submit(pool, 2, (const char *[]){"GET", "user:1"}, NULL);
+ *     const char *reply;
+ *     if (sikv_future_wait(f, &reply, NULL) == 0)
+ *     {
+ *         printf("%s\n", reply);
+ *     }
+ *     sikv_future_free(f);
+ *     sikv_pool_close(pool);
+ *
+ * Commands sent from one thread always use the same connection, so they run in the order they were
+ * sent; different threads are spread over the pool. Arguments are sent as words of the text
+ * protocol and so may not be empty or contain spaces, newlines or '\0'. Replies are passed as the
+ * reply line without its newline: "Ok", "GET Not found", "ERR ..." or a value. PSYNC, SHM, SELECT
+ * and TRACKING change the state of a connection and are refused; pick the keyspace with the db
+ * option. SETBULK is refused too: a SET with a value of 64KB or more is sent as one.
+ *
+ * Functions returning int give 0 on success and -1 with errno set on failure: EINVAL for a
+ * malformed command, ENOTCONN while the connection is down (it is retried in the background),
+ * ECONNRESET for commands lost when it dropped.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIKV_CLIENT_API_VERSION 2
+
+typedef struct sikv_pool sikv_pool_t;
+typedef struct sikv_future sikv_future_t;
+
+struct sikv_client_options
+{
+    const char *host;        // TCP server, with port
+    unsigned short port;
+    const char *unix_path;   // unix socket, used instead of host and port when set
+    bool shm;                // move unix socket connections onto shared memory rings
+    uint32_t shm_ring_size;  // bytes per direction, a power of two; 0 for the default
+    int connections;         // pool size; 0 for the default of 4
+    int db;                  // keyspace selected on every connection
+    size_t cache_keys;       // keys sikv_pool_get may keep locally; 0 for no cache
+};
+
+/*
+ * Runs on the connection's I/O thread, so it should be quick; it may send more commands. reply is
+ * followed by a '\0' and is only valid during the call. It is NULL, with errno set, when the reply
+ * will never come because the connection dropped.
+ */
+typedef void (*sikv_reply_fn)(void *arg, const char *reply, size_t len);
+
+// Connects every connection up front. Returns NULL with errno set on failure
+sikv_pool_t *sikv_pool_open(const struct sikv_client_options *options);
+// Waits for every reply still due, then disconnects
+void sikv_pool_close(sikv_pool_t *pool);
+
+// arg_lens may be NULL for '\0' terminated arguments
+int sikv_pool_send(sikv_pool_t *pool, int argc, const char *const argv[], const size_t arg_lens[], sikv_reply_fn fn, void *arg);
+// A command line as typed, without the newline
+int sikv_pool_send_line(sikv_pool_t *pool, const char *line, size_t len, sikv_reply_fn fn, void *arg);
+// Blocks until every command sent so far has had its reply
+void sikv_pool_drain(sikv_pool_t *pool);
+
+// Returns NULL with errno set when the command could not be sent
+sikv_future_t *sikv_pool_submit(sikv_pool_t *pool, int argc, const char *const argv[], const size_t arg_lens[]);
+sikv_future_t *sikv_pool_submit_line(sikv_pool_t *pool, const char *line, size_t len);
+bool sikv_future_ready(sikv_future_t *future);
+// Blocks for the reply, which stays valid until sikv_future_free
+int sikv_future_wait(sikv_future_t *future, const char **reply, size_t *len);
+void sikv_future_free(sikv_future_t *future);
+
+// Blocking round trip; *reply is malloc'd and '\0' terminated, free it when done
+int sikv_pool_call(sikv_pool_t *pool, int argc, const char *const argv[], const size_t arg_lens[], char **reply, size_t *len);
+
+/*
+ * GET through the pool's cache when cache_keys is set. Connections then turn on TRACKING and the
+ * server tells them when a key they read changes, so a cached value, or the fact that a key is
+ * missing, is served locally until it is written, deleted or flushed. *val is malloc'd and '\0'
+ * terminated. Fails with ENOENT for a missing key and EPROTO for an error reply.
+ */
+int sikv_pool_get(sikv_pool_t *pool, const char *key, size_t key_len, char **val, size_t *len);
+void sikv_pool_cache_stats(sikv_pool_t *pool, uint64_t *hits, uint64_t *misses);
+
+#endif // _SIKV_CLIENT_
@@ -0,0 +1,267 @@
+#ifndef _SIKV_MAP_
+#define _SIKV_MAP_
+
+/*
+ * Type specialized open addressing hash maps.
+ *
+ * SIKV_MAP_INIT stamps out a table and its operations for a given key and value
+ * type. Hashing and key comparison are macros/inline functions so they are inlined at
+ * every probe site and slot sizes are fixed at compile time. Hashes are 64-bit like the
+ * engine's: the MurmurHash3 finaliser for integer keys and MurmurHash3_x64_128 for
+ * strings, e.g.
+ *
+ *     SIKV_MAP_INIT_INT64(counters, uint64_t)
+ *
+ *     sikv_map_counters_t *m = sikv_map_init_counters(0);
+ *     sikv_map_put_counters(m, 42, 1);
+ *     uint64_t *v = sikv_map_get_counters(m, 42);
+ *     sikv_map_destroy_counters(m);
+ *
+ * String keys are not copied; the caller owns the memory for as long as the key is in the map.
+ *
+ * The engine's own table is not an instance. Its slot points at one allocation holding the key, of
+ * any bytes and an explicit length, followed by the value, where an instance keeps a fixed size key
+ * and value in the slot. It also grows through a second array filled incrementally, and its entries
+ * are moved by defrag and shared with replies by reference, none of which an instance does. This
+ * header needs nothing from the engine and can be copied into another project on its own, together
+ * with MurmurHash3.h.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "MurmurHash3.h"
+
+// The engine's defaults, see sikv.h
+#define SIKV_MAP_MIN_CAPACITY 4UL
+#define SIKV_MAP_LOAD_FACTOR (float)0.85
+#define SIKV_MAP_GROWTH 2
+#define SIKV_MAP_NOT_POWER_OF_2(num) (((num) & ((num) - 1L)) != 0)
+
+#define SIKV_MAP_EMPTY 0
+#define SIKV_MAP_LIVE 1
+#define SIKV_MAP_TOMBSTONE 2
+
+static inline uint64_t sikv_map_int32_hash(uint32_t key)
+{
+    return murmur_fmix64(key);
+}
+
+static inline uint64_t sikv_map_int64_hash(uint64_t key)
+{
+    return murmur_fmix64(key);
+}
+
+static inline uint64_t sikv_map_str_hash(const char *key)
+{
+    uint64_t hash[2];
+    MurmurHash3_x64_128_inline(key, strlen(key), 0, hash);
+    return hash[0];
+}
+
+#define sikv_map_int_eq(a, b) ((a) == (b))
+#define sikv_map_str_eq(a, b) (strcmp((a), (b)) == 0)
+
+#define SIKV_MAP_INIT(name, key_t, val_t, hash_fn, eq_fn)                                           \
+    typedef struct sikv_map_##name                                                                  \
+    {                                                                                               \
+        uint64_t capacity;                                                                          \
+        uint64_t len;  /* live keys */                                                              \
+        uint64_t used; /* live keys + tombstones */                                                 \
+        uint8_t *flags;                                                                             \
+        key_t *keys;                                                                                \
+        val_t *vals;                                                                                \
+    } sikv_map_##name##_t;                                                                          \
+                                                                                                    \
+    static inline int sikv_map_alloc_##name(sikv_map_##name##_t *m, uint64_t capacity)              \
+    {                                                                                               \
+        m->flags = (uint8_t *)calloc(capacity, sizeof(uint8_t));                                    \
+        m->keys = (key_t *)malloc(capacity * sizeof(key_t));                                        \
+        m->vals = (val_t *)malloc(capacity * sizeof(val_t));                                        \
+        if (m->flags == NULL || m->keys == NULL || m->vals == NULL)                                 \
+        {                                                                                           \
+            free(m->flags);                                                                         \
+            free(m->keys);                                                                          \
+            free(m->vals);                                                                          \
+            return -1;                                                                              \
+        }                                                                                           \
+        m->capacity = capacity;                                                                     \
+        m->len = 0;                                                                                 \
+        m->used = 0;                                                                                \
+        return 0;                                                                                   \
+    }                                                                                               \
+                                                                                                    \
+    static inline sikv_map_##name##_t *sikv_map_init_##name(uint64_t capacity)                      \
+    {                                                                                               \
+        if (capacity < SIKV_MAP_MIN_CAPACITY)                                                       \
+        {                                                                                           \
+            capacity = SIKV_MAP_MIN_CAPACITY;                                                       \
+        }                                                                                           \
+        if (SIKV_MAP_NOT_POWER_OF_2(capacity))                                                      \
+        {                                                                                           \
+            return NULL;                                                                            \
+        }                                                                                           \
+        sikv_map_##name##_t *m = (sikv_map_##name##_t *)malloc(sizeof(sikv_map_##name##_t));        \
+        if (m == NULL)                                                                              \
+        {                                                                                           \
+            return NULL;                                                                            \
+        }                                                                                           \
+        if (sikv_map_alloc_##name(m, capacity) < 0)                                                 \
+        {                                                                                           \
+            free(m);                                                                                \
+            return NULL;                                                                            \
+        }                                                                                           \
+        return m;                                                                                   \
+    }                                                                                               \
+                                                                                                    \
+    static inline void sikv_map_destroy_##name(sikv_map_##name##_t *m)                              \
+    {                                                                                               \
+        if (m)                                                                                      \
+        {                                                                                           \
+            free(m->flags);                                                                         \
+            free(m->keys);                                                                          \
+            free(m->vals);                                                                          \
+            free(m);                                                                                \
+        }                                                                                           \
+    }                                                                                               \
+                                                                                                    \
+    /* Returns the slot holding key or -1 */                                                        \
+    static inline int64_t sikv_map_find_##name(const sikv_map_##name##_t *m, key_t key)             \
+    {                                                                                               \
+        uint64_t mask = m->capacity - 1;                                                            \
+        uint64_t slot = hash_fn(key) & mask;                                                        \
+        for (uint64_t i = 0; i < m->capacity; i++)                                                  \
+        {                                                                                           \
+            uint8_t flag = m->flags[slot];                                                          \
+            if (flag == SIKV_MAP_EMPTY)                                                             \
+            {                                                                                       \
+                return -1;                                                                          \
+            }                                                                                       \
+            if (flag == SIKV_MAP_LIVE && eq_fn(m->keys[slot], key))                                 \
+            {                                                                                       \
+                return (int64_t)slot;                                                               \
+            }                                                                                       \
+            slot = (slot + 1) & mask;                                                               \
+        }                                                                                           \
+        return -1;                                                                                  \
+    }                                                                                               \
+                                                                                                    \
+    static inline val_t *sikv_map_get_##name(const sikv_map_##name##_t *m, key_t key)               \
+    {                                                                                               \
+        int64_t slot = sikv_map_find_##name(m, key);                                                \
+        return slot < 0 ? NULL : &m->vals[slot];                                                    \
+    }                                                                                               \
+                                                                                                    \
+    /* Rebuilds the table at new_capacity, dropping tombstones */                                   \
+    static inline int sikv_map_resize_##name(sikv_map_##name##_t *m, uint64_t new_capacity)         \
+    {                                                                                               \
+        sikv_map_##name##_t old = *m;                                                               \
+        if (new_capacity < SIKV_MAP_MIN_CAPACITY || SIKV_MAP_NOT_POWER_OF_2(new_capacity) ||        \
+            new_capacity * SIKV_MAP_LOAD_FACTOR <= m->len)                                          \
+        {                                                                                           \
+            return -1;                                                                              \
+        }                                                                                           \
+        if (sikv_map_alloc_##name(m, new_capacity) < 0)                                             \
+        {                                                                                           \
+            *m = old;                                                                               \
+            return -1;                                                                              \
+        }                                                                                           \
+        uint64_t mask = new_capacity - 1;                                                           \
+        for (uint64_t i = 0; i < old.capacity; i++)                                                 \
+        {                                                                                           \
+            if (old.flags[i] != SIKV_MAP_LIVE)                                                      \
+            {                                                                                       \
+                continue;                                                                           \
+            }                                                                                       \
+            uint64_t slot = hash_fn(old.keys[i]) & mask;                                            \
+            while (m->flags[slot] != SIKV_MAP_EMPTY)                                                \
+            {                                                                                       \
+                slot = (slot + 1) & mask;                                                           \
+            }                                                                                       \
+            m->flags[slot] = SIKV_MAP_LIVE;                                                         \
+            m->keys[slot] = old.keys[i];                                                            \
+            m->vals[slot] = old.vals[i];                                                            \
+        }                                                                                           \
+        m->len = old.len;                                                                           \
+        m->used = old.len;                                                                          \
+        free(old.flags);                                                                            \
+        free(old.keys);                                                                             \
+        free(old.vals);                                                                             \
+        return 0;                                                                                   \
+    }                                                                                               \
+                                                                                                    \
+    /* Inserts or overwrites key. Returns the slot used or -1 on allocation failure */              \
+    static inline int64_t sikv_map_put_##name(sikv_map_##name##_t *m, key_t key, val_t val)         \
+    {                                                                                               \
+        if ((float)(m->used + 1) / m->capacity >= SIKV_MAP_LOAD_FACTOR)                             \
+        {                                                                                           \
+            /* Mostly tombstones: rebuild in place instead of growing */                            \
+            uint64_t cap = (float)(m->len + 1) / m->capacity >=                                     \
+                                   SIKV_MAP_LOAD_FACTOR / SIKV_MAP_GROWTH                           \
+                               ? m->capacity * SIKV_MAP_GROWTH                                      \
+                               : m->capacity;                                                       \
+            if (sikv_map_resize_##name(m, cap) < 0)                                                 \
+            {                                                                                       \
+                return -1;                                                                          \
+            }                                                                                       \
+        }                                                                                           \
+        uint64_t mask = m->capacity - 1;                                                            \
+        uint64_t slot = hash_fn(key) & mask;                                                        \
+        int64_t tomb = -1;                                                                          \
+        while (m->flags[slot] != SIKV_MAP_EMPTY)                                                    \
+        {                                                                                           \
+            if (m->flags[slot] == SIKV_MAP_LIVE && eq_fn(m->keys[slot], key))                       \
+            {                                                                                       \
+                m->vals[slot] = val;                                                                \
+                return (int64_t)slot;                                                               \
+            }                                                                                       \
+            if (m->flags[slot] == SIKV_MAP_TOMBSTONE && tomb < 0)                                   \
+            {                                                                                       \
+                tomb = (int64_t)slot;                                                               \
+            }                                                                                       \
+            slot = (slot + 1) & mask;                                                               \
+        }                                                                                           \
+        if (tomb >= 0)                                                                              \
+        {                                                                                           \
+            slot = (uint64_t)tomb;                                                                  \
+        }                                                                                           \
+        else                                                                                        \
+        {                                                                                           \
+            m->used += 1;                                                                           \
+        }                                                                                           \
+        m->flags[slot] = SIKV_MAP_LIVE;                                                             \
+        m->keys[slot] = key;                                                                        \
+        m->vals[slot] = val;                                                                        \
+        m->len += 1;                                                                                \
+        return (int64_t)slot;                                                                       \
+    }                                                                                               \
+                                                                                                    \
+    static inline int sikv_map_del_##name(sikv_map_##name##_t *m, key_t key)                        \
+    {                                                                                               \
+        int64_t slot = sikv_map_find_##name(m, key);                                                \
+        if (slot < 0)                                                                               \
+        {                                                                                           \
+            return -1;                                                                              \
+        }                                                                                           \
+        m->flags[slot] = SIKV_MAP_TOMBSTONE;                                                        \
+        m->len -= 1;                                                                                \
+        return 0;                                                                                   \
+    }
+
+#define SIKV_MAP_INIT_INT(name, val_t) \
+    SIKV_MAP_INIT(name, uint32_t, val_t, sikv_map_int32_hash, sikv_map_int_eq)
+
+#define SIKV_MAP_INIT_INT64(name, val_t) \
+    SIKV_MAP_INIT(name, uint64_t, val_t, sikv_map_int64_hash, sikv_map_int_eq)
+
+#define SIKV_MAP_INIT_STR(name, val_t) \
+    SIKV_MAP_INIT(name, const char *, val_t, sikv_map_str_hash, sikv_map_str_eq)
+
+// Iterate over live slots: sikv_map_foreach(m, i) { m->keys[i], m->vals[i] }
+#define sikv_map_foreach(m, i)                                                                      \
+    for (uint64_t i = 0; i < (m)->capacity; i++)                                                    \
+        if ((m)->flags[i] == SIKV_MAP_LIVE)
+
+#endif // _SIKV_MAP_
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "skiplist.h"
+
+static struct skiplist_node *node_init(int level, const char *key, int key_len)
+{
+    struct skiplist_node *node = (struct skiplist_node *)malloc(skiplist_node_size(level, key_len));
+    if (node == NULL)
+    {
+        return NULL;
+    }
+
+    node->level = level;
+    node->key_len = key_len;
+    node->key = (char *)&node->forward[level];
+    memset(node->forward, 0, level * sizeof(struct skiplist_node *));
+    if (key_len > 0)
+    {
+        memcpy(node->key, key, key_len);
+    }
+    return node;
+}
+
+struct skiplist *skiplist_init(void)
+{
+    struct skiplist *sl = (struct skiplist *)malloc(sizeof(struct skiplist));
+    if (sl == NULL)
+    {
+        perror("skiplist_init: Unable to initialize skiplist");
+        return NULL;
+    }
+
+    sl->head = node_init(SKIPLIST_MAX_LEVEL, NULL, 0);
+    if (sl->head == NULL)
+    {
+        perror("skiplist_init: Unable to initialize skiplist head");
+        free(sl);
+        return NULL;
+    }
+    sl->level = 1;
+    sl->len = 0;
+    sl->size = 0;
+    sl->rand_state = 2463534242U;
+    return sl;
+}
+
+void skiplist_destroy(struct skiplist *sl)
+{
+    if (sl == NULL)
+    {
+        return;
+    }
+
+    struct skiplist_node *node = sl->head;
+    while (node)
+    {
+        struct skiplist_node *next = node->forward[0];
+        free(node);
+        node = next;
+    }
+    free(sl);
+}
+
+// Lexicographic byte order; a key sorts before any longer key it is a prefix of
+int skiplist_cmp(const char *a, int a_len, const char *b, int b_len)
+{
+    int ret = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return a_len - b_len;
+}
+
+static int random_level(struct skiplist *sl)
+{
+    int level = 1;
+    // xorshift32
+    uint32_t x = sl->rand_state;
+    while (level < SKIPLIST_MAX_LEVEL)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if ((x & 0xFFFF) >= (uint32_t)(SKIPLIST_P * 0xFFFF))
+        {
+            break;
+        }
+        level++;
+    }
+    sl->rand_state = x;
+    return level;
+}
+
+// Fill update with the last node before key on every level
+static struct skiplist_node *find_before(struct skiplist *sl, const char *key, int key_len, struct skiplist_node **update)
+{
+    struct skiplist_node *node = sl->head;
+    for (int i = sl->level - 1; i >= 0; i--)
+    {
+        while (node->forward[i] && skiplist_cmp(node->forward[i]->key, node->forward[i]->key_len, key, key_len) < 0)
+        {
+            node = node->forward[i];
+        }
+        update[i] = node;
+    }
+    return node->forward[0];
+}
+
+int skiplist_insert(struct skiplist *sl, const char *key, int key_len)
+{
+    struct skiplist_node *update[SKIPLIST_MAX_LEVEL];
+    struct skiplist_node *node = find_before(sl, key, key_len, update);
+
+    if (node && skiplist_cmp(node->key, node->key_len, key, key_len) == 0)
+    {
+        return 0;
+    }
+
+    int level = random_level(sl);
+    if (level > sl->level)
+    {
+        for (int i = sl->level; i < level; i++)
+        {
+            update[i] = sl->head;
+        }
+        sl->level = level;
+    }
+
+    node = node_init(level, key, key_len);
+    if (node == NULL)
+    {
+        fprintf(stderr, "skiplist_insert: Unable to allocate node\n");
+        return -1;
+    }
+
+    for (int i = 0; i < level; i++)
+    {
+        node->forward[i] = update[i]->forward[i];
+        update[i]->forward[i] = node;
+    }
+    sl->len += 1;
+    sl->size += skiplist_node_size(level, key_len);
+    return 0;
+}
+
+int skiplist_delete(struct skiplist *sl, const char *key, int key_len)
+{
+    struct skiplist_node *update[SKIPLIST_MAX_LEVEL];
+    struct skiplist_node *node = find_before(sl, key, key_len, update);
+
+    if (node == NULL || skiplist_cmp(node->key, node->key_len, key, key_len) != 0)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < sl->level; i++)
+    {
+        if (update[i]->forward[i] != node)
+        {
+            break;
+        }
+        update[i]->forward[i] = node->forward[i];
+    }
+
+    while (sl->level > 1 && sl->head->forward[sl->level - 1] == NULL)
+    {
+        sl->level--;
+    }
+    sl->len -= 1;
+    sl->size -= skiplist_node_size(node->level, node->key_len);
+    free(node);
+    return 0;
+}
+
+// First node with a key >= key (> key when exclusive)
+struct skiplist_node *skiplist_seek(struct skiplist *sl, const char *key, int key_len, bool exclusive)
+{
+    struct skiplist_node *update[SKIPLIST_MAX_LEVEL];
+    struct skiplist_node *node = find_before(sl, key, key_len, update);
+
+    if (exclusive && node && skiplist_cmp(node->key, node->key_len, key, key_len) == 0)
+    {
+        node = node->forward[0];
+    }
+    return node;
+}
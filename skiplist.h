@@ -0,0 +1,51 @@
+#ifndef _SIKV_SKIPLIST_
+#define _SIKV_SKIPLIST_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SKIPLIST_MAX_LEVEL 32
+#define SKIPLIST_P 0.25
+
+struct skiplist_node
+{
+    int key_len;
+    int level;
+    char *key; // stored right after the forward pointers
+    struct skiplist_node *forward[];
+};
+
+struct skiplist
+{
+    int level;
+    uint64_t len;
+    uint64_t size; // bytes allocated for nodes
+    uint32_t rand_state;
+    struct skiplist_node *head;
+};
+
+struct skiplist *skiplist_init(void);
+void skiplist_destroy(struct skiplist *sl);
+int skiplist_insert(struct skiplist *sl, const char *key, int key_len);
+int skiplist_delete(struct skiplist *sl, const char *key, int key_len);
+struct skiplist_node *skiplist_seek(struct skiplist *sl, const char *key, int key_len, bool exclusive);
+int skiplist_cmp(const char *a, int a_len, const char *b, int b_len);
+
+// Bytes a node takes, the forward pointers and the key included
+static inline size_t skiplist_node_size(int level, int key_len)
+{
+    return sizeof(struct skiplist_node) + level * sizeof(struct skiplist_node *) + key_len;
+}
+
+static inline struct skiplist_node *skiplist_first(struct skiplist *sl)
+{
+    return sl->head->forward[0];
+}
+
+static inline struct skiplist_node *skiplist_next(struct skiplist_node *node)
+{
+    return node->forward[0];
+}
+
+#endif // _SIKV_SKIPLIST_
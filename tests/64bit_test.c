@@ -0,0 +1,306 @@
+/*
+ * 64-bit sizing checks for the engine, run with make test-64bit. Each check builds a table that
+ * really crosses 2^31 or 2^32 (slot indices, byte offsets into the slot array, key counts), so most
+ * need tens of GB. A check is skipped when MemAvailable cannot hold what it needs; the limit checks
+ * allocate nothing and always run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "sikv.h"
+
+#define GB (1ULL << 30)
+#define LOAD_BATCH_KEYS (1 << 20)
+
+static int nr_failed;
+
+static uint64_t mem_available(void)
+{
+    char line[256];
+    uint64_t kb = 0;
+
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+// Tables are freed by the lazy free thread, so wait for it before sizing up the next check
+static void drop(struct hash_map *hmap)
+{
+    KV_drop(hmap);
+    while (KV_lazyfree_pending())
+    {
+        usleep(10000);
+    }
+}
+
+static bool fits(const char *name, uint64_t need)
+{
+    uint64_t avail = mem_available();
+    if (avail < need)
+    {
+        printf("SKIP %s: needs %.1fGB, %.1fGB available\n", name, (double)need / GB, (double)avail / GB);
+        return false;
+    }
+    return true;
+}
+
+static void check(const char *name, bool ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    nr_failed += !ok;
+}
+
+// Keys start with their home slot as 16 hex digits, so a check can put a key exactly where it wants
+static uint64_t slot_hash(const void *key, int len, int seed)
+{
+    char hex[17];
+    memcpy(hex, key, 16);
+    hex[16] = '\0';
+    return strtoull(hex, NULL, 16);
+}
+
+static int slot_key(char *buf, uint64_t slot, int n)
+{
+    return sprintf(buf, "%016lx:%d", slot, n);
+}
+
+static void count_key(void *arg, const char *key, int key_len, const char *val, int val_len)
+{
+    (*(uint64_t *)arg)++;
+}
+
+static uint64_t vm_size(void)
+{
+    uint64_t pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (fscanf(f, "%lu", &pages) != 1)
+        {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * A value the allocator cannot back, with the address space capped just above what is mapped, into
+ * an empty slot and into a tombstone. Both must be left as they were: a later key homed at the same
+ * slot with a key of the same length is probed past them, and SCAN does not see them
+ */
+static void check_alloc_failure(void)
+{
+    struct hash_map *hmap = KV_init(1024, slot_hash, KV_STRING, false);
+    assert(hmap);
+    // Never touched, so it costs address space only
+    int big_len = 1 << 30;
+    char *big = mmap(NULL, big_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(big != MAP_FAILED);
+
+    char key[32], other[32], tomb[32];
+    int key_len = slot_key(key, 5, 0);
+    int other_len = slot_key(other, 5, 1);
+    int tomb_len = slot_key(tomb, 7, 0);
+    bool ok = KV_set(hmap, tomb, tomb_len, "v", 2) == 0 && KV_delete(hmap, tomb, tomb_len) == 0;
+
+    struct rlimit old, capped;
+    getrlimit(RLIMIT_AS, &old);
+    capped = old;
+    capped.rlim_cur = vm_size() + (256ULL << 20);
+    setrlimit(RLIMIT_AS, &capped);
+    int failed_empty = KV_set(hmap, key, key_len, big, big_len);
+    int failed_tomb = KV_set(hmap, tomb, tomb_len, big, big_len);
+    setrlimit(RLIMIT_AS, &old);
+    ok = ok && failed_empty < 0 && failed_tomb < 0;
+
+    ok = ok && KV_get(hmap, key, key_len) == NULL && KV_get(hmap, tomb, tomb_len) == NULL;
+    ok = ok && KV_get(hmap, other, other_len) == NULL;
+    ok = ok && KV_set(hmap, other, other_len, "w", 2) == 0 && KV_get(hmap, other, other_len) != NULL;
+    ok = ok && KV_set(hmap, key, key_len, "v", 2) == 0 && KV_get(hmap, key, key_len) != NULL;
+
+    uint64_t seen = 0, cursor = 0;
+    do
+    {
+        cursor = KV_scan(hmap, cursor, NULL, 0, 100, count_key, &seen);
+    } while (cursor);
+    ok = ok && seen == 2 && hmap->len - hmap->tombstones == 2;
+
+    check("a failed allocation leaves the slot as it was", ok);
+    munmap(big, big_len);
+    drop(hmap);
+}
+
+// No table is built; only the arithmetic on counts and offsets past 2^32 is checked
+static void check_limits(void)
+{
+    struct hash_map *hmap = KV_init(1024, KV_hash_function, KV_STRING, false);
+    assert(hmap);
+    assert(KV_set(hmap, "k", 1, "v", 2) == 0);
+
+    KV_set_max_memory(hmap, GB);
+    errno = 0;
+    bool ok = KV_reserve(hmap, 3ULL << 32) < 0 && errno == ENOMEM && hmap->capacity == 1024 && hmap->rebuild_arr == NULL;
+    errno = 0;
+    ok = ok && KV_reserve(hmap, (1ULL << 31) + 1) < 0 && errno == ENOMEM;
+    ok = ok && KV_get(hmap, "k", 1) != NULL;
+    check("reserve past 2^31 and 2^32 keys stops at max memory", ok);
+
+    errno = 0;
+    ok = KV_setrange(hmap, "k", 1, 1ULL << 32, "x", 1) < 0 && errno == EINVAL;
+    errno = 0;
+    ok = ok && KV_setrange(hmap, "k", 1, (1ULL << 31) + 1, "x", 1) < 0 && errno == EINVAL;
+    int len;
+    ok = ok && KV_get_value(hmap, "k", 1, &len) && len == 2;
+    check("value offsets past 2^31 and 2^32 are refused", ok);
+    drop(hmap);
+}
+
+/*
+ * A table of capacity slots with keys at both ends, either side of the middle, and a probe chain
+ * that wraps from the last slot to the first. Large enough tables put those slots past 2^31 and 2^32
+ * as indices, and smaller ones already put their byte offsets there
+ */
+static void check_slots(const char *name, uint64_t capacity)
+{
+    if (!fits(name, capacity * sizeof(struct KV) + GB / 4))
+    {
+        return;
+    }
+    struct hash_map *hmap = KV_init(capacity, slot_hash, KV_STRING, false);
+    if (hmap == NULL)
+    {
+        check(name, false);
+        return;
+    }
+
+    uint64_t slots[] = {0, 1, capacity / 2 - 1, capacity / 2, capacity - 2, capacity - 1};
+    int nr_slots = sizeof(slots) / sizeof(slots[0]);
+    char key[32];
+    int key_len;
+    bool ok = true;
+
+    for (int i = 0; i < nr_slots; i++)
+    {
+        key_len = slot_key(key, slots[i], 0);
+        ok = ok && KV_set(hmap, key, key_len, key, key_len + 1) == 0;
+    }
+    // Three more keys homed at the last slot, which probe past it into slots 2, 3 and 4
+    for (int n = 1; n <= 3; n++)
+    {
+        key_len = slot_key(key, capacity - 1, n);
+        ok = ok && KV_set(hmap, key, key_len, key, key_len + 1) == 0;
+    }
+    for (int i = 0; i < nr_slots; i++)
+    {
+        key_len = slot_key(key, slots[i], 0);
+        char *val = (char *)KV_get(hmap, key, key_len);
+        ok = ok && val && strcmp(val, key) == 0;
+    }
+
+    // Deleting from the middle of the wrapped chain leaves the rest reachable
+    key_len = slot_key(key, capacity - 1, 1);
+    ok = ok && KV_delete(hmap, key, key_len) == 0 && KV_get(hmap, key, key_len) == NULL;
+    for (int n = 2; n <= 3; n++)
+    {
+        key_len = slot_key(key, capacity - 1, n);
+        ok = ok && KV_get(hmap, key, key_len) != NULL;
+    }
+
+    // A cursor is the home slot it visits next. A full pass over a sparse table this size takes
+    // minutes, so each home is visited directly; the last one ends the iteration
+    uint64_t seen = 0;
+    for (int i = 0; i < nr_slots; i++)
+    {
+        uint64_t cursor = KV_scan(hmap, slots[i], NULL, 0, 1, count_key, &seen);
+        ok = ok && (cursor == 0) == (slots[i] == capacity - 1);
+    }
+    ok = ok && seen == (uint64_t)nr_slots + 2 && hmap->len - hmap->tombstones == seen;
+
+    check(name, ok);
+    drop(hmap);
+}
+
+// More keys than fit in 32 bits of signed count, loaded on every CPU
+static void check_key_count(const char *name, uint64_t nr_keys)
+{
+    // Slots at a load of at most a half, plus a 32 byte malloc chunk per small entry
+    if (!fits(name, 2 * nr_keys * sizeof(struct KV) + nr_keys * 32 + GB))
+    {
+        return;
+    }
+    struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    struct KV_record *recs = (struct KV_record *)malloc(LOAD_BATCH_KEYS * sizeof(struct KV_record));
+    char *keys = (char *)malloc(LOAD_BATCH_KEYS * 16);
+    if (hmap == NULL || recs == NULL || keys == NULL || KV_reserve(hmap, nr_keys) < 0)
+    {
+        check(name, false);
+        return;
+    }
+
+    int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool ok = true;
+    for (uint64_t done = 0; ok && done < nr_keys; done += LOAD_BATCH_KEYS)
+    {
+        uint64_t n = nr_keys - done < LOAD_BATCH_KEYS ? nr_keys - done : LOAD_BATCH_KEYS;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            char *key = &keys[i * 16];
+            recs[i] = (struct KV_record){.key = key, .key_len = sprintf(key, "%011lx", done + i), .val = "v", .val_len = 1};
+        }
+        ok = KV_load(hmap, recs, n, nr_threads) == n;
+    }
+    ok = ok && hmap->len - hmap->tombstones == nr_keys;
+
+    char key[16];
+    uint64_t probes[] = {0, (1ULL << 31) - 1, 1ULL << 31, nr_keys - 1};
+    for (int i = 0; i < 4; i++)
+    {
+        int key_len = sprintf(key, "%011lx", probes[i]);
+        ok = ok && KV_get(hmap, key, key_len) != NULL;
+    }
+    int key_len = sprintf(key, "%011lx", (uint64_t)1 << 31);
+    ok = ok && KV_delete(hmap, key, key_len) == 0 && hmap->len - hmap->tombstones == nr_keys - 1;
+    key_len = sprintf(key, "%011lx", nr_keys);
+    ok = ok && KV_get(hmap, key, key_len) == NULL;
+
+    check(name, ok);
+    free(recs);
+    free(keys);
+    drop(hmap);
+}
+
+int main(void)
+{
+    check_limits();
+    check_alloc_failure();
+    check_slots("slot byte offsets past 2^31", 1ULL << 27);
+    check_slots("slot byte offsets past 2^32", 1ULL << 28);
+    check_slots("slot indices past 2^31", 1ULL << 32);
+    check_slots("slot indices past 2^32", 1ULL << 33);
+    check_key_count("key count past 2^31", (1ULL << 31) + (1 << 20));
+    check_key_count("key count past 2^32", (1ULL << 32) + (1 << 20));
+
+    KV_destroy();
+    return nr_failed ? 1 : 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * The client library against a running ./main.out, run with make test-client. Replies far larger
+ * than a read have to arrive whole, commands pipelined from several threads each get their own
+ * reply in the order they were sent, and the pool's cache has to see writes from other clients.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "sikv_client.h"
+
+#define PORT 18110
+#define NR_THREADS 4
+#define NR_PIPELINED 10000
+
+static pid_t server_pid;
+static int nr_failed;
+
+static void check(const char *name, bool ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    fflush(stdout);
+    nr_failed += !ok;
+}
+
+static void spawn(void)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", PORT);
+    char *argv[] = {"./main.out", "127.0.0.1", port, "--loglevel", "warning", NULL};
+
+    server_pid = fork();
+    if (server_pid == 0)
+    {
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(127);
+    }
+}
+
+static void stop(void)
+{
+    if (server_pid > 0)
+    {
+        kill(server_pid, SIGINT);
+        waitpid(server_pid, NULL, 0);
+        server_pid = 0;
+    }
+}
+
+static sikv_pool_t *pool_open(size_t cache_keys)
+{
+    struct sikv_client_options options = {.host = "127.0.0.1", .port = PORT, .cache_keys = cache_keys};
+    for (int tries = 0; tries < 100; tries++)
+    {
+        sikv_pool_t *pool = sikv_pool_open(&options);
+        if (pool)
+        {
+            return pool;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "Unable to connect to port %d\n", PORT);
+    stop();
+    exit(EXIT_FAILURE);
+}
+
+// Values around the sizes a read, a buffer or the large value path change at
+static void check_framing(sikv_pool_t *pool)
+{
+    const size_t lens[] = {1, 1023, 1024, 1025, 65535, 65536, 100000, 4 * 1024 * 1024};
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    {
+        char *val = (char *)malloc(lens[i] + 1);
+        for (size_t j = 0; j < lens[i]; j++)
+        {
+            val[j] = 'a' + (i + j) % 26;
+        }
+        val[lens[i]] = '\0';
+
+        char *reply = NULL;
+        size_t len = 0;
+        ok = ok && sikv_pool_call(pool, 3, (const char *[]){"SET", "framed", val}, NULL, &reply, &len) == 0 && strcmp(reply, "Ok") == 0;
+        free(reply);
+        reply = NULL;
+        ok = ok && sikv_pool_call(pool, 2, (const char *[]){"GET", "framed"}, NULL, &reply, &len) == 0 && len == lens[i] &&
+             memcmp(reply, val, len) == 0 && reply[len] == '\0';
+        if (!ok)
+        {
+            fprintf(stderr, "A value of %zu bytes came back as %zu bytes\n", lens[i], len);
+        }
+        free(reply);
+        free(val);
+    }
+    check("replies of any size arrive whole", ok);
+}
+
+struct sender
+{
+    sikv_pool_t *pool;
+    int id;
+    int next;        // the reply expected next
+    bool sent;       // by the sending thread
+    bool replies_ok; // by the I/O thread running the callbacks
+};
+
+// Replies to one thread's GETs come back in the order they were sent
+static void count_reply(void *arg, const char *reply, size_t len)
+{
+    struct sender *s = (struct sender *)arg;
+    char expected[32];
+    snprintf(expected, sizeof(expected), "v%d.%d", s->id, s->next++);
+    if (reply == NULL || strcmp(reply, expected) != 0)
+    {
+        s->replies_ok = false;
+    }
+}
+
+static void ok_reply(void *arg, const char *reply, size_t len)
+{
+    if (reply == NULL || strcmp(reply, "Ok") != 0)
+    {
+        ((struct sender *)arg)->replies_ok = false;
+    }
+}
+
+static void *send_pipelined(void *arg)
+{
+    struct sender *s = (struct sender *)arg;
+    char key[32], val[32];
+    for (int i = 0; i < NR_PIPELINED; i++)
+    {
+        snprintf(key, sizeof(key), "p%d.%d", s->id, i);
+        snprintf(val, sizeof(val), "v%d.%d", s->id, i);
+        s->sent = s->sent && sikv_pool_send(s->pool, 3, (const char *[]){"SET", key, val}, NULL, ok_reply, s) == 0;
+    }
+    for (int i = 0; i < NR_PIPELINED; i++)
+    {
+        snprintf(key, sizeof(key), "p%d.%d", s->id, i);
+        s->sent = s->sent && sikv_pool_send(s->pool, 2, (const char *[]){"GET", key}, NULL, count_reply, s) == 0;
+    }
+    return NULL;
+}
+
+static void check_pipelining(sikv_pool_t *pool)
+{
+    struct sender senders[NR_THREADS];
+    pthread_t threads[NR_THREADS];
+    for (int i = 0; i < NR_THREADS; i++)
+    {
+        senders[i] = (struct sender){.pool = pool, .id = i, .sent = true, .replies_ok = true};
+        pthread_create(&threads[i], NULL, send_pipelined, &senders[i]);
+    }
+    bool ok = true;
+    for (int i = 0; i < NR_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    sikv_pool_drain(pool);
+    for (int i = 0; i < NR_THREADS; i++)
+    {
+        ok = ok && senders[i].sent && senders[i].replies_ok && senders[i].next == NR_PIPELINED;
+    }
+    check("pipelined commands from several threads get their own replies in order", ok);
+}
+
+// A cached value is served locally until another client writes the key
+static void check_cache(sikv_pool_t *pool, sikv_pool_t *cached)
+{
+    char *val = NULL, *reply = NULL;
+    size_t len;
+    uint64_t hits, misses;
+    bool ok = sikv_pool_call(pool, 3, (const char *[]){"SET", "c", "one"}, NULL, &reply, &len) == 0;
+    free(reply);
+    ok = ok && sikv_pool_get(cached, "c", 1, &val, &len) == 0 && strcmp(val, "one") == 0;
+    free(val);
+    ok = ok && sikv_pool_get(cached, "c", 1, &val, &len) == 0 && strcmp(val, "one") == 0;
+    free(val);
+    sikv_pool_cache_stats(cached, &hits, &misses);
+    ok = ok && hits == 1 && misses == 1;
+
+    ok = ok && sikv_pool_call(pool, 3, (const char *[]){"SET", "c", "two"}, NULL, &reply, &len) == 0;
+    free(reply);
+    // The invalidation is pushed asynchronously, but before the reply to anything sent after it
+    bool updated = false;
+    for (int tries = 0; ok && !updated && tries < 100; tries++)
+    {
+        ok = sikv_pool_get(cached, "c", 1, &val, &len) == 0;
+        updated = ok && strcmp(val, "two") == 0;
+        free(val);
+        usleep(10000);
+    }
+    check("the cache sees writes from other clients", ok && updated);
+}
+
+int main(void)
+{
+    spawn();
+    sikv_pool_t *pool = pool_open(0);
+    sikv_pool_t *cached = pool_open(64);
+    check_framing(pool);
+    check_pipelining(pool);
+    check_cache(pool, cached);
+    sikv_pool_close(cached);
+    sikv_pool_close(pool);
+    stop();
+    return nr_failed ? 1 : 0;
+}
@@ -0,0 +1,615 @@
+/*
+ * Checks for the engine's commands on a table, run with make test-engine. Each check drives the
+ * table through the state its command has to cope with (a rebuild under a SCAN, a gap under a
+ * SETRANGE, ...) and compares the result with what the caller was promised.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "sikv.h"
+#include "skiplist.h"
+
+#define NR_STABLE 1000
+
+static int nr_failed;
+
+static void check(const char *name, bool ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    nr_failed += !ok;
+}
+
+static int set(struct hash_map *hmap, const char *fmt, int n, const char *val)
+{
+    char key[32];
+    int key_len = snprintf(key, sizeof(key), fmt, n);
+    return KV_set(hmap, key, key_len, (char *)val, strlen(val) + 1);
+}
+
+static int del(struct hash_map *hmap, const char *fmt, int n)
+{
+    char key[32];
+    int key_len = snprintf(key, sizeof(key), fmt, n);
+    return KV_delete(hmap, key, key_len);
+}
+
+// Marks the stable keys ("s<n>") a SCAN returned
+static void mark_stable(void *arg, const char *key, int key_len, const char *val, int val_len)
+{
+    char buf[32];
+    if (key_len < (int)sizeof(buf) && key[0] == 's')
+    {
+        memcpy(buf, key, key_len);
+        buf[key_len] = '\0';
+        ((bool *)arg)[atoi(&buf[1])] = true;
+    }
+}
+
+static bool all_seen(const bool *seen)
+{
+    for (int i = 0; i < NR_STABLE; i++)
+    {
+        if (!seen[i])
+        {
+            fprintf(stderr, "s%d was not returned\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * A SCAN returns every key present for the whole iteration, while the table grows through several
+ * rebuilds started between its calls, and while it shrinks and compacts away tombstones
+ */
+static void check_scan(void)
+{
+    struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    assert(hmap);
+    bool seen[NR_STABLE] = {false};
+    bool ok = true;
+    for (int i = 0; i < NR_STABLE; i++)
+    {
+        ok = ok && set(hmap, "s%d", i, "v") == 0;
+    }
+
+    uint64_t capacity = hmap->capacity;
+    uint64_t cursor = 0;
+    int added = 0;
+    do
+    {
+        cursor = KV_scan(hmap, cursor, NULL, 0, 10, mark_stable, seen);
+        for (int i = 0; i < 200 && added < 20 * NR_STABLE; i++, added++)
+        {
+            ok = ok && set(hmap, "g%d", added, "v") == 0;
+        }
+    } while (cursor);
+    ok = ok && hmap->capacity >= capacity * 8;
+    check("scan returns every key while the table grows", ok && all_seen(seen));
+
+    memset(seen, 0, sizeof(seen));
+    capacity = hmap->capacity;
+    int deleted = 0;
+    cursor = 0;
+    do
+    {
+        cursor = KV_scan(hmap, cursor, NULL, 0, 10, mark_stable, seen);
+        for (int i = 0; i < 2000 && deleted < added; i++, deleted++)
+        {
+            ok = ok && del(hmap, "g%d", deleted) == 0;
+        }
+        KV_cron(hmap);
+    } while (cursor);
+    while (hmap->rebuild_arr)
+    {
+        KV_cron(hmap);
+    }
+    ok = ok && hmap->capacity < capacity;
+    check("scan returns every key while the table shrinks", ok && all_seen(seen));
+
+    // Deletes after the shrink left tombstones too few for the cron; a compaction drops them all
+    ok = hmap->tombstones > 0 && KV_compact(hmap) == 0;
+    while (hmap->rebuild_arr)
+    {
+        KV_cron(hmap);
+    }
+    ok = ok && hmap->tombstones == 0 && hmap->len == NR_STABLE;
+    for (int i = 0; i < NR_STABLE; i++)
+    {
+        char key[32];
+        int key_len = snprintf(key, sizeof(key), "s%d", i);
+        ok = ok && KV_get(hmap, key, key_len) != NULL;
+    }
+    check("compaction drops every tombstone and keeps every key", ok);
+
+    // MATCH filters what is returned, not what is visited
+    ok = true;
+    int matched = 0;
+    cursor = 0;
+    do
+    {
+        bool found[NR_STABLE] = {false};
+        cursor = KV_scan(hmap, cursor, "s1?", 3, 10, mark_stable, found);
+        for (int i = 0; i < NR_STABLE; i++)
+        {
+            matched += found[i];
+            ok = ok && (!found[i] || (i >= 10 && i < 20));
+        }
+    } while (cursor);
+    check("scan match returns only matching keys", ok && matched == 10);
+    KV_drop(hmap);
+}
+
+// Appends the keys visited to a comma separated list
+static void join_keys(void *arg, const char *key, int key_len, const char *val, int val_len)
+{
+    char *list = (char *)arg;
+    size_t len = strlen(list);
+    snprintf(&list[len], 256 - len, "%s%.*s", len ? "," : "", key_len, key);
+}
+
+static bool prefix_is(struct hash_map *hmap, const char *prefix, const char *after, const char *expected)
+{
+    char list[256] = "";
+    KV_prefix(hmap, prefix, strlen(prefix), after, after ? strlen(after) : 0, 100, join_keys, list);
+    if (strcmp(list, expected) != 0)
+    {
+        fprintf(stderr, "PREFIX %s AFTER %s returned \"%s\", expected \"%s\"\n", prefix, after ? after : "-", list, expected);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * PREFIX resumes from the greater of the prefix and AFTER, and the index's nodes count towards the
+ * table's memory and its limit
+ */
+static void check_index(void)
+{
+    struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    assert(hmap && KV_index_enable(hmap) == 0);
+    const char *keys[] = {"a1", "b1", "b2", "b3", "c1"};
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        assert(KV_set(hmap, (char *)keys[i], 2, "v", 2) == 0);
+    }
+    bool ok = prefix_is(hmap, "b", NULL, "b1,b2,b3") && prefix_is(hmap, "b", "a", "b1,b2,b3") &&
+              prefix_is(hmap, "b", "a9", "b1,b2,b3") && prefix_is(hmap, "b", "b", "b1,b2,b3") &&
+              prefix_is(hmap, "b", "b1", "b2,b3") && prefix_is(hmap, "b", "b3", "") && prefix_is(hmap, "b", "c", "");
+    check("prefix starts from the greater of the prefix and after", ok);
+
+    uint64_t size = hmap->size;
+    uint64_t index_size = hmap->index->size;
+    ok = KV_set(hmap, "d1", 2, "v", 2) == 0 && hmap->index->size > index_size &&
+         hmap->size == size + 2 + 2 + (hmap->index->size - index_size);
+    ok = ok && KV_delete(hmap, "d1", 2) == 0 && hmap->size == size && hmap->index->size == index_size;
+
+    // Room for the key and value but not for its node
+    KV_set_max_memory(hmap, size + 2 + 2);
+    errno = 0;
+    ok = ok && KV_set(hmap, "d1", 2, "v", 2) < 0 && errno == ENOMEM && hmap->size == size;
+    KV_set_max_memory(hmap, size + 2 + 2 + skiplist_node_size(SKIPLIST_MAX_LEVEL, 2));
+    ok = ok && KV_set(hmap, "d1", 2, "v", 2) == 0;
+    check("index nodes count towards the memory limit", ok);
+    KV_drop(hmap);
+
+    // An index that does not fit under the limit is refused
+    hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    assert(hmap);
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        assert(KV_set(hmap, (char *)keys[i], 2, "v", 2) == 0);
+    }
+    KV_set_max_memory(hmap, hmap->size);
+    errno = 0;
+    ok = KV_index_enable(hmap) < 0 && errno == ENOMEM && hmap->index == NULL;
+    KV_set_max_memory(hmap, 0);
+    size = hmap->size;
+    ok = ok && KV_index_enable(hmap) == 0 && hmap->size == size + hmap->index->size;
+    check("an index past the memory limit is refused", ok);
+    KV_drop(hmap);
+}
+
+// Whether key holds exactly the len bytes of expected, followed by the '\0' every value ends with
+static bool value_is(struct hash_map *hmap, char *key, const char *expected, int len)
+{
+    int val_len;
+    char *val = (char *)KV_get_value(hmap, key, strlen(key), &val_len);
+    if (val == NULL || val_len != len + 1 || memcmp(val, expected, len) != 0 || val[len] != '\0')
+    {
+        fprintf(stderr, "%s does not hold the expected %d bytes\n", key, len);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * SETRANGE past the end of a value fills the gap with '\0' bytes, whether the value stays in its
+ * buffer, outgrows it, or did not exist yet, and APPEND adds to the end
+ */
+static void check_setrange(void)
+{
+    struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    assert(hmap);
+    bool ok = KV_set(hmap, "k", 1, "hello", 6) == 0;
+    ok = ok && KV_setrange(hmap, "k", 1, 1, "EL", 2) == 5 && value_is(hmap, "k", "hELlo", 5);
+    ok = ok && KV_setrange(hmap, "k", 1, 8, "xy", 2) == 10 && value_is(hmap, "k", "hELlo\0\0\0xy", 10);
+    ok = ok && KV_setrange(hmap, "missing", 7, 3, "ab", 2) == 5 && value_is(hmap, "missing", "\0\0\0ab", 5);
+    check("setrange zero fills a gap", ok);
+
+    // Far enough past the end to move the value to a larger buffer, which may hold old bytes
+    char expected[4096] = {0};
+    memcpy(expected, "hELlo\0\0\0xy", 10);
+    memcpy(&expected[4000], "end", 3);
+    ok = KV_setrange(hmap, "k", 1, 4000, "end", 3) == 4003 && value_is(hmap, "k", expected, 4003);
+    ok = ok && KV_setrange(hmap, "k", 1, 0, "H", 1) == 4003;
+    expected[0] = 'H';
+    ok = ok && value_is(hmap, "k", expected, 4003);
+    check("setrange zero fills a gap that outgrows the buffer", ok);
+
+    ok = KV_append(hmap, "a", 1, "foo", 3) == 3 && KV_append(hmap, "a", 1, "bar", 3) == 6 && value_is(hmap, "a", "foobar", 6);
+    check("append creates and extends a value", ok);
+    KV_drop(hmap);
+}
+
+/*
+ * A CAS against a version read before another write is rejected, even once the key was deleted and
+ * set again, and NX and XX only write when the key is missing or present
+ */
+static void check_cas(void)
+{
+    struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    assert(hmap);
+    bool ok = KV_set(hmap, "k", 1, "a", 2) == 0;
+    uint64_t stale = KV_version(hmap, "k", 1);
+    ok = ok && KV_set(hmap, "k", 1, "b", 2) == 0;
+    uint64_t current = KV_version(hmap, "k", 1);
+    ok = ok && current != stale && KV_set_if(hmap, "k", 1, "c", 2, KV_SET_VERSION, stale) == 1 && value_is(hmap, "k", "b", 1);
+    ok = ok && KV_set_if(hmap, "k", 1, "c", 2, KV_SET_VERSION, current) == 0 && value_is(hmap, "k", "c", 1);
+    ok = ok && KV_set_if(hmap, "k", 1, "d", 2, KV_SET_VERSION, current) == 1 && value_is(hmap, "k", "c", 1);
+
+    current = KV_version(hmap, "k", 1);
+    ok = ok && KV_delete(hmap, "k", 1) == 0 && KV_set_if(hmap, "k", 1, "e", 2, KV_SET_VERSION, current) == 1;
+    ok = ok && KV_set(hmap, "k", 1, "f", 2) == 0 && KV_version(hmap, "k", 1) != current;
+    ok = ok && KV_set_if(hmap, "k", 1, "g", 2, KV_SET_VERSION, current) == 1 && value_is(hmap, "k", "f", 1);
+    check("a stale cas is rejected", ok);
+
+    ok = KV_set_if(hmap, "k", 1, "h", 2, KV_SET_NX, 0) == 1 && value_is(hmap, "k", "f", 1);
+    ok = ok && KV_set_if(hmap, "n", 1, "h", 2, KV_SET_XX, 0) == 1 && KV_get(hmap, "n", 1) == NULL;
+    ok = ok && KV_set_if(hmap, "n", 1, "h", 2, KV_SET_NX, 0) == 0 && value_is(hmap, "n", "h", 1);
+    ok = ok && KV_set_if(hmap, "n", 1, "i", 2, KV_SET_XX, 0) == 0 && value_is(hmap, "n", "i", 1);
+    check("nx and xx only write a missing or present key", ok);
+    KV_drop(hmap);
+}
+
+#define NR_REBUILD_KEYS 40000
+
+// What each "r<n>" key should hold: nothing, "v<n>" or "w<n>"
+enum rebuild_state
+{
+    KEY_DELETED,
+    KEY_SET,
+    KEY_OVERWRITTEN
+};
+
+static bool rebuild_keys_are(struct hash_map *hmap, const enum rebuild_state *state)
+{
+    for (int i = 0; i < NR_REBUILD_KEYS; i++)
+    {
+        char key[32], val[32];
+        int key_len = snprintf(key, sizeof(key), "r%d", i);
+        snprintf(val, sizeof(val), "%c%d", state[i] == KEY_OVERWRITTEN ? 'w' : 'v', i);
+        char *found = (char *)KV_get(hmap, key, key_len);
+        if (state[i] == KEY_DELETED ? found != NULL : found == NULL || strcmp(found, val) != 0)
+        {
+            fprintf(stderr, "%s holds %s, expected %s\n", key, found ? found : "nothing", state[i] == KEY_DELETED ? "nothing" : val);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * While a rebuild is moving keys across, lookups find keys on either side of it, deletes and
+ * overwrites take effect wherever the key is, and once it is done the tombstones are gone
+ */
+static void check_rebuild(void)
+{
+    struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    enum rebuild_state *state = (enum rebuild_state *)malloc(NR_REBUILD_KEYS * sizeof(enum rebuild_state));
+    assert(hmap && state);
+    char key[32], val[32];
+    bool ok = true;
+    for (int i = 0; i < NR_REBUILD_KEYS; i++)
+    {
+        snprintf(val, sizeof(val), "v%d", i);
+        ok = ok && set(hmap, "r%d", i, val) == 0;
+        state[i] = KEY_SET;
+    }
+    while (hmap->rebuild_arr)
+    {
+        KV_cron(hmap);
+    }
+    for (int i = 0; i < NR_REBUILD_KEYS; i += 2)
+    {
+        ok = ok && del(hmap, "r%d", i) == 0;
+        state[i] = KEY_DELETED;
+    }
+
+    // Lookups do not move keys, so the rebuild stays right at its start here
+    uint64_t tombstones = hmap->tombstones;
+    ok = ok && tombstones == NR_REBUILD_KEYS / 2 && KV_compact(hmap) == 0 && hmap->rebuild_arr != NULL;
+    ok = ok && rebuild_keys_are(hmap, state);
+    check("lookups find every key at the start of a rebuild", ok);
+
+    // Each write moves a batch, so keep writing in rounds and check between them
+    int rounds = 0, written = 1;
+    for (; hmap->rebuild_arr && written < NR_REBUILD_KEYS; rounds++)
+    {
+        for (int n = 0; n < 500 && written < NR_REBUILD_KEYS; n++, written += 2)
+        {
+            if (written % 4 == 1)
+            {
+                ok = ok && del(hmap, "r%d", written) == 0;
+                state[written] = KEY_DELETED;
+            }
+            else
+            {
+                snprintf(val, sizeof(val), "w%d", written);
+                ok = ok && set(hmap, "r%d", written, val) == 0;
+                state[written] = KEY_OVERWRITTEN;
+            }
+            // Deleted keys must stay deleted wherever the rebuild has got to
+            ok = ok && del(hmap, "r%d", written - 1) < 0;
+        }
+        ok = ok && (hmap->rebuild_arr == NULL || rebuild_keys_are(hmap, state));
+    }
+    ok = ok && rounds > 1 && rebuild_keys_are(hmap, state);
+    check("deletes and overwrites mid rebuild land wherever the key is", ok);
+
+    while (hmap->rebuild_arr)
+    {
+        KV_cron(hmap);
+    }
+    uint64_t live = 0;
+    for (int i = 0; i < NR_REBUILD_KEYS; i++)
+    {
+        live += state[i] != KEY_DELETED;
+    }
+    // Deletes after a key moved leave tombstones in the new array; another compaction drops them
+    ok = hmap->len - hmap->tombstones == live && hmap->tombstones < tombstones && KV_compact(hmap) == 0;
+    while (hmap->rebuild_arr)
+    {
+        KV_cron(hmap);
+    }
+    ok = ok && hmap->tombstones == 0 && hmap->len == live && rebuild_keys_are(hmap, state);
+    int key_len = snprintf(key, sizeof(key), "r%d", 1);
+    ok = ok && KV_get(hmap, key, key_len) == NULL && set(hmap, "r%d", 1, "again") == 0 && hmap->len == live + 1;
+    check("compaction drops the tombstones and keeps every key", ok);
+    free(state);
+    KV_drop(hmap);
+}
+
+#define NR_DEFRAG_KEYS 20000
+
+// The value of "d<n>", of a length that varies with n so values fall in several size classes
+static int defrag_value(int n, char *val)
+{
+    int len = 8 + n % 200;
+    for (int i = 0; i < len; i++)
+    {
+        val[i] = 'a' + (n + i) % 26;
+    }
+    val[len] = '\0';
+    return len;
+}
+
+static bool defrag_keys_intact(struct hash_map *hmap, int step)
+{
+    for (int i = 0; i < NR_DEFRAG_KEYS; i += step)
+    {
+        char key[32], val[256];
+        snprintf(key, sizeof(key), "d%d", i);
+        int len = defrag_value(i, val);
+        if (!value_is(hmap, key, val, len))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Values the defragmenter moves to fuller pages keep their bytes, and the table goes on working
+ * with the new buffers: overwrites, appends and deletes after the move
+ */
+static void check_defrag(void)
+{
+    struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    assert(hmap);
+    bool ok = true;
+    char val[256];
+    for (int i = 0; i < NR_DEFRAG_KEYS; i++)
+    {
+        defrag_value(i, val);
+        ok = ok && set(hmap, "d%d", i, val) == 0;
+    }
+    // Leaves every page a fifth full
+    for (int i = 0; i < NR_DEFRAG_KEYS; i++)
+    {
+        ok = ok && (i % 5 == 0 || del(hmap, "d%d", i) == 0);
+    }
+    while (hmap->rebuild_arr)
+    {
+        KV_cron(hmap);
+    }
+
+    ok = ok && KV_defrag(hmap) == 0 && hmap->defrag_phase != DEFRAG_IDLE;
+    while (hmap->defrag_phase != DEFRAG_IDLE)
+    {
+        KV_cron(hmap);
+    }
+    ok = ok && hmap->defrag_moved > 0 && hmap->len - hmap->tombstones == NR_DEFRAG_KEYS / 5;
+    ok = ok && defrag_keys_intact(hmap, 5);
+    check("values keep their bytes when defrag moves them", ok);
+
+    // The moved buffers are the table's own from now on
+    ok = true;
+    for (int i = 0; i < NR_DEFRAG_KEYS; i += 5)
+    {
+        char key[32];
+        int key_len = snprintf(key, sizeof(key), "d%d", i);
+        if (i % 3 == 0)
+        {
+            ok = ok && KV_delete(hmap, key, key_len) == 0 && KV_get(hmap, key, key_len) == NULL;
+        }
+        else if (i % 3 == 1)
+        {
+            int len = defrag_value(i, val);
+            ok = ok && KV_append(hmap, key, key_len, "+", 1) == len + 1;
+            val[len] = '+';
+            ok = ok && value_is(hmap, key, val, len + 1);
+        }
+        else
+        {
+            ok = ok && set(hmap, "d%d", i, "short") == 0 && value_is(hmap, key, "short", 5);
+        }
+    }
+    check("moved values can be written and deleted", ok);
+    KV_drop(hmap);
+}
+
+#define NR_LOAD_KEYS (2 * LOAD_MIN_PER_THREAD)
+
+// Bytes the table holds for keys and values, leaving out its slot arrays, which KV_load presizes
+static uint64_t data_size(struct hash_map *hmap)
+{
+    return hmap->size - (hmap->capacity + (hmap->rebuild_arr ? hmap->rebuild_capacity : 0)) * sizeof(struct KV);
+}
+
+/*
+ * KV_load keeps the last of several records for a key, over a key already in the table too, on one
+ * thread and split across several, and leaves the table as a run of KV_set would
+ */
+static void check_load(void)
+{
+    // Every key twice, the second half of the records repeating the first
+    uint64_t n = 2 * NR_LOAD_KEYS;
+    struct KV_record *recs = (struct KV_record *)malloc(n * sizeof(struct KV_record));
+    char (*keys)[16] = malloc(NR_LOAD_KEYS * sizeof(*keys));
+    char (*vals)[16] = malloc(n * sizeof(*vals));
+    assert(recs && keys && vals);
+    for (uint64_t i = 0; i < n; i++)
+    {
+        int key_len = snprintf(keys[i % NR_LOAD_KEYS], sizeof(keys[0]), "k%lu", i % NR_LOAD_KEYS);
+        int val_len = snprintf(vals[i], sizeof(vals[0]), "v%lu", i);
+        recs[i] = (struct KV_record){.key = keys[i % NR_LOAD_KEYS], .val = vals[i], .key_len = key_len, .val_len = val_len};
+    }
+
+    struct hash_map *expected = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+    assert(expected);
+    assert(KV_set(expected, "k0", 2, "old", 4) == 0);
+    for (uint64_t i = 0; i < n; i++)
+    {
+        assert(KV_set(expected, (char *)recs[i].key, recs[i].key_len, (char *)recs[i].val, recs[i].val_len + 1) == 0);
+    }
+
+    int nr_threads[] = {1, 4};
+    for (int t = 0; t < 2; t++)
+    {
+        struct hash_map *hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+        assert(hmap);
+        bool ok = KV_set(hmap, "k0", 2, "old", 4) == 0 && KV_load(hmap, recs, n, nr_threads[t]) == n;
+        ok = ok && hmap->len == NR_LOAD_KEYS && data_size(hmap) == data_size(expected);
+        for (uint64_t i = 0; ok && i < NR_LOAD_KEYS; i++)
+        {
+            ok = value_is(hmap, keys[i], vals[i + NR_LOAD_KEYS], strlen(vals[i + NR_LOAD_KEYS]));
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "load keeps the last duplicate on %d thread%s", nr_threads[t], nr_threads[t] > 1 ? "s" : "");
+        check(name, ok);
+        KV_drop(hmap);
+    }
+    KV_drop(expected);
+    free(recs);
+    free(keys);
+    free(vals);
+}
+
+#define NR_REPLY_KEYS 50
+#define NR_REPLY_ROUNDS 2000
+
+struct reply_thread
+{
+    struct hash_map *hmap;
+    char prefix; // of every key in the thread's table
+    bool ok;
+};
+
+// SCANs the thread's own table over and over; each reply has to hold exactly that table's keys
+static void *scan_replies(void *arg)
+{
+    struct reply_thread *t = (struct reply_thread *)arg;
+    char *argv[] = {"SCAN", "0", "COUNT", "1000"};
+    for (int round = 0; round < NR_REPLY_ROUNDS && t->ok; round++)
+    {
+        char *reply = (char *)process_cmd(t->hmap, 4, argv);
+        int nr_keys = 0;
+        t->ok = reply && strncmp(reply, "0 ", 2) == 0;
+        for (char *key = reply ? strchr(reply, ' ') : NULL; t->ok && key; key = strchr(key + 1, ' '))
+        {
+            t->ok = key[1] == t->prefix;
+            nr_keys++;
+        }
+        t->ok = t->ok && nr_keys == NR_REPLY_KEYS;
+    }
+    return NULL;
+}
+
+// Threads running commands on separate tables at once each get their own replies
+static void check_replies(void)
+{
+    struct reply_thread threads[2] = {{.prefix = 'a', .ok = true}, {.prefix = 'b', .ok = true}};
+    pthread_t ids[2];
+    for (int t = 0; t < 2; t++)
+    {
+        threads[t].hmap = KV_init(KV_initial_capacity(), KV_hash_function, KV_STRING, false);
+        assert(threads[t].hmap);
+        char fmt[] = {threads[t].prefix, '%', 'd', '\0'};
+        for (int i = 0; i < NR_REPLY_KEYS; i++)
+        {
+            assert(set(threads[t].hmap, fmt, i, "v") == 0);
+        }
+    }
+    for (int t = 0; t < 2; t++)
+    {
+        pthread_create(&ids[t], NULL, scan_replies, &threads[t]);
+    }
+    for (int t = 0; t < 2; t++)
+    {
+        pthread_join(ids[t], NULL);
+        KV_drop(threads[t].hmap);
+    }
+    check("threads get their own command replies", threads[0].ok && threads[1].ok);
+}
+
+int main(void)
+{
+    check_scan();
+    check_index();
+    check_setrange();
+    check_cas();
+    check_load();
+    check_rebuild();
+    check_defrag();
+    check_replies();
+
+    KV_destroy();
+    return nr_failed ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Checks for libsikv's views, run with make test-libsikv. Readers on several threads hold views of a
+ * small and a large value while a writer overwrites, appends to and deletes them, and keep holding
+ * them past sikv_close; every view has to keep the bytes it was taken with.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "libsikv.h"
+#include "sikv.h"
+
+#define NR_READERS 3
+#define NR_READS 2000
+#define BIG_LEN (2 * LARGE_VALUE_SIZE)
+
+static int nr_failed;
+static sikv_t *db;
+static bool stop;
+static uint64_t nr_writes;
+
+static void check(const char *name, bool ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    nr_failed += !ok;
+}
+
+// "big" is always one letter repeated, so a view that saw two writes mixes letters
+static bool big_intact(const sikv_view_t *view)
+{
+    if (view->len < BIG_LEN || view->data[view->len] != '\0')
+    {
+        return false;
+    }
+    for (size_t i = 0; i < view->len; i++)
+    {
+        if (view->data[i] != view->data[0])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// "small" is "w" and the number of the write, or "x" after a delete and set
+static bool small_intact(const sikv_view_t *view)
+{
+    if (view->data[view->len] != '\0' || strlen(view->data) != view->len)
+    {
+        return false;
+    }
+    return strcmp(view->data, "x") == 0 || (view->len > 1 && view->data[0] == 'w' && strspn(&view->data[1], "0123456789") == view->len - 1);
+}
+
+static void *writer(void *arg)
+{
+    char *big = (char *)malloc(BIG_LEN);
+    assert(big);
+    for (uint64_t i = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); i++)
+    {
+        char val[32];
+        int len = snprintf(val, sizeof(val), "w%lu", i);
+        assert(sikv_set(db, "small", 5, val, len) == 0);
+        memset(big, 'a' + i % 26, BIG_LEN);
+        assert(sikv_set(db, "big", 3, big, BIG_LEN) == 0);
+        // Grows the large value in place unless a view holds it
+        assert(sikv_append(db, "big", 3, big, 1) == BIG_LEN + 1);
+        if (i % 4 == 0)
+        {
+            assert(sikv_del(db, "small", 5) == 0 && sikv_set(db, "small", 5, "x", 1) == 0);
+        }
+        __atomic_add_fetch(&nr_writes, 1, __ATOMIC_RELEASE);
+    }
+    free(big);
+    return NULL;
+}
+
+// Waits for the writer to get through n more rounds
+static void wait_writes(uint64_t n)
+{
+    uint64_t start = __atomic_load_n(&nr_writes, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&nr_writes, __ATOMIC_ACQUIRE) < start + n)
+    {
+        sched_yield();
+    }
+}
+
+static void *reader(void *arg)
+{
+    bool *ok = (bool *)arg;
+    const char *keys[] = {"small", "big"};
+    const size_t key_lens[] = {5, 3};
+    for (int i = 0; i < NR_READS && *ok; i++)
+    {
+        sikv_view_t views[2];
+        // "small" is missing between the writer's delete and set
+        *ok = sikv_mget(db, 2, keys, key_lens, views) >= 1 && views[1].data != NULL;
+        // A reader holding views must not keep the writer, or itself, from writing
+        *ok = *ok && sikv_set(db, "mine", 4, "1", 1) == 0;
+        if (i % 100 == 0)
+        {
+            wait_writes(2);
+        }
+        *ok = *ok && (views[0].data == NULL || small_intact(&views[0])) && big_intact(&views[1]);
+        sikv_view_release(&views[0]);
+        sikv_view_release(&views[1]);
+    }
+    return NULL;
+}
+
+static void check_writes(void)
+{
+    bool ok[NR_READERS];
+    pthread_t writer_thread, readers[NR_READERS];
+    char *big = (char *)malloc(BIG_LEN);
+    assert(big);
+    memset(big, 'a', BIG_LEN);
+    assert(sikv_set(db, "big", 3, big, BIG_LEN) == 0 && sikv_set(db, "small", 5, "x", 1) == 0);
+    free(big);
+
+    pthread_create(&writer_thread, NULL, writer, NULL);
+    for (int i = 0; i < NR_READERS; i++)
+    {
+        ok[i] = true;
+        pthread_create(&readers[i], NULL, reader, &ok[i]);
+    }
+    bool all_ok = true;
+    for (int i = 0; i < NR_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+        all_ok = all_ok && ok[i];
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    pthread_join(writer_thread, NULL);
+    check("views keep their bytes across writes on other threads", all_ok);
+}
+
+struct holder
+{
+    pthread_barrier_t *taken;
+    pthread_barrier_t *closed;
+    bool ok;
+};
+
+// Takes views, lets the main thread close the handle, then reads them
+static void *holder(void *arg)
+{
+    struct holder *h = (struct holder *)arg;
+    sikv_view_t big, small;
+    h->ok = sikv_get_view(db, "big", 3, &big) == 0 && sikv_get_view(db, "small", 5, &small) == 0;
+    pthread_barrier_wait(h->taken);
+    pthread_barrier_wait(h->closed);
+    h->ok = h->ok && big_intact(&big) && small_intact(&small);
+    sikv_view_release(&big);
+    sikv_view_release(&small);
+    return NULL;
+}
+
+static void check_close(void)
+{
+    pthread_barrier_t taken, closed;
+    pthread_t threads[NR_READERS];
+    struct holder holders[NR_READERS];
+    pthread_barrier_init(&taken, NULL, NR_READERS + 1);
+    pthread_barrier_init(&closed, NULL, NR_READERS + 1);
+    for (int i = 0; i < NR_READERS; i++)
+    {
+        holders[i] = (struct holder){.taken = &taken, .closed = &closed};
+        pthread_create(&threads[i], NULL, holder, &holders[i]);
+    }
+    pthread_barrier_wait(&taken);
+    sikv_close(db);
+    db = NULL;
+    pthread_barrier_wait(&closed);
+
+    bool ok = true;
+    for (int i = 0; i < NR_READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ok = ok && holders[i].ok;
+    }
+    pthread_barrier_destroy(&taken);
+    pthread_barrier_destroy(&closed);
+    check("views stay readable after sikv_close", ok);
+}
+
+int main(void)
+{
+    db = sikv_open(NULL);
+    assert(db);
+    check_writes();
+    check_close();
+    return nr_failed ? 1 : 0;
+}
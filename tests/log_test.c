@@ -0,0 +1,74 @@
+/*
+ * Checks for the asynchronous logger, run with make test-log. Threads that log and exit straight
+ * away must get every message written out, and their rings freed rather than kept for good.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define NR_THREADS 100
+#define LOG_PATH "tests/log_test.log"
+
+static int nr_failed;
+
+static void check(const char *name, bool ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    nr_failed += !ok;
+}
+
+static size_t heap_used(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static void *log_and_exit(void *arg)
+{
+    KV_log_write(LL_WARNING, "thread %d", (int)(intptr_t)arg);
+    return NULL;
+}
+
+int main(void)
+{
+    unlink(LOG_PATH);
+    if (KV_log_init(LOG_PATH) < 0)
+    {
+        return 1;
+    }
+
+    // Each thread's ring is created by its first message
+    size_t used = heap_used();
+    for (int i = 0; i < NR_THREADS; i++)
+    {
+        pthread_t thread;
+        pthread_create(&thread, NULL, log_and_exit, (void *)(intptr_t)i);
+        pthread_join(thread, NULL);
+    }
+    usleep(LOG_FLUSH_INTERVAL_MS * 10 * 1000);
+    // Kept, the rings would take NR_THREADS times this
+    size_t grown = heap_used() - used;
+    check("rings of exited threads are freed", grown < LOG_RING_SLOTS * LOG_MSG_LEN);
+    KV_log_shutdown();
+
+    FILE *f = fopen(LOG_PATH, "r");
+    char line[LOG_MSG_LEN + 128];
+    int nr_lines = 0;
+    while (f && fgets(line, sizeof(line), f))
+    {
+        nr_lines += strstr(line, " thread ") != NULL;
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+    unlink(LOG_PATH);
+    check("messages of exited threads are all written", nr_lines == NR_THREADS);
+    return nr_failed ? 1 : 0;
+}
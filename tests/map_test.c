@@ -0,0 +1,124 @@
+/*
+ * Checks for sikv_map.h: the INT64 and STR instances against a plain array of the keys they should
+ * hold, through growth, deletes and tombstone reuse. Run with make test-map
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include "sikv_map.h"
+
+#define NR_KEYS 100000
+
+SIKV_MAP_INIT_INT64(ids, uint64_t)
+SIKV_MAP_INIT_STR(names, int)
+
+static void test_hash(void)
+{
+    uint64_t hash[2];
+
+    // Published MurmurHash3_x64_128 values
+    MurmurHash3_x64_128_inline("hello", 5, 0, hash);
+    assert(hash[0] == 0xcbd8a7b341bd9b02LLU && hash[1] == 0x5b1e906a48ae1d19LLU);
+    MurmurHash3_x64_128_inline("", 0, 0, hash);
+    assert(hash[0] == 0 && hash[1] == 0);
+    assert(sikv_map_str_hash("hello") == 0xcbd8a7b341bd9b02LLU);
+
+    // Both halves of the 64-bit hash reach the slot index
+    uint64_t high = 0;
+    for (uint64_t key = 0; key < 64; key++)
+    {
+        high |= sikv_map_int64_hash(key) >> 32;
+        high |= sikv_map_str_hash((char[]){'a' + key % 26, 'a' + key / 26, '\0'}) >> 32;
+    }
+    assert(high == UINT32_MAX);
+}
+
+static void test_int64(void)
+{
+    static bool present[NR_KEYS];
+    sikv_map_ids_t *m = sikv_map_init_ids(0);
+    assert(m);
+
+    // Keys past 2^32 that differ only in their high half
+    for (uint64_t i = 0; i < NR_KEYS; i++)
+    {
+        assert(sikv_map_put_ids(m, i << 32, i) >= 0);
+        present[i] = true;
+    }
+    assert(m->len == NR_KEYS);
+    for (uint64_t i = 0; i < NR_KEYS; i += 3)
+    {
+        assert(sikv_map_del_ids(m, i << 32) == 0);
+        assert(sikv_map_del_ids(m, i << 32) < 0);
+        present[i] = false;
+    }
+    // Deleted slots are reused without the table filling up
+    for (int round = 0; round < 10; round++)
+    {
+        for (uint64_t i = 0; i < NR_KEYS; i += 3)
+        {
+            assert(sikv_map_put_ids(m, i << 32, i + 1) >= 0);
+            assert(sikv_map_del_ids(m, i << 32) == 0);
+        }
+    }
+
+    uint64_t live = 0;
+    for (uint64_t i = 0; i < NR_KEYS; i++)
+    {
+        uint64_t *val = sikv_map_get_ids(m, i << 32);
+        assert((val != NULL) == present[i]);
+        assert(val == NULL || *val == i);
+        assert(sikv_map_get_ids(m, i) == NULL || i == 0);
+        live += present[i];
+    }
+    uint64_t seen = 0;
+    sikv_map_foreach(m, slot)
+    {
+        assert(present[m->keys[slot] >> 32]);
+        seen++;
+    }
+    assert(m->len == live && seen == live);
+    sikv_map_destroy_ids(m);
+}
+
+static void test_str(void)
+{
+    static char keys[NR_KEYS][16];
+    sikv_map_names_t *m = sikv_map_init_names(4);
+    assert(m);
+
+    for (int i = 0; i < NR_KEYS; i++)
+    {
+        snprintf(keys[i], sizeof(keys[i]), "key:%d", i);
+        assert(sikv_map_put_names(m, keys[i], i) >= 0);
+    }
+    // Overwrites keep one entry per key, and lookups compare contents rather than pointers
+    for (int i = 0; i < NR_KEYS; i += 2)
+    {
+        char key[16];
+        snprintf(key, sizeof(key), "key:%d", i);
+        assert(sikv_map_put_names(m, keys[i], -i) >= 0);
+        assert(*sikv_map_get_names(m, key) == -i);
+    }
+    assert(m->len == NR_KEYS);
+    for (int i = 1; i < NR_KEYS; i += 2)
+    {
+        assert(sikv_map_del_names(m, keys[i]) == 0);
+    }
+    for (int i = 0; i < NR_KEYS; i++)
+    {
+        int *val = sikv_map_get_names(m, keys[i]);
+        assert(i % 2 ? val == NULL : val && *val == -i);
+    }
+    assert(sikv_map_get_names(m, "key:") == NULL && m->len == NR_KEYS / 2);
+    sikv_map_destroy_names(m);
+}
+
+int main(void)
+{
+    test_hash();
+    test_int64();
+    test_str();
+    printf("sikv_map: all tests passed\n");
+    return 0;
+}
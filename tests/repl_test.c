@@ -0,0 +1,443 @@
+/*
+ * Replication over loopback, run with make test-repl: a primary and a replica as two processes of
+ * ./main.out. The replica syncs a table with a value larger than REPL_OUTPUT_LIMIT while the
+ * primary takes writes, then has to match it key for key; then the primary goes away and comes back
+ * and the replica has to stay responsive and sync again. Pass --io-uring to run both on io_uring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define PRIMARY_PORT 18107
+#define REPLICA_PORT 18108
+#define NR_KEYS 200000
+#define NR_DB1_KEYS 1000
+#define BIG_LEN (80UL * 1024 * 1024)
+#define BATCH 1000
+
+struct client
+{
+    int fd;
+    char *buf;
+    size_t len;
+    size_t off;
+    size_t cap;
+};
+
+static const char *backend = NULL;
+static char primary_log[64];
+static pid_t primary_pid, replica_pid;
+static int nr_failed;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void check(const char *name, bool ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    fflush(stdout);
+    nr_failed += !ok;
+}
+
+static pid_t spawn(int port, bool replica)
+{
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    char primary_port[16];
+    snprintf(primary_port, sizeof(primary_port), "%d", PRIMARY_PORT);
+
+    char *argv[16] = {"./main.out", "127.0.0.1", port_str, "--databases", "2", "--loglevel", "warning"};
+    int argc = 7;
+    if (replica)
+    {
+        argv[argc++] = "--replicaof";
+        argv[argc++] = "127.0.0.1";
+        argv[argc++] = primary_port;
+    }
+    else
+    {
+        argv[argc++] = "--logfile";
+        argv[argc++] = primary_log;
+    }
+    if (backend)
+    {
+        argv[argc++] = (char *)backend;
+    }
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(127);
+    }
+    return pid;
+}
+
+// SIGINT, so that the server writes out its log before exiting
+static void stop(pid_t *pid)
+{
+    if (*pid > 0)
+    {
+        kill(*pid, SIGINT);
+        waitpid(*pid, NULL, 0);
+        *pid = 0;
+    }
+}
+
+static void stop_all(void)
+{
+    stop(&primary_pid);
+    stop(&replica_pid);
+}
+
+static struct client *client_connect(int port)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    for (int tries = 0; tries < 100; tries++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            struct client *c = calloc(1, sizeof(struct client));
+            c->fd = fd;
+            return c;
+        }
+        close(fd);
+        usleep(50000);
+    }
+    fprintf(stderr, "Unable to connect to port %d\n", port);
+    exit(EXIT_FAILURE);
+}
+
+static void client_close(struct client *c)
+{
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static void send_all(struct client *c, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(c->fd, buf, len);
+        if (n <= 0)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// The next reply line without its newline, valid until the next call
+static char *reply(struct client *c, size_t *len)
+{
+    size_t seen = c->off; // searched for the newline up to here
+    for (;;)
+    {
+        char *nl = memchr(&c->buf[seen], '\n', c->len - seen);
+        if (nl)
+        {
+            char *line = &c->buf[c->off];
+            *nl = '\0';
+            *len = nl - line;
+            c->off += *len + 1;
+            return line;
+        }
+        memmove(c->buf, &c->buf[c->off], c->len - c->off);
+        c->len -= c->off;
+        c->off = 0;
+        seen = c->len;
+        if (c->len == c->cap)
+        {
+            c->cap = c->cap ? c->cap * 2 : 64 * 1024;
+            c->buf = realloc(c->buf, c->cap);
+        }
+        ssize_t n = read(c->fd, &c->buf[c->len], c->cap - c->len);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Connection closed by the server\n");
+            exit(EXIT_FAILURE);
+        }
+        c->len += n;
+    }
+}
+
+static char *cmd(struct client *c, const char *line)
+{
+    size_t len;
+    send_all(c, line, strlen(line));
+    return reply(c, &len);
+}
+
+// Sends the batch of lines in out and drops their replies
+static void pipeline(struct client *c, const char *out, int nr_lines)
+{
+    size_t len;
+    send_all(c, out, strlen(out));
+    for (int i = 0; i < nr_lines; i++)
+    {
+        reply(c, &len);
+    }
+}
+
+// "replica <host> <port> <state> <offset>" or "primary <replid> <offset> <replicas>"
+static void role(struct client *c, char *state, uint64_t *offset)
+{
+    char *line = cmd(c, "ROLE\n");
+    if (sscanf(line, "replica %*s %*d %31s %lu", state, offset) != 2 && sscanf(line, "primary %*s %lu", offset) != 1)
+    {
+        fprintf(stderr, "Unexpected ROLE reply: %s\n", line);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static bool wait_synced(struct client *primary, struct client *replica, int timeout_ms)
+{
+    char state[32] = "";
+    uint64_t primary_offset, replica_offset;
+    for (uint64_t start = now_ms(); now_ms() - start < (uint64_t)timeout_ms; usleep(20000))
+    {
+        role(primary, state, &primary_offset);
+        role(replica, state, &replica_offset);
+        if (strcmp(state, "streaming") == 0 && replica_offset == primary_offset)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void fill(struct client *primary)
+{
+    static char out[BATCH * 64];
+    for (int i = 0; i < NR_KEYS; i += BATCH)
+    {
+        int off = 0;
+        for (int j = i; j < i + BATCH; j++)
+        {
+            off += sprintf(&out[off], "SET k%d v%d\n", j, j);
+        }
+        pipeline(primary, out, BATCH);
+    }
+
+    cmd(primary, "SELECT 1\n");
+    for (int i = 0; i < NR_DB1_KEYS; i++)
+    {
+        char line[64];
+        sprintf(line, "SET d%d w%d\n", i, i);
+        cmd(primary, line);
+    }
+    cmd(primary, "SELECT 0\n");
+
+    char *big = malloc(BIG_LEN + 64);
+    int off = sprintf(big, "SETBULK big %lu\n", BIG_LEN);
+    for (size_t i = 0; i < BIG_LEN; i++)
+    {
+        big[off + i] = 'a' + i % 26;
+    }
+    big[off + BIG_LEN] = '\n';
+    big[off + BIG_LEN + 1] = '\0';
+    char *ret = cmd(primary, big);
+    if (strcmp(ret, "Ok") != 0)
+    {
+        fprintf(stderr, "SETBULK: %s\n", ret);
+        exit(EXIT_FAILURE);
+    }
+    free(big);
+}
+
+// Writes of every kind to keys the snapshot has and has not got to yet, some to keyspace 1
+static void write_round(struct client *primary, int round)
+{
+    static char out[BATCH * 64];
+    int off = 0;
+    int nr_lines = 0;
+    for (int j = 0; j < BATCH / 8; j++)
+    {
+        int k = (round * 7919 + j * 1543) % NR_KEYS;
+        off += sprintf(&out[off], "APPEND k%d a%d\n", k, round);
+        off += sprintf(&out[off], "SETRANGE k%d 1 r\n", (k + 1) % NR_KEYS);
+        off += sprintf(&out[off], "DEL k%d\n", (k + 2) % NR_KEYS);
+        off += sprintf(&out[off], "APPEND n%d x\n", k);
+        off += sprintf(&out[off], "SELECT 1\n");
+        off += sprintf(&out[off], "APPEND d%d b\n", k % NR_DB1_KEYS);
+        off += sprintf(&out[off], "SELECT 0\n");
+        nr_lines += 7;
+    }
+    pipeline(primary, out, nr_lines);
+}
+
+// Every key either side may hold, compared reply for reply
+static bool same_keys(struct client *primary, struct client *replica)
+{
+    static char out[BATCH * 32];
+    char **replies = malloc(BATCH * sizeof(char *));
+    bool same = true;
+
+    for (int db = 0; db < 2 && same; db++)
+    {
+        char select[16];
+        sprintf(select, "SELECT %d\n", db);
+        cmd(primary, select);
+        cmd(replica, select);
+        int nr_keys = db ? NR_DB1_KEYS : NR_KEYS;
+        for (int prefix = 0; prefix < (db ? 1 : 2) && same; prefix++)
+        {
+            for (int i = 0; i < nr_keys && same; i += BATCH)
+            {
+                int n = nr_keys - i < BATCH ? nr_keys - i : BATCH;
+                int off = 0;
+                for (int j = i; j < i + n; j++)
+                {
+                    off += sprintf(&out[off], "GET %c%d\n", db ? 'd' : "kn"[prefix], j);
+                }
+                send_all(primary, out, off);
+                send_all(replica, out, off);
+                for (int j = 0; j < n; j++)
+                {
+                    size_t len;
+                    replies[j] = strdup(reply(primary, &len));
+                }
+                for (int j = 0; j < n; j++)
+                {
+                    size_t len;
+                    char *got = reply(replica, &len);
+                    if (same && strcmp(got, replies[j]) != 0)
+                    {
+                        fprintf(stderr, "Keyspace %d key %c%d: primary %s, replica %s\n", db, db ? 'd' : "kn"[prefix], i + j, replies[j], got);
+                        same = false;
+                    }
+                    free(replies[j]);
+                }
+            }
+        }
+    }
+    cmd(primary, "SELECT 0\n");
+    cmd(replica, "SELECT 0\n");
+    free(replies);
+    return same;
+}
+
+static bool logged(const char *path, const char *text)
+{
+    static char buf[1 << 20];
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    return strstr(buf, text) != NULL;
+}
+
+static bool same_big(struct client *primary, struct client *replica)
+{
+    size_t len, replica_len;
+    send_all(primary, "GET big\n", 8);
+    char *val = reply(primary, &len);
+    char *copy = malloc(len);
+    memcpy(copy, val, len);
+    send_all(replica, "GET big\n", 8);
+    val = reply(replica, &replica_len);
+    bool same = len == BIG_LEN && replica_len == len && memcmp(copy, val, len) == 0;
+    free(copy);
+    return same;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        backend = argv[1];
+    }
+    atexit(stop_all);
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(primary_log, sizeof(primary_log), "/tmp/repl_test.%d.log", getpid());
+    unlink(primary_log);
+
+    primary_pid = spawn(PRIMARY_PORT, false);
+    struct client *primary = client_connect(PRIMARY_PORT);
+    fill(primary);
+
+    // Written to while the snapshot, which holds a value above the replica output limit, goes out
+    replica_pid = spawn(REPLICA_PORT, true);
+    struct client *replica = client_connect(REPLICA_PORT);
+    char state[32] = "";
+    uint64_t offset;
+    int rounds = 0, rounds_in_transfer = 0;
+    for (uint64_t start = now_ms(); now_ms() - start < 60000; rounds++)
+    {
+        write_round(primary, rounds);
+        role(replica, state, &offset);
+        if (strcmp(state, "streaming") == 0)
+        {
+            break;
+        }
+        rounds_in_transfer += strcmp(state, "transfer") == 0;
+    }
+    write_round(primary, rounds);
+    printf("%d write rounds during the transfer\n", rounds_in_transfer);
+    check("replica syncs while the primary takes writes", wait_synced(primary, replica, 30000));
+    check("replica keys match the primary", same_keys(primary, replica));
+    check("replica holds a value above the output limit", same_big(primary, replica));
+
+    // The replica keeps serving while it tries to reach a primary that is not there
+    client_close(primary);
+    stop(&primary_pid);
+    check("primary keeps the replica while the snapshot goes out", !logged(primary_log, "Dropping replica"));
+    unlink(primary_log);
+    uint64_t slowest = 0;
+    for (int i = 0; i < 30; i++)
+    {
+        uint64_t start = now_ms();
+        role(replica, state, &offset);
+        if (now_ms() - start > slowest)
+        {
+            slowest = now_ms() - start;
+        }
+        usleep(50000);
+    }
+    printf("slowest ROLE without a primary: %lums\n", slowest);
+    check("replica answers without a primary", slowest < 200 && strcmp(state, "streaming") != 0);
+
+    // A new primary has a new replication id, so the replica copies its (empty) table
+    primary_pid = spawn(PRIMARY_PORT, false);
+    primary = client_connect(PRIMARY_PORT);
+    cmd(primary, "SET after restart\n");
+    bool ok = wait_synced(primary, replica, 10000);
+    size_t len;
+    send_all(replica, "GET after\nGET k1\n", 17);
+    ok = ok && strcmp(reply(replica, &len), "restart") == 0;
+    ok = ok && strcmp(reply(replica, &len), "GET Not found") == 0;
+    check("replica resyncs with a restarted primary", ok);
+
+    client_close(primary);
+    client_close(replica);
+    stop_all();
+    unlink(primary_log);
+    return nr_failed ? 1 : 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Client side caching against a running ./main.out, run with make test-tracking. Connections track
+ * the same key names on two keyspaces, and every write, DEL and FLUSH has to push an invalidation to
+ * the connections tracking it on that keyspace and to no one else.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define PORT 18109
+
+struct client
+{
+    int fd;
+    char buf[4096];
+    size_t len;
+};
+
+static pid_t server_pid;
+static int nr_failed;
+
+static void check(const char *name, bool ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    fflush(stdout);
+    nr_failed += !ok;
+}
+
+static void spawn(void)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", PORT);
+    char *argv[] = {"./main.out", "127.0.0.1", port, "--databases", "2", "--loglevel", "warning", NULL};
+
+    server_pid = fork();
+    if (server_pid == 0)
+    {
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(127);
+    }
+}
+
+static void stop(void)
+{
+    if (server_pid > 0)
+    {
+        kill(server_pid, SIGINT);
+        waitpid(server_pid, NULL, 0);
+        server_pid = 0;
+    }
+}
+
+static struct client *client_connect(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    for (int tries = 0; tries < 100; tries++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            struct client *c = calloc(1, sizeof(struct client));
+            c->fd = fd;
+            return c;
+        }
+        close(fd);
+        usleep(50000);
+    }
+    fprintf(stderr, "Unable to connect to port %d\n", PORT);
+    stop();
+    exit(EXIT_FAILURE);
+}
+
+// The next line, pushes included, without its newline; copied to line
+static void read_line(struct client *c, char *line, size_t size)
+{
+    for (;;)
+    {
+        char *nl = memchr(c->buf, '\n', c->len);
+        if (nl)
+        {
+            size_t len = nl - c->buf;
+            snprintf(line, size, "%.*s", (int)len, c->buf);
+            memmove(c->buf, nl + 1, c->len - len - 1);
+            c->len -= len + 1;
+            return;
+        }
+        ssize_t n = c->len < sizeof(c->buf) ? read(c->fd, &c->buf[c->len], sizeof(c->buf) - c->len) : 0;
+        if (n <= 0)
+        {
+            fprintf(stderr, "Connection closed by the server\n");
+            stop();
+            exit(EXIT_FAILURE);
+        }
+        c->len += n;
+    }
+}
+
+// Sends line and returns its reply. Only for clients with no push waiting
+static char *cmd(struct client *c, const char *line)
+{
+    static char reply[256];
+    if (write(c->fd, line, strlen(line)) != (ssize_t)strlen(line))
+    {
+        perror("write");
+        stop();
+        exit(EXIT_FAILURE);
+    }
+    read_line(c, reply, sizeof(reply));
+    return reply;
+}
+
+/*
+ * Whether the pushes c has had since it last checked are exactly expected, "|" separated without
+ * their carriage returns. Pushes are written ahead of the replies sent after them, so everything
+ * before the reply to a ROLE sent now is what c has been pushed
+ */
+static bool pushed(struct client *c, const char *expected)
+{
+    char got[1024] = "", line[256];
+    if (write(c->fd, "ROLE\n", 5) != 5)
+    {
+        return false;
+    }
+    for (read_line(c, line, sizeof(line)); line[0] == '\r'; read_line(c, line, sizeof(line)))
+    {
+        size_t len = strlen(got);
+        snprintf(&got[len], sizeof(got) - len, "%s%s", len ? "|" : "", &line[1]);
+    }
+    if (strcmp(got, expected) != 0)
+    {
+        fprintf(stderr, "Pushed \"%s\", expected \"%s\"\n", got, expected);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    spawn();
+    // a and b track "k" on keyspaces 0 and 1, w writes and starts on keyspace 0
+    struct client *a = client_connect(), *b = client_connect(), *w = client_connect();
+    bool ok = strcmp(cmd(a, "TRACKING ON\n"), "Ok") == 0 && strcmp(cmd(b, "TRACKING ON\n"), "Ok") == 0;
+    ok = ok && strcmp(cmd(b, "SELECT 1\n"), "Ok") == 0;
+    cmd(a, "GET k\n");
+    cmd(b, "GET k\n");
+    check("tracking is turned on", ok);
+
+    cmd(w, "SET k v0\n");
+    ok = pushed(a, "INVALIDATE k") && pushed(b, "");
+    cmd(a, "GET k\n");
+    cmd(w, "SELECT 1\n");
+    cmd(w, "SET k v1\n");
+    ok = ok && pushed(a, "") && pushed(b, "INVALIDATE k");
+    check("a write invalidates the key on its keyspace only", ok);
+
+    cmd(b, "GET k\n");
+    cmd(w, "SELECT 0\n");
+    cmd(w, "DEL k\n");
+    ok = pushed(a, "INVALIDATE k") && pushed(b, "");
+    // Forgotten once invalidated, until read again
+    cmd(w, "SET k v2\n");
+    ok = ok && pushed(a, "");
+    check("a delete invalidates the key on its keyspace only", ok);
+
+    // c tracks a key on keyspace 0 and then moves to keyspace 1, so it keeps what it cached there
+    struct client *c = client_connect();
+    ok = strcmp(cmd(c, "TRACKING ON\n"), "Ok") == 0;
+    cmd(c, "GET f\n");
+    cmd(c, "SELECT 1\n");
+    cmd(a, "GET k\n");
+    cmd(w, "FLUSH\n");
+    ok = ok && pushed(a, "INVALIDATE") && pushed(b, "") && pushed(c, "INVALIDATE f");
+    cmd(w, "SELECT 1\n");
+    cmd(w, "FLUSH\n");
+    ok = ok && pushed(a, "") && pushed(b, "INVALIDATE") && pushed(c, "INVALIDATE");
+    check("a flush invalidates the keyspace flushed only", ok);
+
+    // Broadcast goes by keyspace and prefix
+    struct client *d = client_connect();
+    ok = strcmp(cmd(d, "TRACKING ON BCAST PREFIX p\n"), "Ok") == 0 && strcmp(cmd(d, "SELECT 1\n"), "Ok") == 0;
+    cmd(w, "SET p1 v\n");
+    cmd(w, "SET q1 v\n");
+    cmd(w, "SELECT 0\n");
+    cmd(w, "SET p2 v\n");
+    ok = ok && pushed(d, "INVALIDATE p1");
+    check("broadcast pushes matching keys on its keyspace only", ok);
+
+    stop();
+    return nr_failed ? 1 : 0;
+}
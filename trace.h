@@ -0,0 +1,39 @@
+#ifndef _SIKV_TRACE_
+#define _SIKV_TRACE_
+
+/*
+ * USDT (statically defined tracing) probes for bpftrace, perf and SystemTap, under the `sikv`
+ * provider. An unattached probe is a single nop in the instruction stream and its arguments are
+ * only read by the tracer, so they cost nothing in production. Needs <sys/sdt.h> (Debian/Ubuntu:
+ * systemtap-sdt-dev); without it, or with SIKV_NO_TRACE defined, the probes compile out.
+ *
+ * Probes and arguments:
+ *   cmd__start(cmd, key)                  command parsed, before it runs; key is NULL when absent
+ *   cmd__done(cmd, ns, probes)            command finished, with its latency and slots probed
+ *   find__probe(slot)                     one slot visited by slot_find()/slot_find_free()
+ *   resize__start(old_capacity, new_capacity)  slot array rebuild started, growing, shrinking or compacting
+ *   resize__done(capacity, ns)            rebuild finished, ns after it started
+ *   entry__alloc(size, ptr)               key/value allocation in entry_init()
+ *   conn__open(fd, type)                  connection accepted (or opened to the primary)
+ *   conn__close(fd, type)
+ */
+
+#if !defined(SIKV_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SIKV_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef SIKV_HAVE_USDT
+#define KV_TRACE1(name, a) DTRACE_PROBE1(sikv, name, a)
+#define KV_TRACE2(name, a, b) DTRACE_PROBE2(sikv, name, a, b)
+#define KV_TRACE3(name, a, b, c) DTRACE_PROBE3(sikv, name, a, b, c)
+#else
+// sizeof keeps the arguments referenced without evaluating them
+#define KV_TRACE1(name, a) ((void)sizeof(a))
+#define KV_TRACE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define KV_TRACE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
+#endif // _SIKV_TRACE_
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "sikv.h"
+#include "server.h"
+#include "sikv_map.h"
+#include "log.h"
+
+/*
+ * Key tracking for client side caching.
+ *
+ * A connection that sends `TRACKING ON` has the keys it GETs remembered, and once one of them is
+ * written or deleted the server pushes `\rINVALIDATE <key>` to it so it can drop its cached copy; a
+ * flush pushes a bare `\rINVALIDATE` to the connections on that keyspace. The leading carriage return is a byte no reply can start with
+ * (the command parser splits on it, so no key or value holds one), which is how clients tell pushes
+ * from replies on the same connection. Sharing the connection also orders every invalidation after
+ * the reply it invalidates. A key is forgotten once it has been invalidated, until it is read again.
+ *
+ * `TRACKING ON BCAST [PREFIX <p> ...]` remembers nothing and instead pushes every change to a key
+ * starting with one of the prefixes, or to any key without one, in the connection's keyspace.
+ *
+ * Readers are remembered by connection id rather than pointer so closed connections need not be
+ * looked for; their ids are skipped and dropped with the key. At most TRACKING_MAX_KEYS keys are
+ * remembered, past which one is invalidated early to make room.
+ */
+
+#define TRACKING_MAX_KEYS (1024 * 1024)
+
+struct tracked_key
+{
+    char *key;
+    uint64_t *ids; // readers, by connection id
+    int nr_ids;
+    int cap;
+};
+
+SIKV_MAP_INIT_STR(tracked, struct tracked_key *)
+SIKV_MAP_INIT_INT64(trackers, struct connection *)
+
+static sikv_map_tracked_t **tables = NULL; // per keyspace
+static sikv_map_trackers_t *trackers = NULL; // connections with tracking on, by id
+static uint64_t nr_tracked = 0;
+static int nr_bcast = 0;
+static int evict_db = 0;
+static char *key_buf = NULL;
+static size_t key_cap = 0;
+
+static void push_invalidate(struct connection *conn, const char *key, size_t key_len)
+{
+    if (key == NULL)
+    {
+        conn_write(conn, "\rINVALIDATE\n", 12);
+        return;
+    }
+    conn_write(conn, "\rINVALIDATE ", 12);
+    conn_write(conn, key, key_len);
+    conn_write(conn, "\n", 1);
+}
+
+static struct connection *tracker(uint64_t id)
+{
+    struct connection **conn = sikv_map_get_trackers(trackers, id);
+    return conn && !(*conn)->closing ? *conn : NULL;
+}
+
+static void tracked_free(struct tracked_key *tk)
+{
+    free(tk->key);
+    free(tk->ids);
+    free(tk);
+}
+
+// Tell every reader of tk and forget it
+static void invalidate_key(sikv_map_tracked_t *table, struct tracked_key *tk)
+{
+    size_t key_len = strlen(tk->key);
+    for (int i = 0; i < tk->nr_ids; i++)
+    {
+        struct connection *conn = tracker(tk->ids[i]);
+        if (conn && !conn->tracking_bcast)
+        {
+            push_invalidate(conn, tk->key, key_len);
+        }
+    }
+    sikv_map_del_tracked(table, tk->key);
+    tracked_free(tk);
+    nr_tracked--;
+}
+
+static void evict_one(void)
+{
+    for (int i = 0; i < server_nr_dbs(); i++, evict_db = (evict_db + 1) % server_nr_dbs())
+    {
+        sikv_map_tracked_t *table = tables[evict_db];
+        if (table == NULL || table->len == 0)
+        {
+            continue;
+        }
+        // Start from a random slot so the same few keys are not evicted over and over
+        uint64_t start = rand() & (table->capacity - 1);
+        for (uint64_t j = 0; j < table->capacity; j++)
+        {
+            uint64_t slot = (start + j) & (table->capacity - 1);
+            if (table->flags[slot] == SIKV_MAP_LIVE)
+            {
+                invalidate_key(table, table->vals[slot]);
+                return;
+            }
+        }
+    }
+}
+
+static bool prefix_match(struct connection *conn, const char *key, size_t key_len)
+{
+    if (conn->nr_prefixes == 0)
+    {
+        return true;
+    }
+    for (int i = 0; i < conn->nr_prefixes; i++)
+    {
+        size_t len = strlen(conn->prefixes[i]);
+        if (len <= key_len && memcmp(conn->prefixes[i], key, len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void tracking_notify(void *arg, struct hash_map *hmap, const char *key, int key_len)
+{
+    int db = (int)(intptr_t)arg;
+    sikv_map_tracked_t *table = tables[db];
+
+    if (trackers->len == 0 && nr_tracked == 0)
+    {
+        return;
+    }
+
+    if (key == NULL)
+    {
+        // Connections on the flushed keyspace drop everything; readers that have since selected
+        // another keyspace are told key by key, so what they cached from there survives
+        if (table)
+        {
+            sikv_map_foreach(table, i)
+            {
+                struct tracked_key *tk = table->vals[i];
+                for (int j = 0; j < tk->nr_ids; j++)
+                {
+                    struct connection *conn = tracker(tk->ids[j]);
+                    if (conn && !conn->tracking_bcast && conn->db != db)
+                    {
+                        push_invalidate(conn, tk->key, strlen(tk->key));
+                    }
+                }
+                tracked_free(tk);
+            }
+            nr_tracked -= table->len;
+            sikv_map_destroy_tracked(table);
+            tables[db] = NULL;
+        }
+        sikv_map_foreach(trackers, i)
+        {
+            if (!trackers->vals[i]->closing && trackers->vals[i]->db == db)
+            {
+                push_invalidate(trackers->vals[i], NULL, 0);
+            }
+        }
+        return;
+    }
+
+    if (table && table->len)
+    {
+        // Remembered keys are strings, the table's are not terminated
+        if (key_cap < (size_t)key_len + 1)
+        {
+            char *buf = realloc(key_buf, key_len + 1);
+            if (buf == NULL)
+            {
+                perror("tracking_notify: Unable to grow key buffer");
+                return;
+            }
+            key_buf = buf;
+            key_cap = key_len + 1;
+        }
+        memcpy(key_buf, key, key_len);
+        key_buf[key_len] = '\0';
+
+        struct tracked_key **tk = sikv_map_get_tracked(table, key_buf);
+        if (tk)
+        {
+            invalidate_key(table, *tk);
+        }
+    }
+
+    for (uint64_t i = 0; nr_bcast && i < trackers->capacity; i++)
+    {
+        struct connection *conn = trackers->vals[i];
+        if (trackers->flags[i] == SIKV_MAP_LIVE && conn->tracking_bcast && !conn->closing && conn->db == db &&
+            prefix_match(conn, key, key_len))
+        {
+            push_invalidate(conn, key, key_len);
+        }
+    }
+}
+
+// Remember that conn read key. Called for every GET on a tracking connection, hit or miss
+void tracking_read(struct connection *conn, const char *key)
+{
+    if (!conn->tracking || conn->tracking_bcast)
+    {
+        return;
+    }
+
+    sikv_map_tracked_t *table = tables[conn->db];
+    if (table == NULL && (table = tables[conn->db] = sikv_map_init_tracked(0)) == NULL)
+    {
+        return;
+    }
+
+    struct tracked_key **found = sikv_map_get_tracked(table, key);
+    struct tracked_key *tk = found ? *found : NULL;
+    if (tk == NULL)
+    {
+        if (nr_tracked >= TRACKING_MAX_KEYS)
+        {
+            evict_one();
+        }
+        tk = (struct tracked_key *)calloc(1, sizeof(struct tracked_key));
+        if (tk == NULL || (tk->key = strdup(key)) == NULL || sikv_map_put_tracked(table, tk->key, tk) < 0)
+        {
+            if (tk)
+            {
+                free(tk->key);
+            }
+            free(tk);
+            KV_log(LL_WARNING, "tracking_read: Unable to remember key");
+            return;
+        }
+        nr_tracked++;
+    }
+
+    for (int i = 0; i < tk->nr_ids; i++)
+    {
+        if (tk->ids[i] == conn->id)
+        {
+            return;
+        }
+    }
+    if (tk->nr_ids == tk->cap)
+    {
+        int cap = tk->cap ? tk->cap * 2 : 2;
+        uint64_t *ids = realloc(tk->ids, cap * sizeof(uint64_t));
+        if (ids == NULL)
+        {
+            KV_log(LL_WARNING, "tracking_read: Unable to remember reader");
+            return;
+        }
+        tk->ids = ids;
+        tk->cap = cap;
+    }
+    tk->ids[tk->nr_ids++] = conn->id;
+}
+
+static void tracking_off(struct connection *conn)
+{
+    if (!conn->tracking)
+    {
+        return;
+    }
+    if (conn->tracking_bcast)
+    {
+        nr_bcast--;
+    }
+    for (int i = 0; i < conn->nr_prefixes; i++)
+    {
+        free(conn->prefixes[i]);
+    }
+    free(conn->prefixes);
+    conn->prefixes = NULL;
+    conn->nr_prefixes = 0;
+    conn->tracking = false;
+    conn->tracking_bcast = false;
+    sikv_map_del_trackers(trackers, conn->id);
+}
+
+// TRACKING ON [BCAST] [PREFIX <prefix> ...] | OFF
+void tracking_cmd(struct connection *conn, int argc, char *argv[])
+{
+    const char *err = NULL;
+    bool bcast = false;
+    int nr_prefixes = 0;
+
+    if (argc < 2 || (strcasecmp(argv[1], "ON") != 0 && strcasecmp(argv[1], "OFF") != 0))
+    {
+        err = "ERR TRACKING takes ON or OFF\n";
+    }
+    for (int i = 2; err == NULL && i < argc; i++)
+    {
+        if (strcasecmp(argv[i], "BCAST") == 0)
+        {
+            bcast = true;
+        }
+        else if (strcasecmp(argv[i], "PREFIX") == 0 && i + 1 < argc)
+        {
+            nr_prefixes++;
+            i++;
+        }
+        else
+        {
+            err = "ERR TRACKING syntax error\n";
+        }
+    }
+    if (err == NULL && nr_prefixes && !bcast)
+    {
+        err = "ERR TRACKING PREFIX needs BCAST\n";
+    }
+    if (err)
+    {
+        conn_write(conn, err, strlen(err));
+        return;
+    }
+
+    tracking_off(conn);
+    if (strcasecmp(argv[1], "OFF") == 0)
+    {
+        conn_write(conn, "Ok\n", 3);
+        return;
+    }
+
+    bool oom = false;
+    if (nr_prefixes)
+    {
+        conn->prefixes = (char **)calloc(nr_prefixes, sizeof(char *));
+        oom = conn->prefixes == NULL;
+        for (int i = 2; !oom && i < argc; i++)
+        {
+            if (strcasecmp(argv[i], "PREFIX") == 0)
+            {
+                char *prefix = strdup(argv[++i]);
+                oom = prefix == NULL;
+                conn->prefixes[conn->nr_prefixes] = prefix;
+                conn->nr_prefixes += !oom;
+            }
+        }
+    }
+    // On from here so tracking_off releases whatever was set up
+    conn->tracking = true;
+    if (oom || sikv_map_put_trackers(trackers, conn->id, conn) < 0)
+    {
+        tracking_off(conn);
+        err = "ERR TRACKING out of memory\n";
+        conn_write(conn, err, strlen(err));
+        return;
+    }
+    conn->tracking_bcast = bcast;
+    nr_bcast += bcast;
+    conn_write(conn, "Ok\n", 3);
+}
+
+void tracking_conn_closed(struct connection *conn)
+{
+    tracking_off(conn);
+}
+
+// Watch every keyspace. Called once the keyspaces exist
+void tracking_init(void)
+{
+    tables = (sikv_map_tracked_t **)calloc(server_nr_dbs(), sizeof(sikv_map_tracked_t *));
+    trackers = sikv_map_init_trackers(0);
+    if (tables == NULL || trackers == NULL)
+    {
+        perror("tracking_init: Unable to allocate tracking tables");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < server_nr_dbs(); i++)
+    {
+        KV_set_notify(server_db(i), tracking_notify, (void *)(intptr_t)i);
+    }
+}
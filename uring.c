@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "sikv.h"
+#include "server.h"
+#include "log.h"
+
+/*
+ * io_uring network backend.
+ *
+ * One multishot accept on the listening socket and one multishot recv per connection, receiving
+ * into a ring of provided buffers, keep reads going without resubmitting. Replies queued while
+ * handling a batch of completions are submitted together with the wait for the next batch, so a
+ * loop iteration costs a single io_uring_enter however many clients it served.
+ *
+ * Talks to the kernel through the raw syscalls; liburing is not required.
+ */
+
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+
+#define URING_ENTRIES 1024
+#define URING_BUF_COUNT 1024 // power of two
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+// user_data carries the connection pointer, or for accepts the listening socket, with the operation in the low bits
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_TIMEOUT 4
+#define OP_CANCEL 5
+#define OP_MASK 7UL
+
+struct uring
+{
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_ptr_len;
+    void *cq_ptr;
+    size_t cq_ptr_len;
+    size_t sqes_len;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+};
+
+static struct uring ring;
+static int listen_fd = -1;
+static struct __kernel_timespec cron_ts = {.tv_sec = 0, .tv_nsec = CRON_INTERVAL_MS * 1000000L};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_teardown(struct uring *r)
+{
+    if (r->br)
+    {
+        munmap(r->br, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(r->bufs);
+    if (r->sqes)
+    {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+    {
+        munmap(r->cq_ptr, r->cq_ptr_len);
+    }
+    if (r->sq_ptr)
+    {
+        munmap(r->sq_ptr, r->sq_ptr_len);
+    }
+    if (r->fd >= 0)
+    {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(struct uring));
+    r->fd = -1;
+}
+
+static int ring_setup(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0)
+    {
+        r->fd = -1;
+        return -1;
+    }
+
+    r->sq_ptr_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ptr_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_ptr_len > r->sq_ptr_len)
+        {
+            r->sq_ptr_len = r->cq_ptr_len;
+        }
+        r->cq_ptr_len = r->sq_ptr_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_ptr_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+    {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_ptr_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+        {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_entries = p.sq_entries;
+    r->sq_khead = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_ktail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->sq_tail = *r->sq_ktail;
+    r->cq_khead = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_ktail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    // Provided buffer ring for multishot recv
+    r->br = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED)
+    {
+        r->br = NULL;
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        goto fail;
+    }
+
+    r->bufs = (char *)malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+    if (r->bufs == NULL)
+    {
+        goto fail;
+    }
+
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++)
+    {
+        struct io_uring_buf *buf = &r->br->bufs[i];
+        buf->addr = (uint64_t)(uintptr_t)&r->bufs[i * URING_BUF_SIZE];
+        buf->len = URING_BUF_SIZE;
+        buf->bid = i;
+    }
+    __atomic_store_n(&r->br->tail, URING_BUF_COUNT, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    ring_teardown(r);
+    return -1;
+}
+
+static void buf_recycle(struct uring *r, unsigned bid)
+{
+    uint16_t tail = r->br->tail;
+    struct io_uring_buf *buf = &r->br->bufs[tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)&r->bufs[bid * URING_BUF_SIZE];
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&r->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_submit(struct uring *r, unsigned wait_nr)
+{
+    unsigned to_submit = r->sq_tail - *r->sq_khead;
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+
+    int ret;
+    do
+    {
+        ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static struct io_uring_sqe *sqe_get(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+    if (r->sq_tail - head >= r->sq_entries)
+    {
+        // Submission queue is full; hand what we have to the kernel first
+        ring_submit(r, 0);
+        head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+        if (r->sq_tail - head >= r->sq_entries)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned idx = r->sq_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    r->sq_tail++;
+    return sqe;
+}
+
+static uint64_t tag(void *ptr, unsigned long op)
+{
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static int queue_accept(struct uring *r, int fd)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag((void *)((uintptr_t)fd << 3), OP_ACCEPT);
+    return 0;
+}
+
+static int queue_recv(struct uring *r, int fd, void *owner)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = tag(owner, OP_RECV);
+    return 0;
+}
+
+static void queue_timeout(struct uring *r)
+{
+    struct io_uring_sqe *sqe = sqe_get(r);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&cron_ts;
+    sqe->len = 1;
+    sqe->user_data = tag(NULL, OP_TIMEOUT);
+}
+
+static struct io_uring_cqe *cqe_wait(struct uring *r)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        unsigned head = *r->cq_khead;
+        if (head != __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE))
+        {
+            return &r->cqes[head & *r->cq_mask];
+        }
+        if (ring_submit(r, 1) < 0)
+        {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static void cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_khead, *r->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Multishot accept and recv exist as opcodes before they support the multishot flag, so the probe
+ * actually runs both on a scratch ring and checks the kernel reports more completions to come
+ */
+static bool uring_probe(void)
+{
+    struct uring r;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    bool supported = false;
+    int lfd = -1, cfd = -1;
+    int pair[2] = {-1, -1};
+
+    if (ring_setup(&r, 8) < 0)
+    {
+        return false;
+    }
+
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, probe_len);
+    if (probe == NULL || sys_io_uring_register(r.fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+        goto out;
+    }
+
+    int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL};
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            goto out;
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 || queue_recv(&r, pair[0], NULL) < 0)
+    {
+        goto out;
+    }
+    if (write(pair[1], "x", 1) != 1)
+    {
+        goto out;
+    }
+    struct io_uring_cqe *cqe = cqe_wait(&r);
+    if (cqe == NULL || cqe->res != 1 || !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        goto out;
+    }
+    cqe_seen(&r);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr *)&addr, &addr_len) < 0 || queue_accept(&r, lfd) < 0)
+    {
+        goto out;
+    }
+    cfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (cfd < 0 || connect(cfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        goto out;
+    }
+    cqe = cqe_wait(&r);
+    if (cqe == NULL || cqe->res < 0 || !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        goto out;
+    }
+    close(cqe->res);
+    cqe_seen(&r);
+    supported = true;
+
+out:
+    free(probe);
+    if (cfd >= 0)
+    {
+        close(cfd);
+    }
+    if (lfd >= 0)
+    {
+        close(lfd);
+    }
+    if (pair[0] >= 0)
+    {
+        close(pair[0]);
+        close(pair[1]);
+    }
+    // Tearing down the ring cancels whatever is still pending on it
+    ring_teardown(&r);
+    return supported;
+}
+
+int uring_init(int server_fd)
+{
+    if (!uring_probe())
+    {
+        return -1;
+    }
+
+    if (ring_setup(&ring, URING_ENTRIES) < 0)
+    {
+        return -1;
+    }
+
+    listen_fd = server_fd;
+    if (queue_accept(&ring, listen_fd) < 0)
+    {
+        ring_teardown(&ring);
+        return -1;
+    }
+    queue_timeout(&ring);
+    return 0;
+}
+
+// Accept on another listening socket too (e.g the unix socket)
+int uring_listen(int fd)
+{
+    return queue_accept(&ring, fd);
+}
+
+void uring_conn_add(struct connection *conn)
+{
+    if (queue_recv(&ring, conn->fd, conn) < 0)
+    {
+        KV_log(LL_WARNING, "uring_conn_add: Submission queue full");
+        conn_close(conn);
+        return;
+    }
+    conn->inflight++;
+}
+
+void uring_conn_close(struct connection *conn)
+{
+    struct io_uring_sqe *sqe = sqe_get(&ring);
+    if (sqe)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = tag(conn, OP_RECV);
+        sqe->user_data = tag(NULL, OP_CANCEL);
+    }
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+static void queue_send(struct connection *conn)
+{
+    struct io_uring_sqe *sqe = sqe_get(&ring);
+    if (sqe == NULL)
+    {
+        KV_log(LL_WARNING, "uring_flush: Submission queue full");
+        conn_close(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->sbuf[conn->soff];
+    sqe->len = conn->slen - conn->soff;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = tag(conn, OP_SEND);
+    conn->send_inflight = true;
+    conn->inflight++;
+}
+
+// The queued output moves to the send buffer, which must stay put until the kernel is done with it
+void uring_flush(struct connection *conn)
+{
+    if (conn->send_inflight || conn->closing || conn->woff == conn->wlen)
+    {
+        return;
+    }
+
+    char *sbuf = conn->sbuf;
+    size_t scap = conn->scap;
+    conn->sbuf = conn->wbuf;
+    conn->scap = conn->wcap;
+    conn->slen = conn->wlen;
+    conn->soff = conn->woff;
+    conn->wbuf = sbuf;
+    conn->wcap = scap;
+    conn->wlen = conn->woff = 0;
+    queue_send(conn);
+}
+
+static void handle_recv(struct connection *conn, struct io_uring_cqe *cqe)
+{
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn->closing)
+        {
+            conn_feed(conn, &ring.bufs[bid * URING_BUF_SIZE], cqe->res);
+        }
+        buf_recycle(&ring, bid);
+    }
+
+    if (more)
+    {
+        return;
+    }
+
+    conn->inflight--;
+    if (conn->closing)
+    {
+        return;
+    }
+    // Multishot recv stops when it runs out of buffers; anything else ends the connection
+    if (cqe->res > 0 || cqe->res == -ENOBUFS)
+    {
+        if (queue_recv(&ring, conn->fd, conn) == 0)
+        {
+            conn->inflight++;
+            return;
+        }
+    }
+    conn_close(conn);
+}
+
+static void handle_send(struct connection *conn, struct io_uring_cqe *cqe)
+{
+    conn->inflight--;
+    conn->send_inflight = false;
+
+    if (cqe->res < 0)
+    {
+        if (!conn->closing)
+        {
+            KV_log(LL_VERBOSE, "write error: %s", strerror(-cqe->res));
+            conn_close(conn);
+        }
+        return;
+    }
+
+    conn->soff += cqe->res;
+    if (conn->soff < conn->slen && !conn->closing)
+    {
+        // Short send; the rest goes out before anything queued since
+        queue_send(conn);
+    }
+}
+
+void uring_run(void)
+{
+    while (!server_stopping())
+    {
+        // Shared memory clients are polled, so only block when none of them is busy
+        if (ring_submit(&ring, server_can_sleep() ? 1 : 0) < 0)
+        {
+            perror("io_uring_enter");
+            break;
+        }
+
+        unsigned head = *ring.cq_khead;
+        unsigned tail = __atomic_load_n(ring.cq_ktail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            unsigned long op = cqe->user_data & OP_MASK;
+            struct connection *conn = (struct connection *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+
+            switch (op)
+            {
+            case OP_ACCEPT:
+                if (cqe->res >= 0 && conn_create(cqe->res, CONN_CLIENT) == NULL)
+                {
+                    close(cqe->res);
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    queue_accept(&ring, (int)(cqe->user_data >> 3));
+                }
+                break;
+            case OP_RECV:
+                handle_recv(conn, cqe);
+                break;
+            case OP_SEND:
+                handle_send(conn, cqe);
+                break;
+            case OP_TIMEOUT:
+                queue_timeout(&ring);
+                break;
+            default:
+                break;
+            }
+        }
+        __atomic_store_n(ring.cq_khead, head, __ATOMIC_RELEASE);
+
+        server_tick();
+    }
+}
+
+#else
+
+int uring_init(int server_fd)
+{
+    return -1;
+}
+
+int uring_listen(int fd)
+{
+    return -1;
+}
+
+void uring_conn_add(struct connection *conn)
+{
+}
+
+void uring_conn_close(struct connection *conn)
+{
+}
+
+void uring_flush(struct connection *conn)
+{
+}
+
+void uring_run(void)
+{
+}
+
+#endif